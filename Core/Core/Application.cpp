@@ -135,6 +135,10 @@ namespace LSIS {
 			}
 
 			m_scene->Update();
+			if (m_scene->HasTransformsChanged()) {
+				m_scene->ClearTransformsChanged();
+				OnEvent(TransformsUpdatedEvent());
+			}
 			m_scene->Render();
 
 			for (auto& layer : m_layers) {
@@ -139,7 +139,7 @@ private:
 		~KdNode() {}
 
 		inline float Dist(const KeyT& other) const {
-			return sqrt(SqrDist(key, other.key));
+			return sqrt(SqrDist(key, other));
 		}
 
 	};
@@ -563,7 +563,7 @@ inline void KdTree<KeyT, ValT, K>::NNearestRecurse(const unsigned int in_node, c
 		if (nodes[in_node].val != in_val || dist > 0.0f) {
 			out_queue.push(KDTreeRecord<KeyT, ValT>(dist, nodes[in_node].key, nodes[in_node].val));
 			if (out_queue.at_capacity())
-				in_out_dist = min(in_out_dist, out_queue.top().dist);
+				in_out_dist = std::min(in_out_dist, out_queue.top().dist);
 		}
 	}
 
@@ -574,17 +574,13 @@ inline void KdTree<KeyT, ValT, K>::NNearestRecurse(const unsigned int in_node, c
 		float axis_dist = fabsf(nodes[in_node].key[axis] - in_key[axis]);
 		bool axis_dir = in_key[axis] < nodes[in_node].key[axis];
 
-		if (axis_dir || axis_dist < in_out_dist) {
-			unsigned int left_child = 2 * in_node;
-			if (left_child < nodes.size())
-				NNearestRecurse(left_child, in_key, in_val, in_out_dist, out_queue);
-
-		}
-		if (!axis_dir || axis_dist < in_out_dist) {
-			unsigned int right_child = 2 * in_node + 1;
-			if (right_child < nodes.size())
-				NNearestRecurse(right_child, in_key, in_val, in_out_dist, out_queue);
-		}
+		// Visit the side of the key first, so the queue fills with close elements and the far side can be skipped
+		unsigned int near_child = axis_dir ? 2 * in_node : 2 * in_node + 1;
+		unsigned int far_child = axis_dir ? 2 * in_node + 1 : 2 * in_node;
+		if (near_child < nodes.size())
+			NNearestRecurse(near_child, in_key, in_val, in_out_dist, out_queue);
+		if (axis_dist < in_out_dist && far_child < nodes.size())
+			NNearestRecurse(far_child, in_key, in_val, in_out_dist, out_queue);
 	}
 }
 
@@ -94,4 +94,12 @@ namespace LSIS {
 	private:
 		Ref<Camera> m_cam;
 	};
+
+	class TransformsUpdatedEvent : public Event {
+	public:
+		TransformsUpdatedEvent() {}
+
+		EVENT_CLASS_TYPE(TransformsUpdated)
+		EVENT_CLASS_CATEGORY(EventCategoryApplication)
+	};
 }
\ No newline at end of file
@@ -30,7 +30,8 @@ namespace LSIS {
 		MouseButtonRepeat,
 		MouseButtonReleased,
 
-		CameraUpdated
+		CameraUpdated,
+		TransformsUpdated
 	};
 
 	enum EventCategory {
@@ -0,0 +1,77 @@
+#include "pch.h"
+#include "MappedFile.h"
+
+#ifdef LSIS_PLATFORM_WIN
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // LSIS_PLATFORM_WIN
+
+namespace LSIS {
+
+#ifdef LSIS_PLATFORM_WIN
+
+	MappedFile::MappedFile(const std::string& filename)
+	{
+		HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+		m_file = file;
+
+		LARGE_INTEGER size = {};
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+			return;
+
+		m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_mapping == nullptr)
+			return;
+
+		m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+		m_size = m_data != nullptr ? static_cast<size_t>(size.QuadPart) : 0;
+	}
+
+	MappedFile::~MappedFile()
+	{
+		if (m_data != nullptr)
+			UnmapViewOfFile(m_data);
+		if (m_mapping != nullptr)
+			CloseHandle(m_mapping);
+		if (m_file != nullptr)
+			CloseHandle(m_file);
+	}
+
+#else
+
+	MappedFile::MappedFile(const std::string& filename)
+	{
+		m_file = open(filename.c_str(), O_RDONLY);
+		if (m_file < 0)
+			return;
+
+		struct stat info = {};
+		if (fstat(m_file, &info) != 0 || info.st_size == 0)
+			return;
+
+		void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, m_file, 0);
+		if (data == MAP_FAILED)
+			return;
+
+		m_data = data;
+		m_size = static_cast<size_t>(info.st_size);
+	}
+
+	MappedFile::~MappedFile()
+	{
+		if (m_data != nullptr)
+			munmap(const_cast<void*>(m_data), m_size);
+		if (m_file >= 0)
+			close(m_file);
+	}
+
+#endif // LSIS_PLATFORM_WIN
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+
+namespace LSIS {
+
+	/// Read only memory mapping of a whole file. The mapping is released when the object is destroyed
+	class MappedFile {
+	public:
+		MappedFile(const std::string& filename);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool IsOpen() const { return m_data != nullptr; }
+		const void* GetData() const { return m_data; }
+		size_t GetSize() const { return m_size; }
+
+	private:
+		const void* m_data = nullptr;
+		size_t m_size = 0;
+#ifdef LSIS_PLATFORM_WIN
+		void* m_file = nullptr;
+		void* m_mapping = nullptr;
+#else
+		int m_file = -1;
+#endif // LSIS_PLATFORM_WIN
+	};
+
+}
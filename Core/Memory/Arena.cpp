@@ -0,0 +1,85 @@
+#include "pch.h"
+#include "Arena.h"
+
+#include <new>
+
+namespace LSIS {
+
+	Arena::Arena(size_t block_size)
+		: m_block_size(block_size)
+	{
+	}
+
+	Arena::~Arena()
+	{
+		for (block& b : m_blocks) {
+			free_block(b);
+		}
+	}
+
+	Arena& Arena::GetScratch()
+	{
+		static thread_local Arena s_scratch;
+		return s_scratch;
+	}
+
+	void* Arena::Allocate(size_t size, size_t alignment)
+	{
+		// Continue in the current block, or the first of the following blocks with room
+		while (m_block < m_blocks.size()) {
+			const block& b = m_blocks[m_block];
+			const size_t offset = (m_offset + alignment - 1) & ~(alignment - 1);
+			if (offset + size <= b.size) {
+				m_offset = offset + size;
+				return b.data + offset;
+			}
+			m_block++;
+			m_offset = 0;
+		}
+
+		// Block starts are aligned, so the allocation fits if the block is at least its size
+		m_blocks.push_back(allocate_block(std::max(size, m_block_size)));
+		m_block = m_blocks.size() - 1;
+		m_offset = size;
+		return m_blocks.back().data;
+	}
+
+	void Arena::Rewind(Marker marker)
+	{
+		m_block = marker.block;
+		m_offset = marker.offset;
+
+		// Merge the blocks when the arena is empty, so the next run of the same size fits in a single block
+		if (m_block == 0 && m_offset == 0 && m_blocks.size() > 1) {
+			const size_t capacity = GetCapacity();
+			for (block& b : m_blocks) {
+				free_block(b);
+			}
+			m_blocks.clear();
+			m_blocks.push_back(allocate_block(capacity));
+		}
+	}
+
+	size_t Arena::GetCapacity() const
+	{
+		size_t capacity = 0;
+		for (const block& b : m_blocks) {
+			capacity += b.size;
+		}
+		return capacity;
+	}
+
+	Arena::block Arena::allocate_block(size_t size)
+	{
+		block b = {};
+		b.data = static_cast<std::byte*>(::operator new(size, std::align_val_t(s_block_alignment)));
+		b.size = size;
+		return b;
+	}
+
+	void Arena::free_block(block b)
+	{
+		::operator delete(b.data, std::align_val_t(s_block_alignment));
+	}
+
+}
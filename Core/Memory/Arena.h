@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace LSIS {
+
+	/// Linear allocator for temporary build data. Allocations bump a pointer within large blocks and are never freed individually.
+	/// The memory is released by rewinding to a marker, most conveniently with an Arena::Scope, and the blocks are kept for reuse.
+	/// When the arena is rewound to the start, the blocks are merged into one, so a repeated workload of the same size does no heap allocation after the first run.
+	/// Only trivially destructible types can be allocated, as no destructors are called. An arena must only be used by one thread at a time.
+	class Arena {
+	public:
+		typedef struct Marker {
+			size_t block;
+			size_t offset;
+		} Marker;
+
+		/// Rewinds the arena to where it was when the scope was created
+		class Scope {
+		public:
+			Scope(Arena& arena) : m_arena(arena), m_marker(arena.GetMarker()) {}
+			~Scope() { m_arena.Rewind(m_marker); }
+			Scope(const Scope&) = delete;
+		private:
+			Arena& m_arena;
+			const Marker m_marker;
+		};
+
+		Arena(size_t block_size = s_default_block_size);
+		~Arena();
+
+		Arena(const Arena&) = delete;
+
+		/// The arena of the calling thread. Every thread, including the ones in the ThreadPool, has its own
+		static Arena& GetScratch();
+
+		void* Allocate(size_t size, size_t alignment);
+
+		/// Uninitialized storage for 'count' elements of T
+		template<typename T>
+		inline T* Allocate(size_t count) {
+			static_assert(std::is_trivially_destructible<T>::value, "Arena allocations are never destructed!");
+			return static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+		}
+
+		inline Marker GetMarker() const { return { m_block, m_offset }; }
+		/// Frees everything allocated after the marker was taken
+		void Rewind(Marker marker);
+		/// Frees all allocations
+		inline void Reset() { Rewind({ 0, 0 }); }
+
+		/// Bytes reserved from the heap
+		size_t GetCapacity() const;
+
+	private:
+		typedef struct block {
+			std::byte* data;
+			size_t size;
+		} block;
+
+		block allocate_block(size_t size);
+		void free_block(block b);
+
+	private:
+		static constexpr size_t s_default_block_size = 1 << 20;
+		// Blocks are aligned to cache lines, which covers the SSE and AVX types used by the builders
+		static constexpr size_t s_block_alignment = 64;
+
+		const size_t m_block_size;
+		std::vector<block> m_blocks;
+		size_t m_block = 0; // block currently allocated from
+		size_t m_offset = 0; // first free byte of the current block
+	};
+
+}
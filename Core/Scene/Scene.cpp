@@ -59,6 +59,12 @@ namespace LSIS {
 		return m_camera;
 	}
 
+	void Scene::SetTransform(entt::entity entity, const glm::mat4& transform)
+	{
+		m_registry.get<TransformComponent>(entity).Transform = transform;
+		m_transforms_changed = true;
+	}
+
 	std::mutex queue_mutex;
 
 	void Scene::Update()
@@ -48,6 +48,11 @@ namespace LSIS {
 		void SetCamera(std::shared_ptr<Camera> camera);
 		std::shared_ptr<Camera> GetCamera() const;
 
+		// Moves an entity. The change is reported once per frame with a TransformsUpdatedEvent
+		void SetTransform(entt::entity entity, const glm::mat4& transform);
+		bool HasTransformsChanged() const { return m_transforms_changed; }
+		void ClearTransformsChanged() { m_transforms_changed = false; }
+
 		void Update();
 		void Render();
 
@@ -83,6 +88,8 @@ namespace LSIS {
 
 		std::mutex m_upload_mutex;
 		std::queue<ObjectUpload> m_uploads{};
+
+		bool m_transforms_changed = false;
 	};
 
 
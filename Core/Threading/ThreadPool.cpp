@@ -0,0 +1,139 @@
+#include "pch.h"
+#include "ThreadPool.h"
+
+namespace LSIS {
+
+	static thread_local size_t s_thread_index = 0;
+	static std::unique_ptr<ThreadPool> s_pool;
+	static size_t s_requested_threads = 0;
+
+	ThreadPool::ThreadPool(size_t num_threads)
+		: m_num_queued(0), m_running(true)
+	{
+		if (num_threads == 0) {
+			num_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+		}
+
+		// One queue for the external threads, and one for each worker
+		for (size_t i = 0; i < num_threads; i++) {
+			m_queues.push_back(std::make_unique<queue>());
+		}
+
+		for (size_t i = 1; i < num_threads; i++) {
+			m_workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_sleep_mutex);
+			m_running = false;
+		}
+		m_sleep_cv.notify_all();
+		for (auto& worker : m_workers) {
+			worker.join();
+		}
+	}
+
+	void ThreadPool::Init(size_t num_threads)
+	{
+		s_requested_threads = num_threads;
+		s_pool.reset();
+		s_pool = std::make_unique<ThreadPool>(num_threads);
+	}
+
+	ThreadPool& ThreadPool::Get()
+	{
+		if (!s_pool) {
+			s_pool = std::make_unique<ThreadPool>(s_requested_threads);
+		}
+		return *s_pool;
+	}
+
+	size_t ThreadPool::GetThreadIndex()
+	{
+		return s_thread_index;
+	}
+
+	void ThreadPool::Submit(TaskGroup& group, Task task)
+	{
+		group.m_pending.fetch_add(1, std::memory_order_relaxed);
+
+		// Push to the back of the callers own queue
+		queue& q = *m_queues[s_thread_index < m_queues.size() ? s_thread_index : 0];
+		{
+			std::lock_guard<std::mutex> lock(q.mutex);
+			q.tasks.emplace_back(&group, std::move(task));
+		}
+		{
+			// Take the sleep lock, so a worker can't miss the notification between checking the queue count and going to sleep
+			std::lock_guard<std::mutex> lock(m_sleep_mutex);
+			m_num_queued.fetch_add(1, std::memory_order_release);
+		}
+		m_sleep_cv.notify_one();
+	}
+
+	void ThreadPool::Wait(TaskGroup& group)
+	{
+		const size_t index = s_thread_index < m_queues.size() ? s_thread_index : 0;
+		while (!group.Done()) {
+			if (!TryExecute(index)) {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	void ThreadPool::WorkerLoop(size_t index)
+	{
+		s_thread_index = index;
+		while (m_running) {
+			if (TryExecute(index))
+				continue;
+
+			// Sleep until new work is submitted
+			std::unique_lock<std::mutex> lock(m_sleep_mutex);
+			m_sleep_cv.wait(lock, [this]() { return !m_running || m_num_queued.load(std::memory_order_acquire) > 0; });
+		}
+	}
+
+	bool ThreadPool::TryExecute(size_t index)
+	{
+		std::pair<TaskGroup*, Task> item;
+		if (!Pop(index, item) && !Steal(index, item))
+			return false;
+
+		m_num_queued.fetch_sub(1, std::memory_order_relaxed);
+		item.second();
+		item.first->m_pending.fetch_sub(1, std::memory_order_release);
+		return true;
+	}
+
+	bool ThreadPool::Pop(size_t index, std::pair<TaskGroup*, Task>& out)
+	{
+		queue& q = *m_queues[index];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (q.tasks.empty())
+			return false;
+		out = std::move(q.tasks.back());
+		q.tasks.pop_back();
+		return true;
+	}
+
+	bool ThreadPool::Steal(size_t index, std::pair<TaskGroup*, Task>& out)
+	{
+		const size_t N = m_queues.size();
+		for (size_t i = 1; i < N; i++) {
+			queue& q = *m_queues[(index + i) % N];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (q.tasks.empty())
+				continue;
+			// Steal the oldest task, as it is likely to be the largest
+			out = std::move(q.tasks.front());
+			q.tasks.pop_front();
+			return true;
+		}
+		return false;
+	}
+
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace LSIS {
+
+	/// Work-stealing thread pool.
+	/// Every thread owns a deque of tasks. The owner pushes and pops at the back, idle threads steal from the front of the other deques.
+	/// Slot 0 belongs to the thread(s) outside the pool, which help out with the work while waiting on a TaskGroup.
+	class ThreadPool {
+	public:
+		using Task = std::function<void()>;
+
+		/// Counts the unfinished tasks submitted with the group
+		class TaskGroup {
+		public:
+			TaskGroup() : m_pending(0) {}
+			TaskGroup(const TaskGroup&) = delete;
+			inline bool Done() const { return m_pending.load(std::memory_order_acquire) == 0; }
+		private:
+			friend class ThreadPool;
+			std::atomic<size_t> m_pending;
+		};
+
+		ThreadPool(size_t num_threads);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+
+		/// Sets the number of threads of the global pool, including the calling thread. 0 uses the hardware concurrency
+		static void Init(size_t num_threads);
+		static ThreadPool& Get();
+
+		/// Number of threads working on tasks, including the thread waiting on the pool
+		inline size_t GetNumThreads() const { return m_queues.size(); }
+		/// Index of the calling thread in the range [0, GetNumThreads()). Threads outside the pool returns 0
+		static size_t GetThreadIndex();
+
+		void Submit(TaskGroup& group, Task task);
+		/// Executes pending tasks until all tasks in the group has finished
+		void Wait(TaskGroup& group);
+
+		/// Splits [begin,end) into 'num_chunks' contiguous chunks and calls func(chunk_begin, chunk_end, chunk_index) for each in parallel.
+		/// The chunk boundaries only depend on the range and chunk count, so results merged in chunk order are deterministic.
+		template<typename Func>
+		void ParallelFor(size_t begin, size_t end, size_t num_chunks, Func&& func);
+
+		/// Same as above, using one chunk per thread
+		template<typename Func>
+		inline void ParallelFor(size_t begin, size_t end, Func&& func) { ParallelFor(begin, end, GetNumThreads(), std::forward<Func>(func)); }
+
+	private:
+		typedef struct queue {
+			std::mutex mutex;
+			std::deque<std::pair<TaskGroup*, Task>> tasks;
+		} queue;
+
+		void WorkerLoop(size_t index);
+		bool TryExecute(size_t index);
+		bool Pop(size_t index, std::pair<TaskGroup*, Task>& out);
+		bool Steal(size_t index, std::pair<TaskGroup*, Task>& out);
+
+	private:
+		std::vector<std::unique_ptr<queue>> m_queues;
+		std::vector<std::thread> m_workers;
+
+		std::mutex m_sleep_mutex;
+		std::condition_variable m_sleep_cv;
+		std::atomic<size_t> m_num_queued;
+		std::atomic<bool> m_running;
+	};
+
+	template<typename Func>
+	inline void ThreadPool::ParallelFor(size_t begin, size_t end, size_t num_chunks, Func&& func)
+	{
+		if (end <= begin)
+			return;
+
+		const size_t range = end - begin;
+		num_chunks = std::max<size_t>(1, std::min(num_chunks, range));
+		const size_t chunk_size = range / num_chunks;
+		const size_t remainder = range % num_chunks;
+
+		TaskGroup group;
+		size_t chunk_begin = begin;
+		for (size_t c = 0; c < num_chunks; c++) {
+			const size_t chunk_end = chunk_begin + chunk_size + (c < remainder ? 1 : 0);
+			if (c == num_chunks - 1) {
+				// Run the last chunk on the calling thread
+				func(chunk_begin, chunk_end, c);
+			}
+			else {
+				Submit(group, [&func, chunk_begin, chunk_end, c]() { func(chunk_begin, chunk_end, c); });
+			}
+			chunk_begin = chunk_end;
+		}
+		Wait(group);
+	}
+
+}
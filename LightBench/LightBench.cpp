@@ -0,0 +1,595 @@
+#include "pch.h"
+#include "LightBench.h"
+
+#include "Mesh/MeshLoader.h"
+#include "Threading/ThreadPool.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+#include "gtc/constants.hpp"
+
+namespace LSIS {
+
+	LightBench::LightBench(const Settings& settings)
+		: m_settings(settings)
+	{
+	}
+
+	LightBench::~LightBench()
+	{
+	}
+
+	bool LightBench::AddOBJScene(const std::vector<std::string>& filepaths)
+	{
+		scene s = {};
+		std::vector<glm::vec3> triangles;
+
+		for (const std::string& filepath : filepaths) {
+			if (!std::filesystem::exists(filepath)) {
+				printf("Failed to find the OBJ file: %s\n", filepath.c_str());
+				return false;
+			}
+			const auto mesh = MeshLoader::LoadFromOBJ(filepath);
+			s.name += (s.name.empty() ? "" : "+") + std::filesystem::path(filepath).stem().string();
+
+			const VertexData* vertices = mesh->GetVertices();
+			const MaterialData* materials = mesh->GetMaterials();
+			for (size_t i = 0; i < mesh->GetNumIndices(); i++) {
+				const FaceData face = mesh->GetIndices()[i];
+				const glm::vec3 p0 = vertices[face.vertex0].position;
+				const glm::vec3 p1 = vertices[face.vertex1].position;
+				const glm::vec3 p2 = vertices[face.vertex2].position;
+				triangles.insert(triangles.end(), { p0, p1, p2 });
+
+				// The same lights as PathTracer::LoadSceneData, apart from degenerate faces
+				if (face.material < 0 || face.material >= static_cast<int>(mesh->GetNumMaterials()))
+					continue;
+				const glm::vec3 e = materials[face.material].emissive;
+				const glm::vec3 cross = glm::cross(p1 - p0, p2 - p0);
+				if ((e.x > 0.0f || e.y > 0.0f || e.z > 0.0f) && glm::length(cross) > 0.0f) {
+					s.lights.push_back(SHARED::make_mesh_light(p0, p1, p2, glm::normalize(cross), e));
+				}
+			}
+		}
+
+		if (s.lights.empty()) {
+			printf("No emissive faces in the scene: %s\n", s.name.c_str());
+			return false;
+		}
+
+		// Shading points are distributed over all faces by area
+		const size_t num_faces = triangles.size() / 3;
+		std::vector<double> cdf = std::vector<double>(num_faces);
+		double sum = 0.0;
+		for (size_t i = 0; i < num_faces; i++) {
+			sum += glm::length(glm::cross(triangles[i * 3 + 1] - triangles[i * 3], triangles[i * 3 + 2] - triangles[i * 3]));
+			cdf[i] = sum;
+		}
+
+		std::mt19937 rng = std::mt19937(m_settings.seed);
+		std::uniform_real_distribution<float> u = std::uniform_real_distribution<float>(0.0f, 1.0f);
+		for (size_t i = 0; i < m_settings.num_points; i++) {
+			const size_t face = std::min<size_t>(std::upper_bound(cdf.begin(), cdf.end(), u(rng) * sum) - cdf.begin(), num_faces - 1);
+			const glm::vec3 p0 = triangles[face * 3];
+			const glm::vec3 p1 = triangles[face * 3 + 1];
+			const glm::vec3 p2 = triangles[face * 3 + 2];
+			const glm::vec3 cross = glm::cross(p1 - p0, p2 - p0);
+			if (!(glm::length(cross) > 0.0f))
+				continue;
+
+			// Uniform point in the triangle
+			const float r1 = glm::sqrt(u(rng));
+			const float r2 = u(rng);
+			const glm::vec3 position = p0 * (1.0f - r1) + p1 * (r1 * (1.0f - r2)) + p2 * (r1 * r2);
+			s.points.push_back({ position, glm::normalize(cross) });
+		}
+
+		m_scenes.push_back(std::move(s));
+		return true;
+	}
+
+	bool LightBench::AddSyntheticScene(const std::string& distribution, size_t num_lights)
+	{
+		if (num_lights == 0 || (distribution != "uniform" && distribution != "clustered" && distribution != "ceiling")) {
+			printf("Unknown synthetic scene: %s %zd\n", distribution.c_str(), num_lights);
+			return false;
+		}
+
+		scene s = {};
+		s.name = distribution + "_" + std::to_string(num_lights);
+
+		std::mt19937 rng = std::mt19937(m_settings.seed);
+		std::uniform_real_distribution<float> u = std::uniform_real_distribution<float>(0.0f, 1.0f);
+		std::normal_distribution<float> normal = std::normal_distribution<float>(0.0f, 2.0f);
+
+		const auto random_direction = [&]() {
+			const float z = 1.0f - 2.0f * u(rng);
+			const float phi = glm::two_pi<float>() * u(rng);
+			const float r = glm::sqrt(glm::max(0.0f, 1.0f - z * z));
+			return glm::vec3(r * glm::cos(phi), r * glm::sin(phi), z);
+		};
+		// Right triangle facing along n, with the legs of length 'size'
+		const auto make_light = [](glm::vec3 p, glm::vec3 n, float size, glm::vec3 intensity) {
+			const glm::vec3 t = glm::normalize(glm::cross(n, glm::abs(n.x) > 0.9f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f)));
+			const glm::vec3 b = glm::cross(n, t);
+			return SHARED::make_mesh_light(p, p + t * size, p + b * size, n, intensity);
+		};
+
+		std::vector<glm::vec3> centers;
+		for (int i = 0; i < 32; i++) {
+			centers.push_back(glm::vec3(u(rng), u(rng), u(rng)) * 100.0f);
+		}
+
+		// Lights are placed in [0,100]^3
+		const size_t side = static_cast<size_t>(glm::ceil(glm::sqrt(static_cast<double>(num_lights))));
+		const float spacing = 100.0f / static_cast<float>(side);
+		for (size_t i = 0; i < num_lights; i++) {
+			const glm::vec3 intensity = glm::vec3(0.5f + u(rng));
+			if (distribution == "uniform") {
+				s.lights.push_back(make_light(glm::vec3(u(rng), u(rng), u(rng)) * 100.0f, random_direction(), 0.5f, intensity));
+			}
+			else if (distribution == "clustered") {
+				const glm::vec3 center = centers[static_cast<size_t>(u(rng) * centers.size()) % centers.size()];
+				s.lights.push_back(make_light(center + glm::vec3(normal(rng), normal(rng), normal(rng)), random_direction(), 0.5f, intensity));
+			}
+			else {
+				const glm::vec3 p = glm::vec3((static_cast<float>(i % side) + 0.5f) * spacing, 100.0f, (static_cast<float>(i / side) + 0.5f) * spacing);
+				s.lights.push_back(make_light(p, glm::vec3(0.0f, -1.0f, 0.0f), spacing * 0.5f, intensity));
+			}
+		}
+
+		// The ceiling lights the floor below it, the others points anywhere within the lights
+		for (size_t i = 0; i < m_settings.num_points; i++) {
+			if (distribution == "ceiling") {
+				s.points.push_back({ glm::vec3(u(rng) * 100.0f, 0.0f, u(rng) * 100.0f), glm::vec3(0.0f, 1.0f, 0.0f) });
+			}
+			else {
+				s.points.push_back({ glm::vec3(u(rng), u(rng), u(rng)) * 100.0f, random_direction() });
+			}
+		}
+
+		m_scenes.push_back(std::move(s));
+		return true;
+	}
+
+	void LightBench::Run()
+	{
+		m_results.clear();
+		for (const scene& s : m_scenes) {
+			run_scene(s);
+		}
+	}
+
+	void LightBench::run_scene(const scene& s)
+	{
+		using clock = std::chrono::steady_clock;
+		ThreadPool& pool = ThreadPool::Get();
+
+		printf("Scene: %s, lights: %zd, shading points: %zd\n", s.name.c_str(), s.lights.size(), s.points.size());
+
+		// The sum of all contributions at each point, which the estimates are relative to
+		std::vector<double> reference = std::vector<double>(s.points.size());
+		pool.ParallelFor(0, s.points.size(), [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				double sum = 0.0;
+				for (const SHARED::Light& light : s.lights) {
+					sum += contribution(light, s.points[i]);
+				}
+				reference[i] = sum;
+			}
+		});
+
+		Result base = {};
+		base.scene = s.name;
+		base.num_lights = s.lights.size();
+
+		if (std::find(m_settings.methods.begin(), m_settings.methods.end(), Method::energy) != m_settings.methods.end()) {
+			const auto start = clock::now();
+			const std::vector<SHARED::AliasEntry> table = build_power_alias_table(s.lights.data(), s.lights.size());
+			const auto stop = clock::now();
+
+			Result result = base;
+			result.method = Method::energy;
+			result.attenuation = Attenuation::center;
+			result.build_ms = std::chrono::duration<double, std::milli>(stop - start).count();
+			selection_variance(s.lights, s.points, reference, [&](const shading_point&, double r, double* pdf) { return pick_power_light(table, s.lights, r, pdf); }, result);
+
+			print_result(result);
+			m_results.push_back(result);
+		}
+
+		for (size_t bins : m_settings.bins) {
+			for (size_t leaf_size : m_settings.leaf_sizes) {
+				const auto start = clock::now();
+				const LightTree tree = LightTree(s.lights.data(), s.lights.size(), bins, leaf_size);
+				const auto stop = clock::now();
+
+				Result tree_result = base;
+				tree_result.bins = bins;
+				tree_result.leaf_size = leaf_size;
+				tree_result.build_ms = std::chrono::duration<double, std::milli>(stop - start).count();
+				measure_tree(tree, tree_result);
+
+				for (Method method : m_settings.methods) {
+					if (method == Method::energy)
+						continue;
+					const bool orientation = method == Method::lighttree;
+					for (Attenuation attenuation : m_settings.attenuations) {
+						Result result = tree_result;
+						result.method = method;
+						result.attenuation = attenuation;
+						selection_variance(tree.GetLights(), s.points, reference, [&](const shading_point& point, double r, double* pdf) { return pick_tree_light(tree, orientation, attenuation, point, r, pdf); }, result);
+
+						print_result(result);
+						m_results.push_back(result);
+					}
+				}
+			}
+		}
+	}
+
+	void LightBench::print_result(const Result& result) const
+	{
+		printf("  %-9s %-11s bins: %4zd, leaf: %2zd, build: %9.3fms, nodes: %8zd, depth: %3zd, SAH: %10.4g, SAOH: %10.4g, variance: %10.4g, null picks: %.4f\n",
+			ToString(result.method), ToString(result.attenuation), result.bins, result.leaf_size, result.build_ms, result.num_nodes, result.depth, result.sah_cost, result.saoh_cost, result.variance, result.null_picks);
+	}
+
+	void LightBench::measure_tree(const LightTree& tree, Result& result) const
+	{
+		const SHARED::LightTreeNode* nodes = tree.GetNodes();
+		if (tree.GetNumNodes() == 0)
+			return;
+
+		const auto area = [&](const SHARED::LightTreeNode& node) {
+			const glm::vec3 d = convert(node.pmax) - convert(node.pmin);
+			return 2.0 * (d.x * d.y + d.x * d.z + d.y * d.z);
+		};
+		// The orientation measure of bcone_measure in LightTree
+		const auto orientation = [](const SHARED::LightTreeNode& node) {
+			const double pi = glm::pi<double>();
+			const double t_o = THETA_O(node);
+			const double t_e = THETA_E(node);
+			const double t_w = glm::min(t_o + t_e, pi);
+			return 2.0 * pi * 2.0 * (1.0 - cos(t_o)) + pi / 2.0 * (2.0 * t_w * sin(t_o) - cos(t_o - 2.0 * t_w) - 2.0 * t_o * sin(t_o) + cos(t_o));
+		};
+		const auto energy = [](const SHARED::LightTreeNode& node) {
+			return static_cast<double>(node.energy.x) + node.energy.y + node.energy.z;
+		};
+
+		const double root_area = area(nodes[0]);
+		const double root_saoh = energy(nodes[0]) * root_area * orientation(nodes[0]);
+
+		double sah = 0.0;
+		double saoh = 0.0;
+		size_t num_nodes = 0;
+		size_t depth = 0;
+		std::vector<std::pair<int, size_t>> stack = { { 0, 1 } };
+		while (!stack.empty()) {
+			const auto [index, node_depth] = stack.back(); stack.pop_back();
+			const SHARED::LightTreeNode& node = nodes[index];
+
+			num_nodes++;
+			depth = std::max(depth, node_depth);
+			sah += area(node);
+			saoh += energy(node) * area(node) * orientation(node);
+
+			if (!(LEAF(node))) {
+				stack.push_back({ node.right, node_depth + 1 });
+				stack.push_back({ node.left, node_depth + 1 });
+			}
+		}
+
+		result.num_nodes = num_nodes;
+		result.depth = depth;
+		result.sah_cost = root_area > 0.0 ? sah / root_area : 0.0;
+		result.saoh_cost = root_saoh > 0.0 ? saoh / root_saoh : 0.0;
+	}
+
+	inline float LightBench::contribution(const SHARED::Light& light, const shading_point& point) const
+	{
+		const glm::vec3 t = convert(light.tangent);
+		const glm::vec3 b = convert(light.bitangent);
+		const float area = glm::length(glm::cross(t, b)) * 0.5f;
+
+		const glm::vec3 center = convert(light.position) + (t + b) / 3.0f;
+		const glm::vec3 diff = center - point.position;
+		const float sqr_dist = glm::dot(diff, diff);
+		if (!(sqr_dist > 0.0f))
+			return 0.0f;
+
+		const glm::vec3 dir = diff / glm::sqrt(sqr_dist);
+		const float cos_theta = glm::max(glm::dot(point.normal, dir), 0.0f);
+		const float cos_theta_light = glm::max(-glm::dot(convert(light.direction), dir), 0.0f);
+		return (light.intensity.x + light.intensity.y + light.intensity.z) * area * cos_theta * cos_theta_light / sqr_dist;
+	}
+
+	template<typename Pick>
+	void LightBench::selection_variance(const std::vector<SHARED::Light>& lights, const std::vector<shading_point>& points, const std::vector<double>& reference, Pick&& pick, Result& result) const
+	{
+		std::vector<double> variance = std::vector<double>(points.size(), -1.0);
+		std::vector<size_t> null_picks = std::vector<size_t>(points.size(), 0);
+
+		// Every point has its own random sequence, so the estimate doesn't depend on the number of threads
+		ThreadPool::Get().ParallelFor(0, points.size(), [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				if (!(reference[i] > 0.0))
+					continue;
+
+				std::mt19937 rng = std::mt19937(m_settings.seed * 7919u + static_cast<uint32_t>(i));
+				std::uniform_real_distribution<double> u = std::uniform_real_distribution<double>(0.0, 1.0);
+
+				double sum = 0.0;
+				double sum_sqr = 0.0;
+				for (size_t j = 0; j < m_settings.num_samples; j++) {
+					double pdf = 0.0;
+					const int index = pick(points[i], u(rng), &pdf);
+
+					double estimate = 0.0;
+					if (index == -1 || !(pdf > 0.0)) {
+						null_picks[i]++;
+					}
+					else {
+						estimate = contribution(lights[index], points[i]) / pdf;
+					}
+					sum += estimate;
+					sum_sqr += estimate * estimate;
+				}
+
+				const double n = static_cast<double>(m_settings.num_samples);
+				const double mean = sum / n;
+				variance[i] = glm::max(0.0, sum_sqr / n - mean * mean) / (reference[i] * reference[i]);
+			}
+		});
+
+		size_t count = 0;
+		double sum_variance = 0.0;
+		size_t sum_null_picks = 0;
+		for (size_t i = 0; i < points.size(); i++) {
+			if (variance[i] < 0.0)
+				continue;
+			count++;
+			sum_variance += variance[i];
+			sum_null_picks += null_picks[i];
+		}
+		result.variance = count > 0 ? sum_variance / static_cast<double>(count) : 0.0;
+		result.null_picks = count > 0 ? static_cast<double>(sum_null_picks) / static_cast<double>(count * m_settings.num_samples) : 0.0;
+	}
+
+	int LightBench::pick_tree_light(const LightTree& tree, bool orientation, Attenuation attenuation, const shading_point& point, double r, double* pdf) const
+	{
+		const SHARED::LightTreeNode* nodes = tree.GetNodes();
+		const std::vector<float>& leaf_cdf = tree.GetLeafCDF();
+
+		SHARED::LightTreeNode node = nodes[0];
+		double p = 1.0;
+		double xi = r;
+
+		while (!(LEAF(node))) {
+			const SHARED::LightTreeNode& node_l = nodes[node.left];
+			const SHARED::LightTreeNode& node_r = nodes[node.right];
+
+			const glm::vec2 atten = calc_attenuation(node_l, node_r, point.position, attenuation);
+			const float I_l = importance(node_l, point, orientation) * atten.x;
+			const float I_r = importance(node_r, point, orientation) * atten.y;
+			const float sum = I_l + I_r;
+
+			// null light
+			if (!(sum > 0.0f)) {
+				*pdf = 1.0;
+				return -1;
+			}
+
+			const double p_l = I_l / sum;
+			const double p_r = I_r / sum;
+			if (xi < p_l) {
+				xi = xi / p_l;
+				node = node_l;
+				p *= p_l;
+			}
+			else {
+				xi = (xi - p_l) / p_r;
+				node = node_r;
+				p *= p_r;
+			}
+		}
+
+		// Pick within the leaf with the cdf, like pick_leaf_light
+		const int first = INDEX(node);
+		const int last = first + COUNT(node) - 1;
+		int index = first;
+		float cdf_prev = 0.0f;
+		while (index < last && xi >= leaf_cdf[index]) {
+			cdf_prev = leaf_cdf[index];
+			index++;
+		}
+		*pdf = p * (leaf_cdf[index] - cdf_prev);
+		return index;
+	}
+
+	inline float LightBench::importance(const SHARED::LightTreeNode& node, const shading_point& point, bool orientation) const
+	{
+		const glm::vec3 pmin = convert(node.pmin);
+		const glm::vec3 pmax = convert(node.pmax);
+		const glm::vec3 diff = (pmin + pmax) * 0.5f - point.position;
+		const glm::vec3 dir = glm::normalize(diff);
+
+		const float theta_i = glm::acos(glm::clamp(glm::dot(point.normal, dir), -1.0f, 1.0f));
+		const float theta_u = max_angle(pmin, pmax, point.position);
+		const float theta_ti = glm::max(0.0f, theta_i - theta_u);
+
+		glm::vec3 I = glm::abs(glm::cos(theta_ti)) * convert(node.energy);
+		if (orientation) {
+			const float theta = glm::acos(glm::clamp(-glm::dot(convert(node.axis), dir), -1.0f, 1.0f));
+			const float theta_t = glm::max(0.0f, (theta - THETA_O(node)) - theta_u);
+			if (theta_t >= THETA_E(node))
+				return 0.0f;
+			I *= glm::cos(theta_t);
+		}
+		return glm::max(glm::max(I.x, I.y), I.z);
+	}
+
+	inline glm::vec2 LightBench::calc_attenuation(const SHARED::LightTreeNode& left, const SHARED::LightTreeNode& right, const glm::vec3& position, Attenuation attenuation) const
+	{
+		const bool min_dist = attenuation == Attenuation::mindist || attenuation == Attenuation::zerotest;
+		const auto sqr_dist = [&](const SHARED::LightTreeNode& node) {
+			const glm::vec3 pmin = convert(node.pmin);
+			const glm::vec3 pmax = convert(node.pmax);
+			if (min_dist) {
+				// Distance to the closest point of the box, zero inside it
+				const glm::vec3 v = glm::max(glm::max(pmin - position, position - pmax), glm::vec3(0.0f));
+				return glm::dot(v, v);
+			}
+			const glm::vec3 d = position - (pmin + pmax) * 0.5f;
+			return glm::dot(d, d);
+		};
+		const auto sqr_diagonal = [&](const SHARED::LightTreeNode& node) {
+			const glm::vec3 d = convert(node.pmax) - convert(node.pmin);
+			return glm::dot(d, d);
+		};
+
+		glm::vec2 dist = glm::vec2(sqr_dist(left), sqr_dist(right));
+		if (attenuation == Attenuation::zerotest) {
+			const float alpha = 0.5f;
+			if (dist.x == 0.0f)
+				dist += sqr_diagonal(left) * alpha;
+			if (dist.y == 0.0f)
+				dist += sqr_diagonal(right) * alpha;
+		}
+		else if (attenuation == Attenuation::conditional || attenuation == Attenuation::mindist) {
+			if (!(dist.x > sqr_diagonal(left) && dist.y > sqr_diagonal(right)))
+				return glm::vec2(1.0f);
+		}
+		return 1.0f / dist;
+	}
+
+	inline float LightBench::max_angle(const glm::vec3& pmin, const glm::vec3& pmax, const glm::vec3& position) const
+	{
+		const bool inside = pmin.x <= position.x && pmin.y <= position.y && pmin.z <= position.z && position.x <= pmax.x && position.y <= pmax.y && position.z <= pmax.z;
+		if (inside)
+			return glm::pi<float>();
+
+		const glm::vec3 p_to_center = (pmin + pmax) * 0.5f - position;
+		const glm::vec3 half_diagonal = (pmax - pmin) * 0.5f;
+		const float b_sqr = glm::dot(half_diagonal, half_diagonal);
+		const float c_sqr = glm::dot(p_to_center, p_to_center);
+		const float c = glm::sqrt(c_sqr);
+
+		// The widest angle to a corner, by the law of cosines
+		float min_cos_theta = 1.0f;
+		for (int i = 0; i < 8; i++) {
+			const glm::vec3 corner = glm::vec3(i & 1 ? pmax.x : pmin.x, i & 2 ? pmax.y : pmin.y, i & 4 ? pmax.z : pmin.z);
+			const glm::vec3 p_to_corner = corner - position;
+			const float a_sqr = glm::dot(p_to_corner, p_to_corner);
+			const float a = glm::sqrt(a_sqr);
+			min_cos_theta = glm::min(min_cos_theta, (c_sqr + a_sqr - b_sqr) / (2.0f * c * a));
+		}
+		return glm::acos(glm::clamp(min_cos_theta, -1.0f, 1.0f));
+	}
+
+	int LightBench::pick_power_light(const std::vector<SHARED::AliasEntry>& table, const std::vector<SHARED::Light>& lights, double r, double* pdf) const
+	{
+		// Same as select_light in shade.cl
+		const size_t n = table.size();
+		const double x = r * static_cast<double>(n);
+		const size_t slot = std::min<size_t>(static_cast<size_t>(x), n - 1);
+		const int index = (x - static_cast<double>(slot)) < table[slot].probability ? static_cast<int>(slot) : table[slot].alias;
+
+		// The pdf of triangle lights includes picking the point on the light, which is removed to get the probability of the light
+		const SHARED::Light& light = lights[index];
+		const float area = glm::length(glm::cross(convert(light.tangent), convert(light.bitangent))) * 0.5f;
+		const bool triangle = light.position.w == 1.0f && area > 0.0f;
+		*pdf = triangle ? static_cast<double>(table[index].pdf) * area : table[index].pdf;
+		return index;
+	}
+
+	bool LightBench::WriteCSV(const std::string& filename) const
+	{
+		std::ofstream file = std::ofstream(filename, std::ios::trunc);
+		if (!file.is_open()) {
+			std::cout << "Failed to write the results: " << filename << "\n";
+			return false;
+		}
+
+		file << "scene,num_lights,method,attenuation,bins,leaf_size,build_ms,num_nodes,depth,sah_cost,saoh_cost,variance,null_picks\n";
+		for (const Result& r : m_results) {
+			file << r.scene << "," << r.num_lights << "," << ToString(r.method) << "," << ToString(r.attenuation) << "," << r.bins << "," << r.leaf_size << ","
+				<< r.build_ms << "," << r.num_nodes << "," << r.depth << "," << r.sah_cost << "," << r.saoh_cost << "," << r.variance << "," << r.null_picks << "\n";
+		}
+		return static_cast<bool>(file);
+	}
+
+	bool LightBench::WriteJSON(const std::string& filename) const
+	{
+		std::ofstream file = std::ofstream(filename, std::ios::trunc);
+		if (!file.is_open()) {
+			std::cout << "Failed to write the results: " << filename << "\n";
+			return false;
+		}
+
+		// Scene names are file stems and generated names, so they need no escaping
+		file << "[\n";
+		for (size_t i = 0; i < m_results.size(); i++) {
+			const Result& r = m_results[i];
+			file << "  { \"scene\": \"" << r.scene << "\", \"num_lights\": " << r.num_lights
+				<< ", \"method\": \"" << ToString(r.method) << "\", \"attenuation\": \"" << ToString(r.attenuation) << "\""
+				<< ", \"bins\": " << r.bins << ", \"leaf_size\": " << r.leaf_size << ", \"build_ms\": " << r.build_ms
+				<< ", \"num_nodes\": " << r.num_nodes << ", \"depth\": " << r.depth << ", \"sah_cost\": " << r.sah_cost << ", \"saoh_cost\": " << r.saoh_cost
+				<< ", \"variance\": " << r.variance << ", \"null_picks\": " << r.null_picks << " }" << (i + 1 < m_results.size() ? ",\n" : "\n");
+		}
+		file << "]\n";
+		return static_cast<bool>(file);
+	}
+
+	bool LightBench::ParseMethod(const std::string& name, Method& method)
+	{
+		if (name == "energy")
+			method = Method::energy;
+		else if (name == "spatial")
+			method = Method::spatial;
+		else if (name == "lighttree")
+			method = Method::lighttree;
+		else
+			return false;
+		return true;
+	}
+
+	bool LightBench::ParseAttenuation(const std::string& name, Attenuation& attenuation)
+	{
+		if (name == "center")
+			attenuation = Attenuation::center;
+		else if (name == "conditional")
+			attenuation = Attenuation::conditional;
+		else if (name == "mindist")
+			attenuation = Attenuation::mindist;
+		else if (name == "zerotest")
+			attenuation = Attenuation::zerotest;
+		else
+			return false;
+		return true;
+	}
+
+	const char* LightBench::ToString(Method method)
+	{
+		switch (method) {
+		case Method::energy: return "energy";
+		case Method::spatial: return "spatial";
+		case Method::lighttree: return "lighttree";
+		}
+		return "";
+	}
+
+	const char* LightBench::ToString(Attenuation attenuation)
+	{
+		switch (attenuation) {
+		case Attenuation::center: return "center";
+		case Attenuation::conditional: return "conditional";
+		case Attenuation::mindist: return "mindist";
+		case Attenuation::zerotest: return "zerotest";
+		}
+		return "";
+	}
+
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "LightStructure/LightTree.h"
+
+namespace LSIS {
+
+	/// Headless benchmark of the light structures, built and evaluated on the host without a window or OpenCL device.
+	/// Every scene is built with each combination of bin count and leaf size. For each tree and sampling method, the variance of the light selection
+	/// is estimated by Monte Carlo at shading points sampled in the scene, relative to the unshadowed contribution of all lights.
+	class LightBench {
+	public:
+		enum class Method {
+			energy,
+			spatial,
+			lighttree
+		};
+
+		// The cluster attenuations of the -atten option of the PathTracer
+		enum class Attenuation {
+			center,
+			conditional,
+			mindist,
+			zerotest
+		};
+
+		typedef struct Settings {
+			std::vector<size_t> bins = { 128 };
+			std::vector<size_t> leaf_sizes = { 1 };
+			std::vector<Method> methods = { Method::energy, Method::lighttree };
+			std::vector<Attenuation> attenuations = { Attenuation::center };
+			size_t num_points = 256; // shading points per scene
+			size_t num_samples = 1024; // lights picked per shading point
+			uint32_t seed = 1;
+		} Settings;
+
+		typedef struct Result {
+			std::string scene;
+			size_t num_lights;
+			Method method;
+			Attenuation attenuation;
+			size_t bins; // 0 for the energy method
+			size_t leaf_size;
+			double build_ms;
+			size_t num_nodes;
+			size_t depth;
+			double sah_cost; // sum of the node areas relative to the root
+			double saoh_cost; // sum of the node energy, area and orientation measures relative to the root
+			double variance; // mean relative variance of contribution / pdf over the shading points
+			double null_picks; // fraction of the picks that found no light
+		} Result;
+
+		LightBench(const Settings& settings);
+		~LightBench();
+
+		/// Loads the OBJ files as one scene. The emissive faces are the lights, and the shading points are sampled on all faces by area
+		bool AddOBJScene(const std::vector<std::string>& filepaths);
+		/// Generated emitters. "uniform" scatters the lights in a box, "clustered" around a few centers and "ceiling" places them in a grid facing the floor
+		bool AddSyntheticScene(const std::string& distribution, size_t num_lights);
+
+		/// Builds and evaluates all scenes with all settings
+		void Run();
+		const std::vector<Result>& GetResults() const { return m_results; }
+
+		bool WriteCSV(const std::string& filename) const;
+		bool WriteJSON(const std::string& filename) const;
+
+		static bool ParseMethod(const std::string& name, Method& method);
+		static bool ParseAttenuation(const std::string& name, Attenuation& attenuation);
+		static const char* ToString(Method method);
+		static const char* ToString(Attenuation attenuation);
+
+	private:
+		typedef struct shading_point {
+			glm::vec3 position;
+			glm::vec3 normal;
+		} shading_point;
+
+		typedef struct scene {
+			std::string name;
+			std::vector<SHARED::Light> lights;
+			std::vector<shading_point> points;
+		} scene;
+
+		void run_scene(const scene& s);
+		void print_result(const Result& result) const;
+
+		// Node count, depth and costs of the tree, traversed from the root
+		void measure_tree(const LightTree& tree, Result& result) const;
+
+		// Unshadowed contribution of the light at the point, with the light as a point at its center. The selection should be proportional to it
+		inline float contribution(const SHARED::Light& light, const shading_point& point) const;
+
+		// Mean relative variance of contribution / pdf, with 'pick' returning the light index and its probability
+		template<typename Pick>
+		void selection_variance(const std::vector<SHARED::Light>& lights, const std::vector<shading_point>& points, const std::vector<double>& reference, Pick&& pick, Result& result) const;
+
+		// Host versions of pick_light, importance and calc_attenuation of shade.cl, for the binary tree
+		int pick_tree_light(const LightTree& tree, bool orientation, Attenuation attenuation, const shading_point& point, double r, double* pdf) const;
+		inline float importance(const SHARED::LightTreeNode& node, const shading_point& point, bool orientation) const;
+		inline glm::vec2 calc_attenuation(const SHARED::LightTreeNode& left, const SHARED::LightTreeNode& right, const glm::vec3& position, Attenuation attenuation) const;
+		inline float max_angle(const glm::vec3& pmin, const glm::vec3& pmax, const glm::vec3& position) const;
+
+		int pick_power_light(const std::vector<SHARED::AliasEntry>& table, const std::vector<SHARED::Light>& lights, double r, double* pdf) const;
+
+		inline glm::vec3 convert(cl_float4 vec) const { return glm::vec3(vec.x, vec.y, vec.z); }
+
+	private:
+		const Settings m_settings;
+		std::vector<scene> m_scenes;
+		std::vector<Result> m_results;
+	};
+
+}
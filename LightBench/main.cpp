@@ -0,0 +1,141 @@
+#include "pch.h"
+
+#include "LightBench.h"
+#include "Threading/ThreadPool.h"
+
+// Splits a comma separated list
+std::vector<std::string> split_list(const std::string& list) {
+	std::vector<std::string> items;
+	std::stringstream stream = std::stringstream(list);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		if (!item.empty())
+			items.push_back(item);
+	}
+	return items;
+}
+
+std::vector<size_t> parse_sizes(const std::string& list) {
+	std::vector<size_t> sizes;
+	for (const std::string& item : split_list(list)) {
+		sizes.push_back(std::stoul(item));
+	}
+	return sizes;
+}
+
+void print_usage() {
+	printf("Usage: LightBench [options]\n");
+	printf("  -obj file             OBJ file, all files are loaded as one scene\n");
+	printf("  -synthetic dist n     generated scene with n lights, dist is uniform, clustered or ceiling\n");
+	printf("  -bins a,b,...         bin counts of the tree builds (128)\n");
+	printf("  -leaf a,b,...         max leaf sizes of the tree builds (1)\n");
+	printf("  -method a,b,...       energy, spatial and/or lighttree (energy,lighttree)\n");
+	printf("  -atten a,b,...        center, conditional, mindist and/or zerotest (center)\n");
+	printf("  -points n             shading points per scene (256)\n");
+	printf("  -samples n            lights picked per shading point (1024)\n");
+	printf("  -seed n               seed of the scenes and samples (1)\n");
+	printf("  -threads n            number of threads in the thread pool\n");
+	printf("  -csv file             write the results as CSV\n");
+	printf("  -json file            write the results as JSON\n");
+}
+
+int main(int argc, char** argv) {
+
+	std::vector<std::string> arg_list(argv, argc + argv);
+
+	LSIS::LightBench::Settings settings = {};
+	std::vector<std::string> obj_files;
+	std::vector<std::pair<std::string, size_t>> synthetic_scenes;
+	std::string csv_file = "";
+	std::string json_file = "";
+
+	for (int i = 1; i < argc; i++) {
+		const std::string& arg = arg_list[i];
+		const int remaining = argc - i - 1;
+		if (arg == "-obj" && remaining >= 1) {
+			obj_files.push_back(arg_list[++i]);
+		}
+		else if (arg == "-synthetic" && remaining >= 2) {
+			const std::string& distribution = arg_list[++i];
+			const size_t num_lights = std::stoul(arg_list[++i]);
+			synthetic_scenes.push_back({ distribution, num_lights });
+		}
+		else if (arg == "-bins" && remaining >= 1) {
+			settings.bins = parse_sizes(arg_list[++i]);
+		}
+		else if (arg == "-leaf" && remaining >= 1) {
+			settings.leaf_sizes = parse_sizes(arg_list[++i]);
+		}
+		else if (arg == "-method" && remaining >= 1) {
+			settings.methods.clear();
+			for (const std::string& name : split_list(arg_list[++i])) {
+				LSIS::LightBench::Method method;
+				if (!LSIS::LightBench::ParseMethod(name, method)) {
+					printf("Unknown method: %s\n", name.c_str());
+					return 1;
+				}
+				settings.methods.push_back(method);
+			}
+		}
+		else if (arg == "-atten" && remaining >= 1) {
+			settings.attenuations.clear();
+			for (const std::string& name : split_list(arg_list[++i])) {
+				LSIS::LightBench::Attenuation attenuation;
+				if (!LSIS::LightBench::ParseAttenuation(name, attenuation)) {
+					printf("Unknown attenuation: %s\n", name.c_str());
+					return 1;
+				}
+				settings.attenuations.push_back(attenuation);
+			}
+		}
+		else if (arg == "-points" && remaining >= 1) {
+			settings.num_points = std::stoul(arg_list[++i]);
+		}
+		else if (arg == "-samples" && remaining >= 1) {
+			settings.num_samples = std::stoul(arg_list[++i]);
+		}
+		else if (arg == "-seed" && remaining >= 1) {
+			settings.seed = static_cast<uint32_t>(std::stoul(arg_list[++i]));
+		}
+		else if (arg == "-threads" && remaining >= 1) {
+			LSIS::ThreadPool::Init(std::stoul(arg_list[++i]));
+		}
+		else if (arg == "-csv" && remaining >= 1) {
+			csv_file = arg_list[++i];
+		}
+		else if (arg == "-json" && remaining >= 1) {
+			json_file = arg_list[++i];
+		}
+		else {
+			printf("Unknown option: %s\n", arg.c_str());
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (obj_files.empty() && synthetic_scenes.empty()) {
+		print_usage();
+		return 1;
+	}
+
+	LSIS::LightBench bench = LSIS::LightBench(settings);
+	if (!obj_files.empty() && !bench.AddOBJScene(obj_files)) {
+		return 1;
+	}
+	for (const auto& [distribution, num_lights] : synthetic_scenes) {
+		if (!bench.AddSyntheticScene(distribution, num_lights)) {
+			return 1;
+		}
+	}
+
+	bench.Run();
+
+	bool success = true;
+	if (!csv_file.empty()) {
+		success &= bench.WriteCSV(csv_file);
+	}
+	if (!json_file.empty()) {
+		success &= bench.WriteJSON(json_file);
+	}
+	return success ? 0 : 1;
+}
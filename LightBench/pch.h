@@ -0,0 +1,15 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <algorithm>
+#include <functional>
+
+#include <string>
+#include <sstream>
+#include <array>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "glm.hpp"
\ No newline at end of file
@@ -8,6 +8,10 @@
 
 namespace LSIS {
 
+	/// Builds a binary BVH on the device, as a LBVH over the morton codes of the face centers. Nothing passes through the host.
+	/// Internal nodes are stored in [0, n-1) with the root at 0, followed by the n leaves. Leaves hold a single face, with node.left = -1 and node.right = the index of the face in the input order,
+	/// so the faces are used as they are. The internal nodes are finally merged with the bounds of their children into BVHNodes, keeping their indices.
+	/// Lower quality than the SAH BVH, but fast enough to rebuild for dynamic scenes
 	class BVHBuilder : Kernel {
 		typedef struct morton_key {
 			cl_ulong code;
@@ -19,41 +23,44 @@ namespace LSIS {
 
 		virtual void Compile() override;
 
-		const std::pair<TypedBuffer<SHARED::Node>, TypedBuffer<SHARED::AABB>> Build(const TypedBuffer<SHARED::Vertex>& vertices, const TypedBuffer<SHARED::Face>& faces);
+		/// Builds the BVH, and optimizes it with 'treelet_passes' passes of treelet restructuring. 'parents' is set to the parent of each merged node, -1 for the root
+		TypedBuffer<SHARED::BVHNode> Build(const TypedBuffer<SHARED::Vertex>& vertices, const TypedBuffer<SHARED::Face>& faces, TypedBuffer<cl_int>& parents, size_t treelet_passes = 0);
+		/// Treelet restructuring of a binary BVH on the device, the same as TreeletRestructure. Leaves and the root keep their indices
+		void Restructure(const cl_uint num_nodes, const TypedBuffer<SHARED::Node>& nodes, const TypedBuffer<SHARED::AABB>& bboxes, size_t num_passes);
 
 	private:
 
 		void CalcPrimitiveBounds(cl_uint num_vertices, cl_uint num_faces, const TypedBuffer<SHARED::Vertex>& vertices, const TypedBuffer<SHARED::Face>& faces, const TypedBuffer<cl_float3>& centers, const TypedBuffer<SHARED::AABB>& bboxes);
-		void FindSceneBounds(cl_uint num_primitives, const TypedBuffer<SHARED::AABB>& bboxes, const TypedBuffer<cl_float3>& scene_bounds);
-		void GenerateMortonCodes(cl_uint num_primitives, const TypedBuffer<cl_float3>& centers, const TypedBuffer<cl_float3>& scene_bounds, const TypedBuffer<morton_key>& codes);
-		void SortMortonCodes(cl_uint num_primitives, const TypedBuffer<morton_key>& codes, TypedBuffer<morton_key>& codes_sorted);
+		void FindSceneBounds(cl_uint num_primitives, const TypedBuffer<SHARED::AABB>& bboxes, const TypedBuffer<SHARED::AABB>& scene_bounds);
+		void GenerateMortonCodes(cl_uint num_primitives, const TypedBuffer<cl_float3>& centers, const TypedBuffer<SHARED::AABB>& scene_bounds, const TypedBuffer<morton_key>& codes);
+		void SortMortonCodes(cl_uint num_primitives, TypedBuffer<morton_key>& codes);
 		void GenerateNodes(cl_uint num_primitives, const TypedBuffer<morton_key>& codes, const TypedBuffer<SHARED::AABB>& bounds, const TypedBuffer<SHARED::Node>& nodes, const TypedBuffer<SHARED::AABB>& nodes_bounds);
 		void Refit(const cl_uint num_primitives, const TypedBuffer<SHARED::Node>& nodes, const TypedBuffer<SHARED::AABB>& bboxes);
-
-		inline uint64_t clz64(const uint64_t i) {
-			return __lzcnt64(i);
-		}
-
-		inline uint64_t sigma(const uint64_t i, const uint64_t j) {
-			return clz64(i ^ j);
-		}
-
-		inline glm::vec3 mad(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
-			return (a * b) + c;
-		}
-
-		inline uint32_t findSplit(const morton_key* codes, const uint32_t first, const uint32_t last);
-		uint32_t generate(const morton_key* codes, const SHARED::AABB* bounds, const uint32_t first, const uint32_t last, SHARED::Node* nodes, SHARED::AABB* nodes_bounds, const uint32_t idx);
-		SHARED::AABB calc_bboxes(SHARED::Node* nodes, SHARED::AABB* nodes_bboxes, uint32_t idx);
+		void MergeNodes(const cl_uint num_primitives, const TypedBuffer<SHARED::Node>& nodes, const TypedBuffer<SHARED::AABB>& bboxes, const TypedBuffer<SHARED::BVHNode>& merged, const TypedBuffer<cl_int>& parents);
 
 	private:
+		// Must match the defines in bvh_builder.cl and radixsortCL.h
+		static constexpr size_t s_bounds_group_size = 256;
+		static constexpr size_t s_bounds_max_groups = 256;
+		static constexpr size_t s_radix_bits = 8;
+		static constexpr size_t s_radix_range = 1 << s_radix_bits;
+		static constexpr size_t s_radix_block_size = 1024;
+		static constexpr size_t s_radix_scan_tile = 1024;
+
 		cl::Program m_program;
 		cl::Kernel m_kernel_prepare;
 		cl::Kernel m_kernel_scene_bounds;
 		cl::Kernel m_kernel_morton_code;
-		cl::Kernel m_kernel_sort;
+		cl::Kernel m_kernel_radix_count;
+		cl::Kernel m_kernel_radix_reduce;
+		cl::Kernel m_kernel_radix_scan;
+		cl::Kernel m_kernel_radix_downsweep;
+		cl::Kernel m_kernel_radix_scatter;
 		cl::Kernel m_kernel_hireachy;
 		cl::Kernel m_kernel_refit;
+		cl::Kernel m_kernel_parents;
+		cl::Kernel m_kernel_restructure;
+		cl::Kernel m_kernel_merge;
 	};
 
-}
\ No newline at end of file
+}
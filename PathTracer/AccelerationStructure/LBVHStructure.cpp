@@ -2,16 +2,18 @@
 #include "LBVHStructure.h"
 
 #include <algorithm>
-#include <execution>
+#include <new>
 
 #include <intrin.h>
 #include "DataStructures/MortonCode.h"
+#include "TreeletRestructure.h"
 
 #include "Core/Timer.h"
 
 namespace LSIS {
 
-	LBVHStructure::LBVHStructure()
+	LBVHStructure::LBVHStructure(size_t max_leaf_size, size_t treelet_passes)
+		: m_max_leaf_size(std::max<size_t>(max_leaf_size, 1)), m_treelet_passes(treelet_passes)
 	{
 	}
 
@@ -19,10 +21,6 @@ namespace LSIS {
 	{
 	}
 
-	inline float max(const glm::vec3& vec) {
-		return vec.x > vec.y ? (vec.x > vec.z ? vec.x : vec.z) : (vec.y > vec.z ? vec.y : vec.z);
-	}
-
 	inline uint64_t clz64(const uint64_t i) {
 		return __lzcnt64(i);
 	}
@@ -35,204 +33,295 @@ namespace LSIS {
 		return (a * b) + c;
 	}
 
-	/// implementation from https://devblogs.nvidia.com/thinking-parallel-part-iii-tree-construction-gpu/
-	inline uint32_t LBVHStructure::findSplit(const morton_code_64_t* codes, const uint32_t first, const uint32_t last) {
-		const uint64_t firstCode = codes[first].code;
-		const uint64_t lastCode = codes[last].code;
-
-		if (firstCode == lastCode)
-			return (first + last) >> 1;
-
-		// Calculate the number of highest bits that are the same
-		// for all objects, using the count-leading-zeros intrinsic.
-
-		const uint64_t commonPrefix = clz64(firstCode ^ lastCode);
-		//int commonPrefix = __clz(firstCode ^ lastCode);
-
-		// Use binary search to find where the next bit differs.
-		// Specifically, we are looking for the highest object that
-		// shares more than commonPrefix bits with the first one.
-
-		uint64_t split = first; // initial guess
-		uint64_t step = last - first;
-
-		do
-		{
-			step = (step + 1) >> 1; // exponential decrease
-			uint64_t newSplit = split + step; // proposed new position
+	inline void store_bbox(SHARED::AABB& dst, const glm::vec3& pmin, const glm::vec3& pmax) {
+		dst.min.x = pmin.x;
+		dst.min.y = pmin.y;
+		dst.min.z = pmin.z;
+		dst.max.x = pmax.x;
+		dst.max.y = pmax.y;
+		dst.max.z = pmax.z;
+	}
 
-			if (newSplit < last)
-			{
-				const uint64_t splitCode = codes[newSplit].code;
-				uint64_t splitPrefix = clz64(firstCode ^ splitCode);
-				if (splitPrefix > commonPrefix)
-					split = newSplit; // accept proposal
+	LBVHStructure::morton_code_64_t* LBVHStructure::sort_morton_codes(morton_code_64_t* keys, morton_code_64_t* keys_tmp, size_t num_keys)
+	{
+		ThreadPool& pool = ThreadPool::Get();
+		const size_t num_chunks = std::max<size_t>(1, std::min(pool.GetNumThreads(), num_keys));
+		std::vector<size_t> offsets(num_chunks * s_radix_range);
+
+		for (uint32_t shift = 0; shift < 64; shift += s_radix_bits) {
+			// Count the digits of each chunk
+			pool.ParallelFor(0, num_keys, num_chunks, [&](size_t begin, size_t end, size_t chunk) {
+				size_t* counts = offsets.data() + chunk * s_radix_range;
+				std::fill(counts, counts + s_radix_range, 0);
+				for (size_t i = begin; i < end; i++) {
+					counts[(keys[i].code >> shift) & (s_radix_range - 1)]++;
+				}
+			});
+
+			// Scan the counts in digit major order, so each chunk scatters after the same digit of the previous chunks and the sort is stable
+			size_t offset = 0;
+			bool single_digit = false;
+			for (size_t digit = 0; digit < s_radix_range; digit++) {
+				const size_t digit_begin = offset;
+				for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+					const size_t count = offsets[chunk * s_radix_range + digit];
+					offsets[chunk * s_radix_range + digit] = offset;
+					offset += count;
+				}
+				single_digit = single_digit || offset - digit_begin == num_keys;
 			}
-		} while (step > 1);
 
-		return static_cast<uint32_t>(split);
+			// The pass would leave the keys in place
+			if (single_digit)
+				continue;
+
+			pool.ParallelFor(0, num_keys, num_chunks, [&](size_t begin, size_t end, size_t chunk) {
+				size_t* chunk_offsets = offsets.data() + chunk * s_radix_range;
+				for (size_t i = begin; i < end; i++) {
+					keys_tmp[chunk_offsets[(keys[i].code >> shift) & (s_radix_range - 1)]++] = keys[i];
+				}
+			});
+			std::swap(keys, keys_tmp);
+		}
+
+		return keys;
 	}
 
-	uint32_t LBVHStructure::generate(const morton_code_64_t* codes, const uint32_t first, const uint32_t last, SHARED::Node* nodes, const uint32_t idx) {
+	inline int LBVHStructure::delta(const morton_code_64_t* codes, int64_t num_codes, int64_t i, int64_t j)
+	{
+		if (j < 0 || j >= num_codes)
+			return -1;
+
+		const uint64_t code_i = codes[i].code;
+		const uint64_t code_j = codes[j].code;
+		if (code_i == code_j)
+			return 64 + static_cast<int>(__lzcnt(static_cast<uint32_t>(i ^ j)));
+		return static_cast<int>(clz64(code_i ^ code_j));
+	}
 
-		if (first == last) {
-			SHARED::Node node = {};
-			node.left = -1;
-			node.right =codes[first].index;
-			nodes[idx] = node;
-			//printf("idx: %d, leaf\n", idx);
-			return 1;
+	/// implementation from https://devblogs.nvidia.com/thinking-parallel-part-iii-tree-construction-gpu/
+	void LBVHStructure::emit_node(const morton_code_64_t* codes, int64_t num_codes, int64_t i, build_node* nodes, int* parents)
+	{
+		// The range of the node extends towards the neighbour sharing the longest prefix
+		const int64_t d = delta(codes, num_codes, i, i + 1) > delta(codes, num_codes, i, i - 1) ? 1 : -1;
+
+		// Find the other end of the range, as the last code sharing more than the prefix with the other neighbour
+		const int delta_min = delta(codes, num_codes, i, i - d);
+		int64_t length_max = 2;
+		while (delta(codes, num_codes, i, i + length_max * d) > delta_min)
+			length_max *= 2;
+
+		int64_t length = 0;
+		for (int64_t t = length_max / 2; t >= 1; t /= 2) {
+			if (delta(codes, num_codes, i, i + (length + t) * d) > delta_min)
+				length += t;
 		}
-		// find split
-		int split = findSplit(codes, first, last);
-		//int range = last - first;
-		//int split = first + (range / 2);
-
+		const int64_t j = i + length * d;
+
+		// Binary search for the highest code sharing more than the prefix of the range with node i
+		const int delta_node = delta(codes, num_codes, i, j);
+		int64_t s = 0;
+		int64_t t = length;
+		do {
+			t = (t + 1) / 2;
+			if (delta(codes, num_codes, i, i + (s + t) * d) > delta_node)
+				s += t;
+		} while (t > 1);
+		const int64_t split = i + s * d + std::min<int64_t>(d, 0);
+
+		// Children covering a single code are leaves
+		const int64_t first = std::min(i, j);
+		const int64_t last = std::max(i, j);
+		const int64_t leaves = num_codes - 1;
+
+		build_node& node = nodes[i];
+		node.left = static_cast<uint32_t>(first == split ? leaves + split : split);
+		node.right = static_cast<uint32_t>(last == split + 1 ? leaves + split + 1 : split + 1);
+		node.first = static_cast<uint32_t>(first);
+		node.count = static_cast<uint32_t>(last - first + 1);
+		parents[node.left] = static_cast<int>(i);
+		parents[node.right] = static_cast<int>(i);
+	}
 
-		// process sub-ranges
-		uint32_t num_left = generate(codes, first, split, nodes, idx + 1);
-		uint32_t num_right = generate(codes, split + 1, last, nodes, idx + num_left + 1);
+	void LBVHStructure::store_subtree(const build_node* nodes, uint32_t node, uint32_t index, int parent, ThreadPool::TaskGroup& group)
+	{
+		// Follows the left children, as they are stored right after their parent
+		while (true) {
+			const build_node& build = nodes[node];
+			store_bbox(m_bboxes[index], build.bbox.p_min, build.bbox.p_max);
+
+			SHARED::Node stored = {};
+			stored.parent = parent;
+			if (build.count == 1 || build.collapse) {
+				stored.left = -static_cast<int>(build.count);
+				stored.right = static_cast<int>(build.first);
+				m_nodes[index] = stored;
+				return;
+			}
 
-		SHARED::Node node = {};
-		node.left = idx + 1;
-		node.right = num_left + idx + 1;
-		nodes[idx] = node;
+			// The sizes of the subtrees give the index of the right child without visiting the left subtree
+			stored.left = static_cast<int>(index + 1);
+			stored.right = static_cast<int>(index + 1 + nodes[build.left].size);
+			m_nodes[index] = stored;
 
-		return num_left + num_right + 1;
-	}
+			const uint32_t right = build.right;
+			const uint32_t right_index = static_cast<uint32_t>(stored.right);
+			const int right_parent = static_cast<int>(index);
+			if (nodes[right].size >= s_task_threshold) {
+				ThreadPool::Get().Submit(group, [this, nodes, right, right_index, right_parent, &group]() { store_subtree(nodes, right, right_index, right_parent, group); });
+			}
+			else {
+				store_subtree(nodes, right, right_index, right_parent, group);
+			}
 
-	LBVHStructure::AABB LBVHStructure::calc_bboxes(SHARED::Node* nodes, SHARED::AABB* nodes_bboxes, const AABB* bboxes, uint32_t idx) {
-		SHARED::Node& node = nodes[idx];
-		SHARED::AABB& node_bbox = nodes_bboxes[idx];
-		// if leaf
-		if (node.left == -1) {
-			uint32_t face_idx = static_cast<uint32_t>(node.right);
-			const AABB& bbox = bboxes[face_idx];
-			node_bbox.min.x = bbox.p_min.x;
-			node_bbox.min.y = bbox.p_min.y;
-			node_bbox.min.z = bbox.p_min.z;
-			node_bbox.max.x = bbox.p_max.x;
-			node_bbox.max.y = bbox.p_max.y;
-			node_bbox.max.z = bbox.p_max.z;
-			return bbox;
+			parent = static_cast<int>(index);
+			index = index + 1;
+			node = build.left;
 		}
-
-		// internal node
-		uint32_t left = node.left;
-		uint32_t right = node.right;
-		AABB bbox = AABB(calc_bboxes(nodes, nodes_bboxes, bboxes, left), calc_bboxes(nodes, nodes_bboxes, bboxes, right));
-		node_bbox.min.x = bbox.p_min.x;
-		node_bbox.min.y = bbox.p_min.y;
-		node_bbox.min.z = bbox.p_min.z;
-		node_bbox.max.x = bbox.p_max.x;
-		node_bbox.max.y = bbox.p_max.y;
-		node_bbox.max.z = bbox.p_max.z;
-
-		return bbox;
 	}
-	   
-	void LBVHStructure::Build(TypedBuffer<SHARED::Vertex>& vertex_buffer, TypedBuffer<SHARED::Face>& face_buffer)
+
+	void LBVHStructure::Build(const SHARED::Vertex* vertices, const SHARED::Face* faces, size_t num_faces)
 	{
 		PROFILE_SCOPE("LBVH Build");
 
-		const size_t N = face_buffer.Count();
+		const size_t N = num_faces;
 
 		m_num_faces = N;
-		m_num_vertices = vertex_buffer.Count();
 
-		if (m_num_faces == 0 || m_num_vertices == 0) {
+		if (m_num_faces == 0) {
 			return;
 		}
 
-		printf("num_vertices: %zd, num_faces: %zd\n", m_num_vertices, m_num_faces);
-
-		SHARED::Face* faces = new SHARED::Face[N]; // (Face*)malloc(sizeof(Face) * N);
-		SHARED::Vertex* vertices = new SHARED::Vertex[m_num_vertices]; // (Vertex*)malloc(sizeof(Vertex) * num_vertices);
-
-		// exstract bounding boxes for each face in the scene
-		AABB * bboxes = new AABB[N];// (AABB*)malloc(sizeof(AABB) * N);
-		glm::vec3* centers = new glm::vec3[N]; // (glm::vec3*) malloc(sizeof(glm::vec3) * N);
-
-		auto queue = Compute::GetCommandQueue();
-		queue.enqueueReadBuffer(vertex_buffer.GetBuffer(), CL_TRUE, 0, vertex_buffer.Size(), vertices);
-		queue.enqueueReadBuffer(face_buffer.GetBuffer(), CL_TRUE, 0, face_buffer.Size(), faces);
-
-		// Find scene bounds
+		// Temporary build data lives in the scratch arena of this thread, and is freed when the scope ends
+		Arena& arena = Arena::GetScratch();
+		Arena::Scope arena_scope(arena);
+
+		AABB* bboxes = arena.Allocate<AABB>(N);
+		glm::vec3* centers = arena.Allocate<glm::vec3>(N);
+		morton_code_64_t* keys = arena.Allocate<morton_code_64_t>(N);
+		morton_code_64_t* keys_tmp = arena.Allocate<morton_code_64_t>(N);
+		build_node* nodes = arena.Allocate<build_node>(2 * N - 1);
+		int* parents = arena.Allocate<int>(2 * N - 1);
+		std::atomic<uint32_t>* visits = arena.Allocate<std::atomic<uint32_t>>(N);
+
+		ThreadPool& pool = ThreadPool::Get();
+		const size_t num_chunks = pool.GetNumThreads();
+
+		// Find the bounds and centers of the faces. The scene bounds are merged from the bounds of the chunks
+		AABB* chunk_bounds = arena.Allocate<AABB>(num_chunks);
+		pool.ParallelFor(0, N, num_chunks, [&](size_t begin, size_t end, size_t chunk) {
+			AABB bounds = AABB();
+			for (size_t i = begin; i < end; i++) {
+				const SHARED::Face& face = faces[i];
+
+				const SHARED::Vertex& v0 = vertices[face.index.x];
+				const SHARED::Vertex& v1 = vertices[face.index.y];
+				const SHARED::Vertex& v2 = vertices[face.index.z];
+
+				glm::vec3 p0 = { v0.position.x, v0.position.y, v0.position.z };
+				glm::vec3 p1 = { v1.position.x, v1.position.y, v1.position.z };
+				glm::vec3 p2 = { v2.position.x, v2.position.y, v2.position.z };
+
+				// find center of triangle as the average position
+				centers[i] = (p0 + p1 + p2) / 3.0f;
+				AABB bbox = AABB(p0);
+				bbox.add_AABB(p1);
+				bbox.add_AABB(p2);
+
+				bboxes[i] = bbox;
+
+				bounds.add_AABB(bbox);
+			}
+			chunk_bounds[chunk] = bounds;
+		});
 		AABB bounds = AABB();
-		for (size_t i = 0; i < N; i++) {
-			const SHARED::Face& face = faces[i];
-
-			//printf("face: %d,%d,%d,%d\n", face.index.x, face.index.y, face.index.z, face.index.w);
-
-			const SHARED::Vertex& v0 = vertices[face.index.x];
-			const SHARED::Vertex& v1 = vertices[face.index.y];
-			const SHARED::Vertex& v2 = vertices[face.index.z];
-
-			//printf("v0: %f,%f,%f\n", v0.position.x, v0.position.y, v0.position.z);
-			//printf("v1: %f,%f,%f\n", v1.position.x, v1.position.y, v1.position.z);
-			//printf("v2: %f,%f,%f\n", v2.position.x, v2.position.y, v2.position.z);
-
-			glm::vec3 p0 = { v0.position.x, v0.position.y, v0.position.z };
-			glm::vec3 p1 = { v1.position.x, v1.position.y, v1.position.z };
-			glm::vec3 p2 = { v2.position.x, v2.position.y, v2.position.z };
-
-			// find center of triangle as the average position
-			centers[i] = (p0 + p1 + p2) / 3.0f;
-			AABB bbox = AABB(p0);
-			bbox.add_AABB(p1);
-			bbox.add_AABB(p2);
-
-			bboxes[i] = bbox;
-
-			bounds.add_AABB(bbox);
+		for (size_t c = 0; c < std::min(num_chunks, N); c++) {
+			bounds.add_AABB(chunk_bounds[c]);
 		}
 
-		//printf("Scene Bounds: [%f,%f,%f][%f,%f,%f]\n", bounds.p_min.x, bounds.p_min.y, bounds.p_min.z, bounds.p_max.x, bounds.p_max.y, bounds.p_max.z);
-
-		// calculate transforms to project the coordinates into the range [0,1]
-		glm::vec3 diagonal = bounds.p_max - bounds.p_min;
-		const float max_dim = max(diagonal);
-		const glm::vec3 scale = glm::vec3(1.0f / max_dim);
-		const glm::vec3 transform = -bounds.p_min * scale;
-
-		// create temporary array on the stack for building the bvh structure
-		morton_code_64_t* morton_keys = new morton_code_64_t[N]; // (morton_code_64_t*)malloc(sizeof(morton_code_64_t) * N);
-
-		// generate morton codes based on the bounding boxes in the scene
-		for (int i = 0; i < N; i++) {
-			const glm::vec p = (centers[i] - bounds.p_min) / diagonal;
-			morton_code_64_t key{};
-			key.code = Float3ToInt64(p);
-			key.index = i;
-			morton_keys[i] = key;
-		}
+		// generate morton codes of the centers in the range [0,1] of the scene bounds. Flat dimensions are left at 0
+		const glm::vec3 diagonal = bounds.p_max - bounds.p_min;
+		const glm::vec3 inv_diagonal = glm::vec3(
+			diagonal.x > 0.0f ? 1.0f / diagonal.x : 0.0f,
+			diagonal.y > 0.0f ? 1.0f / diagonal.y : 0.0f,
+			diagonal.z > 0.0f ? 1.0f / diagonal.z : 0.0f);
+		pool.ParallelFor(0, N, [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				const glm::vec3 p = glm::clamp((centers[i] - bounds.p_min) * inv_diagonal, 0.0f, 1.0f);
+				morton_code_64_t key{};
+				key.code = Float3ToInt64(p);
+				key.index = static_cast<uint32_t>(i);
+				keys[i] = key;
+			}
+		});
 
 		// sort morton codes
-		std::sort(std::execution::seq,morton_keys, morton_keys + N);
-
-		// internal nodes is equal to N-1 and where N is the amount of leaves.
-		size_t num_internal_nodes = N - 1;
-		m_num_nodes = N + num_internal_nodes;
-
-		// clear and resize the nodes array to hold the maximum amounds of nodes, based on the number of leaves
-		SHARED::Node* nodes = new SHARED::Node[m_num_nodes]; // (Node*)malloc(sizeof(Node) * m_num_nodes);
-		SHARED::AABB* nodes_bboxes = new SHARED::AABB[m_num_nodes];
-
-		// Generate Hiearachy
-		generate(morton_keys, 0, static_cast<uint32_t>(N - 1), nodes, 0);
+		const morton_code_64_t* morton_keys = sort_morton_codes(keys, keys_tmp, N);
+
+		// With single face leaves, there are N-1 internal nodes where N is the amount of leaves. The root is internal node 0, or the leaf of a single face
+		parents[0] = -1;
+		pool.ParallelFor(0, N - 1, [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				emit_node(morton_keys, static_cast<int64_t>(N), static_cast<int64_t>(i), nodes, parents);
+				new (&visits[i]) std::atomic<uint32_t>(0);
+			}
+		});
+
+		// Refit the bounds and SAH costs from the leaves. The first thread to reach a node stops, the second continues with it, as both subtrees are done
+		pool.ParallelFor(0, N, [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				build_node& leaf = nodes[N - 1 + i];
+				leaf.first = static_cast<uint32_t>(i);
+				leaf.count = 1;
+				leaf.size = 1;
+				leaf.collapse = false;
+				leaf.bbox = bboxes[morton_keys[i].index];
+				leaf.cost = s_intersection_cost * leaf.bbox.area();
+
+				int index = parents[N - 1 + i];
+				while (index != -1 && visits[index].fetch_add(1, std::memory_order_acq_rel) == 1) {
+					build_node& node = nodes[index];
+					const build_node& left = nodes[node.left];
+					const build_node& right = nodes[node.right];
+
+					node.bbox = AABB(left.bbox, right.bbox);
+					const float area = node.bbox.area();
+					node.cost = s_traversal_cost * area + left.cost + right.cost;
+
+					// Collapse the subtree into a leaf if that is cheaper
+					node.collapse = node.count <= m_max_leaf_size && s_intersection_cost * node.count * area <= node.cost;
+					if (node.collapse)
+						node.cost = s_intersection_cost * node.count * area;
+					node.size = node.collapse ? 1 : 1 + left.size + right.size;
+
+					index = parents[index];
+				}
+			}
+		});
+
+		// Store the nodes left of the collapsed subtrees in depth first order
+		m_num_nodes = nodes[0].size;
+		m_nodes.resize(m_num_nodes);
+		m_bboxes.resize(m_num_nodes);
+		ThreadPool::TaskGroup group;
+		store_subtree(nodes, 0, 0, -1, group);
+		pool.Wait(group);
+
+		if (m_treelet_passes > 0) {
+			PROFILE_SCOPE("Treelet Restructure");
+			TreeletRestructure restructure = TreeletRestructure(m_nodes.data(), m_bboxes.data(), m_num_nodes, m_treelet_passes);
+		}
 
-		// Calculate the bounding boxes
-		calc_bboxes(nodes, nodes_bboxes, bboxes, 0);
+		// Order the faces as the leaves reference them
+		m_faces.resize(N);
+		pool.ParallelFor(0, N, [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				m_faces[i] = faces[morton_keys[i].index];
+			}
+		});
 
 		// Upload data to the GPU
-		LoadBVHBuffer(nodes, nodes_bboxes, m_num_nodes);
-		//LoadGeometryBuffers(vertices, m_num_vertices, faces, m_num_faces);
-
-		delete[] faces;
-		delete[] vertices;
-		delete[] bboxes;
-		delete[] centers;
-		delete[] morton_keys;
+		LoadBVHBuffer(m_nodes.data(), m_bboxes.data(), m_num_nodes);
 
 		isBuild = true;
 	}
@@ -242,12 +331,14 @@ namespace LSIS {
 		// initialize buffers
 		m_buffer_bvh = TypedBuffer<SHARED::Node>(Compute::GetContext(), CL_MEM_READ_ONLY, num_nodes);
 		m_buffer_bboxes = TypedBuffer<SHARED::AABB>(Compute::GetContext(), CL_MEM_READ_ONLY, num_nodes);
+		m_buffer_faces = TypedBuffer<SHARED::Face>(Compute::GetContext(), CL_MEM_READ_ONLY, m_faces.size());
 		m_num_nodes = num_nodes;
 
 		// Upload data
 		auto queue = Compute::GetCommandQueue();
 		queue.enqueueWriteBuffer(m_buffer_bvh.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Node) * num_nodes, static_cast<const void*>(nodes));
 		queue.enqueueWriteBuffer(m_buffer_bboxes.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::AABB) * num_nodes, static_cast<const void*>(bboxes));
+		queue.enqueueWriteBuffer(m_buffer_faces.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Face) * m_faces.size(), static_cast<const void*>(m_faces.data()));
 
 	}
 
@@ -1,20 +1,33 @@
 #pragma once
 
+#include <vector>
+
 #include "Kernels/shared_defines.h"
 #include "Mesh/Mesh.h"
 #include "Compute/Buffer.h"
+#include "Threading/ThreadPool.h"
 
 namespace LSIS {
 
+	/// BVH over the faces sorted by the morton codes of their centers, built in parallel on the host. The morton codes are sorted with a parallel LSD radix sort, and every internal node
+	/// is emitted independently from the sorted codes, as in "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees" by Karras 2012. The bounds are then refitted bottom up.
+	/// Subtrees of up to 'max_leaf_size' faces are collapsed into a leaf when that is cheaper by the SAH.
+	/// Leaves reference a contiguous range of the faces in morton order, with node.left = -count and node.right = the first face.
+	/// With 'treelet_passes' > 0 the tree is optimized by treelet restructuring before it is uploaded
 	class LBVHStructure {
 	public:
-		LBVHStructure();
+		LBVHStructure(size_t max_leaf_size = 4, size_t treelet_passes = 0);
 		virtual ~LBVHStructure();
 
-		void Build(TypedBuffer<SHARED::Vertex>& vertex_buffer, TypedBuffer<SHARED::Face>& face_buffer);
-			   
-		TypedBuffer<SHARED::Node> GetNodes() const { return m_buffer_bvh; }
-		TypedBuffer<SHARED::AABB> GetBBoxes() const { return m_buffer_bboxes; }
+		void Build(const SHARED::Vertex* vertices, const SHARED::Face* faces, size_t num_faces);
+
+		TypedBuffer<SHARED::Node> GetNodesBuffer() const { return m_buffer_bvh; }
+		TypedBuffer<SHARED::AABB> GetBoundsBuffer() const { return m_buffer_bboxes; }
+		const SHARED::Node* GetNodes() const { return m_nodes.data(); }
+		const SHARED::AABB* GetBounds() const { return m_bboxes.data(); }
+		/// The faces in the order referenced by the leaves. Use this instead of the input faces
+		TypedBuffer<SHARED::Face> GetFaceBuffer() const { return m_buffer_faces; }
+		const std::vector<SHARED::Face>& GetFaces() const { return m_faces; }
 
 	private:
 
@@ -38,22 +51,54 @@ namespace LSIS {
 			AABB(const AABB& a, const AABB& b) : p_min(min(a.p_min, b.p_min)), p_max(max(a.p_max, b.p_max)) {}
 			AABB(const glm::vec3& p) : p_min(p), p_max(p) {}
 			inline void add_AABB(const AABB& aabb) { p_min = min(p_min, aabb.p_min); p_max = max(p_max, aabb.p_max); }
+			inline float area() const { const glm::vec3 d = p_max - p_min; return 2.0f * (d.x * d.y + d.x * d.z + d.y * d.z); }
+		};
+
+		// Node of the hierarchy before the leaves are collapsed. The N-1 internal nodes are followed by the N single face leaves
+		struct build_node {
+			uint32_t left;
+			uint32_t right;
+			// The sorted faces [first, first + count) below the node
+			uint32_t first;
+			uint32_t count;
+			// Number of nodes stored for the subtree, 1 if it is collapsed into a leaf
+			uint32_t size;
+			bool collapse;
+			float cost;
+			AABB bbox;
 		};
 
-		static uint32_t findSplit(const morton_code_64_t* codes, const uint32_t first, const uint32_t last);
-		static uint32_t generate(const morton_code_64_t* codes, const uint32_t first, const uint32_t last, SHARED::Node* nodes, const uint32_t idx);
-		static AABB LBVHStructure::calc_bboxes(SHARED::Node* nodes, SHARED::AABB* nodes_bboxes, const AABB* bboxes, uint32_t idx);
+		// Sorts the keys by their code, using 'keys_tmp' for the passes. Returns the array holding the sorted keys
+		static morton_code_64_t* sort_morton_codes(morton_code_64_t* keys, morton_code_64_t* keys_tmp, size_t num_keys);
+		// Length of the common prefix of the codes i and j, with the indices breaking ties. -1 if j is outside the codes
+		static int delta(const morton_code_64_t* codes, int64_t num_codes, int64_t i, int64_t j);
+		// Links the internal node i to its children, and stores its range of the codes
+		static void emit_node(const morton_code_64_t* codes, int64_t num_codes, int64_t i, build_node* nodes, int* parents);
+		// Stores the subtree of the build node 'node' in depth first order from 'index'. Large right subtrees are stored by tasks in 'group'
+		void store_subtree(const build_node* nodes, uint32_t node, uint32_t index, int parent, ThreadPool::TaskGroup& group);
 
 		void LoadBVHBuffer(const SHARED::Node* nodes, const SHARED::AABB* bboxes, size_t num_nodes);
 
 	private:
+		// SAH costs of traversing a node and intersecting a face
+		static constexpr float s_traversal_cost = 1.0f;
+		static constexpr float s_intersection_cost = 1.0f;
+		static constexpr uint32_t s_radix_bits = 8;
+		static constexpr uint32_t s_radix_range = 1 << s_radix_bits;
+		// Subtrees with at least this many nodes are stored by their own task
+		static constexpr uint32_t s_task_threshold = 1 << 10;
 
 		bool isBuild = false;
+		const size_t m_max_leaf_size;
+		const size_t m_treelet_passes;
 
 		TypedBuffer<SHARED::Node> m_buffer_bvh;
 		TypedBuffer<SHARED::AABB> m_buffer_bboxes;
+		TypedBuffer<SHARED::Face> m_buffer_faces;
+		std::vector<SHARED::Node> m_nodes;
+		std::vector<SHARED::AABB> m_bboxes;
+		std::vector<SHARED::Face> m_faces;
 
-		size_t m_num_vertices;
 		size_t m_num_faces;
 		size_t m_num_nodes;
 
@@ -0,0 +1,120 @@
+#include "pch.h"
+#include "MergedBVH.h"
+
+namespace LSIS {
+
+	MergedBVH::MergedBVH(const SHARED::Node* nodes, const SHARED::AABB* bboxes)
+	{
+		static_assert(sizeof(SHARED::BVHNode) == 64, "merged BVH nodes must be 64 bytes");
+
+		// A root leaf is stored as both children of the root, which only tests its faces twice
+		if (nodes[0].left < 0) {
+			SHARED::BVHNode node = {};
+			set_child(node, false, nodes[0], bboxes[0]);
+			set_child(node, true, nodes[0], bboxes[0]);
+			m_nodes.push_back(node);
+			m_parents.push_back(-1);
+			m_depth = 1;
+			return;
+		}
+
+		// The binary node to store, the merged node and side referencing it, and its depth
+		struct entry {
+			int source;
+			int parent;
+			bool right;
+			size_t depth;
+		};
+		std::vector<entry> stack = { { 0, -1, false, 1 } };
+
+		while (!stack.empty()) {
+			const entry e = stack.back(); stack.pop_back();
+
+			const int index = static_cast<int>(m_nodes.size());
+			m_parents.push_back(e.parent);
+			m_depth = std::max(m_depth, e.depth);
+			if (e.parent != -1) {
+				if (e.right)
+					m_nodes[e.parent].right = index;
+				else
+					m_nodes[e.parent].left = index;
+			}
+
+			const SHARED::Node& source = nodes[e.source];
+			SHARED::BVHNode node = {};
+			set_child(node, false, nodes[source.left], bboxes[source.left]);
+			set_child(node, true, nodes[source.right], bboxes[source.right]);
+			m_nodes.push_back(node);
+
+			// The left child is pushed last, so it is stored right after this node
+			if (nodes[source.right].left >= 0)
+				stack.push_back({ source.right, index, true, e.depth + 1 });
+			if (nodes[source.left].left >= 0)
+				stack.push_back({ source.left, index, false, e.depth + 1 });
+		}
+	}
+
+	MergedBVH::~MergedBVH()
+	{
+	}
+
+	TypedBuffer<SHARED::BVHNode> MergedBVH::GetNodeBuffer()
+	{
+		TypedBuffer<SHARED::BVHNode> buffer = TypedBuffer<SHARED::BVHNode>(Compute::GetContext(), CL_MEM_READ_ONLY, m_nodes.size());
+		CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::BVHNode) * m_nodes.size(), m_nodes.data()));
+		return buffer;
+	}
+
+	TypedBuffer<cl_int> MergedBVH::GetParentBuffer()
+	{
+		TypedBuffer<cl_int> buffer = TypedBuffer<cl_int>(Compute::GetContext(), CL_MEM_READ_ONLY, m_parents.size());
+		CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(cl_int) * m_parents.size(), m_parents.data()));
+		return buffer;
+	}
+
+	size_t MergedBVH::CalcDepth(const cl_int* parents, size_t num_nodes)
+	{
+		// Each node is walked up to the first node with a known depth, so every node is only resolved once
+		std::vector<size_t> depths(num_nodes, 0);
+		std::vector<int> path;
+		size_t max_depth = 0;
+		for (size_t i = 0; i < num_nodes; i++) {
+			int index = static_cast<int>(i);
+			while (index != -1 && depths[index] == 0) {
+				path.push_back(index);
+				index = parents[index];
+			}
+
+			size_t depth = index == -1 ? 0 : depths[index];
+			while (!path.empty()) {
+				depths[path.back()] = ++depth;
+				path.pop_back();
+			}
+			max_depth = std::max(max_depth, depth);
+		}
+		return max_depth;
+	}
+
+	void MergedBVH::set_child(SHARED::BVHNode& node, bool right, const SHARED::Node& child, const SHARED::AABB& bbox)
+	{
+		const bool leaf = child.left < 0;
+		const int index = leaf ? child.right : -1;
+		const int count = leaf ? -child.left : 0;
+		const float pmin[3] = { bbox.min.x, bbox.min.y, bbox.min.z };
+		const float pmax[3] = { bbox.max.x, bbox.max.y, bbox.max.z };
+
+		if (right) {
+			std::copy(pmin, pmin + 3, node.right_min);
+			std::copy(pmax, pmax + 3, node.right_max);
+			node.right = index;
+			node.right_count = count;
+		}
+		else {
+			std::copy(pmin, pmin + 3, node.left_min);
+			std::copy(pmax, pmax + 3, node.left_max);
+			node.left = index;
+			node.left_count = count;
+		}
+	}
+
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+
+#include "Kernels/shared_defines.h"
+#include "Compute/Buffer.h"
+
+namespace LSIS {
+
+	/// Relayout of the binary BVH of SAHBVHStructure or LBVHStructure into BVHNodes, with the bounds of both children in the node.
+	/// Only internal nodes are stored, as the leaves are referenced by their faces. The nodes are in depth first order with the left child right after its parent,
+	/// so the nearest child is often in the cache line after the node. The faces keep their order.
+	/// The parent of each node is kept in a separate array, as it is only read by the stackless traversal when it goes back up
+	class MergedBVH {
+	public:
+		/// 'nodes' and 'bboxes' are the binary BVH with the root at 0
+		MergedBVH(const SHARED::Node* nodes, const SHARED::AABB* bboxes);
+		~MergedBVH();
+
+		TypedBuffer<SHARED::BVHNode> GetNodeBuffer();
+		const std::vector<SHARED::BVHNode>& GetNodes() const { return m_nodes; }
+		size_t GetNumNodes() const { return m_nodes.size(); }
+		/// Parent of each node, -1 for the root
+		TypedBuffer<cl_int> GetParentBuffer();
+		const std::vector<cl_int>& GetParents() const { return m_parents; }
+		/// Number of nodes on the longest path from the root, counting the root
+		size_t GetDepth() const { return m_depth; }
+
+		/// Depth of any merged BVH from the parents of its nodes, as GetDepth
+		static size_t CalcDepth(const cl_int* parents, size_t num_nodes);
+
+	private:
+		// Stores the bounds of 'child' in the node, and its faces if it is a leaf. Internal children are linked when they are stored
+		void set_child(SHARED::BVHNode& node, bool right, const SHARED::Node& child, const SHARED::AABB& bbox);
+
+	private:
+		std::vector<SHARED::BVHNode> m_nodes;
+		std::vector<cl_int> m_parents;
+		size_t m_depth = 0;
+	};
+
+}
@@ -1,10 +1,10 @@
 #include "pch.h"
 #include "SAHBVHStructure.h"
 #include "Core/Timer.h"
+#include "Threading/ThreadPool.h"
 
 #include <immintrin.h>
 
-#include <queue>
 
 namespace LSIS {
 
@@ -15,7 +15,8 @@ namespace LSIS {
 		return tmp[n];
 	}
 
-	SAHBVHStructure::SAHBVHStructure(const SHARED::Vertex* vertices, const SHARED::Face* faces, const size_t num_faces)
+	SAHBVHStructure::SAHBVHStructure(const SHARED::Vertex* vertices, const SHARED::Face* faces, const size_t num_faces, size_t k, size_t max_leaf_size)
+		: m_K(std::max<size_t>(k, 2)), m_max_leaf_size(std::max<size_t>(max_leaf_size, 1))
 	{
 		PROFILE_SCOPE("SAH BVH Builder");
 
@@ -25,124 +26,175 @@ namespace LSIS {
 			m_bboxes = nullptr;
 			return;
 		}
-		// allocate permanent storage
+		// allocate permanent storage, for the most nodes possible
 		m_num_nodes = 2L * num_faces - 1L;
 		m_nodes = new SHARED::Node[m_num_nodes];
 		m_bboxes = new SHARED::AABB[m_num_nodes];
 
+		// Temporary build data lives in the scratch arena of this thread, and is freed when the scope ends
+		Arena& arena = Arena::GetScratch();
+		Arena::Scope arena_scope(arena);
+
 		build_info info = {};
 
-		info.centers = new float4[num_faces];
-		info.bounds = new float4[num_faces * 2];
-		info.ids = initialize_face_ids(num_faces);
+		info.centers = arena.Allocate<float4>(num_faces);
+		info.bounds = arena.Allocate<float4>(num_faces * 2);
+		info.ids = initialize_face_ids(arena, num_faces);
+		info.ids_tmp = arena.Allocate<uint32_t>(num_faces);
+
+		// Bins, split measures and sweep data for each thread in the pool
+		ThreadPool& pool = ThreadPool::Get();
+		build_scratch* scratch = allocate_scratch(arena, pool.GetNumThreads());
+
+		// The bounds of the chunks are merged with min and max, so the result doesn't depend on the chunks
+		const size_t num_chunks = pool.GetNumThreads();
+		bbox* chunk_cb = arena.Allocate<bbox>(num_chunks);
+		pool.ParallelFor(0, num_faces, num_chunks, [&](size_t begin, size_t end, size_t chunk) {
+			chunk_cb[chunk] = calc_bounds_and_centers(info.centers, info.bounds, vertices, faces, begin, end);
+		});
+		bbox cb = make_negative_bbox();
+		for (size_t c = 0; c < std::min(num_chunks, num_faces); c++) {
+			_mm_store_ps(*cb.pmin, _mm_min_ps(_mm_load_ps(*cb.pmin), _mm_load_ps(*chunk_cb[c].pmin)));
+			_mm_store_ps(*cb.pmax, _mm_max_ps(_mm_load_ps(*cb.pmax), _mm_load_ps(*chunk_cb[c].pmax)));
+		}
 
-		uint32_t next_index = 0;
-		info.next_index = &next_index;
+		// Build the tree from the root. Returns when all subtrees has been built
+		ThreadPool::TaskGroup group;
+		build_subtree(info, scratch, group, queue_item(0, 0, (uint32_t)num_faces, cb));
+		pool.Wait(group);
 
-		bbox cb = calc_bounds_and_centers(info.centers, info.bounds, vertices, faces, num_faces);
+		// Multi face leaves leave unused nodes in the layout
+		if (m_max_leaf_size > 1) {
+			compact_nodes();
+		}
 
-		auto queue = std::queue<queue_item>();
-		queue.emplace(next_index++, 0, (uint32_t)num_faces, cb);
+		// The tasks write their nodes independently, so the parents are linked once the nodes are in place
+		m_nodes[0].parent = -1;
+		pool.ParallelFor(0, m_num_nodes, [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				const SHARED::Node& node = m_nodes[i];
+				if (node.left >= 0) {
+					m_nodes[node.left].parent = static_cast<int>(i);
+					m_nodes[node.right].parent = static_cast<int>(i);
+				}
+			}
+		});
 
-		while (!queue.empty()) {
-			// fetch next node index to be processed from the queue
-			queue_item args = queue.front();
-			queue.pop();
+		// Order the faces as the leaves reference them
+		m_faces.resize(num_faces);
+		for (size_t i = 0; i < num_faces; i++) {
+			m_faces[i] = faces[info.ids[i]];
+		}
+	}
+
+	void SAHBVHStructure::build_subtree(build_info info, build_scratch* scratch, ThreadPool::TaskGroup& group, queue_item root)
+	{
+		// A task runs on a single thread, so the scratch data can be fetched once.
+		// Tasks executed by this thread while it waits inside the parallel binning and partition also use it, but nothing is kept in it across those waits
+		build_scratch& local = scratch[ThreadPool::GetThreadIndex()];
 
-			cb = args.cb;
-			uint32_t range = args.right - args.left;
-			if (range == 1) { // is leaf node
+		// Use a local stack to avoid stack overflow with many faces
+		std::vector<queue_item> stack;
+		stack.push_back(root);
+
+		while (!stack.empty()) {
+			// fetch next node to be processed from the stack
+			const queue_item args = stack.back();
+			stack.pop_back();
+
+			const bbox cb = args.cb;
+			const uint32_t range = args.right - args.left;
+			SHARED::AABB& bbox_node = m_bboxes[args.index];
+
+			if (range == 1) { // is single face leaf
 				SHARED::Node node = {};
 				node.left = -1;
-				node.right = info.ids[args.left];
+				node.right = args.left;
 				m_nodes[args.index] = node;
-				SHARED::AABB bbox = {};
-				_mm_store_ps((float*)&bbox.min, _mm_load_ps((float*)&info.bounds[node.right * 2]));
-				_mm_store_ps((float*)&bbox.max, _mm_load_ps((float*)&info.bounds[node.right * 2 + 1]));
-				m_bboxes[args.index] = bbox;
-
-				//printf("Index: %d, Leaf\n", index);
+				const uint32_t id = info.ids[args.left];
+				_mm_store_ps((float*)&bbox_node.min, _mm_load_ps((float*)&info.bounds[id * 2]));
+				_mm_store_ps((float*)&bbox_node.max, _mm_load_ps((float*)&info.bounds[id * 2 + 1]));
 				continue;
 			}
-			else { // is internal node
-				bbox bins_bound[K];
-				bbox bin_center_bounds[K];
-				uint32_t bins_count[K];
-				for (int i = 0; i < K; i++) {
-					bins_bound[i] = make_negative_bbox(); // initialize to negtive bounds
-					bins_count[i] = 0;
-				}
 
-				const int k = find_max_axis(cb.pmin, cb.pmax); // axis of the partition
+			// Nodes small enough for a leaf become one if that is cheaper than the best split
+			bbox cb_l, cb_r;
+			uint32_t middle = args.left;
+			bool leaf = false;
+			const int k = find_max_axis(cb.pmin, cb.pmax); // axis of the partition
+			if (range <= s_sweep_threshold) { // is small node
+				float split_cost;
+				middle = sweep_split(info, local, args.left, args.right, &bbox_node, &cb_l, &cb_r, &split_cost);
+				leaf = range <= m_max_leaf_size && leaf_is_cheaper(bbox_node, range, split_cost);
+			}
+			else if (!(cb.pmax[k] > cb.pmin[k])) { // all centers are the same, so binning can't separate them
+				bbox node_bound;
+				bin_faces(info, local.bins_bound, local.bins_count, args.left, args.right, 1, k, 0.0f, 0.0f, &node_bound);
+				_mm_store_ps((float*)&bbox_node.min, _mm_load_ps(*node_bound.pmin));
+				_mm_store_ps((float*)&bbox_node.max, _mm_load_ps(*node_bound.pmax));
+
+				middle = args.left + range / 2;
+				cb_l = cb;
+				cb_r = cb;
+			}
+			else { // is large node
+				// The bin count grows with the number of faces, up to K
+				const uint32_t num_bins = std::min<uint32_t>(static_cast<uint32_t>(m_K), std::max(s_min_bins, range / 2));
 				const float k0 = cb.pmin[k];
-				const float k1 = (static_cast<float>(K) * (1.0f - 1e-6f)) / (cb.pmax[k] - cb.pmin[k]);
+				const float k1 = (static_cast<float>(num_bins) * (1.0f - 1e-6f)) / (cb.pmax[k] - cb.pmin[k]);
 
-				//printf("Info: k: %d, k0: %f, k1: %f\n", k, k0, k1);
-				//printf("cb_k: [%f,%f}\n", cb.pmin[k], cb.pmax[k]);
-
-				__m128 pmin_node = _mm_set1_ps(std::numeric_limits<float>::infinity());
-				__m128 pmax_node = _mm_set1_ps(-std::numeric_limits<float>::infinity());
-
-				for (uint32_t i = args.left; i < args.right; i++) {
-					const uint32_t id = info.ids[i];
-					const float c_ik = info.centers[id][k];
-
-					CORE_ASSERT(c_ik <= cb.pmax[k] && c_ik >= cb.pmin[k], "center out of bounds, failure in partition!");
-
-					const uint32_t bin_id = static_cast<uint32_t>(k1 * (c_ik - k0));
-					CORE_ASSERT(bin_id >= 0 && bin_id < K, "Bin ID out of bounds!");
-
-					const __m128 pmin = _mm_load_ps((float*)(&info.bounds[id * 2]));
-					const __m128 pmax = _mm_load_ps((float*)(&info.bounds[id * 2 + 1]));
-
-					pmin_node = _mm_min_ps(pmin_node, pmin);
-					pmax_node = _mm_max_ps(pmax_node, pmax);
+				bbox node_bound;
+				if (range >= s_parallel_threshold) {
+					bin_faces_parallel(info, local, args.left, args.right, num_bins, k, k0, k1, &node_bound);
+				}
+				else {
+					bin_faces(info, local.bins_bound, local.bins_count, args.left, args.right, num_bins, k, k0, k1, &node_bound);
+				}
+				_mm_store_ps((float*)&bbox_node.min, _mm_load_ps(*node_bound.pmin));
+				_mm_store_ps((float*)&bbox_node.max, _mm_load_ps(*node_bound.pmax));
 
-					const __m128 bin_pmin = _mm_load_ps((float*)&(bins_bound[bin_id].pmin));
-					const __m128 bin_pmax = _mm_load_ps((float*)&(bins_bound[bin_id].pmax));
+				accumulate_from_left(local.A_l, local.N_l, local.bins_bound, local.bins_count, num_bins);
+				accumulate_from_right(local.A_r, local.N_r, local.bins_bound, local.bins_count, num_bins);
 
-					_mm_store_ps((float*)&(bins_bound[bin_id].pmin), _mm_min_ps(pmin, bin_pmin));
-					_mm_store_ps((float*)&(bins_bound[bin_id].pmax), _mm_max_ps(pmax, bin_pmax));
+				const uint32_t best_split_bin_id = find_optimal_split(local.A_l, local.A_r, local.N_l, local.N_r, num_bins);
+				const float split_cost = local.A_l[best_split_bin_id] * local.N_l[best_split_bin_id] + local.A_r[best_split_bin_id + 1] * local.N_r[best_split_bin_id + 1];
+				leaf = range <= m_max_leaf_size && leaf_is_cheaper(bbox_node, range, split_cost);
 
-					bins_count[bin_id]++;
+				if (!leaf && range >= s_parallel_threshold) {
+					middle = partition_parallel(info, args.left, args.right, &cb_l, &cb_r, best_split_bin_id, k, k0, k1);
 				}
+				else if (!leaf) {
+					middle = reorder_ids(info, args.left, args.right, &cb_l, &cb_r, best_split_bin_id, k, k0, k1);
+				}
+			}
 
+			if (leaf) { // the faces of the leaf are contiguous in the ids
 				SHARED::Node node = {};
-				node.left = next_index++;
-				node.right = next_index++;
+				node.left = -static_cast<int>(range);
+				node.right = args.left;
 				m_nodes[args.index] = node;
+				continue;
+			}
 
-				SHARED::AABB bbox_node = {};
-				_mm_store_ps((float*)&bbox_node.min, pmin_node);
-				_mm_store_ps((float*)&bbox_node.max, pmax_node);
-				m_bboxes[args.index] = bbox_node;
-
-				float A_l[K];
-				uint32_t N_l[K];
-				accumulate_from_left(A_l, N_l, bins_bound, bins_count);
-
-				float A_r[K];
-				uint32_t N_r[K];
-				accumulate_from_right(A_r, N_r, bins_bound, bins_count);
-
-				const uint32_t best_split_bin_id = find_optimal_split(A_l, A_r, N_l, N_r);
-
-				bbox cb_l, cb_r;
-				uint32_t middle = reorder_ids(info, args.left, args.right, &cb_l, &cb_r, best_split_bin_id, k, k0, k1);
+			// Depth first layout. The left subtree is stored right after this node, followed by the right subtree.
+			// A subtree of n faces has at most 2n-1 nodes, so the index of every node is known without synchronizing with the other tasks
+			SHARED::Node node = {};
+			node.left = args.index + 1;
+			node.right = args.index + 2 * (middle - args.left);
+			m_nodes[args.index] = node;
 
-				queue.emplace(node.left, args.left, middle, cb_l);
-				queue.emplace(node.right, middle, args.right, cb_r);
+			const queue_item item_left = queue_item(node.left, args.left, middle, cb_l);
+			const queue_item item_right = queue_item(node.right, middle, args.right, cb_r);
 
+			// Large subtrees are handed to the pool, so idle threads can steal them
+			if (args.right - middle >= s_task_threshold) {
+				ThreadPool::Get().Submit(group, [this, info, scratch, &group, item_right]() { build_subtree(info, scratch, group, item_right); });
 			}
+			else {
+				stack.push_back(item_right);
+			}
+			stack.push_back(item_left);
 		}
-
-		//uint32_t last = build_recursive(info, 0, num_faces, cb);
-		//CORE_ASSERT(last == num_nodes, "generated and allocated nodes not matching!");
-
-		// clean allocated memory
-		delete[] info.centers;
-		delete[] info.bounds;
-		delete[] info.ids;
 	}
 
 	SAHBVHStructure::~SAHBVHStructure()
@@ -169,15 +221,24 @@ namespace LSIS {
 		return buffer;
 	}
 
-	SAHBVHStructure::bbox SAHBVHStructure::calc_bounds_and_centers(float4* centers, float4* bounds, const SHARED::Vertex* vertices, const SHARED::Face* faces, const size_t num_faces)
+	TypedBuffer<SHARED::Face> SAHBVHStructure::GetFaceBuffer()
+	{
+		if (m_faces.empty()) {
+			return TypedBuffer<SHARED::Face>();
+		}
+		TypedBuffer<SHARED::Face> buffer = TypedBuffer<SHARED::Face>(Compute::GetContext(), CL_MEM_READ_ONLY, m_faces.size());
+		Compute::GetCommandQueue().enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Face) * m_faces.size(), m_faces.data());
+		return buffer;
+	}
+
+	SAHBVHStructure::bbox SAHBVHStructure::calc_bounds_and_centers(float4* centers, float4* bounds, const SHARED::Vertex* vertices, const SHARED::Face* faces, const size_t begin, const size_t end)
 	{
 		__m128 cb_min = _mm_set1_ps(std::numeric_limits<float>::infinity());
 		__m128 cb_max = _mm_set1_ps(-std::numeric_limits<float>::infinity());
 
-		const SHARED::Face* end = faces + num_faces;
-		float4* center_it = centers;
-		float4* bound_it = bounds;
-		for (const SHARED::Face* face = faces; face < end; face++) {
+		float4* center_it = centers + begin;
+		float4* bound_it = bounds + begin * 2;
+		for (const SHARED::Face* face = faces + begin; face < faces + end; face++) {
 			const cl_uint4 index = face->index;
 			const __m128 p0 = _mm_load_ps((const float*)(&(vertices[index.x].position)));
 			const __m128 p1 = _mm_load_ps((const float*)(&(vertices[index.y].position)));
@@ -201,107 +262,30 @@ namespace LSIS {
 		return cb;
 	}
 
-	inline uint32_t* SAHBVHStructure::initialize_face_ids(size_t num_faces)
+	inline uint32_t* SAHBVHStructure::initialize_face_ids(Arena& arena, size_t num_faces)
 	{
-		uint32_t* face_ids = new uint32_t[num_faces];
+		uint32_t* face_ids = arena.Allocate<uint32_t>(num_faces);
 		for (uint32_t i = 0; i < num_faces; i++) {
 			face_ids[i] = i;
 		}
 		return face_ids;
 	}
 
-	inline uint32_t SAHBVHStructure::build_recursive(build_info info, uint32_t begin, uint32_t end, const bbox cb)
+	SAHBVHStructure::build_scratch* SAHBVHStructure::allocate_scratch(Arena& arena, size_t num_threads)
 	{
-		bbox cb_l, cb_r;
-		uint32_t middle;
-		const uint32_t index = (*info.next_index)++;
-		{
-			int num = end - begin;
-			//printf("Build Recurse: Num: %d\n", num);
-			if (num == 1) {
-				SHARED::Node node = {};
-				node.left = -1;
-				node.right = info.ids[begin];
-				m_nodes[index] = node;
-				SHARED::AABB bbox = {};
-				_mm_store_ps((float*)&bbox.min, _mm_load_ps((float*)&info.bounds[node.right * 2]));
-				_mm_store_ps((float*)&bbox.max, _mm_load_ps((float*)&info.bounds[node.right * 2 + 1]));
-				m_bboxes[index] = bbox;
-
-				//printf("Index: %d, Leaf\n", index);
-				return index;
-			}
-			//printf("Index: %d, Internal\n", index);
-			//printf("cb: pmin: %f,%f,%f, pmax: %f,%f,%f\n", cb.pmin.x, cb.pmin.y, cb.pmin.z, cb.pmax.x, cb.pmax.y, cb.pmax.z);
-
-			bbox bins_bound[K];
-			bbox bin_center_bounds[K];
-			uint32_t bins_count[K];
-			for (int i = 0; i < K; i++) {
-				bins_bound[i] = make_negative_bbox(); // initialize to negtive bounds
-				bins_count[i] = 0;
-			}
-
-			const int k = find_max_axis(cb.pmin, cb.pmax); // axis of the partition
-			const float k0 = cb.pmin[k];
-			const float k1 = (static_cast<float>(K) * (1.0f - 1e-6f)) / (cb.pmax[k] - cb.pmin[k]);
-
-			//printf("Info: k: %d, k0: %f, k1: %f\n", k, k0, k1);
-			//printf("cb_k: [%f,%f}\n", cb.pmin[k], cb.pmax[k]);
-
-			__m128 pmin_node = _mm_set1_ps(std::numeric_limits<float>::infinity());
-			__m128 pmax_node = _mm_set1_ps(-std::numeric_limits<float>::infinity());
-
-			for (uint32_t i = begin; i < end; i++) {
-				const uint32_t id = info.ids[i];
-				const float c_ik = info.centers[id][k];
-
-				CORE_ASSERT(c_ik <= cb.pmax[k] && c_ik >= cb.pmin[k], "center out of bounds, failure in partition!");
-
-				const uint32_t bin_id = static_cast<uint32_t>(k1 * (c_ik - k0));
-				CORE_ASSERT(bin_id >= 0 && bin_id < K, "Bin ID out of bounds!");
-
-				const __m128 pmin = _mm_load_ps((float*)(&info.bounds[id * 2]));
-				const __m128 pmax = _mm_load_ps((float*)(&info.bounds[id * 2 + 1]));
-
-				pmin_node = _mm_min_ps(pmin_node, pmin);
-				pmax_node = _mm_max_ps(pmax_node, pmax);
-
-				const __m128 bin_pmin = _mm_load_ps((float*)&(bins_bound[bin_id].pmin));
-				const __m128 bin_pmax = _mm_load_ps((float*)&(bins_bound[bin_id].pmax));
-
-				_mm_store_ps((float*)&(bins_bound[bin_id].pmin), _mm_min_ps(pmin, bin_pmin));
-				_mm_store_ps((float*)&(bins_bound[bin_id].pmax), _mm_max_ps(pmax, bin_pmax));
-
-				bins_count[bin_id]++;
-			}
-
-			SHARED::AABB bbox_node = {};
-			_mm_store_ps((float*)&bbox_node.min, pmin_node);
-			_mm_store_ps((float*)&bbox_node.max, pmax_node);
-			m_bboxes[index] = bbox_node;
-
-			float A_l[K];
-			uint32_t N_l[K];
-			accumulate_from_left(A_l, N_l, bins_bound, bins_count);
-
-			float A_r[K];
-			uint32_t N_r[K];
-			accumulate_from_right(A_r, N_r, bins_bound, bins_count);
-
-			const uint32_t best_split_bin_id = find_optimal_split(A_l, A_r, N_l, N_r);
-
-			middle = reorder_ids(info, begin, end, &cb_l, &cb_r, best_split_bin_id, k, k0, k1);
+		build_scratch* scratch = arena.Allocate<build_scratch>(num_threads);
+		for (size_t i = 0; i < num_threads; i++) {
+			build_scratch& s = scratch[i];
+			s.bins_bound = arena.Allocate<bbox>(m_K);
+			s.bins_count = arena.Allocate<uint32_t>(m_K);
+			s.A_l = arena.Allocate<float>(m_K);
+			s.N_l = arena.Allocate<uint32_t>(m_K);
+			s.A_r = arena.Allocate<float>(m_K);
+			s.N_r = arena.Allocate<uint32_t>(m_K);
+			s.order = arena.Allocate<uint32_t>(3 * s_sweep_threshold);
+			s.areas = arena.Allocate<float>(s_sweep_threshold);
 		}
-
-		//printf("Range: left: %zd, middle: %zd, right: %zd\n", (size_t)begin, (size_t)middle, (size_t)end);
-		SHARED::Node node = {};
-		node.left = build_recursive(info, begin, middle, cb_l);
-		node.right = build_recursive(info, middle, end, cb_r);
-
-		m_nodes[index] = node;
-
-		return index;
+		return scratch;
 	}
 
 	inline uint32_t SAHBVHStructure::find_max_axis(float4 pmin, float4 pmax)
@@ -318,17 +302,17 @@ namespace LSIS {
 		const __m128 xxyw = _mm_shuffle_ps(diagonal, diagonal, _MM_SHUFFLE(3, 1, 0, 0));
 		const __m128 yzzw = _mm_shuffle_ps(diagonal, diagonal, _MM_SHUFFLE(3, 2, 2, 1));
 		const __m128 mul = _mm_mul_ps(xxyw, yzzw);
-		const __m128 mul2 = _mm_mul_ps(mul, _mm_set_ps(2.0f, 2.0f, 2.0f, 0.0f));
+		const __m128 mul2 = _mm_mul_ps(mul, _mm_set_ps(0.0f, 2.0f, 2.0f, 2.0f));
 		__m128 sum = _mm_hadd_ps(mul2, mul2);
-		sum = _mm_hadd_ps(mul2, mul2);
+		sum = _mm_hadd_ps(sum, sum);
 		return _mm_cvtss_f32(sum);
 	}
 
-	inline void SAHBVHStructure::accumulate_from_left(float* A_l, uint32_t* N_l, const bbox* bin_bounds, const uint32_t* bin_counts)
+	inline void SAHBVHStructure::accumulate_from_left(float* A_l, uint32_t* N_l, const bbox* bin_bounds, const uint32_t* bin_counts, const uint32_t num_bins)
 	{
 		// accumulate counts
 		uint32_t count = 0;
-		for (int i = 0; i < K; i++) {
+		for (int i = 0; i < static_cast<int>(num_bins); i++) {
 			count += bin_counts[i];
 			N_l[i] = count;
 		}
@@ -336,7 +320,7 @@ namespace LSIS {
 		// Accumulate bounds and calculate areas
 		__m128 pmin = _mm_set1_ps(std::numeric_limits<float>::infinity());
 		__m128 pmax = _mm_set1_ps(-std::numeric_limits<float>::infinity());
-		for (int i = 0; i < K; i++) {
+		for (int i = 0; i < static_cast<int>(num_bins); i++) {
 			pmin = _mm_min_ps(pmin, _mm_load_ps((float*)&(bin_bounds[i].pmin)));
 			pmax = _mm_max_ps(pmax, _mm_load_ps((float*)&(bin_bounds[i].pmax)));
 
@@ -345,11 +329,11 @@ namespace LSIS {
 		}
 	}
 
-	inline void SAHBVHStructure::accumulate_from_right(float* A_r, uint32_t* N_r, const bbox* bin_bounds, const uint32_t* bin_counts)
+	inline void SAHBVHStructure::accumulate_from_right(float* A_r, uint32_t* N_r, const bbox* bin_bounds, const uint32_t* bin_counts, const uint32_t num_bins)
 	{
 		// accumulate counts
 		uint32_t count = 0;
-		for (int i = K - 1L; i >= 0; i--) {
+		for (int i = static_cast<int>(num_bins) - 1; i >= 0; i--) {
 			count += bin_counts[i];
 			N_r[i] = count;
 		}
@@ -357,7 +341,7 @@ namespace LSIS {
 		// Accumulate bounds and calculate areas
 		__m128 pmin = _mm_set1_ps(std::numeric_limits<float>::infinity());
 		__m128 pmax = _mm_set1_ps(-std::numeric_limits<float>::infinity());
-		for (int i = K - 1L; i >= 0; i--) {
+		for (int i = static_cast<int>(num_bins) - 1; i >= 0; i--) {
 			pmin = _mm_min_ps(pmin, _mm_load_ps((float*)&(bin_bounds[i].pmin)));
 			pmax = _mm_max_ps(pmax, _mm_load_ps((float*)&(bin_bounds[i].pmax)));
 
@@ -366,14 +350,14 @@ namespace LSIS {
 		}
 	}
 
-	inline uint32_t SAHBVHStructure::find_optimal_split(float* A_l, float* A_r, uint32_t* N_l, uint32_t* N_r)
+	inline uint32_t SAHBVHStructure::find_optimal_split(float* A_l, float* A_r, uint32_t* N_l, uint32_t* N_r, const uint32_t num_bins)
 	{
 		// initialize best score and index to first bin
 		float cost_best = A_l[0] * N_l[0] + A_r[0] * N_r[0];
 		uint32_t i_best = 0;
 
 		// iterate through the rest of the bins and save everytime a better score is found
-		for (uint32_t i = 1; i < K - 1; i++) {
+		for (uint32_t i = 1; i < num_bins - 1; i++) {
 			const float cost = A_l[i] * N_l[i] + A_r[i + 1] * N_r[i + 1];
 			if (cost < cost_best) {
 				cost_best = cost;
@@ -384,6 +368,165 @@ namespace LSIS {
 		return i_best;
 	}
 
+	inline void SAHBVHStructure::bin_faces(build_info info, bbox* bins_bound, uint32_t* bins_count, uint32_t begin, uint32_t end, uint32_t num_bins, int k, float k0, float k1, bbox* bbox_node)
+	{
+		for (uint32_t i = 0; i < num_bins; i++) {
+			bins_bound[i] = make_negative_bbox(); // initialize to negtive bounds
+			bins_count[i] = 0;
+		}
+
+		__m128 pmin_node = _mm_set1_ps(std::numeric_limits<float>::infinity());
+		__m128 pmax_node = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+
+		for (uint32_t i = begin; i < end; i++) {
+			const uint32_t id = info.ids[i];
+			const float c_ik = info.centers[id][k];
+
+			const uint32_t bin_id = static_cast<uint32_t>(k1 * (c_ik - k0));
+			CORE_ASSERT(bin_id >= 0 && bin_id < num_bins, "Bin ID out of bounds!");
+
+			const __m128 pmin = _mm_load_ps((float*)(&info.bounds[id * 2]));
+			const __m128 pmax = _mm_load_ps((float*)(&info.bounds[id * 2 + 1]));
+
+			pmin_node = _mm_min_ps(pmin_node, pmin);
+			pmax_node = _mm_max_ps(pmax_node, pmax);
+
+			const __m128 bin_pmin = _mm_load_ps((float*)&(bins_bound[bin_id].pmin));
+			const __m128 bin_pmax = _mm_load_ps((float*)&(bins_bound[bin_id].pmax));
+
+			_mm_store_ps((float*)&(bins_bound[bin_id].pmin), _mm_min_ps(pmin, bin_pmin));
+			_mm_store_ps((float*)&(bins_bound[bin_id].pmax), _mm_max_ps(pmax, bin_pmax));
+
+			bins_count[bin_id]++;
+		}
+
+		_mm_store_ps(*bbox_node->pmin, pmin_node);
+		_mm_store_ps(*bbox_node->pmax, pmax_node);
+	}
+
+	void SAHBVHStructure::bin_faces_parallel(build_info info, build_scratch& scratch, uint32_t begin, uint32_t end, uint32_t num_bins, int k, float k0, float k1, bbox* bbox_node)
+	{
+		ThreadPool& pool = ThreadPool::Get();
+		const size_t num_chunks = (end - begin + s_chunk_size - 1) / s_chunk_size;
+
+		// Each chunk gets its own set of bins, which avoids synchronization while binning.
+		// Tasks run by this thread while it waits allocate after them, and rewind before returning
+		Arena& arena = Arena::GetScratch();
+		Arena::Scope arena_scope(arena);
+		bbox* chunk_bounds = arena.Allocate<bbox>(num_chunks * num_bins);
+		uint32_t* chunk_counts = arena.Allocate<uint32_t>(num_chunks * num_bins);
+		bbox* chunk_nodes = arena.Allocate<bbox>(num_chunks);
+
+		pool.ParallelFor(begin, end, num_chunks, [&](size_t chunk_begin, size_t chunk_end, size_t chunk) {
+			bin_faces(info, &chunk_bounds[chunk * num_bins], &chunk_counts[chunk * num_bins], static_cast<uint32_t>(chunk_begin), static_cast<uint32_t>(chunk_end), num_bins, k, k0, k1, &chunk_nodes[chunk]);
+		});
+
+		// Merge the chunks. Bounds and counts are combined with min, max and sums, so the result doesn't depend on the scheduling
+		__m128 pmin_node = _mm_set1_ps(std::numeric_limits<float>::infinity());
+		__m128 pmax_node = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+		for (uint32_t i = 0; i < num_bins; i++) {
+			scratch.bins_bound[i] = make_negative_bbox();
+			scratch.bins_count[i] = 0;
+		}
+		for (size_t c = 0; c < num_chunks; c++) {
+			for (uint32_t i = 0; i < num_bins; i++) {
+				const bbox& b = chunk_bounds[c * num_bins + i];
+				_mm_store_ps(*scratch.bins_bound[i].pmin, _mm_min_ps(_mm_load_ps(*scratch.bins_bound[i].pmin), _mm_load_ps(*b.pmin)));
+				_mm_store_ps(*scratch.bins_bound[i].pmax, _mm_max_ps(_mm_load_ps(*scratch.bins_bound[i].pmax), _mm_load_ps(*b.pmax)));
+				scratch.bins_count[i] += chunk_counts[c * num_bins + i];
+			}
+			pmin_node = _mm_min_ps(pmin_node, _mm_load_ps(*chunk_nodes[c].pmin));
+			pmax_node = _mm_max_ps(pmax_node, _mm_load_ps(*chunk_nodes[c].pmax));
+		}
+		_mm_store_ps(*bbox_node->pmin, pmin_node);
+		_mm_store_ps(*bbox_node->pmax, pmax_node);
+	}
+
+	uint32_t SAHBVHStructure::partition_parallel(build_info info, uint32_t begin, uint32_t end, bbox* cb_l, bbox* cb_r, const uint32_t split_bin_id, int k, float k0, float k1)
+	{
+		ThreadPool& pool = ThreadPool::Get();
+		const size_t num_chunks = (end - begin + s_chunk_size - 1) / s_chunk_size;
+
+		Arena& arena = Arena::GetScratch();
+		Arena::Scope arena_scope(arena);
+		uint32_t* chunk_left = arena.Allocate<uint32_t>(num_chunks); // faces going left, and then where they go
+		uint32_t* chunk_right = arena.Allocate<uint32_t>(num_chunks);
+		bbox* chunk_cb = arena.Allocate<bbox>(num_chunks * 2);
+
+		// Count the faces on each side of the split in every chunk, and bound their centers
+		pool.ParallelFor(begin, end, num_chunks, [&](size_t chunk_begin, size_t chunk_end, size_t chunk) {
+			__m128 pmin_l = _mm_set1_ps(std::numeric_limits<float>::infinity());
+			__m128 pmax_l = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+			__m128 pmin_r = pmin_l;
+			__m128 pmax_r = pmax_l;
+			uint32_t count = 0;
+			for (size_t i = chunk_begin; i < chunk_end; i++) {
+				const __m128 c = _mm_load_ps((float*)&info.centers[info.ids[i]]);
+				const uint32_t bin_id = static_cast<uint32_t>(k1 * (Nth(c, k) - k0));
+				if (bin_id <= split_bin_id) {
+					pmin_l = _mm_min_ps(pmin_l, c);
+					pmax_l = _mm_max_ps(pmax_l, c);
+					count++;
+				}
+				else {
+					pmin_r = _mm_min_ps(pmin_r, c);
+					pmax_r = _mm_max_ps(pmax_r, c);
+				}
+			}
+			chunk_left[chunk] = count;
+			chunk_right[chunk] = static_cast<uint32_t>(chunk_end - chunk_begin) - count;
+			_mm_store_ps(*chunk_cb[chunk * 2].pmin, pmin_l);
+			_mm_store_ps(*chunk_cb[chunk * 2].pmax, pmax_l);
+			_mm_store_ps(*chunk_cb[chunk * 2 + 1].pmin, pmin_r);
+			_mm_store_ps(*chunk_cb[chunk * 2 + 1].pmax, pmax_r);
+		});
+
+		// The faces of each chunk are placed after the faces of the chunks before it, on both sides, so the order is the same for any number of threads
+		uint32_t num_left = 0;
+		for (size_t c = 0; c < num_chunks; c++) {
+			num_left += chunk_left[c];
+		}
+		uint32_t offset_left = begin;
+		uint32_t offset_right = begin + num_left;
+		__m128 pmin_l = _mm_set1_ps(std::numeric_limits<float>::infinity());
+		__m128 pmax_l = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+		__m128 pmin_r = pmin_l;
+		__m128 pmax_r = pmax_l;
+		for (size_t c = 0; c < num_chunks; c++) {
+			const uint32_t count_left = chunk_left[c];
+			const uint32_t count_right = chunk_right[c];
+			chunk_left[c] = offset_left;
+			chunk_right[c] = offset_right;
+			offset_left += count_left;
+			offset_right += count_right;
+
+			pmin_l = _mm_min_ps(pmin_l, _mm_load_ps(*chunk_cb[c * 2].pmin));
+			pmax_l = _mm_max_ps(pmax_l, _mm_load_ps(*chunk_cb[c * 2].pmax));
+			pmin_r = _mm_min_ps(pmin_r, _mm_load_ps(*chunk_cb[c * 2 + 1].pmin));
+			pmax_r = _mm_max_ps(pmax_r, _mm_load_ps(*chunk_cb[c * 2 + 1].pmax));
+		}
+		_mm_store_ps(*cb_l->pmin, pmin_l);
+		_mm_store_ps(*cb_l->pmax, pmax_l);
+		_mm_store_ps(*cb_r->pmin, pmin_r);
+		_mm_store_ps(*cb_r->pmax, pmax_r);
+
+		// Scatter the ids to their side, and copy them back
+		pool.ParallelFor(begin, end, num_chunks, [&](size_t chunk_begin, size_t chunk_end, size_t chunk) {
+			uint32_t left = chunk_left[chunk];
+			uint32_t right = chunk_right[chunk];
+			for (size_t i = chunk_begin; i < chunk_end; i++) {
+				const uint32_t id = info.ids[i];
+				const uint32_t bin_id = static_cast<uint32_t>(k1 * (info.centers[id][k] - k0));
+				info.ids_tmp[bin_id <= split_bin_id ? left++ : right++] = id;
+			}
+		});
+		pool.ParallelFor(begin, end, num_chunks, [&](size_t chunk_begin, size_t chunk_end, size_t) {
+			std::copy(info.ids_tmp + chunk_begin, info.ids_tmp + chunk_end, info.ids + chunk_begin);
+		});
+
+		return begin + num_left;
+	}
+
 	inline uint32_t SAHBVHStructure::reorder_ids(build_info info, uint32_t begin, uint32_t end, bbox* cb_l, bbox* cb_r, const uint32_t split_bin_id, int k, float k0, float k1)
 	{
 		uint32_t left = begin;
@@ -449,22 +592,22 @@ namespace LSIS {
 		// check left partition
 		const int k_l = find_max_axis(cb_l->pmin, cb_l->pmax); // axis of the partition
 		const float k0_l = cb_l->pmin[k_l];
-		const float k1_l = (static_cast<float>(K) * (1.0f - 1e-6f)) / (cb_l->pmax[k_l] - cb_l->pmin[k_l]);
+		const float k1_l = (static_cast<float>(m_K) * (1.0f - 1e-6f)) / (cb_l->pmax[k_l] - cb_l->pmin[k_l]);
 		for (int i = begin; i < left; i++) {
 			const float4 c_i = info.centers[info.ids[i]];
 			const uint32_t bin_id = static_cast<uint32_t>(k1_l * (c_i[k_l] - k0_l));
-			CORE_ASSERT(bin_id >= 0 && bin_id < K, "Bin ID out of bounds!");
+			CORE_ASSERT(bin_id >= 0 && bin_id < m_K, "Bin ID out of bounds!");
 			//CORE_ASSERT(bin_id <= split_bin_id, "WRONG PARTITION!");
 		}
 
 		// check right partition
 		const int k_r = find_max_axis(cb_r->pmin, cb_r->pmax); // axis of the partition
 		const float k0_r = cb_r->pmin[k_r];
-		const float k1_r = (static_cast<float>(K) * (1.0f - 1e-6f)) / (cb_r->pmax[k_r] - cb_r->pmin[k_r]);
+		const float k1_r = (static_cast<float>(m_K) * (1.0f - 1e-6f)) / (cb_r->pmax[k_r] - cb_r->pmin[k_r]);
 		for (int i = left; i < end; i++) {
 			const float4 c_i = info.centers[info.ids[i]];
 			const uint32_t bin_id = static_cast<uint32_t>(k1_r * (c_i[k_r] - k0_r));
-			CORE_ASSERT(bin_id >= 0 && bin_id < K, "Bin ID out of bounds!");
+			CORE_ASSERT(bin_id >= 0 && bin_id < m_K, "Bin ID out of bounds!");
 			//CORE_ASSERT(bin_id > split_bin_id, "WRONG PARTITION!");
 		}
 #endif // DEBUG
@@ -474,6 +617,125 @@ namespace LSIS {
 		return left;
 	}
 
+	inline uint32_t SAHBVHStructure::sweep_split(build_info info, build_scratch& scratch, uint32_t begin, uint32_t end, SHARED::AABB* bbox_node, bbox* cb_l, bbox* cb_r, float* cost)
+	{
+		const uint32_t range = end - begin;
+		CORE_ASSERT(range <= s_sweep_threshold, "Too many faces for the sweep!");
+
+		float cost_best = std::numeric_limits<float>::infinity();
+		uint32_t k_best = 0;
+		uint32_t i_best = range / 2 - 1;
+
+		__m128 pmin_node = _mm_set1_ps(std::numeric_limits<float>::infinity());
+		__m128 pmax_node = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+
+		for (int k = 0; k < 3; k++) {
+			// Sort by the center, with ties broken by the id so the order is deterministic
+			uint32_t* order = scratch.order + k * s_sweep_threshold;
+			std::copy(info.ids + begin, info.ids + end, order);
+			std::sort(order, order + range, [&](uint32_t a, uint32_t b) {
+				return info.centers[a][k] < info.centers[b][k] || (info.centers[a][k] == info.centers[b][k] && a < b);
+			});
+
+			// Area of the faces to the right of each split, accumulated from the right
+			__m128 pmin = _mm_set1_ps(std::numeric_limits<float>::infinity());
+			__m128 pmax = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+			for (int i = static_cast<int>(range) - 1; i > 0; i--) {
+				pmin = _mm_min_ps(pmin, _mm_load_ps((float*)&info.bounds[order[i] * 2]));
+				pmax = _mm_max_ps(pmax, _mm_load_ps((float*)&info.bounds[order[i] * 2 + 1]));
+				scratch.areas[i] = calc_area(_mm_sub_ps(pmax, pmin));
+			}
+
+			// Split i has the faces [0,i] to the left
+			pmin = _mm_set1_ps(std::numeric_limits<float>::infinity());
+			pmax = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+			for (uint32_t i = 0; i < range - 1; i++) {
+				pmin = _mm_min_ps(pmin, _mm_load_ps((float*)&info.bounds[order[i] * 2]));
+				pmax = _mm_max_ps(pmax, _mm_load_ps((float*)&info.bounds[order[i] * 2 + 1]));
+				const float cost = calc_area(_mm_sub_ps(pmax, pmin)) * (i + 1) + scratch.areas[i + 1] * (range - i - 1);
+				if (cost < cost_best) {
+					cost_best = cost;
+					k_best = k;
+					i_best = i;
+				}
+			}
+
+			// The node bound is the same on every axis
+			if (k == 0) {
+				pmin_node = _mm_min_ps(pmin, _mm_load_ps((float*)&info.bounds[order[range - 1] * 2]));
+				pmax_node = _mm_max_ps(pmax, _mm_load_ps((float*)&info.bounds[order[range - 1] * 2 + 1]));
+			}
+		}
+
+		_mm_store_ps((float*)&bbox_node->min, pmin_node);
+		_mm_store_ps((float*)&bbox_node->max, pmax_node);
+
+		// Store the faces in the order of the best axis, and bound the centers of each side
+		const uint32_t* order = scratch.order + k_best * s_sweep_threshold;
+		std::copy(order, order + range, info.ids + begin);
+		const uint32_t middle = begin + i_best + 1;
+
+		__m128 pmin_l = _mm_set1_ps(std::numeric_limits<float>::infinity());
+		__m128 pmax_l = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+		__m128 pmin_r = pmin_l;
+		__m128 pmax_r = pmax_l;
+		for (uint32_t i = begin; i < middle; i++) {
+			const __m128 c = _mm_load_ps((float*)&info.centers[info.ids[i]]);
+			pmin_l = _mm_min_ps(pmin_l, c);
+			pmax_l = _mm_max_ps(pmax_l, c);
+		}
+		for (uint32_t i = middle; i < end; i++) {
+			const __m128 c = _mm_load_ps((float*)&info.centers[info.ids[i]]);
+			pmin_r = _mm_min_ps(pmin_r, c);
+			pmax_r = _mm_max_ps(pmax_r, c);
+		}
+		_mm_store_ps((float*)&cb_l->pmin, pmin_l);
+		_mm_store_ps((float*)&cb_l->pmax, pmax_l);
+		_mm_store_ps((float*)&cb_r->pmin, pmin_r);
+		_mm_store_ps((float*)&cb_r->pmax, pmax_r);
+
+		*cost = cost_best;
+		return middle;
+	}
+
+	inline bool SAHBVHStructure::leaf_is_cheaper(const SHARED::AABB& bbox_node, uint32_t count, float split_cost)
+	{
+		const float area = calc_area(_mm_sub_ps(_mm_load_ps((const float*)&bbox_node.max), _mm_load_ps((const float*)&bbox_node.min)));
+		return s_intersection_cost * count * area <= s_traversal_cost * area + s_intersection_cost * split_cost;
+	}
+
+	void SAHBVHStructure::compact_nodes()
+	{
+		// Find the new index of all reachable nodes. Visiting the left child first keeps it right after its parent
+		std::vector<int> remap(m_num_nodes, -1);
+		std::vector<int> stack = { 0 };
+		int next_index = 0;
+		while (!stack.empty()) {
+			const int index = stack.back(); stack.pop_back();
+			remap[index] = next_index++;
+
+			const SHARED::Node& node = m_nodes[index];
+			if (node.left >= 0) {
+				stack.push_back(node.right);
+				stack.push_back(node.left);
+			}
+		}
+
+		// Move the nodes to their new position. The new index is never larger than the old, so it can be done in place
+		for (size_t i = 0; i < m_num_nodes; i++) {
+			if (remap[i] == -1)
+				continue;
+			SHARED::Node node = m_nodes[i];
+			if (node.left >= 0) {
+				node.left = remap[node.left];
+				node.right = remap[node.right];
+			}
+			m_nodes[remap[i]] = node;
+			m_bboxes[remap[i]] = m_bboxes[i];
+		}
+		m_num_nodes = next_index;
+	}
+
 	SAHBVHStructure::queue_item::queue_item(uint32_t index, uint32_t left, uint32_t right, bbox cb)
 		:index(index), left(left), right(right), cb(cb)
 	{
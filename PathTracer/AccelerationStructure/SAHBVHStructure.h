@@ -1,13 +1,15 @@
 #pragma once
 
+#include <vector>
+
 #include "Kernels/shared_defines.h"
 #include "Mesh/Mesh.h"
 #include "Compute/Buffer.h"
+#include "Memory/Arena.h"
+#include "Threading/ThreadPool.h"
 
 namespace LSIS {
 
-#define K 128
-
 
 	class SAHBVHStructure
 	{
@@ -45,9 +47,21 @@ namespace LSIS {
 			float4* centers;
 			float4* bounds;
 			uint32_t* ids;
-			uint32_t* next_index;
+			uint32_t* ids_tmp; // target of the parallel partition
 		} build_info;
 
+		// Bins, split measures and sweep data of a thread
+		typedef struct build_scratch {
+			bbox* bins_bound;
+			uint32_t* bins_count;
+			float* A_l;
+			uint32_t* N_l;
+			float* A_r;
+			uint32_t* N_r;
+			uint32_t* order; // faces sorted along each axis by the sweep
+			float* areas; // right side areas of the sweep
+		} build_scratch;
+
 		typedef struct queue_item {
 			uint32_t index;
 			uint32_t left;
@@ -59,34 +73,81 @@ namespace LSIS {
 
 
 	public:
-		SAHBVHStructure(const SHARED::Vertex* vertices, const SHARED::Face* faces, const size_t num_faces);
+		/// Nodes are split with up to 'k' bins along the longest axis of the centers. The bin count is lowered for nodes with few faces,
+		/// and the smallest nodes are split by an exact sweep over the faces sorted along each axis.
+		/// The build runs on the ThreadPool. The largest nodes are binned and partitioned by all threads, and subtrees are built as tasks below them.
+		/// Nodes are stored depth first, so the result is the same for any number of threads.
+		/// Nodes of up to 'max_leaf_size' faces become leaves when that is cheaper by the SAH than the best split.
+		/// Leaves reference a contiguous range of the reordered faces, with node.left = -count and node.right = the first face
+		SAHBVHStructure(const SHARED::Vertex* vertices, const SHARED::Face* faces, const size_t num_faces, size_t k = 128, size_t max_leaf_size = 4);
 		~SAHBVHStructure();
 
 		TypedBuffer<SHARED::AABB> GetBoundsBuffer();
 		TypedBuffer<SHARED::Node> GetNodesBuffer();
+		/// The faces in the order referenced by the leaves. Use this instead of the input faces
+		TypedBuffer<SHARED::Face> GetFaceBuffer();
+		const std::vector<SHARED::Face>& GetFaces() const { return m_faces; }
+		const SHARED::Node* GetNodes() const { return m_nodes; }
+		const SHARED::AABB* GetBounds() const { return m_bboxes; }
+		size_t GetNumNodes() const { return m_num_nodes; }
 
 	private:
 
-		// Iterate over all faces and calculate the AABBs and centroids. returns the bounding volume for all face centroids
-		inline bbox calc_bounds_and_centers(float4* centers, float4* bounds, const SHARED::Vertex* vertices, const SHARED::Face* faces, const size_t num_faces);
-		// return an array of size 'num_faces', initialized with 0,1,2...num_faces-1
-		inline uint32_t* initialize_face_ids(size_t num_faces);
+		// Builds the subtree of 'root' on the calling thread, and submits the large subtrees below it to the pool
+		void build_subtree(build_info info, build_scratch* scratch, ThreadPool::TaskGroup& group, queue_item root);
+
+		// Iterate over the faces [begin,end) and calculate the AABBs and centroids. returns the bounding volume for the face centroids
+		inline bbox calc_bounds_and_centers(float4* centers, float4* bounds, const SHARED::Vertex* vertices, const SHARED::Face* faces, const size_t begin, const size_t end);
+		// return an array of size 'num_faces' allocated from the arena, initialized with 0,1,2...num_faces-1
+		inline uint32_t* initialize_face_ids(Arena& arena, size_t num_faces);
+		// Scratch data for each of the threads, allocated from the arena
+		build_scratch* allocate_scratch(Arena& arena, size_t num_threads);
 
-		inline uint32_t build_recursive(build_info info, uint32_t begin, uint32_t end, const bbox cb);
 		inline uint32_t find_max_axis(float4 pmin, float4 pmax);
 		inline float calc_area(const __m128 diagonal);
-		inline void accumulate_from_left(float* A_l, uint32_t* N_l, const bbox* bin_bounds, const uint32_t* bin_counts);
-		inline void accumulate_from_right(float* A_r, uint32_t* N_r, const bbox* bin_bounds, const uint32_t* bin_counts);
-		inline uint32_t find_optimal_split(float* A_l, float* A_r, uint32_t* N_l, uint32_t* N_r);
+		inline void accumulate_from_left(float* A_l, uint32_t* N_l, const bbox* bin_bounds, const uint32_t* bin_counts, const uint32_t num_bins);
+		inline void accumulate_from_right(float* A_r, uint32_t* N_r, const bbox* bin_bounds, const uint32_t* bin_counts, const uint32_t num_bins);
+		inline uint32_t find_optimal_split(float* A_l, float* A_r, uint32_t* N_l, uint32_t* N_r, const uint32_t num_bins);
+		// Bins the faces [begin,end) along axis k, and bounds them in 'bbox_node'
+		inline void bin_faces(build_info info, bbox* bins_bound, uint32_t* bins_count, uint32_t begin, uint32_t end, uint32_t num_bins, int k, float k0, float k1, bbox* bbox_node);
+		// Bins in fixed size chunks on all threads, and merges the chunks into the bins of 'scratch'
+		void bin_faces_parallel(build_info info, build_scratch& scratch, uint32_t begin, uint32_t end, uint32_t num_bins, int k, float k0, float k1, bbox* bbox_node);
+		// Same split as reorder_ids on all threads. The faces keep their relative order on each side
+		uint32_t partition_parallel(build_info info, uint32_t begin, uint32_t end, bbox* cb_l, bbox* cb_r, const uint32_t split_bin_id, int k, float k0, float k1);
 		inline uint32_t reorder_ids(build_info info, uint32_t begin, uint32_t end, bbox* cb_l, bbox* cb_r, const uint32_t split_bin_id, int k, float k0, float k1);
+		// Finds the best split of [begin,end) among all splits of the faces sorted along each axis, and reorders the ids to it. Returns the first id of the right side
+		// The unnormalized SAH cost of the split is stored in 'cost'
+		inline uint32_t sweep_split(build_info info, build_scratch& scratch, uint32_t begin, uint32_t end, SHARED::AABB* bbox_node, bbox* cb_l, bbox* cb_r, float* cost);
+		// True if a leaf of 'count' faces is no more expensive than the split, with 'split_cost' from the split search
+		inline bool leaf_is_cheaper(const SHARED::AABB& bbox_node, uint32_t count, float split_cost);
+
+		// Removes the nodes left unused by multi face leaves, keeping the depth first order
+		void compact_nodes();
 
 		//int BuildRecursive(Bound* bounds, glm::vec3* centers, int index, int start, int end, Bound partition_bound);
 		//float Cost(Bound A_l, int N_l, Bound A_r, int N_r);
 
 	private:
+		// Subtrees with more faces than this are built as separate tasks
+		static constexpr uint32_t s_task_threshold = 1 << 10;
+		// Nodes with more faces than this are binned and partitioned on all threads
+		static constexpr uint32_t s_parallel_threshold = 1 << 16;
+		// Number of faces per chunk of the parallel binning and partition. Fixed so the result is the same for any number of threads
+		static constexpr uint32_t s_chunk_size = 1 << 13;
+		// Nodes with at most this many faces are split by the sweep
+		static constexpr uint32_t s_sweep_threshold = 16;
+		// Fewest bins used for a binned node
+		static constexpr uint32_t s_min_bins = 16;
+		// SAH costs of traversing a node and intersecting a face
+		static constexpr float s_traversal_cost = 1.0f;
+		static constexpr float s_intersection_cost = 1.0f;
+
+		const size_t m_K;
+		const size_t m_max_leaf_size;
 		SHARED::Node* m_nodes;
 		SHARED::AABB* m_bboxes;
 		size_t m_num_nodes;
+		std::vector<SHARED::Face> m_faces;
 
 	};
 
@@ -0,0 +1,186 @@
+#include "pch.h"
+#include "TreeletRestructure.h"
+
+#include <limits>
+#include <new>
+
+#include "Threading/ThreadPool.h"
+
+namespace LSIS {
+
+	TreeletRestructure::TreeletRestructure(SHARED::Node* nodes, SHARED::AABB* bboxes, size_t num_nodes, size_t num_passes)
+		: m_nodes(nodes), m_bboxes(bboxes), m_num_nodes(num_nodes)
+	{
+		if (num_nodes == 0)
+			return;
+
+		static_assert(TREELET_SIZE <= 8, "the subsets of the treelet leaves must fit in 8 bits");
+
+		Arena& arena = Arena::GetScratch();
+		Arena::Scope scope(arena);
+		float* costs = arena.Allocate<float>(num_nodes);
+		std::atomic<uint32_t>* visits = arena.Allocate<std::atomic<uint32_t>>(num_nodes);
+
+		m_initial_cost = calc_cost();
+
+		ThreadPool& pool = ThreadPool::Get();
+		pool.ParallelFor(0, num_nodes, [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				const SHARED::Node& node = m_nodes[i];
+				if (!is_leaf(node)) {
+					m_nodes[node.left].parent = static_cast<int>(i);
+					m_nodes[node.right].parent = static_cast<int>(i);
+				}
+			}
+		});
+		m_nodes[0].parent = -1;
+
+		for (size_t pass = 0; pass < num_passes; pass++) {
+			pool.ParallelFor(0, num_nodes, [&](size_t begin, size_t end, size_t) {
+				for (size_t i = begin; i < end; i++) {
+					new (&visits[i]) std::atomic<uint32_t>(0);
+				}
+			});
+
+			pool.ParallelFor(0, num_nodes, [&](size_t begin, size_t end, size_t) {
+				for (size_t i = begin; i < end; i++) {
+					const SHARED::Node& leaf = m_nodes[i];
+					if (!is_leaf(leaf))
+						continue;
+
+					costs[i] = s_intersection_cost * static_cast<float>(-leaf.left) * area(m_bboxes[i]);
+
+					// The first thread to reach a node stops. The second continues with it, as both subtrees are done
+					int index = leaf.parent;
+					while (index != -1 && visits[index].fetch_add(1, std::memory_order_acq_rel) == 1) {
+						optimize_treelet(index, costs);
+						index = m_nodes[index].parent;
+					}
+				}
+			});
+		}
+
+		m_cost = calc_cost();
+	}
+
+	TreeletRestructure::~TreeletRestructure()
+	{
+	}
+
+	float TreeletRestructure::calc_cost() const
+	{
+		double cost = 0.0;
+		for (size_t i = 0; i < m_num_nodes; i++) {
+			const SHARED::Node& node = m_nodes[i];
+			const float cost_node = is_leaf(node) ? s_intersection_cost * static_cast<float>(-node.left) : s_traversal_cost;
+			cost += cost_node * area(m_bboxes[i]);
+		}
+		const float root_area = area(m_bboxes[0]);
+		return root_area > 0.0f ? static_cast<float>(cost / root_area) : 0.0f;
+	}
+
+	void TreeletRestructure::optimize_treelet(int root, float* costs)
+	{
+		int leaves[TREELET_SIZE];
+		int internals[TREELET_SIZE - 1];
+		int num_leaves = 2;
+		int num_internals = 1;
+		leaves[0] = m_nodes[root].left;
+		leaves[1] = m_nodes[root].right;
+		internals[0] = root;
+
+		// Expand the internal treelet leaf with the largest area, until the treelet is full
+		while (num_leaves < TREELET_SIZE) {
+			int best = -1;
+			float best_area = -1.0f;
+			for (int i = 0; i < num_leaves; i++) {
+				if (!is_leaf(m_nodes[leaves[i]]) && area(m_bboxes[leaves[i]]) > best_area) {
+					best_area = area(m_bboxes[leaves[i]]);
+					best = i;
+				}
+			}
+			if (best == -1)
+				break;
+
+			const int expanded = leaves[best];
+			internals[num_internals++] = expanded;
+			leaves[best] = m_nodes[expanded].left;
+			leaves[num_leaves++] = m_nodes[expanded].right;
+		}
+
+		const float cost_current = s_traversal_cost * area(m_bboxes[root]) + costs[m_nodes[root].left] + costs[m_nodes[root].right];
+		if (num_leaves < 3) {
+			costs[root] = cost_current;
+			return;
+		}
+
+		// Bounds and optimal cost of every subset of the treelet leaves. Subsets are smaller than their supersets, so they are solved first
+		constexpr uint32_t num_subsets = 1 << TREELET_SIZE;
+		SHARED::AABB subset_bounds[num_subsets];
+		float subset_costs[num_subsets];
+		uint8_t partitions[num_subsets];
+
+		for (int i = 0; i < num_leaves; i++) {
+			subset_bounds[1 << i] = m_bboxes[leaves[i]];
+			subset_costs[1 << i] = costs[leaves[i]];
+		}
+
+		const uint32_t full = (1u << num_leaves) - 1;
+		for (uint32_t set = 1; set <= full; set++) {
+			const uint32_t lowest = set & (0u - set);
+			if (set == lowest)
+				continue;
+
+			subset_bounds[set] = merge(subset_bounds[lowest], subset_bounds[set ^ lowest]);
+
+			// Only partitions with the lowest leaf on the left are tried, as the sides are symmetric
+			float best = std::numeric_limits<float>::infinity();
+			uint32_t best_partition = lowest;
+			for (uint32_t left = (set - 1) & set; left > 0; left = (left - 1) & set) {
+				if ((left & lowest) == 0)
+					continue;
+				const float cost = subset_costs[left] + subset_costs[set ^ left];
+				if (cost < best) {
+					best = cost;
+					best_partition = left;
+				}
+			}
+
+			subset_costs[set] = s_traversal_cost * area(subset_bounds[set]) + best;
+			partitions[set] = static_cast<uint8_t>(best_partition);
+		}
+
+		// Keep the treelet unless the new topology is measurably cheaper, so rounding errors do not shuffle equal treelets
+		if (subset_costs[full] >= cost_current * (1.0f - s_min_improvement)) {
+			costs[root] = cost_current;
+			return;
+		}
+
+		// The root is the first internal node used, so it keeps its index
+		int next_internal = 0;
+		rebuild(full, leaves, internals, next_internal, partitions, subset_bounds, subset_costs, costs);
+	}
+
+	int TreeletRestructure::rebuild(uint32_t set, const int* leaves, const int* internals, int& next_internal, const uint8_t* partitions, const SHARED::AABB* subset_bounds, const float* subset_costs, float* costs)
+	{
+		if ((set & (set - 1)) == 0) {
+			int i = 0;
+			while ((set >> i) != 1)
+				i++;
+			return leaves[i];
+		}
+
+		const int index = internals[next_internal++];
+		const int left = rebuild(partitions[set], leaves, internals, next_internal, partitions, subset_bounds, subset_costs, costs);
+		const int right = rebuild(set ^ partitions[set], leaves, internals, next_internal, partitions, subset_bounds, subset_costs, costs);
+
+		m_nodes[index].left = left;
+		m_nodes[index].right = right;
+		m_nodes[left].parent = index;
+		m_nodes[right].parent = index;
+		m_bboxes[index] = subset_bounds[set];
+		costs[index] = subset_costs[set];
+		return index;
+	}
+
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+
+#include "Kernels/shared_defines.h"
+#include "Memory/Arena.h"
+
+namespace LSIS {
+
+	/// Treelet restructuring of a binary BVH, to lower the SAH cost of a fast build like the LBVH.
+	/// The nodes are processed bottom up in parallel: a thread walks up from every leaf, and the second thread to reach a node continues with it, so both subtrees are finished.
+	/// At each node a treelet is formed by expanding the largest internal treelet leaf until it has TREELET_SIZE leaves, and the treelet is rebuilt in the topology with the lowest SAH cost, found by dynamic programming over the subsets of its leaves.
+	/// The restructuring is done in place. Leaves and the root keep their indices, the internal nodes of a treelet are reused, and node.parent is set for all nodes.
+	/// Leaves are never split or merged, so the faces keep their order
+	class TreeletRestructure {
+	public:
+		/// 'nodes' and 'bboxes' are the binary BVH with the root at 0
+		TreeletRestructure(SHARED::Node* nodes, SHARED::AABB* bboxes, size_t num_nodes, size_t num_passes = 3);
+		~TreeletRestructure();
+
+		/// SAH cost of the BVH before and after the restructuring, relative to the root area
+		float GetInitialCost() const { return m_initial_cost; }
+		float GetCost() const { return m_cost; }
+
+	private:
+		// SAH cost of the whole tree relative to the root area
+		float calc_cost() const;
+		// Restructures the treelet below 'root', and updates its bounds and cost
+		void optimize_treelet(int root, float* costs);
+		// Relinks the nodes of the treelet in the optimal topology of the leaves in 'set'. Returns the node of the set
+		int rebuild(uint32_t set, const int* leaves, const int* internals, int& next_internal, const uint8_t* partitions, const SHARED::AABB* subset_bounds, const float* subset_costs, float* costs);
+
+		inline bool is_leaf(const SHARED::Node& node) const { return node.left < 0; }
+		inline float area(const SHARED::AABB& bbox) const {
+			const float dx = bbox.max.x - bbox.min.x;
+			const float dy = bbox.max.y - bbox.min.y;
+			const float dz = bbox.max.z - bbox.min.z;
+			return 2.0f * (dx * dy + dx * dz + dy * dz);
+		}
+		inline SHARED::AABB merge(const SHARED::AABB& a, const SHARED::AABB& b) const {
+			SHARED::AABB bbox = {};
+			bbox.min = { std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y), std::min(a.min.z, b.min.z), 0.0f };
+			bbox.max = { std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y), std::max(a.max.z, b.max.z), 0.0f };
+			return bbox;
+		}
+
+	private:
+		// SAH costs of traversing a node and intersecting a face, as used by the builders
+		static constexpr float s_traversal_cost = 1.0f;
+		static constexpr float s_intersection_cost = 1.0f;
+		// Relative improvement needed before a treelet is rebuilt
+		static constexpr float s_min_improvement = 1e-5f;
+
+		SHARED::Node* m_nodes;
+		SHARED::AABB* m_bboxes;
+		const size_t m_num_nodes;
+		float m_initial_cost = 0.0f;
+		float m_cost = 0.0f;
+	};
+
+}
@@ -0,0 +1,175 @@
+#include "pch.h"
+#include "TwoLevelBVH.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+#include "SAHBVHStructure.h"
+#include "MergedBVH.h"
+
+namespace LSIS {
+
+	TwoLevelBVH::TwoLevelBVH(const SHARED::Vertex* vertices, SHARED::Face* faces, const std::vector<Mesh>& meshes, size_t k)
+	{
+		for (const Mesh& mesh : meshes) {
+			CORE_ASSERT(mesh.num_faces > 0, "Can't build a BVH for a mesh without faces!");
+
+			SAHBVHStructure structure = SAHBVHStructure(vertices, faces + mesh.first_face, mesh.num_faces, k);
+			MergedBVH merged = MergedBVH(structure.GetNodes(), structure.GetBounds());
+			std::copy(structure.GetFaces().begin(), structure.GetFaces().end(), faces + mesh.first_face);
+
+			// Move the nodes of the mesh after the previous meshes, and its leaves to the faces of the mesh
+			const int node_offset = static_cast<int>(m_mesh_nodes.size());
+			const int face_offset = static_cast<int>(mesh.first_face);
+			for (size_t i = 0; i < merged.GetNumNodes(); i++) {
+				SHARED::BVHNode node = merged.GetNodes()[i];
+				node.left += node.left_count > 0 ? face_offset : node_offset;
+				node.right += node.right_count > 0 ? face_offset : node_offset;
+				m_mesh_nodes.push_back(node);
+
+				const cl_int parent = merged.GetParents()[i];
+				m_mesh_parents.push_back(parent == -1 ? -1 : parent + node_offset);
+			}
+
+			m_mesh_roots.push_back(node_offset);
+			m_mesh_bounds.push_back(structure.GetBounds()[0]);
+			m_mesh_depth = std::max(m_mesh_depth, merged.GetDepth());
+		}
+	}
+
+	TwoLevelBVH::~TwoLevelBVH()
+	{
+	}
+
+	void TwoLevelBVH::SetInstances(const std::vector<uint32_t>& meshes, const std::vector<glm::mat4>& transforms)
+	{
+		CORE_ASSERT(meshes.size() == transforms.size(), "Every instance needs a transform!");
+		CORE_ASSERT(!meshes.empty(), "Can't build a BVH without instances!");
+
+		const size_t num_instances = meshes.size();
+		std::vector<SHARED::AABB> instance_bounds(num_instances);
+		std::vector<glm::vec3> centers(num_instances);
+		for (size_t i = 0; i < num_instances; i++) {
+			instance_bounds[i] = transform_bounds(m_mesh_bounds[meshes[i]], transforms[i]);
+			const SHARED::AABB& bbox = instance_bounds[i];
+			centers[i] = glm::vec3(bbox.min.x + bbox.max.x, bbox.min.y + bbox.max.y, bbox.min.z + bbox.max.z) * 0.5f;
+		}
+
+		std::vector<uint32_t> ids(num_instances);
+		std::iota(ids.begin(), ids.end(), 0);
+
+		std::vector<SHARED::Node> nodes;
+		std::vector<SHARED::AABB> bboxes;
+		nodes.reserve(num_instances * 2 - 1);
+		bboxes.reserve(num_instances * 2 - 1);
+		build_top(nodes, bboxes, ids.data(), instance_bounds.data(), centers.data(), 0, static_cast<uint32_t>(num_instances));
+		nodes[0].parent = -1;
+
+		// Median splits keep the top level shallow, so it is always traced with the short stack
+		MergedBVH merged = MergedBVH(nodes.data(), bboxes.data());
+		CORE_ASSERT(merged.GetDepth() <= BVH_STACK_SIZE, "The top level BVH is too deep for the traversal stack!");
+		m_nodes = merged.GetNodes();
+		m_bounds = bboxes[0];
+
+		// The leaves reference the instances in the order of 'ids'
+		m_instances.resize(num_instances);
+		for (size_t i = 0; i < num_instances; i++) {
+			const uint32_t id = ids[i];
+			const glm::mat4 world_to_object = glm::inverse(transforms[id]);
+
+			SHARED::Instance instance = {};
+			for (int row = 0; row < 3; row++) {
+				instance.world_to_object[row] = { world_to_object[0][row], world_to_object[1][row], world_to_object[2][row], world_to_object[3][row] };
+			}
+			instance.root = m_mesh_roots[meshes[id]];
+			m_instances[i] = instance;
+		}
+	}
+
+	TypedBuffer<SHARED::BVHNode> TwoLevelBVH::GetMeshNodeBuffer()
+	{
+		TypedBuffer<SHARED::BVHNode> buffer = TypedBuffer<SHARED::BVHNode>(Compute::GetContext(), CL_MEM_READ_ONLY, m_mesh_nodes.size());
+		CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::BVHNode) * m_mesh_nodes.size(), m_mesh_nodes.data()));
+		return buffer;
+	}
+
+	TypedBuffer<cl_int> TwoLevelBVH::GetMeshParentBuffer()
+	{
+		TypedBuffer<cl_int> buffer = TypedBuffer<cl_int>(Compute::GetContext(), CL_MEM_READ_ONLY, m_mesh_parents.size());
+		CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(cl_int) * m_mesh_parents.size(), m_mesh_parents.data()));
+		return buffer;
+	}
+
+	TypedBuffer<SHARED::BVHNode> TwoLevelBVH::GetNodeBuffer()
+	{
+		TypedBuffer<SHARED::BVHNode> buffer = TypedBuffer<SHARED::BVHNode>(Compute::GetContext(), CL_MEM_READ_ONLY, m_nodes.size());
+		CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::BVHNode) * m_nodes.size(), m_nodes.data()));
+		return buffer;
+	}
+
+	TypedBuffer<SHARED::Instance> TwoLevelBVH::GetInstanceBuffer()
+	{
+		TypedBuffer<SHARED::Instance> buffer = TypedBuffer<SHARED::Instance>(Compute::GetContext(), CL_MEM_READ_ONLY, m_instances.size());
+		CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Instance) * m_instances.size(), m_instances.data()));
+		return buffer;
+	}
+
+	int TwoLevelBVH::build_top(std::vector<SHARED::Node>& nodes, std::vector<SHARED::AABB>& bboxes, uint32_t* ids, const SHARED::AABB* instance_bounds, const glm::vec3* centers, uint32_t begin, uint32_t end)
+	{
+		const int index = static_cast<int>(nodes.size());
+		nodes.push_back({});
+		bboxes.push_back(instance_bounds[ids[begin]]);
+
+		if (end - begin == 1) {
+			SHARED::Node leaf = {};
+			leaf.left = -1;
+			leaf.right = static_cast<int>(begin);
+			nodes[index] = leaf;
+			return index;
+		}
+
+		glm::vec3 cmin = centers[ids[begin]];
+		glm::vec3 cmax = cmin;
+		for (uint32_t i = begin + 1; i < end; i++) {
+			cmin = glm::min(cmin, centers[ids[i]]);
+			cmax = glm::max(cmax, centers[ids[i]]);
+		}
+		const glm::vec3 extent = cmax - cmin;
+		const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+		const uint32_t middle = begin + (end - begin) / 2;
+		std::nth_element(ids + begin, ids + middle, ids + end, [&](uint32_t a, uint32_t b) { return centers[a][axis] < centers[b][axis]; });
+
+		SHARED::Node node = {};
+		node.left = build_top(nodes, bboxes, ids, instance_bounds, centers, begin, middle);
+		node.right = build_top(nodes, bboxes, ids, instance_bounds, centers, middle, end);
+		nodes[index] = node;
+		nodes[node.left].parent = index;
+		nodes[node.right].parent = index;
+		bboxes[index] = merge(bboxes[node.left], bboxes[node.right]);
+		return index;
+	}
+
+	SHARED::AABB TwoLevelBVH::transform_bounds(const SHARED::AABB& bbox, const glm::mat4& transform) const
+	{
+		glm::vec3 pmin = glm::vec3(std::numeric_limits<float>::max());
+		glm::vec3 pmax = glm::vec3(-std::numeric_limits<float>::max());
+		for (int corner = 0; corner < 8; corner++) {
+			const glm::vec4 p = glm::vec4(
+				corner & 1 ? bbox.max.x : bbox.min.x,
+				corner & 2 ? bbox.max.y : bbox.min.y,
+				corner & 4 ? bbox.max.z : bbox.min.z,
+				1.0f);
+			const glm::vec3 q = glm::vec3(transform * p);
+			pmin = glm::min(pmin, q);
+			pmax = glm::max(pmax, q);
+		}
+
+		SHARED::AABB result = {};
+		result.min = { pmin.x, pmin.y, pmin.z, 0.0f };
+		result.max = { pmax.x, pmax.y, pmax.z, 0.0f };
+		return result;
+	}
+
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+
+#include "glm.hpp"
+
+#include "Kernels/shared_defines.h"
+#include "Compute/Buffer.h"
+
+namespace LSIS {
+
+	/// Two level BVH of instanced meshes. Every unique mesh has a bottom level BVH over its faces in its own space, built once with SAHBVHStructure.
+	/// The instances place a mesh in the world with a transform, and the small top level BVH over their world bounds is all that is rebuilt when they move.
+	/// Both levels are merged BVHNodes. The bottom levels share one node array, and the leaves of the top level reference the instances.
+	/// The faces of each mesh are reordered within the range of the mesh, as its leaves reference them
+	class TwoLevelBVH {
+	public:
+		/// The faces [first_face, first_face + num_faces) of the shared face array
+		struct Mesh {
+			size_t first_face;
+			size_t num_faces;
+		};
+
+		/// Builds the bottom level BVH of each mesh with at most 'k' bins per node. The meshes can't be empty
+		TwoLevelBVH(const SHARED::Vertex* vertices, SHARED::Face* faces, const std::vector<Mesh>& meshes, size_t k);
+		~TwoLevelBVH();
+
+		/// Rebuilds the top level for the instances of the meshes 'meshes', placed with the object to world 'transforms'
+		void SetInstances(const std::vector<uint32_t>& meshes, const std::vector<glm::mat4>& transforms);
+
+		/// Nodes of the bottom level BVHs, and the parent of each node, -1 for the root of a mesh
+		TypedBuffer<SHARED::BVHNode> GetMeshNodeBuffer();
+		TypedBuffer<cl_int> GetMeshParentBuffer();
+		/// Nodes of the top level BVH, and the instances in the order its leaves reference them
+		TypedBuffer<SHARED::BVHNode> GetNodeBuffer();
+		TypedBuffer<SHARED::Instance> GetInstanceBuffer();
+
+		size_t GetNumMeshNodes() const { return m_mesh_nodes.size(); }
+		size_t GetNumInstances() const { return m_instances.size(); }
+		/// Depth of the deepest bottom level BVH, as MergedBVH::GetDepth
+		size_t GetMeshDepth() const { return m_mesh_depth; }
+		/// Bounds of all instances in world space
+		const SHARED::AABB& GetBounds() const { return m_bounds; }
+
+	private:
+		// Builds the top level nodes over the instances ids[begin, end) by splitting at the median center along the largest axis. Returns the node
+		int build_top(std::vector<SHARED::Node>& nodes, std::vector<SHARED::AABB>& bboxes, uint32_t* ids, const SHARED::AABB* instance_bounds, const glm::vec3* centers, uint32_t begin, uint32_t end);
+
+		// Bounds of 'bbox' after the transform
+		SHARED::AABB transform_bounds(const SHARED::AABB& bbox, const glm::mat4& transform) const;
+		inline SHARED::AABB merge(const SHARED::AABB& a, const SHARED::AABB& b) const {
+			SHARED::AABB bbox = {};
+			bbox.min = { std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y), std::min(a.min.z, b.min.z), 0.0f };
+			bbox.max = { std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y), std::max(a.max.z, b.max.z), 0.0f };
+			return bbox;
+		}
+
+	private:
+		std::vector<SHARED::BVHNode> m_mesh_nodes;
+		std::vector<cl_int> m_mesh_parents;
+		std::vector<int> m_mesh_roots;
+		std::vector<SHARED::AABB> m_mesh_bounds;
+		size_t m_mesh_depth = 0;
+
+		std::vector<SHARED::BVHNode> m_nodes;
+		std::vector<SHARED::Instance> m_instances;
+		SHARED::AABB m_bounds = {};
+	};
+
+}
@@ -0,0 +1,164 @@
+#include "pch.h"
+#include "WideBVH.h"
+
+#include <cmath>
+#include <queue>
+
+namespace LSIS {
+
+	WideBVH::WideBVH(const SHARED::Node* nodes, const SHARED::AABB* bboxes, const SHARED::Face* faces, size_t width)
+		: m_width(glm::clamp<size_t>(width, 2, BVH_MAX_WIDTH))
+	{
+		static_assert(sizeof(SHARED::WideBVHNode) == 80, "wide BVH nodes must be 80 bytes");
+
+		m_nodes.push_back({});
+
+		// Pairs of the wide node index and the binary node it is made from
+		auto queue = std::queue<std::pair<int, int>>();
+		queue.push({ 0, 0 });
+
+		std::vector<int> children;
+		children.reserve(m_width);
+
+		while (!queue.empty()) {
+			const auto [index, source] = queue.front(); queue.pop();
+
+			// A root leaf becomes the only child of the root
+			children.clear();
+			if (nodes[source].left < 0) {
+				children.push_back(source);
+			}
+			else {
+				children.push_back(nodes[source].left);
+				children.push_back(nodes[source].right);
+			}
+
+			// Replace the internal child with the largest area by its two children, until the node is full
+			while (children.size() < m_width) {
+				int best = -1;
+				float best_area = -1.0f;
+				for (int i = 0; i < children.size(); i++) {
+					const SHARED::Node& child = nodes[children[i]];
+					if (child.left >= 0 && area(bboxes[children[i]]) > best_area) {
+						best_area = area(bboxes[children[i]]);
+						best = i;
+					}
+				}
+				if (best == -1)
+					break;
+
+				const SHARED::Node& opened = nodes[children[best]];
+				children[best] = opened.left;
+				children.insert(children.begin() + best + 1, opened.right);
+			}
+
+			// Internal children are stored after the nodes already created, and the faces of the leaf children after the faces already placed
+			SHARED::WideBVHNode node = {};
+			node.child_base = static_cast<int>(m_nodes.size());
+			node.face_base = static_cast<int>(m_faces.size());
+			for (int i = 0; i < children.size(); i++) {
+				const SHARED::Node& child = nodes[children[i]];
+				if (child.left >= 0) {
+					node.meta[i] = WIDE_BVH_INTERNAL;
+					queue.push({ static_cast<int>(m_nodes.size()), children[i] });
+					m_nodes.push_back({});
+				}
+				else {
+					const int count = -child.left;
+					CORE_ASSERT(count < WIDE_BVH_INTERNAL, "the face count of a wide BVH leaf must fit in 8 bits!");
+					node.meta[i] = static_cast<cl_uchar>(count);
+					m_faces.insert(m_faces.end(), faces + child.right, faces + child.right + count);
+				}
+			}
+
+			encode_bounds(node, bboxes[source], children, bboxes);
+			m_nodes[index] = node;
+		}
+
+		// The traversal pushes the internal children of a node, and the rest stays on the stack while one of them is traversed.
+		// Children are stored after their parent, so the stack use below each node is found in reverse order
+		std::vector<size_t> stack_size(m_nodes.size());
+		for (size_t i = m_nodes.size(); i-- > 0;) {
+			const SHARED::WideBVHNode& node = m_nodes[i];
+			size_t num_internal = 0;
+			size_t below = 0;
+			for (int j = 0; j < BVH_MAX_WIDTH && node.meta[j] != 0; j++) {
+				if (node.meta[j] == WIDE_BVH_INTERNAL) {
+					below = std::max(below, stack_size[node.child_base + num_internal]);
+					num_internal++;
+				}
+			}
+			stack_size[i] = num_internal == 0 ? 0 : std::max(num_internal, num_internal - 1 + below);
+		}
+		m_stack_size = stack_size[0];
+	}
+
+	WideBVH::~WideBVH()
+	{
+	}
+
+	TypedBuffer<SHARED::WideBVHNode> WideBVH::GetNodeBuffer()
+	{
+		TypedBuffer<SHARED::WideBVHNode> buffer = TypedBuffer<SHARED::WideBVHNode>(Compute::GetContext(), CL_MEM_READ_ONLY, m_nodes.size());
+		CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::WideBVHNode) * m_nodes.size(), m_nodes.data()));
+		return buffer;
+	}
+
+	TypedBuffer<SHARED::Face> WideBVH::GetFaceBuffer()
+	{
+		if (m_faces.empty()) {
+			return TypedBuffer<SHARED::Face>();
+		}
+		TypedBuffer<SHARED::Face> buffer = TypedBuffer<SHARED::Face>(Compute::GetContext(), CL_MEM_READ_ONLY, m_faces.size());
+		CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Face) * m_faces.size(), m_faces.data()));
+		return buffer;
+	}
+
+	void WideBVH::encode_bounds(SHARED::WideBVHNode& node, const SHARED::AABB& bounds, const std::vector<int>& children, const SHARED::AABB* bboxes)
+	{
+		const glm::vec3 origin = glm::vec3(bounds.min.x, bounds.min.y, bounds.min.z);
+		const glm::vec3 extent = glm::vec3(bounds.max.x, bounds.max.y, bounds.max.z) - origin;
+		cl_uchar8* qmin[3] = { &node.qmin_x, &node.qmin_y, &node.qmin_z };
+		cl_uchar8* qmax[3] = { &node.qmax_x, &node.qmax_y, &node.qmax_z };
+		int exponent[3];
+
+		for (int k = 0; k < 3; k++) {
+			// The smallest power of two, where 255 cells covers the node
+			exponent[k] = -126;
+			if (extent[k] > 0.0f)
+				std::frexp(extent[k] / 255.0f, &exponent[k]);
+			exponent[k] = glm::max(exponent[k], -126);
+
+			// The kernel decodes the bounds as origin + q * 2^exponent, which may round the top of the last child past the 255th cell.
+			// The cells are doubled until every child fits
+			for (;; exponent[k]++) {
+				const float scale = std::ldexp(1.0f, exponent[k]);
+				bool fits = true;
+				for (int i = 0; i < children.size() && fits; i++) {
+					const SHARED::AABB& child = bboxes[children[i]];
+					const glm::vec3 cmin = glm::vec3(child.min.x, child.min.y, child.min.z);
+					const glm::vec3 cmax = glm::vec3(child.max.x, child.max.y, child.max.z);
+
+					int lo = glm::clamp(int(std::floor((cmin[k] - origin[k]) / scale)), 0, 255);
+					int hi = glm::clamp(int(std::ceil((cmax[k] - origin[k]) / scale)), 0, 255);
+					while (lo > 0 && origin[k] + float(lo) * scale > cmin[k])
+						lo--;
+					while (hi < 255 && origin[k] + float(hi) * scale < cmax[k])
+						hi++;
+
+					fits = origin[k] + float(hi) * scale >= cmax[k];
+					qmin[k]->s[i] = static_cast<cl_uchar>(lo);
+					qmax[k]->s[i] = static_cast<cl_uchar>(hi);
+				}
+				if (fits)
+					break;
+			}
+		}
+
+		node.origin[0] = origin.x;
+		node.origin[1] = origin.y;
+		node.origin[2] = origin.z;
+		node.exponent = { cl_char(exponent[0]), cl_char(exponent[1]), cl_char(exponent[2]), 0 };
+	}
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+
+#include "Kernels/shared_defines.h"
+#include "Compute/Buffer.h"
+
+namespace LSIS {
+
+	/// BVH with up to BVH_MAX_WIDTH children per node, made by collapsing the binary BVH of SAHBVHStructure or LBVHStructure.
+	/// Internal children are opened largest surface area first, until the node is full or only leaves are left.
+	/// All child bounds of a node are stored in the node, quantized conservatively to 8 bits, so the traversal tests all children with one fetch.
+	/// The faces are reordered so the leaf children of each node reference a contiguous range
+	class WideBVH {
+	public:
+		/// 'nodes' and 'bboxes' are the binary BVH with the root at 0, and 'faces' the faces in the order its leaves reference
+		WideBVH(const SHARED::Node* nodes, const SHARED::AABB* bboxes, const SHARED::Face* faces, size_t width = 8);
+		~WideBVH();
+
+		TypedBuffer<SHARED::WideBVHNode> GetNodeBuffer();
+		/// The faces in the order referenced by the wide nodes. Use this instead of the faces of the binary BVH
+		TypedBuffer<SHARED::Face> GetFaceBuffer();
+		const std::vector<SHARED::Face>& GetFaces() const { return m_faces; }
+		size_t GetNumNodes() const { return m_nodes.size(); }
+		/// Most entries on the stack of the wide traversal, when every child is hit. Must not exceed WIDE_STACK_SIZE
+		size_t GetStackSize() const { return m_stack_size; }
+
+	private:
+		// Quantizes the bounds of the children relative to the bounds of the node, rounding outwards
+		void encode_bounds(SHARED::WideBVHNode& node, const SHARED::AABB& bounds, const std::vector<int>& children, const SHARED::AABB* bboxes);
+
+		inline float area(const SHARED::AABB& bbox) const {
+			const float dx = bbox.max.x - bbox.min.x;
+			const float dy = bbox.max.y - bbox.min.y;
+			const float dz = bbox.max.z - bbox.min.z;
+			return dx * dy + dx * dz + dy * dz;
+		}
+
+	private:
+		const size_t m_width;
+		std::vector<SHARED::WideBVHNode> m_nodes;
+		std::vector<SHARED::Face> m_faces;
+		size_t m_stack_size = 0;
+	};
+
+}
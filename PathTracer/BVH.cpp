@@ -13,22 +13,88 @@ namespace LSIS {
 	{
 	}
 
-	void BVH::SetGeometryBuffers(const TypedBuffer<SHARED::Vertex>& vertices, const TypedBuffer<SHARED::Face>& faces)
+	void BVH::SetGeometryBuffers(const TypedBuffer<SHARED::Vertex>& vertices, const TypedBuffer<SHARED::Face>& faces, const TypedBuffer<SHARED::Triangle>& triangles)
 	{
+		CHECK(m_closest.setArg(1, triangles.GetBuffer()));
 		CHECK(m_closest.setArg(2, faces.GetBuffer()));
 		CHECK(m_closest.setArg(3, vertices.GetBuffer()));
 
-		CHECK(m_occlusion.setArg(2, faces.GetBuffer()));
-		CHECK(m_occlusion.setArg(3, vertices.GetBuffer()));
+		// Occlusion only needs the triangles
+		CHECK(m_occlusion.setArg(1, triangles.GetBuffer()));
+
+		// The wide kernels take the same arguments
+		CHECK(m_closest_wide.setArg(1, triangles.GetBuffer()));
+		CHECK(m_closest_wide.setArg(2, faces.GetBuffer()));
+		CHECK(m_closest_wide.setArg(3, vertices.GetBuffer()));
+
+		CHECK(m_occlusion_wide.setArg(1, triangles.GetBuffer()));
+
+		// The stackless kernels take the parents after the nodes
+		CHECK(m_closest_stackless.setArg(2, triangles.GetBuffer()));
+		CHECK(m_closest_stackless.setArg(3, faces.GetBuffer()));
+		CHECK(m_closest_stackless.setArg(4, vertices.GetBuffer()));
+
+		CHECK(m_occlusion_stackless.setArg(2, triangles.GetBuffer()));
+
+		// The instanced kernels take the top level and the instances first
+		CHECK(m_closest_instances.setArg(4, triangles.GetBuffer()));
+		CHECK(m_closest_instances.setArg(5, faces.GetBuffer()));
+		CHECK(m_closest_instances.setArg(6, vertices.GetBuffer()));
+
+		CHECK(m_occlusion_instances.setArg(4, triangles.GetBuffer()));
 	}
 
-	void BVH::SetBVHBuffer(const TypedBuffer<SHARED::Node>& nodes, const TypedBuffer<SHARED::AABB>& bboxes)
+	void BVH::SetBVHBuffer(const TypedBuffer<SHARED::BVHNode>& nodes, const TypedBuffer<cl_int>& parents)
 	{
 		CHECK(m_closest.setArg(0, nodes.GetBuffer()));
-		CHECK(m_closest.setArg(1, bboxes.GetBuffer()));
-
 		CHECK(m_occlusion.setArg(0, nodes.GetBuffer()));
-		CHECK(m_occlusion.setArg(1, bboxes.GetBuffer()));
+
+		CHECK(m_closest_stackless.setArg(0, nodes.GetBuffer()));
+		CHECK(m_closest_stackless.setArg(1, parents.GetBuffer()));
+		CHECK(m_occlusion_stackless.setArg(0, nodes.GetBuffer()));
+		CHECK(m_occlusion_stackless.setArg(1, parents.GetBuffer()));
+
+		m_wide = false;
+		m_instanced = false;
+	}
+
+	void BVH::SetWideBVHBuffer(const TypedBuffer<SHARED::WideBVHNode>& nodes)
+	{
+		CHECK(m_closest_wide.setArg(0, nodes.GetBuffer()));
+		CHECK(m_occlusion_wide.setArg(0, nodes.GetBuffer()));
+
+		m_wide = true;
+		m_instanced = false;
+	}
+
+	void BVH::SetInstancedBVHBuffers(const TypedBuffer<SHARED::BVHNode>& top_nodes, const TypedBuffer<SHARED::Instance>& instances, const TypedBuffer<SHARED::BVHNode>& nodes, const TypedBuffer<cl_int>& parents)
+	{
+		SetInstances(top_nodes, instances);
+
+		CHECK(m_closest_instances.setArg(2, nodes.GetBuffer()));
+		CHECK(m_closest_instances.setArg(3, parents.GetBuffer()));
+		CHECK(m_occlusion_instances.setArg(2, nodes.GetBuffer()));
+		CHECK(m_occlusion_instances.setArg(3, parents.GetBuffer()));
+
+		m_wide = false;
+		m_instanced = true;
+	}
+
+	void BVH::SetInstances(const TypedBuffer<SHARED::BVHNode>& top_nodes, const TypedBuffer<SHARED::Instance>& instances)
+	{
+		CHECK(m_closest_instances.setArg(0, top_nodes.GetBuffer()));
+		CHECK(m_closest_instances.setArg(1, instances.GetBuffer()));
+		CHECK(m_occlusion_instances.setArg(0, top_nodes.GetBuffer()));
+		CHECK(m_occlusion_instances.setArg(1, instances.GetBuffer()));
+	}
+
+	void BVH::UseStacklessTraversal(bool b)
+	{
+		m_stackless = b;
+
+		const cl_int stackless = b ? 1 : 0;
+		CHECK(m_closest_instances.setArg(7, sizeof(cl_int), &stackless));
+		CHECK(m_occlusion_instances.setArg(5, sizeof(cl_int), &stackless));
 	}
 
 	void BVH::Compile()
@@ -36,6 +102,12 @@ namespace LSIS {
 		m_program = Compute::CreateProgram(Compute::GetContext(), Compute::GetDevice(), "Kernels/bvh.cl", { "-I Kernels/" });
 		m_closest = Compute::CreateKernel(m_program, "intersect_bvh");
 		m_occlusion = Compute::CreateKernel(m_program, "occluded");
+		m_closest_wide = Compute::CreateKernel(m_program, "intersect_wide_bvh");
+		m_occlusion_wide = Compute::CreateKernel(m_program, "occluded_wide_bvh");
+		m_closest_stackless = Compute::CreateKernel(m_program, "intersect_bvh_stackless");
+		m_occlusion_stackless = Compute::CreateKernel(m_program, "occluded_stackless");
+		m_closest_instances = Compute::CreateKernel(m_program, "intersect_instances");
+		m_occlusion_instances = Compute::CreateKernel(m_program, "occluded_instances");
 	}
 
 	void BVH::Trace(const TypedBuffer<SHARED::Ray>& rays, const TypedBuffer<SHARED::Intersection>& intersections, const TypedBuffer<SHARED::GeometricInfo>& info, const TypedBuffer<cl_uint>& count, cl::Event* e)
@@ -51,15 +123,18 @@ namespace LSIS {
 
 		const cl_uint zero = 0;
 
+		cl_uint first = 0;
+		cl::Kernel& kernel = closest_kernel(first);
+
 		// Bind dynamic kernel arguments
-		CHECK(m_closest.setArg(4, rays.GetBuffer()));
-		CHECK(m_closest.setArg(5, sizeof(cl_uint), &zero));
-		CHECK(m_closest.setArg(6, intersections.GetBuffer()));
-		CHECK(m_closest.setArg(7, info.GetBuffer()));
-		CHECK(m_closest.setArg(8, count.GetBuffer()));
+		CHECK(kernel.setArg(first + 0, rays.GetBuffer()));
+		CHECK(kernel.setArg(first + 1, sizeof(cl_uint), &zero));
+		CHECK(kernel.setArg(first + 2, intersections.GetBuffer()));
+		CHECK(kernel.setArg(first + 3, info.GetBuffer()));
+		CHECK(kernel.setArg(first + 4, count.GetBuffer()));
 
 		// submit kernel
-		CHECK(Compute::GetCommandQueue().enqueueNDRangeKernel(m_closest, cl::NullRange, cl::NDRange(num_rays), cl::NullRange, nullptr, e));
+		CHECK(Compute::GetCommandQueue().enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(num_rays), cl::NullRange, nullptr, e));
 	}
 
 	void BVH::TraceOcclusion(const TypedBuffer<SHARED::Ray>& rays, const TypedBuffer<cl_int>& hits, const TypedBuffer<cl_uint>& count, cl::Event* e) {
@@ -67,14 +142,45 @@ namespace LSIS {
 
 		const cl_uint zero = 0;
 
+		cl_uint first = 0;
+		cl::Kernel& kernel = occlusion_kernel(first);
+
 		// Bind dynamic kernel arguments
-		CHECK(m_occlusion.setArg(4, rays.GetBuffer()));
-		CHECK(m_occlusion.setArg(5, sizeof(cl_uint), &zero));
-		CHECK(m_occlusion.setArg(6, hits.GetBuffer()));
-		CHECK(m_occlusion.setArg(7, count.GetBuffer()));
+		CHECK(kernel.setArg(first + 0, rays.GetBuffer()));
+		CHECK(kernel.setArg(first + 1, sizeof(cl_uint), &zero));
+		CHECK(kernel.setArg(first + 2, hits.GetBuffer()));
+		CHECK(kernel.setArg(first + 3, count.GetBuffer()));
 
 		// Submit kernel
-		CHECK(Compute::GetCommandQueue().enqueueNDRangeKernel(m_occlusion, cl::NullRange, cl::NDRange(num_rays), cl::NullRange, nullptr, e));
+		CHECK(Compute::GetCommandQueue().enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(num_rays), cl::NullRange, nullptr, e));
+	}
+
+	cl::Kernel& BVH::closest_kernel(cl_uint& first)
+	{
+		if (m_instanced) {
+			first = 8;
+			return m_closest_instances;
+		}
+		if (m_wide) {
+			first = 4;
+			return m_closest_wide;
+		}
+		first = m_stackless ? 5 : 4;
+		return m_stackless ? m_closest_stackless : m_closest;
+	}
+
+	cl::Kernel& BVH::occlusion_kernel(cl_uint& first)
+	{
+		if (m_instanced) {
+			first = 6;
+			return m_occlusion_instances;
+		}
+		if (m_wide) {
+			first = 2;
+			return m_occlusion_wide;
+		}
+		first = m_stackless ? 3 : 2;
+		return m_stackless ? m_occlusion_stackless : m_occlusion;
 	}
 
 }
\ No newline at end of file
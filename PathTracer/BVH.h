@@ -13,18 +13,44 @@ namespace LSIS {
 		BVH();
 		virtual ~BVH();
 
-		void SetGeometryBuffers(const TypedBuffer<SHARED::Vertex>& vertices, const TypedBuffer<SHARED::Face>& faces);
-		void SetBVHBuffer(const TypedBuffer<SHARED::Node>& nodes, const TypedBuffer<SHARED::AABB>& bboxes);
+		/// 'triangles' holds the intersection data of 'faces', in the same order. The faces and vertices are only read for the closest hit
+		void SetGeometryBuffers(const TypedBuffer<SHARED::Vertex>& vertices, const TypedBuffer<SHARED::Face>& faces, const TypedBuffer<SHARED::Triangle>& triangles);
+		/// Traces with the binary BVH in merged nodes, from MergedBVH or BVHBuilder. 'parents' holds the parent of each node, and is only read by the stackless traversal
+		void SetBVHBuffer(const TypedBuffer<SHARED::BVHNode>& nodes, const TypedBuffer<cl_int>& parents);
+		/// Traces with the wide BVH instead of the binary. The faces set by SetGeometryBuffers must be in the order of the wide BVH
+		void SetWideBVHBuffer(const TypedBuffer<SHARED::WideBVHNode>& nodes);
+		/// Traces with the two level BVH of TwoLevelBVH. 'nodes' and 'parents' are the bottom levels of the meshes, and the vertices set by SetGeometryBuffers are in the space of the meshes.
+		/// The stackless traversal applies to the bottom levels
+		void SetInstancedBVHBuffers(const TypedBuffer<SHARED::BVHNode>& top_nodes, const TypedBuffer<SHARED::Instance>& instances, const TypedBuffer<SHARED::BVHNode>& nodes, const TypedBuffer<cl_int>& parents);
+		/// Updates the top level of the two level BVH after the instances moved
+		void SetInstances(const TypedBuffer<SHARED::BVHNode>& top_nodes, const TypedBuffer<SHARED::Instance>& instances);
+
+		/// Traverse the binary BVH without a stack, going back up through the parents. Needed when the tree is deeper than BVH_STACK_SIZE
+		void UseStacklessTraversal(bool b);
 
 		virtual void Compile() override;
 
 		void Trace(const TypedBuffer<SHARED::Ray>& rays, const TypedBuffer<SHARED::Intersection>& intersections, const TypedBuffer<SHARED::GeometricInfo>& info, const TypedBuffer<cl_uint>& count, cl::Event* e = nullptr);
 		void TraceOcclusion(const TypedBuffer<SHARED::Ray>& rays, const TypedBuffer<cl_int>& hits, const TypedBuffer<cl_uint>& count, cl::Event* e = nullptr);
 
+	private:
+		// The kernels of the current BVH, and the index of their first argument set per trace
+		cl::Kernel& closest_kernel(cl_uint& first);
+		cl::Kernel& occlusion_kernel(cl_uint& first);
+
 	private:
 		cl::Program m_program;
 		cl::Kernel m_closest;
 		cl::Kernel m_occlusion;
+		cl::Kernel m_closest_wide;
+		cl::Kernel m_occlusion_wide;
+		cl::Kernel m_closest_stackless;
+		cl::Kernel m_occlusion_stackless;
+		cl::Kernel m_closest_instances;
+		cl::Kernel m_occlusion_instances;
+		bool m_wide = false;
+		bool m_stackless = false;
+		bool m_instanced = false;
 
 		cl_uint m_num_nodes = 0;
 	};
@@ -1,8 +1,6 @@
 
 #include "commonCL.h"
 
-#define MAX_DEPTH 24
-
 #define min_component(vec) min3(vec.x, vec.y, vec.z)
 #define max_component(vec) max3(vec.x, vec.y, vec.z)
 
@@ -37,9 +35,9 @@ inline bool intersect_bbox(float3 pmin, float3 pmax, float3 oxinvdir, float3 inv
     return tmax >= tmin;
 }
 
-inline float2 fast_intersect_bbox(AABB bbox, float3 oxinvdir, float3 invdir, float t_min, float t_max){
-    float3 t1 = mad(bbox.min.xyz, invdir, oxinvdir);
-    float3 t2 = mad(bbox.max.xyz, invdir, oxinvdir);
+inline float2 fast_intersect_bbox(float3 pmin, float3 pmax, float3 oxinvdir, float3 invdir, float t_min, float t_max){
+    float3 t1 = mad(pmin, invdir, oxinvdir);
+    float3 t2 = mad(pmax, invdir, oxinvdir);
 
     float tmin = max_component(min(t1,t2));
     float tmax = min_component(max(t1,t2));
@@ -50,15 +48,36 @@ inline float2 fast_intersect_bbox(AABB bbox, float3 oxinvdir, float3 invdir, flo
     return (float2)(tmin, tmax);
 }
 
+/**
+Intersects the ray with the quantized bounds of all children of a wide node at once.
+Returns the entry distance of each child, or INFINITY if it is missed
+ */
+inline float8 intersect_wide_node(const WideBVHNode node, float3 oxinvdir, float3 invdir, float t_min, float t_max){
+    // 2^exponent, built directly as the bits of the float
+    const float3 scale = as_float3((convert_int3(node.exponent.xyz) + 127) << 23);
+    const float3 origin = (float3)(node.origin[0], node.origin[1], node.origin[2]);
+
+    const float8 tx1 = (origin.x + convert_float8(node.qmin_x) * scale.x) * invdir.x + oxinvdir.x;
+    const float8 tx2 = (origin.x + convert_float8(node.qmax_x) * scale.x) * invdir.x + oxinvdir.x;
+    const float8 ty1 = (origin.y + convert_float8(node.qmin_y) * scale.y) * invdir.y + oxinvdir.y;
+    const float8 ty2 = (origin.y + convert_float8(node.qmax_y) * scale.y) * invdir.y + oxinvdir.y;
+    const float8 tz1 = (origin.z + convert_float8(node.qmin_z) * scale.z) * invdir.z + oxinvdir.z;
+    const float8 tz2 = (origin.z + convert_float8(node.qmax_z) * scale.z) * invdir.z + oxinvdir.z;
+
+    const float8 tmin = max(max(min(tx1, tx2), min(ty1, ty2)), max(min(tz1, tz2), (float8)(t_min)));
+    const float8 tmax = min(min(max(tx1, tx2), max(ty1, ty2)), min(max(tz1, tz2), (float8)(t_max)));
+
+    return select((float8)(INFINITY), tmin, tmin <= tmax);
+}
+
 inline float intersect_triangle(
     const Ray ray,
-    const float3 v1,
-    const float3 v2,
-    const float3 v3
+    const Triangle triangle
     )
 {
-    float3 const e1 = v2 - v1;
-    float3 const e2 = v3 - v1;
+    float3 const v1 = triangle.v0.xyz;
+    float3 const e1 = triangle.e1.xyz;
+    float3 const e2 = triangle.e2.xyz;
     float3 const s1 = cross(ray.direction.xyz, e2);
     float const t_max = ray.direction.w;
     
@@ -102,13 +121,406 @@ inline float2 calculate_triangle_barycentrics(float3 p, float3 v0, float3 v1, fl
 }
 
 
+// Applies the affine transform with the rows 'm' to the point 'p'
+inline float3 transform_point(const float4* m, const float3 p){
+    const float4 v = (float4)(p, 1.0f);
+    return (float3)(dot(m[0], v), dot(m[1], v), dot(m[2], v));
+}
+
+// Applies the linear part of the affine transform with the rows 'm' to the direction 'd'
+inline float3 transform_direction(const float4* m, const float3 d){
+    return (float3)(dot(m[0].xyz, d), dot(m[1].xyz, d), dot(m[2].xyz, d));
+}
+
+// Moves the ray into the space of the instance. The direction is not normalized, so distances along the ray are the same in both spaces
+inline Ray transform_ray(const Instance* instance, const Ray ray){
+    Ray object_ray = ray;
+    object_ray.origin.xyz = transform_point(instance->world_to_object, ray.origin.xyz);
+    object_ray.direction.xyz = transform_direction(instance->world_to_object, ray.direction.xyz);
+    return object_ray;
+}
+
+// Writes the closest hit of the ray, with 'prim_id' as the face and 't_max' as the distance.
+// The traversal only reads the triangles, so this is the only fetch of the face and its vertices.
+// 'instance' is the instance that was hit when the vertices are in its space, or 0 when they are in world space
+inline void write_intersection(
+    IN_BUF(Face, faces),
+    IN_BUF(Vertex, vertices),
+    const Ray ray,
+    const Instance* instance,
+    const int hits,
+    const int prim_id,
+    const float t_max,
+    OUT_BUF(Intersection, intersection),
+    OUT_BUF(GeometricInfo, geometric_info)
+){
+    Intersection hit = {};
+    GeometricInfo info = {};
+    if (hits) {
+        const Face face = faces[prim_id];
+        const Vertex v0 = vertices[face.index.x];
+        const Vertex v1 = vertices[face.index.y];
+        const Vertex v2 = vertices[face.index.z];
+
+        const float3 hit_pos = ray.origin.xyz + ray.direction.xyz * t_max;
+        const float3 object_pos = instance ? transform_point(instance->world_to_object, hit_pos) : hit_pos;
+        const float2 uv = calculate_triangle_barycentrics(object_pos, v0.position.xyz, v1.position.xyz, v2.position.xyz);
+        float3 normal_shading = interpolate(GetVertexNormal(v0), GetVertexNormal(v1), GetVertexNormal(v2), uv);
+        const float2 tex_coord = interpolate(GetVertexUV(v0),GetVertexUV(v1),GetVertexUV(v2),uv);
+
+        // Normals move to world space with the inverse transpose, which is the transpose of the world to object rows
+        if (instance) {
+            const float4* m = instance->world_to_object;
+            normal_shading = normalize(m[0].xyz * normal_shading.x + m[1].xyz * normal_shading.y + m[2].xyz * normal_shading.z);
+        }
+
+        const float flip = dot(ray.direction.xyz, normal_shading) < 0.0f ? 1.0f : -1.0f;
+
+        hit.material_index = face.index.w;
+        info.position = (float4)(hit_pos, 0.0f);
+        info.normal = (float4)(normal_shading * flip, 0.0f);
+        info.uvwt = (float4)(uv.xy, 0.0f, t_max);
+    }else{
+        hit.material_index = -1;
+    }
+
+    info.incoming = (float4)(ray.direction.xyz, 0.0f);
+    
+    // save intersection info
+    hit.hit = hits;
+    hit.prim_index = prim_id;
+    intersection[0] = hit;
+    geometric_info[0] = info;
+}
+
 /**
 Based on shortstack bvh2 from RadeonRays SDK 2.0 
 Link: "https://github.com/GPUOpen-LibrariesAndSDKs/RadeonRays_SDK/blob/legacy-2.0/RadeonRays/src/kernels/CL/intersect_bvh2_short_stack.cl"
+Closest hit in the subtree below 'root'. Each node holds the bounds of both children, so a step is a single node fetch. Leaf children are intersected right away and never visited as nodes.
+'t_max', 'prim_id' and 'hits' are updated for every closer hit
+ */
+inline void intersect_subtree(
+    IN_BUF(BVHNode, nodes),
+    IN_BUF(Triangle, triangles),
+    const int root,
+    const Ray ray,
+    float* t_max,
+    int* prim_id,
+    int* hits
+){
+    // fixed size queue, for storing the nodes not yet taken when iterating through the tree
+    int queue[BVH_STACK_SIZE];
+
+    const float t_min = ray.origin.w;
+
+    const float3 invdir = safe_invdir(ray.direction.xyz);
+    const float3 origin = ray.origin.xyz;
+    const float3 oxinvdir = -origin * invdir;
+
+    int count = 0;
+    int next = root;
+
+    while (next != -1) {
+        const BVHNode node = nodes[next];
+
+        // test intersection for both children
+        const float2 s0 = fast_intersect_bbox(vload3(0, node.left_min), vload3(0, node.left_max), oxinvdir, invdir, t_min, *t_max);
+        const float2 s1 = fast_intersect_bbox(vload3(0, node.right_min), vload3(0, node.right_max), oxinvdir, invdir, t_min, *t_max);
+
+        bool traverse_left = (s0.x <= s0.y);
+        bool traverse_right = (s1.x <= s1.y);
+
+        // Leaf children hold the faces [index, index + count)
+        if (traverse_left && node.left_count > 0) {
+            for (int i = node.left; i < node.left + node.left_count; i++) {
+                // Check if the ray hit the contained triangle and store the distance in f if hit
+                float f = intersect_triangle(ray, triangles[i]);
+
+                // if the hit is closer than the currently closest hit
+                if (f < *t_max) {
+                    *t_max = f;
+                    *prim_id = i;
+                    *hits += 1;
+                }
+            }
+            traverse_left = false;
+        }
+        if (traverse_right && node.right_count > 0) {
+            for (int i = node.right; i < node.right + node.right_count; i++) {
+                float f = intersect_triangle(ray, triangles[i]);
+                if (f < *t_max) {
+                    *t_max = f;
+                    *prim_id = i;
+                    *hits += 1;
+                }
+            }
+            traverse_right = false;
+        }
+
+        // The leaves may have moved the closest hit in front of the internal children
+        traverse_left = traverse_left && (s0.x <= *t_max);
+        traverse_right = traverse_right && (s1.x <= *t_max);
+        const bool right_first = traverse_right && (s0.x > s1.x);
+
+        if (traverse_left || traverse_right){
+            int deffered = -1;
+
+            if (right_first || !traverse_left){
+                next = node.right;
+                deffered = node.left;
+            }else{
+                next = node.left;
+                deffered = node.right;
+            }
+
+            if (traverse_left && traverse_right){
+                queue[count++] = deffered;
+            }
+
+            continue;
+        }
+
+        // get the next node from the queue
+        next = count > 0 ? queue[--count] : -1;
+    }
+}
+
+/**
+Any hit in the subtree below 'root', up to the distance of the ray
+ */
+inline bool occluded_subtree(
+    IN_BUF(BVHNode, nodes),
+    IN_BUF(Triangle, triangles),
+    const int root,
+    const Ray ray
+){
+    // fixed size queue, for storing the nodes not yet taken when iterating through the tree
+    int queue[BVH_STACK_SIZE];
+
+    const float t_max = ray.direction.w;
+    const float t_min = ray.origin.w;
+
+    const float3 invdir = safe_invdir(ray.direction.xyz);
+    const float3 origin = ray.origin.xyz;
+    const float3 oxinvdir = -origin * invdir;
+
+    int count = 0;
+    int next = root;
+
+    while (next != -1){
+        const BVHNode node = nodes[next];
+
+        // test intersection for both children
+        const float2 s0 = fast_intersect_bbox(vload3(0, node.left_min), vload3(0, node.left_max), oxinvdir, invdir, t_min, t_max);
+        const float2 s1 = fast_intersect_bbox(vload3(0, node.right_min), vload3(0, node.right_max), oxinvdir, invdir, t_min, t_max);
+
+        bool traverse_left = (s0.x <= s0.y);
+        bool traverse_right = (s1.x <= s1.y);
+
+        // Any hit in a leaf child ends the traversal
+        if (traverse_left && node.left_count > 0) {
+            for (int i = node.left; i < node.left + node.left_count; i++) {
+                if (intersect_triangle(ray, triangles[i]) < t_max)
+                    return true;
+            }
+            traverse_left = false;
+        }
+        if (traverse_right && node.right_count > 0) {
+            for (int i = node.right; i < node.right + node.right_count; i++) {
+                if (intersect_triangle(ray, triangles[i]) < t_max)
+                    return true;
+            }
+            traverse_right = false;
+        }
+
+        const bool right_first = traverse_right && (s0.x > s1.x);
+
+        if (traverse_left || traverse_right){
+            int deffered = -1;
+
+            if (right_first || !traverse_left){
+                next = node.right;
+                deffered = node.left;
+            }else{
+                next = node.left;
+                deffered = node.right;
+            }
+
+            if (traverse_left && traverse_right){
+                queue[count++] = deffered;
+            }
+
+            continue;
+        }
+
+        // get the next node from the queue
+        next = count > 0 ? queue[--count] : -1;
+    }
+    return false;
+}
+
+/**
+Stackless version of intersect_subtree, going back up through the parents instead of popping a stack. Based on
+"Efficient Stack-less BVH Traversal for Ray Tracing" by Hapala et al. 2011, with the child order recomputed at the parent.
+The entry distance of a child only depends on t_min, so the parent orders its internal children the same way on every visit,
+and the child the traversal comes back from tells which of them is left. Leaf children are intersected when the node is entered from its parent.
+The parent of 'root' must be -1
+ */
+inline void intersect_subtree_stackless(
+    IN_BUF(BVHNode, nodes),
+    IN_BUF(int, parents),
+    IN_BUF(Triangle, triangles),
+    const int root,
+    const Ray ray,
+    float* t_max,
+    int* prim_id,
+    int* hits
+){
+    const float t_min = ray.origin.w;
+
+    const float3 invdir = safe_invdir(ray.direction.xyz);
+    const float3 origin = ray.origin.xyz;
+    const float3 oxinvdir = -origin * invdir;
+
+    int current = root;
+    // the child the traversal came back up from, -1 when the node is entered from its parent
+    int from = -1;
+
+    while (current != -1) {
+        const BVHNode node = nodes[current];
+
+        const float2 s0 = fast_intersect_bbox(vload3(0, node.left_min), vload3(0, node.left_max), oxinvdir, invdir, t_min, *t_max);
+        const float2 s1 = fast_intersect_bbox(vload3(0, node.right_min), vload3(0, node.right_max), oxinvdir, invdir, t_min, *t_max);
+
+        if (from == -1) {
+            if (s0.x <= s0.y && node.left_count > 0) {
+                for (int i = node.left; i < node.left + node.left_count; i++) {
+                    float f = intersect_triangle(ray, triangles[i]);
+                    if (f < *t_max) {
+                        *t_max = f;
+                        *prim_id = i;
+                        *hits += 1;
+                    }
+                }
+            }
+            if (s1.x <= s1.y && node.right_count > 0) {
+                for (int i = node.right; i < node.right + node.right_count; i++) {
+                    float f = intersect_triangle(ray, triangles[i]);
+                    if (f < *t_max) {
+                        *t_max = f;
+                        *prim_id = i;
+                        *hits += 1;
+                    }
+                }
+            }
+        }
+
+        const bool traverse_left = node.left_count == 0 && s0.x <= min(s0.y, *t_max);
+        const bool traverse_right = node.right_count == 0 && s1.x <= min(s1.y, *t_max);
+
+        // The near child is the nearest internal child, whether it is hit or not
+        const bool right_first = node.left_count > 0 || (node.right_count == 0 && s0.x > s1.x);
+        const int near_child = right_first ? node.right : node.left;
+        const int far_child = right_first ? node.left : node.right;
+        const bool traverse_near = right_first ? traverse_right : traverse_left;
+        const bool traverse_far = right_first ? traverse_left : traverse_right;
+
+        int next = -1;
+        if (from == -1) {
+            next = traverse_near ? near_child : (traverse_far ? far_child : -1);
+        }
+        else if (from == near_child) {
+            next = traverse_far ? far_child : -1;
+        }
+
+        if (next != -1) {
+            from = -1;
+            current = next;
+        }
+        else {
+            from = current;
+            current = parents[current];
+        }
+    }
+}
+
+/**
+Any hit version of intersect_subtree_stackless
+ */
+inline bool occluded_subtree_stackless(
+    IN_BUF(BVHNode, nodes),
+    IN_BUF(int, parents),
+    IN_BUF(Triangle, triangles),
+    const int root,
+    const Ray ray
+){
+    const float t_max = ray.direction.w;
+    const float t_min = ray.origin.w;
+
+    const float3 invdir = safe_invdir(ray.direction.xyz);
+    const float3 origin = ray.origin.xyz;
+    const float3 oxinvdir = -origin * invdir;
+
+    int current = root;
+    int from = -1;
+
+    while (current != -1){
+        const BVHNode node = nodes[current];
+
+        const float2 s0 = fast_intersect_bbox(vload3(0, node.left_min), vload3(0, node.left_max), oxinvdir, invdir, t_min, t_max);
+        const float2 s1 = fast_intersect_bbox(vload3(0, node.right_min), vload3(0, node.right_max), oxinvdir, invdir, t_min, t_max);
+
+        // Any hit in a leaf child ends the traversal
+        if (from == -1) {
+            if (s0.x <= s0.y && node.left_count > 0) {
+                for (int i = node.left; i < node.left + node.left_count; i++) {
+                    if (intersect_triangle(ray, triangles[i]) < t_max)
+                        return true;
+                }
+            }
+            if (s1.x <= s1.y && node.right_count > 0) {
+                for (int i = node.right; i < node.right + node.right_count; i++) {
+                    if (intersect_triangle(ray, triangles[i]) < t_max)
+                        return true;
+                }
+            }
+        }
+
+        const bool traverse_left = node.left_count == 0 && s0.x <= s0.y;
+        const bool traverse_right = node.right_count == 0 && s1.x <= s1.y;
+
+        const bool right_first = node.left_count > 0 || (node.right_count == 0 && s0.x > s1.x);
+        const int near_child = right_first ? node.right : node.left;
+        const int far_child = right_first ? node.left : node.right;
+        const bool traverse_near = right_first ? traverse_right : traverse_left;
+        const bool traverse_far = right_first ? traverse_left : traverse_right;
+
+        int next = -1;
+        if (from == -1) {
+            next = traverse_near ? near_child : (traverse_far ? far_child : -1);
+        }
+        else if (from == near_child) {
+            next = traverse_far ? far_child : -1;
+        }
+
+        if (next != -1) {
+            from = -1;
+            current = next;
+        }
+        else {
+            from = current;
+            current = parents[current];
+        }
+    }
+    return false;
+}
+
+/**
+Closest hit traversal of the binary BVH with a short stack
  */ 
 __kernel void intersect_bvh(
-    IN_BUF(Node, nodes),
-    IN_BUF(AABB, bboxes),
+    IN_BUF(BVHNode, nodes),
+    IN_BUF(Triangle, triangles),
     IN_BUF(Face, faces),
     IN_BUF(Vertex, vertices),
     IN_BUF(Ray, rays),
@@ -119,17 +531,118 @@ __kernel void intersect_bvh(
 ){
     const int id = get_global_id(0);
 
-    // fixed size queue, for storing the nodes not yet taken when iterating through the tree
-    int queue[MAX_DEPTH];
+    if (id < active_rays[0]) {
+        const Ray ray = rays[id];
+
+        float t_max = ray.direction.w;
+        int hits = 0;
+        int prim_id = -1;
+
+        intersect_subtree(nodes, triangles, 0, ray, &t_max, &prim_id, &hits);
+
+        write_intersection(faces, vertices, ray, 0, hits, prim_id, t_max, intersections + id, geometric_info + id);
+    }
+}
+
+/**
+Any hit traversal of the binary BVH with a short stack
+ */ 
+__kernel void occluded(
+    IN_BUF(BVHNode, nodes),
+    IN_BUF(Triangle, triangles),
+    IN_BUF(Ray, rays),
+    IN_VAL(uint, num_rays),
+    OUT_BUF(int, hits),
+    IN_BUF(uint, active_rays)
+){
+    const int id = get_global_id(0);
+
+    if (id < active_rays[0]){
+        hits[id] = occluded_subtree(nodes, triangles, 0, rays[id]) ? 1 : -1;
+    }
+}
+
+/**
+Closest hit traversal of the binary BVH without a stack, for trees deeper than BVH_STACK_SIZE
+ */
+__kernel void intersect_bvh_stackless(
+    IN_BUF(BVHNode, nodes),
+    IN_BUF(int, parents),
+    IN_BUF(Triangle, triangles),
+    IN_BUF(Face, faces),
+    IN_BUF(Vertex, vertices),
+    IN_BUF(Ray, rays),
+    IN_VAL(int, num_rays),
+    OUT_BUF(Intersection, intersections),
+    OUT_BUF(GeometricInfo, geometric_info),
+    IN_BUF(uint, active_rays)
+){
+    const int id = get_global_id(0);
 
     if (id < active_rays[0]) {
-        Ray ray = rays[id];
+        const Ray ray = rays[id];
 
         float t_max = ray.direction.w;
-        float t_min = ray.origin.w;
+        int hits = 0;
+        int prim_id = -1;
+
+        intersect_subtree_stackless(nodes, parents, triangles, 0, ray, &t_max, &prim_id, &hits);
+
+        write_intersection(faces, vertices, ray, 0, hits, prim_id, t_max, intersections + id, geometric_info + id);
+    }
+}
+
+/**
+Any hit traversal of the binary BVH without a stack
+ */
+__kernel void occluded_stackless(
+    IN_BUF(BVHNode, nodes),
+    IN_BUF(int, parents),
+    IN_BUF(Triangle, triangles),
+    IN_BUF(Ray, rays),
+    IN_VAL(uint, num_rays),
+    OUT_BUF(int, hits),
+    IN_BUF(uint, active_rays)
+){
+    const int id = get_global_id(0);
+
+    if (id < active_rays[0]){
+        hits[id] = occluded_subtree_stackless(nodes, parents, triangles, 0, rays[id]) ? 1 : -1;
+    }
+}
+
+/**
+Closest hit traversal of the two level BVH. The top level is traversed with a short stack, and for each instance hit the ray is moved into
+the space of its mesh and traced through the bottom level BVH of the mesh. The bottom levels are traced without a stack when 'stackless' is set
+ */
+__kernel void intersect_instances(
+    IN_BUF(BVHNode, top_nodes),
+    IN_BUF(Instance, instances),
+    IN_BUF(BVHNode, nodes),
+    IN_BUF(int, parents),
+    IN_BUF(Triangle, triangles),
+    IN_BUF(Face, faces),
+    IN_BUF(Vertex, vertices),
+    IN_VAL(int, stackless),
+    IN_BUF(Ray, rays),
+    IN_VAL(int, num_rays),
+    OUT_BUF(Intersection, intersections),
+    OUT_BUF(GeometricInfo, geometric_info),
+    IN_BUF(uint, active_rays)
+){
+    const int id = get_global_id(0);
+
+    int queue[BVH_STACK_SIZE];
+
+    if (id < active_rays[0]) {
+        const Ray ray = rays[id];
+
+        float t_max = ray.direction.w;
+        const float t_min = ray.origin.w;
 
         int hits = 0;
         int prim_id = -1;
+        int instance_id = -1;
 
         const float3 invdir = safe_invdir(ray.direction.xyz);
         const float3 origin = ray.origin.xyz;
@@ -137,133 +650,190 @@ __kernel void intersect_bvh(
 
         int count = 0;
         int next = 0;
-        Node node;
-
-        int depth = 0;
 
         while (next != -1) {
-            node = nodes[next];
-            //bbox = bboxes[next];
-            int left = node.left;
-            int right = node.right;
-
-            // If node is leaf
-            if (left == -1){
-                 // Fetch the vertices of the triangle
-                Face face = faces[right];
-                Vertex v0 = vertices[face.index.x];
-                Vertex v1 = vertices[face.index.y];
-                Vertex v2 = vertices[face.index.z];
+            const BVHNode node = top_nodes[next];
 
-                // Check if the ray hit the contained triangle and store the distance in f if hit
-                float f = intersect_triangle(ray, v0.position.xyz, v1.position.xyz, v2.position.xyz);
+            const float2 s0 = fast_intersect_bbox(vload3(0, node.left_min), vload3(0, node.left_max), oxinvdir, invdir, t_min, t_max);
+            const float2 s1 = fast_intersect_bbox(vload3(0, node.right_min), vload3(0, node.right_max), oxinvdir, invdir, t_min, t_max);
 
-                // if the hit is closer than the currently closest hit
-                if (f < t_max) {
-                    t_max = f;
-                    prim_id = right;
-                    hits += 1;
+            bool traverse_left = (s0.x <= s0.y);
+            bool traverse_right = (s1.x <= s1.y);
+
+            // Leaf children hold the instances [index, index + count)
+            for (int side = 0; side < 2; side++) {
+                const bool leaf = side == 0 ? (traverse_left && node.left_count > 0) : (traverse_right && node.right_count > 0);
+                if (!leaf)
+                    continue;
+
+                const int first = side == 0 ? node.left : node.right;
+                const int last = first + (side == 0 ? node.left_count : node.right_count);
+                for (int i = first; i < last; i++) {
+                    const Instance instance = instances[i];
+                    const Ray object_ray = transform_ray(&instance, ray);
+
+                    const int prev_hits = hits;
+                    if (stackless)
+                        intersect_subtree_stackless(nodes, parents, triangles, instance.root, object_ray, &t_max, &prim_id, &hits);
+                    else
+                        intersect_subtree(nodes, triangles, instance.root, object_ray, &t_max, &prim_id, &hits);
+                    if (hits != prev_hits)
+                        instance_id = i;
+                }
+            }
+            traverse_left = traverse_left && node.left_count == 0 && (s0.x <= t_max);
+            traverse_right = traverse_right && node.right_count == 0 && (s1.x <= t_max);
+            const bool right_first = traverse_right && (s0.x > s1.x);
+
+            if (traverse_left || traverse_right){
+                int deffered = -1;
+
+                if (right_first || !traverse_left){
+                    next = node.right;
+                    deffered = node.left;
+                }else{
+                    next = node.left;
+                    deffered = node.right;
                 }
 
-            }else{ // Node is internal
-                const AABB bbox_l = bboxes[left];
-                const AABB bbox_r = bboxes[right];
+                if (traverse_left && traverse_right){
+                    queue[count++] = deffered;
+                }
 
-                // test intersection for both childnodes
-                const float2 s0 = fast_intersect_bbox(bbox_l, oxinvdir, invdir, t_min, t_max);
-                const float2 s1 = fast_intersect_bbox(bbox_r, oxinvdir, invdir, t_min, t_max);
+                continue;
+            }
 
-                const bool traverse_left = (s0.x <= s0.y);
-                const bool traverse_right = (s1.x <= s1.y);
-                const bool right_first = traverse_right && (s0.x > s1.x);
+            next = count > 0 ? queue[--count] : -1;
+        }
 
-                if (traverse_left || traverse_right){
-                    int deffered = -1;
+        if (instance_id != -1) {
+            const Instance instance = instances[instance_id];
+            write_intersection(faces, vertices, ray, &instance, hits, prim_id, t_max, intersections + id, geometric_info + id);
+        }
+        else {
+            write_intersection(faces, vertices, ray, 0, hits, prim_id, t_max, intersections + id, geometric_info + id);
+        }
+    }
+}
 
-                    if (right_first || !traverse_left){
-                        next = right;
-                        deffered = left;
-                    }else{
-                        next = left;
-                        deffered = right;
-                    }
+/**
+Any hit traversal of the two level BVH
+ */
+__kernel void occluded_instances(
+    IN_BUF(BVHNode, top_nodes),
+    IN_BUF(Instance, instances),
+    IN_BUF(BVHNode, nodes),
+    IN_BUF(int, parents),
+    IN_BUF(Triangle, triangles),
+    IN_VAL(int, stackless),
+    IN_BUF(Ray, rays),
+    IN_VAL(uint, num_rays),
+    OUT_BUF(int, hits),
+    IN_BUF(uint, active_rays)
+){
+    const int id = get_global_id(0);
 
-                    if (traverse_left && traverse_right){
-                        queue[count++] = deffered;
-                    }
+    int queue[BVH_STACK_SIZE];
+
+    if (id < active_rays[0]){
+        const Ray ray = rays[id];
+
+        const float t_max = ray.direction.w;
+        const float t_min = ray.origin.w;
 
+        const float3 invdir = safe_invdir(ray.direction.xyz);
+        const float3 origin = ray.origin.xyz;
+        const float3 oxinvdir = -origin * invdir;
+
+        int count = 0;
+        int next = 0;
+
+        while (next != -1){
+            const BVHNode node = top_nodes[next];
+
+            const float2 s0 = fast_intersect_bbox(vload3(0, node.left_min), vload3(0, node.left_max), oxinvdir, invdir, t_min, t_max);
+            const float2 s1 = fast_intersect_bbox(vload3(0, node.right_min), vload3(0, node.right_max), oxinvdir, invdir, t_min, t_max);
+
+            bool traverse_left = (s0.x <= s0.y);
+            bool traverse_right = (s1.x <= s1.y);
+
+            for (int side = 0; side < 2; side++) {
+                const bool leaf = side == 0 ? (traverse_left && node.left_count > 0) : (traverse_right && node.right_count > 0);
+                if (!leaf)
                     continue;
+
+                const int first = side == 0 ? node.left : node.right;
+                const int last = first + (side == 0 ? node.left_count : node.right_count);
+                for (int i = first; i < last; i++) {
+                    const Instance instance = instances[i];
+                    const Ray object_ray = transform_ray(&instance, ray);
+
+                    const bool occluded = stackless ?
+                        occluded_subtree_stackless(nodes, parents, triangles, instance.root, object_ray) :
+                        occluded_subtree(nodes, triangles, instance.root, object_ray);
+                    if (occluded) {
+                        hits[id] = 1;
+                        return;
+                    }
                 }
             }
+            traverse_left = traverse_left && node.left_count == 0;
+            traverse_right = traverse_right && node.right_count == 0;
+            const bool right_first = traverse_right && (s0.x > s1.x);
+
+            if (traverse_left || traverse_right){
+                int deffered = -1;
+
+                if (right_first || !traverse_left){
+                    next = node.right;
+                    deffered = node.left;
+                }else{
+                    next = node.left;
+                    deffered = node.right;
+                }
 
-            // get the next node from the queue
-            next = count > 0 ? queue[--count] : -1;
-
-            // Make sure all threads are ready
-            //barrier(CLK_LOCAL_MEM_FENCE);
+                if (traverse_left && traverse_right){
+                    queue[count++] = deffered;
+                }
 
-            depth = max(count, depth);
-        }
+                continue;
+            }
 
-        Intersection hit = {};
-        GeometricInfo info = {};
-        if (hits) {
-            const Face face = faces[prim_id];
-            const Vertex v0 = vertices[face.index.x];
-            const Vertex v1 = vertices[face.index.y];
-            const Vertex v2 = vertices[face.index.z];
-
-            const float3 hit_pos = ray.origin.xyz + ray.direction.xyz * t_max;
-            const float2 uv = calculate_triangle_barycentrics(hit_pos, v0.position.xyz, v1.position.xyz, v2.position.xyz);
-            const float3 normal_shading = interpolate(GetVertexNormal(v0), GetVertexNormal(v1), GetVertexNormal(v2), uv);
-            const float2 tex_coord = interpolate(GetVertexUV(v0),GetVertexUV(v1),GetVertexUV(v2),uv);
-
-            const float flip = dot(ray.direction.xyz, normal_shading) < 0.0f ? 1.0f : -1.0f;
-
-            hit.material_index = face.index.w;
-            info.position = (float4)(hit_pos, 0.0f);
-            info.normal = (float4)(normal_shading * flip, 0.0f);
-            info.uvwt = (float4)(uv.xy, 0.0f, t_max);
-        }else{
-            hit.material_index = -1;
+            next = count > 0 ? queue[--count] : -1;
         }
-
-        info.incoming = (float4)(ray.direction.xyz, 0.0f);
-        
-        // save intersection info
-        hit.hit = hits;
-        hit.prim_index = prim_id;
-        intersections[id] = hit;
-        geometric_info[id] = info;
+        hits[id] = -1;
     }
-
 }
 
 /**
-Based on shortstack bvh2 from RadeonRays SDK 2.0 
-Link: "https://github.com/GPUOpen-LibrariesAndSDKs/RadeonRays_SDK/blob/legacy-2.0/RadeonRays/src/kernels/CL/intersect_bvh2_short_stack.cl"
- */ 
-__kernel void occluded(
-    IN_BUF(Node, nodes),
-    IN_BUF(AABB, bboxes),
+Traversal of the wide BVH. All children of a node are tested with one fetch, and the faces of the hit leaf children are intersected right away.
+The hit internal children are pushed farthest first, so the nearest is visited next
+ */
+__kernel void intersect_wide_bvh(
+    IN_BUF(WideBVHNode, nodes),
+    IN_BUF(Triangle, triangles),
     IN_BUF(Face, faces),
     IN_BUF(Vertex, vertices),
     IN_BUF(Ray, rays),
-    IN_VAL(uint, num_rays),
-    OUT_BUF(int, hits),
+    IN_VAL(int, num_rays),
+    OUT_BUF(Intersection, intersections),
+    OUT_BUF(GeometricInfo, geometric_info),
     IN_BUF(uint, active_rays)
 ){
     const int id = get_global_id(0);
 
-    // fixed size queue, for storing the nodes not yet taken when iterating through the tree
-    int queue[MAX_DEPTH];
+    // nodes not yet visited, with their entry distance
+    int stack[WIDE_STACK_SIZE];
+    float stack_t[WIDE_STACK_SIZE];
 
-    if (id < active_rays[0]){
-        // fetch ray data
+    if (id < active_rays[0]) {
         const Ray ray = rays[id];
 
         float t_max = ray.direction.w;
-        float t_min = ray.origin.w;
+        const float t_min = ray.origin.w;
+
+        int hits = 0;
+        int prim_id = -1;
 
         const float3 invdir = safe_invdir(ray.direction.xyz);
         const float3 origin = ray.origin.xyz;
@@ -272,61 +842,117 @@ __kernel void occluded(
         int count = 0;
         int next = 0;
 
-        while (next != -1){
-            const Node node = nodes[next];
+        while (next != -1) {
+            const WideBVHNode node = nodes[next];
+
+            float entry[BVH_MAX_WIDTH];
+            vstore8(intersect_wide_node(node, oxinvdir, invdir, t_min, t_max), 0, entry);
+
+            int child = node.child_base;
+            int first_face = node.face_base;
+            const int first = count;
+            for (int i = 0; i < BVH_MAX_WIDTH && node.meta[i] != 0; i++) {
+                const int meta = node.meta[i];
+                if (meta == WIDE_BVH_INTERNAL) {
+                    if (entry[i] <= t_max) {
+                        // Insert among the children of this node, keeping the nearest on top
+                        int j = count++;
+                        while (j > first && stack_t[j - 1] < entry[i]) {
+                            stack[j] = stack[j - 1];
+                            stack_t[j] = stack_t[j - 1];
+                            j--;
+                        }
+                        stack[j] = child;
+                        stack_t[j] = entry[i];
+                    }
+                    child++;
+                }
+                else {
+                    if (entry[i] <= t_max) {
+                        for (int f = first_face; f < first_face + meta; f++) {
+                            const float t = intersect_triangle(ray, triangles[f]);
+                            if (t < t_max) {
+                                t_max = t;
+                                prim_id = f;
+                                hits += 1;
+                            }
+                        }
+                    }
+                    first_face += meta;
+                }
+            }
 
-            const int left = node.left;
-            const int right = node.right;
+            // get the next node from the stack, skipping the nodes entered beyond the closest hit
+            next = -1;
+            while (count > 0 && next == -1) {
+                count--;
+                if (stack_t[count] <= t_max)
+                    next = stack[count];
+            }
+        }
 
-            if (left == -1){
-                 // Fetch the vertices of the triangle
-                Face face = faces[right];
-                Vertex v0 = vertices[face.index.x];
-                Vertex v1 = vertices[face.index.y];
-                Vertex v2 = vertices[face.index.z];
+        write_intersection(faces, vertices, ray, 0, hits, prim_id, t_max, intersections + id, geometric_info + id);
+    }
+}
 
-                // Check if the ray hit the contained triangle and store the distance in f if hit
-                float f = intersect_triangle(ray, v0.position.xyz, v1.position.xyz, v2.position.xyz);
+/**
+Any hit traversal of the wide BVH
+ */
+__kernel void occluded_wide_bvh(
+    IN_BUF(WideBVHNode, nodes),
+    IN_BUF(Triangle, triangles),
+    IN_BUF(Ray, rays),
+    IN_VAL(uint, num_rays),
+    OUT_BUF(int, hits),
+    IN_BUF(uint, active_rays)
+){
+    const int id = get_global_id(0);
 
-                // if the
-                if (f < t_max) {
-                    hits[id] = 1;
-                    return;
-                }
-            }else{
-                const AABB bbox_l = bboxes[left];
-                const AABB bbox_r = bboxes[right];
-
-                // test intersection for both childnodes
-                const float2 s0 = fast_intersect_bbox(bbox_l, oxinvdir, invdir, t_min, t_max);
-                const float2 s1 = fast_intersect_bbox(bbox_r, oxinvdir, invdir, t_min, t_max);
-
-                const bool traverse_left = (s0.x <= s0.y);
-                const bool traverse_right = (s1.x <= s1.y);
-                const bool right_first = traverse_right && (s0.x > s1.x);
-
-                if (traverse_left || traverse_right){
-                    int deffered = -1;
-
-                    if (right_first || !traverse_left){
-                        next = right;
-                        deffered = left;
-                    }else{
-                        next = left;
-                        deffered = right;
-                    }
+    int stack[WIDE_STACK_SIZE];
 
-                    if (traverse_left && traverse_right){
-                        queue[count++] = deffered;
-                    }
+    if (id < active_rays[0]){
+        const Ray ray = rays[id];
 
-                    continue;
+        const float t_max = ray.direction.w;
+        const float t_min = ray.origin.w;
+
+        const float3 invdir = safe_invdir(ray.direction.xyz);
+        const float3 origin = ray.origin.xyz;
+        const float3 oxinvdir = -origin * invdir;
+
+        int count = 0;
+        int next = 0;
+
+        while (next != -1){
+            const WideBVHNode node = nodes[next];
+
+            float entry[BVH_MAX_WIDTH];
+            vstore8(intersect_wide_node(node, oxinvdir, invdir, t_min, t_max), 0, entry);
+
+            int child = node.child_base;
+            int first_face = node.face_base;
+            for (int i = 0; i < BVH_MAX_WIDTH && node.meta[i] != 0; i++) {
+                const int meta = node.meta[i];
+                if (meta == WIDE_BVH_INTERNAL) {
+                    if (entry[i] <= t_max)
+                        stack[count++] = child;
+                    child++;
+                }
+                else {
+                    if (entry[i] <= t_max) {
+                        for (int f = first_face; f < first_face + meta; f++) {
+                            if (intersect_triangle(ray, triangles[f]) < t_max) {
+                                hits[id] = 1;
+                                return;
+                            }
+                        }
+                    }
+                    first_face += meta;
                 }
             }
 
-            // get the next node from the queue
-            next = count > 0 ? queue[--count] : -1;
+            next = count > 0 ? stack[--count] : -1;
         }
         hits[id] = -1;
     }
-}
\ No newline at end of file
+}
@@ -1,9 +1,9 @@
 #include "commonCL.h"
+#include "mortonCL.h"
+#include "radixsortCL.h"
 
-typedef struct morton_key {
-	ulong code;
-	uint index;
-} morton_key;
+// Binary BVH built on the device as a LBVH [Karras 2012]. Internal nodes are stored in [0, n-1) with the root at 0, followed by the n leaves.
+// Leaves hold a single face, with node.left = -1 and node.right = the index of the face in the input order.
 
 AABB bbox_union(AABB a, AABB b){
 	AABB bbox = {};
@@ -12,46 +12,6 @@ AABB bbox_union(AABB a, AABB b){
 	return bbox;
 }
 
-inline ulong SplitBy3(ulong x)
-{
-	x &= 0x1fffff; // we only look at the first 21 bits
-	x = (x | x << 32) & 0x1f00000000ffff;
-	x = (x | x << 16) & 0x1f0000ff0000ff;
-	x = (x | x << 8) & 0x100f00f00f00f00f;
-	x = (x | x << 4) & 0x10c30c30c30c30c3;
-	x = (x | x << 2) & 0x1249249249249249;
-
-	return x;
-}
-
-inline ulong MortonCode(float3 p) {
-
-	if (p.x > 1 || p.x < -0.0f)
-		printf("FAIL X! [%f]\n", p.x);
-
-	if (p.y > 1 || p.y < -0.0f)
-		printf("FAIL Y! [%f]\n", p.y);
-
-	if (p.z > 1 || p.z < -0.0f)
-		printf("FAIL Z! [%f]\n", p.z);
-
-	// points must be in the range [0,1]
-	//assert(p[0] <= 1 && p[0] >= 0); // x-component out of range [0,1]
-	//assert(p[1] <= 1 && p[1] >= 0); // y-component out of range [0,1]
-	//assert(p[2] <= 1 && p[2] >= 0); // z-component out of range [0,1]
-
-	// project the normalized values onto the range of 21 bits
-	float3 tmp = p * (float)(0x1fffff);
-
-	ulong x = SplitBy3((ulong)(tmp.x));
-	ulong y = SplitBy3((ulong)(tmp.y));
-	ulong z = SplitBy3((ulong)(tmp.z));
-
-	// interleave the bits from the 3 dimensions
-	return x | y << 1 | z << 2;
-
-}
-
 __kernel void prepare_geometry_data(
 	IN_VAL(uint, num_vertices),
 	IN_VAL(uint, num_faces),
@@ -81,230 +41,76 @@ __kernel void prepare_geometry_data(
 	}
 }
 
-#define WORKGROUP_SIZE 32
+#define BOUNDS_GROUP_SIZE 256
 
-__attribute__((work_group_size_hint(WORKGROUP_SIZE, 1, 1)))
+// Reduces the bounds to one AABB per work group, in 'group_bounds'.
+// Launched over the faces with several work groups, and then with a single work group over the bounds of the groups
+__attribute__((reqd_work_group_size(BOUNDS_GROUP_SIZE, 1, 1)))
 __kernel void calc_scene_bounds(
 	IN_VAL(uint, N),
 	IN_BUF(AABB, bounds),
-	OUT_BUF(float3, scene_bounds) // [p_min, p_max]
+	OUT_BUF(AABB, group_bounds)
 ) {
-	__local float3 min_array[WORKGROUP_SIZE];
-	__local float3 max_array[WORKGROUP_SIZE];
+	__local float3 min_array[BOUNDS_GROUP_SIZE];
+	__local float3 max_array[BOUNDS_GROUP_SIZE];
 
-	const uint id = get_global_id(0);
 	const uint id_local = get_local_id(0);
 
-	const uint stride = N / WORKGROUP_SIZE + (N % WORKGROUP_SIZE > 0);
-	const uint start = stride * id_local;
-	const uint end = min(start + stride, N);
-
 	float3 p_min = (float3)(INFINITY);
 	float3 p_max = (float3)(-INFINITY);
-
-	for (uint i = start; i < end; i++) {
-		AABB bbox = bounds[i];
+	for (uint i = get_global_id(0); i < N; i += get_global_size(0)) {
+		const AABB bbox = bounds[i];
 		p_min = min(p_min, bbox.min.xyz);
 		p_max = max(p_max, bbox.max.xyz);
 	}
-
 	min_array[id_local] = p_min;
 	max_array[id_local] = p_max;
-
 	barrier(CLK_LOCAL_MEM_FENCE);
 
-	for (uint offset = WORKGROUP_SIZE / 2; offset > 0; offset >>= 1) {
+	for (uint offset = BOUNDS_GROUP_SIZE / 2; offset > 0; offset >>= 1) {
 		if (id_local < offset) {
 			min_array[id_local] = min(min_array[id_local], min_array[id_local + offset]);
 			max_array[id_local] = max(max_array[id_local], max_array[id_local + offset]);
 		}
+		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
-	barrier(CLK_LOCAL_MEM_FENCE);
-
-	if (id == 0) {
-		scene_bounds[0] = min_array[0];
-		scene_bounds[1] = max_array[0];
-		printf("Scene Bounds: [%f,%f,%f][%f,%f,%f]\n", min_array[0].x,min_array[0].y,min_array[0].z,max_array[0].x,max_array[0].y,max_array[0].z);
+	if (id_local == 0) {
+		AABB bbox = {};
+		bbox.min = (float4)(min_array[0], 0.0f);
+		bbox.max = (float4)(max_array[0], 0.0f);
+		group_bounds[get_group_id(0)] = bbox;
 	}
-
 }
 
 __kernel void generate_morton_codes(
 	IN_VAL(uint, N),
 	IN_BUF(float3, centers),
-	IN_BUF(float3, bounds),
+	IN_BUF(AABB, scene_bounds),
 	OUT_BUF(morton_key, codes)
 ) {
-	const int id = get_global_id(0);
+	const uint id = get_global_id(0);
 
 	// Check that the id is in range, to not overflow any buffers.
 	if (id < N) {
+		const float3 p_min = scene_bounds[0].min.xyz;
+		const float3 diagonal = scene_bounds[0].max.xyz - p_min;
 
-		// Load global bounds for the scene into stack
-		const float3 p_min = bounds[0];
-		const float3 p_max = bounds[1];
-		const float3 center = centers[id];
-
-		// Calculate the scale and transform, to map the positions into the range [0.0,1.0]
-		const float3 diagonal = p_max - p_min;
-		const float scale = 1.0f / max(diagonal.x, max(diagonal.y, diagonal.z));
-		const float3 transform = -p_min * scale;
+		// Map the centers into the range [0,1], as the CPU builder. Flat dimensions all map to 0
+		const float3 scale = (float3)(
+			diagonal.x > 0.0f ? 1.0f / diagonal.x : 0.0f,
+			diagonal.y > 0.0f ? 1.0f / diagonal.y : 0.0f,
+			diagonal.z > 0.0f ? 1.0f / diagonal.z : 0.0f);
+		const float3 p = clamp((centers[id] - p_min) * scale, 0.0f, 1.0f);
 
-		// calculate the morton code
-		const float3 p = center * scale + transform;
 		morton_key key = {};
 		key.code = MortonCode(p);
 		key.index = id;
-
-		// Save result
 		codes[id] = key;
 	}
 
 }
 
-#define SORT_GROUP_SIZE 64
-#define BYTE_MASK 0xff
-#define BYTE_RANGE 256
-
-inline uint RadixByte(ulong x, uint shift) {
-	return (x >> shift) & BYTE_MASK;
-}
-
-__attribute__((work_group_size_hint(SORT_GROUP_SIZE, 1, 1)))
-__kernel void sort_codes(
-	IN_VAL(uint, N),
-	IN_VAL(uint, shift),
-	IN_BUF(morton_key, codes),
-	OUT_BUF(morton_key, codes_sorted)
-) {
-	const uint id = get_global_id(0);
-	const uint id_local = get_local_id(0);
-
-	const uint stride = N / SORT_GROUP_SIZE + (N % SORT_GROUP_SIZE > 0) + 1;
-	const uint start = stride * id_local;
-	const uint end = min(start + stride, N);
-
-	//printf("id: %d, range[%d,%d], N: %d\n", id, start, end, N);
-
-	volatile __local uint count_global[BYTE_RANGE];
-	__local uint offset_global[BYTE_RANGE];
-
-	if (id == 0) {
-		for (uint i = 0; i < BYTE_RANGE; i++) {
-			count_global[i] = 0;
-		}
-	}
-
-	uint count_table[BYTE_RANGE];
-	for (uint i = 0; i < BYTE_RANGE; i++) {
-		count_table[i] = 0;
-	}
-
-	for (uint i = start; i < end; i++) {
-		morton_key key = codes[i];
-		uint prefix = RadixByte(key.code, shift);
-		count_table[prefix]++;
-	}
-
-	// calculate local offsets
-	uint offset_table[BYTE_RANGE];
-	for (uint i = 0; i < BYTE_RANGE; i++) {
-		offset_table[i] = atomic_add(&count_global[i], count_table[i]);
-	}
-
-	barrier(CLK_LOCAL_MEM_FENCE);
-
-	// calculate global offsets of each key
-	if (id == 0) {
-		offset_global[0] = 0;
-		for (uint i = 1; i < BYTE_RANGE; i++) {
-			offset_global[i] = offset_global[i - 1] + count_global[i - 1];
-			//printf("index: %d, count: %d, offset: %d\n", i, count_global[i], offset_global[i]);
-		}
-	}
-
-	barrier(CLK_LOCAL_MEM_FENCE);
-
-	// Add global offset to local offset
-	for (uint i = 0; i < BYTE_RANGE; i++) {
-		offset_table[i] += offset_global[i];
-		//printf("index: %d, offset: %d\n", i, offset_table[i]);
-	}
-
-	for (uint i = start; i < end; i++) {
-		morton_key key = codes[i];
-		uint prefix = RadixByte(key.code, shift);
-		uint offset = offset_table[prefix]++;
-		codes_sorted[offset] = key;
-	}
-
-}
-
-inline int longest_common_prefix(__global morton_key const* restrict morton_keys, int num_primitives, int i0, int i1) {
-	// select left and right 
-	int left = min(i0, i1);
-	int right = max(i0, i1);
-
-	// check the left and right is within the range of the primitives
-	if (left < 0 || right >= num_primitives) {
-		return -1;
-	}
-
-	// Load codes from buffer
-	ulong left_code = morton_keys[left].code;
-	ulong right_code = morton_keys[right].code;
-
-	// in case the codes are the same, find common prefix for the indices instead.
-	return left_code != right_code ? clz(left_code ^ right_code) : (64 + clz(left ^ right));
-}
-
-inline int2 find_span(__global morton_key const* restrict keys, int num_primitives, int index) {
-	// direction for the range
-	int d = sign((float)(longest_common_prefix(keys, num_primitives, index, index + 1) - longest_common_prefix(keys, num_primitives, index, index - 1)));
-
-	int delta_min = longest_common_prefix(keys, num_primitives, index, index - d);
-
-	// Max rough estimate for far end
-	int lmax = 2;
-	while (longest_common_prefix(keys, num_primitives, index, index + lmax * d) > delta_min)
-		lmax *= 2;
-
-	// Search back for the exact bound in the span
-	int l = 0;
-	int t = lmax;
-	do {
-		t /= 2;
-		if (longest_common_prefix(keys, num_primitives, index, index + (l + t) * d) > delta_min) {
-			l = l + t;
-		}
-	} while (t > 1);
-
-	return (int2)(min(index, index + l * d), max(index, index + l * d));
-}
-
-inline int find_split(__global morton_key const* restrict keys, int num_primitives, int2 span) {
-	int left = span.x;
-	int right = span.y;
-
-	int num_common = longest_common_prefix(keys, num_primitives, left, right);
-
-	do {
-		// propose new split in the middle of the range [left,right]
-		int split = (right + left) / 2;
-
-		if (longest_common_prefix(keys, num_primitives, left, split) > num_common) {
-			left = split;
-		}
-		else {
-			right = split;
-		}
-
-	} while (right > left + 1);
-
-	return left;
-}
-
 __kernel void generate_hierachy(
 	IN_VAL(uint, num_primitives),
 	IN_BUF(morton_key, codes),
@@ -318,9 +124,15 @@ __kernel void generate_hierachy(
 	if (id < num_primitives) {
 		// Have all the leaves in the back half of the buffer
 		const uint leaf_index = (num_primitives - 1) + id;
+		const uint face = codes[id].index;
 		nodes[leaf_index].left = -1;
-		nodes[leaf_index].right = codes[id].index;
-		nodes_bboxes[leaf_index] = bboxes[id];
+		nodes[leaf_index].right = face;
+		nodes_bboxes[leaf_index] = bboxes[face];
+	}
+
+	// The root has no parent. With a single face it is the leaf
+	if (id == 0) {
+		nodes[0].parent = -1;
 	}
 
 	// Create internal nodes
@@ -343,35 +155,235 @@ __kernel void generate_hierachy(
 
 }
 
+// Bounds of the internal nodes, bottom up from the leaves. The second work item to reach a node computes it, so both children are done.
+// 'flags' has one zeroed counter for each internal node
 __kernel void refit_bounds(
 	IN_VAL(uint, num_primitives),
 	IN_BUF(Node, nodes),
-	OUT_BUF(AABB, bounds),
-	OUT_BUF(uint, flags)
+	__global volatile AABB* bounds,
+	__global volatile uint* flags
 ) {
 	const uint id = get_global_id(0);
 
 	if (id < num_primitives){
-		uint index = (num_primitives - 1) + id;
+		int index = nodes[(num_primitives - 1) + id].parent;
 
-		do {
+		while (index != -1) {
+			// Publish the child before signalling the parent, and read the child of the other work item after
+			write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			if (atomic_inc(flags + index) == 0)
+				break;
+			read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+			bounds[index] = bbox_union(bounds[nodes[index].left], bounds[nodes[index].right]);
 			index = nodes[index].parent;
+		}
+	}
 
-			if (atomic_cmpxchg(flags + index, 0, 1) == 1){
-				int child_left = nodes[index].left;
-				int child_right = nodes[index].right;
+}
+
+// SAH costs of traversing a node and intersecting a face, as used by the CPU builders
+#define TRAVERSAL_COST 1.0f
+#define INTERSECTION_COST 1.0f
+
+float bbox_area(AABB bbox){
+	const float3 d = bbox.max.xyz - bbox.min.xyz;
+	return 2.0f * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+
+__kernel void compute_parents(
+	IN_VAL(uint, num_nodes),
+	OUT_BUF(Node, nodes)
+){
+	const uint id = get_global_id(0);
+
+	if (id < num_nodes){
+		const int left = nodes[id].left;
+		const int right = nodes[id].right;
+		if (left >= 0){
+			nodes[left].parent = id;
+			nodes[right].parent = id;
+		}
+		if (id == 0){
+			nodes[0].parent = -1;
+		}
+	}
+}
 
-				AABB bbox = bbox_union(bounds[child_left], bounds[child_right]);
-				//printf("id: %d,idx: %d\n", id, index);
+/*
+Rebuilds the treelet below 'root' in the topology with the lowest SAH cost, and updates the bounds and cost of its nodes.
+Same algorithm as TreeletRestructure::optimize_treelet, with the recursive rebuild done with an explicit stack
+*/
+void optimize_treelet(const int root, __global volatile Node* nodes, __global volatile AABB* bboxes, __global volatile float* costs){
+	int leaves[TREELET_SIZE];
+	int internals[TREELET_SIZE - 1];
+	int num_leaves = 2;
+	int num_internals = 1;
+	leaves[0] = nodes[root].left;
+	leaves[1] = nodes[root].right;
+	internals[0] = root;
+
+	// Expand the internal treelet leaf with the largest area, until the treelet is full
+	while (num_leaves < TREELET_SIZE){
+		int best = -1;
+		float best_area = -1.0f;
+		for (int i = 0; i < num_leaves; i++){
+			const float area = bbox_area(bboxes[leaves[i]]);
+			if (nodes[leaves[i]].left >= 0 && area > best_area){
+				best_area = area;
+				best = i;
+			}
+		}
+		if (best == -1)
+			break;
+
+		const int expanded = leaves[best];
+		internals[num_internals++] = expanded;
+		leaves[best] = nodes[expanded].left;
+		leaves[num_leaves++] = nodes[expanded].right;
+	}
+
+	const float cost_current = TRAVERSAL_COST * bbox_area(bboxes[root]) + costs[nodes[root].left] + costs[nodes[root].right];
+	if (num_leaves < 3){
+		costs[root] = cost_current;
+		return;
+	}
 
-				bounds[index] = bbox;
+	// Bounds and optimal cost of every subset of the treelet leaves
+	AABB subset_bounds[1 << TREELET_SIZE];
+	float subset_costs[1 << TREELET_SIZE];
+	uchar partitions[1 << TREELET_SIZE];
 
-				//printf("idx: %d, l:%d, r:%d, p:%d, bound[%f,%f,%f][%f,%f,%f]\n", index, child_left, child_right, nodes[index].parent, bbox.min.x,bbox.min.y,bbox.min.z,bbox.max.x,bbox.max.y,bbox.max.z);
+	for (int i = 0; i < num_leaves; i++){
+		subset_bounds[1 << i] = bboxes[leaves[i]];
+		subset_costs[1 << i] = costs[leaves[i]];
+	}
+
+	const uint full = (1u << num_leaves) - 1;
+	for (uint set = 1; set <= full; set++){
+		const uint lowest = set & (0u - set);
+		if (set == lowest)
+			continue;
+
+		subset_bounds[set] = bbox_union(subset_bounds[lowest], subset_bounds[set ^ lowest]);
+
+		// Only partitions with the lowest leaf on the left are tried, as the sides are symmetric
+		float best = INFINITY;
+		uint best_partition = lowest;
+		for (uint left = (set - 1) & set; left > 0; left = (left - 1) & set){
+			if ((left & lowest) == 0)
+				continue;
+			const float cost = subset_costs[left] + subset_costs[set ^ left];
+			if (cost < best){
+				best = cost;
+				best_partition = left;
+			}
+		}
+
+		subset_costs[set] = TRAVERSAL_COST * bbox_area(subset_bounds[set]) + best;
+		partitions[set] = (uchar)best_partition;
+	}
+
+	if (subset_costs[full] >= cost_current * (1.0f - 1e-5f)){
+		costs[root] = cost_current;
+		return;
+	}
+
+	// The root is the first internal node used, so it keeps its index
+	uint stack_set[TREELET_SIZE];
+	int stack_node[TREELET_SIZE];
+	int sp = 0;
+	int next_internal = 1;
+	stack_set[sp] = full;
+	stack_node[sp++] = root;
+
+	while (sp > 0){
+		sp--;
+		const uint set = stack_set[sp];
+		const int index = stack_node[sp];
+		const uint sides[2] = { partitions[set], set ^ partitions[set] };
+		int children[2];
+
+		for (int k = 0; k < 2; k++){
+			if ((sides[k] & (sides[k] - 1)) == 0){
+				children[k] = leaves[31 - clz(sides[k])];
 			}else{
-				break;
+				children[k] = internals[next_internal++];
+				stack_set[sp] = sides[k];
+				stack_node[sp++] = children[k];
 			}
-			
-		} while(index != 0);
+			nodes[children[k]].parent = index;
+		}
+
+		nodes[index].left = children[0];
+		nodes[index].right = children[1];
+		bboxes[index] = subset_bounds[set];
+		costs[index] = subset_costs[set];
+	}
+}
+
+/*
+One pass of treelet restructuring. Every leaf walks up the tree, and the second work item to reach a node restructures the treelet below it, so both subtrees are done.
+'flags' must be zero before each pass, and the parents set by compute_parents before the first
+*/
+__kernel void restructure_treelets(
+	IN_VAL(uint, num_nodes),
+	__global volatile Node* nodes,
+	__global volatile AABB* bboxes,
+	__global volatile float* costs,
+	__global volatile uint* flags
+){
+	const uint id = get_global_id(0);
+
+	if (id < num_nodes && nodes[id].left < 0){
+		costs[id] = INTERSECTION_COST * (float)(-nodes[id].left) * bbox_area(bboxes[id]);
+
+		int index = nodes[id].parent;
+		while (index != -1){
+			// Publish the subtree before signalling the parent, and read the subtree of the other work item after
+			write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			if (atomic_inc(flags + index) == 0)
+				break;
+			read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+			optimize_treelet(index, nodes, bboxes, costs);
+			index = nodes[index].parent;
+		}
 	}
+}
+
+// Stores the bounds of 'child' in a side of a merged node, and references it as a leaf of its faces or as an internal node
+inline void merge_child(__global const Node* nodes, __global const AABB* bboxes, const int child, float* pmin, float* pmax, int* index, int* count){
+	const AABB bbox = bboxes[child];
+	vstore3(bbox.min.xyz, 0, pmin);
+	vstore3(bbox.max.xyz, 0, pmax);
+
+	const Node node = nodes[child];
+	*index = node.left < 0 ? node.right : child;
+	*count = node.left < 0 ? -node.left : 0;
+}
 
-}
\ No newline at end of file
+/*
+Merges each internal node with the bounds of its children into a BVHNode at the same index, as the internal nodes are [0, n-1).
+A single face is the root leaf, and is stored as both children of the root. The parent of each node is stored for the stackless traversal
+*/
+__kernel void merge_nodes(
+	IN_VAL(uint, num_primitives),
+	IN_BUF(Node, nodes),
+	IN_BUF(AABB, bboxes),
+	OUT_BUF(BVHNode, merged),
+	OUT_BUF(int, parents)
+){
+	const uint id = get_global_id(0);
+
+	if (id < max(num_primitives - 1, 1u)){
+		const int left = num_primitives > 1 ? nodes[id].left : 0;
+		const int right = num_primitives > 1 ? nodes[id].right : 0;
+
+		BVHNode node;
+		merge_child(nodes, bboxes, left, node.left_min, node.left_max, &node.left, &node.left_count);
+		merge_child(nodes, bboxes, right, node.right_min, node.right_max, &node.right, &node.right_count);
+		merged[id] = node;
+		parents[id] = num_primitives > 1 ? nodes[id].parent : -1;
+	}
+}
@@ -0,0 +1,213 @@
+#include "commonCL.h"
+#include "mortonCL.h"
+#include "radixsortCL.h"
+
+// Binary light tree built on the device as a LBVH [Karras 2012]. Internal nodes are stored in [0, n-1) with the root at 0, followed by the n leaves.
+// Leaves hold a single light and reference the lights in morton order.
+
+#define BOUNDS_GROUP_SIZE 256
+
+// Same as LightTree::union_bcone. Cones are stored as (axis, theta_o)
+inline float4 union_cone(float4 a, float4 b) {
+	if (b.w > a.w) {
+		const float4 tmp = a;
+		a = b;
+		b = tmp;
+	}
+	// a already covers all directions
+	if (a.w >= PI)
+		return a;
+
+	const float d = clamp(dot(a.xyz, b.xyz), -1.0f, 1.0f);
+	if (d >= 1.0f)
+		return a;
+
+	const float theta_d = acos(d);
+	if (min(theta_d + b.w, PI) <= a.w)
+		return a;
+
+	const float theta_o = (a.w + theta_d + b.w) * 0.5f;
+	if (theta_o >= PI)
+		return (float4)(a.xyz, PI);
+
+	// Rotate a.axis towards b.axis by theta_r in the plane spanned by the two axis
+	const float theta_r = theta_o - a.w;
+	const float3 ortho = b.xyz - a.xyz * d;
+	const float ortho_length = length(ortho);
+	if (ortho_length <= 0.0f) // opposite axis, any rotation plane works. Be conservative
+		return (float4)(a.xyz, PI);
+
+	const float3 axis = normalize(a.xyz * cos(theta_r) + ortho * (sin(theta_r) / ortho_length));
+	return (float4)(axis, theta_o);
+}
+
+// Same bounds as LightTree::calc_light_bounds
+__kernel void prepare_lights(
+	IN_VAL(uint, num_lights),
+	IN_BUF(Light, lights),
+	OUT_BUF(LightTreeNode, leaves),
+	OUT_BUF(float3, centers)
+) {
+	const uint id = get_global_id(0);
+	if (id < num_lights) {
+		const Light light = lights[id];
+
+		const float3 t = light.tangent.xyz;
+		const float3 b = light.bitangent.xyz;
+		const float area = length(cross(t, b)) * 0.5f;
+
+		const float3 p0 = light.position.xyz;
+		const float3 p1 = p0 + t;
+		const float3 p2 = p0 + b;
+		const float3 pmin = min(min(p0, p1), p2);
+		const float3 pmax = max(max(p0, p1), p2);
+
+		LightTreeNode leaf;
+		leaf.pmin = (float4)(pmin, 0.0f);
+		leaf.pmax = (float4)(pmax, 0.0f);
+		leaf.axis = (float4)(normalize(light.direction.xyz), 0.0f);
+		leaf.energy = (float4)(light.intensity.xyz * area, light.direction.w);
+		leaf.left = 0;
+		leaf.right = 1;
+		leaf.type = 0;
+		leaf.padding = 0;
+
+		leaves[id] = leaf;
+		centers[id] = (pmin + pmax) * 0.5f;
+	}
+}
+
+// Bounds of the light centers. Must be launched as a single work group of BOUNDS_GROUP_SIZE work items
+__attribute__((reqd_work_group_size(BOUNDS_GROUP_SIZE, 1, 1)))
+__kernel void calc_centroid_bounds(
+	IN_VAL(uint, num_lights),
+	IN_BUF(float3, centers),
+	OUT_BUF(float3, bounds)
+) {
+	__local float3 min_array[BOUNDS_GROUP_SIZE];
+	__local float3 max_array[BOUNDS_GROUP_SIZE];
+
+	const uint id = get_local_id(0);
+
+	float3 pmin = (float3)(INFINITY);
+	float3 pmax = (float3)(-INFINITY);
+	for (uint i = id; i < num_lights; i += BOUNDS_GROUP_SIZE) {
+		pmin = min(pmin, centers[i]);
+		pmax = max(pmax, centers[i]);
+	}
+	min_array[id] = pmin;
+	max_array[id] = pmax;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint offset = BOUNDS_GROUP_SIZE / 2; offset > 0; offset >>= 1) {
+		if (id < offset) {
+			min_array[id] = min(min_array[id], min_array[id + offset]);
+			max_array[id] = max(max_array[id], max_array[id + offset]);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (id == 0) {
+		bounds[0] = min_array[0];
+		bounds[1] = max_array[0];
+	}
+}
+
+__kernel void generate_light_codes(
+	IN_VAL(uint, num_lights),
+	IN_BUF(float3, centers),
+	IN_BUF(float3, bounds),
+	OUT_BUF(morton_key, codes)
+) {
+	const uint id = get_global_id(0);
+	if (id < num_lights) {
+		const float3 pmin = bounds[0];
+		const float3 diagonal = bounds[1] - pmin;
+		// flat dimensions all map to 0
+		const float3 scale = (float3)(
+			diagonal.x > 0.0f ? 1.0f / diagonal.x : 0.0f,
+			diagonal.y > 0.0f ? 1.0f / diagonal.y : 0.0f,
+			diagonal.z > 0.0f ? 1.0f / diagonal.z : 0.0f);
+		const float3 p = clamp((centers[id] - pmin) * scale, 0.0f, 1.0f);
+
+		morton_key key;
+		key.code = MortonCode(p);
+		key.index = id;
+		codes[id] = key;
+	}
+}
+
+// Links the internal nodes and writes the leaves and lights in morton order
+__kernel void generate_light_hierarchy(
+	IN_VAL(uint, num_lights),
+	IN_BUF(morton_key, codes),
+	IN_BUF(LightTreeNode, leaves),
+	IN_BUF(Light, lights),
+	OUT_BUF(LightTreeNode, nodes),
+	OUT_BUF(int, parents),
+	OUT_BUF(Light, lights_sorted)
+) {
+	const int id = get_global_id(0);
+	const int n = num_lights;
+
+	if (id < n) {
+		const uint light = codes[id].index;
+		LightTreeNode leaf = leaves[light];
+		leaf.left = id;
+		nodes[(n - 1) + id] = leaf;
+		lights_sorted[id] = lights[light];
+	}
+
+	if (id < n - 1) {
+		const int2 range = find_span(codes, n, id);
+		const int split = find_split(codes, n, range);
+
+		const int child_left = split == range.x ? (n - 1) + split : split;
+		const int child_right = split + 1 == range.y ? (n - 1) + split + 1 : split + 1;
+
+		nodes[id].left = child_left;
+		nodes[id].right = child_right;
+		nodes[id].type = 1;
+		nodes[id].padding = 0;
+
+		parents[child_left] = id;
+		parents[child_right] = id;
+	}
+
+	if (id == 0)
+		parents[0] = -1;
+}
+
+// Computes the internal nodes bottom up, starting a thread at each leaf. The second thread to reach a node computes it, at which point both children are done.
+// The flags must be cleared before the launch
+__kernel void refit_light_tree(
+	IN_VAL(uint, num_lights),
+	IN_BUF(int, parents),
+	__global volatile LightTreeNode* nodes,
+	__global volatile uint* flags
+) {
+	const uint id = get_global_id(0);
+	if (id >= num_lights)
+		return;
+
+	int index = parents[(num_lights - 1) + id];
+	while (index >= 0) {
+		// make the child written by this thread visible before signalling
+		write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+		if (atomic_inc(flags + index) == 0)
+			break;
+		read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+		LightTreeNode node = nodes[index];
+		const LightTreeNode left = nodes[node.left];
+		const LightTreeNode right = nodes[node.right];
+
+		node.pmin = (float4)(min(left.pmin.xyz, right.pmin.xyz), 0.0f);
+		node.pmax = (float4)(max(left.pmax.xyz, right.pmax.xyz), 0.0f);
+		node.axis = union_cone(left.axis, right.axis);
+		node.energy = (float4)(left.energy.xyz + right.energy.xyz, max(THETA_E(left), THETA_E(right)));
+		nodes[index] = node;
+
+		index = parents[index];
+	}
+}
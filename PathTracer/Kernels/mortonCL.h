@@ -0,0 +1,116 @@
+#ifndef MORTON_CL
+#define MORTON_CL
+
+// Morton codes and the hierarchy construction from "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees" [Karras 2012].
+// Shared by the BVH and light tree builders
+
+typedef struct morton_key {
+	ulong code;
+	uint index;
+} morton_key;
+
+inline ulong SplitBy3(ulong x)
+{
+	x &= 0x1fffff; // we only look at the first 21 bits
+	x = (x | x << 32) & 0x1f00000000ffff;
+	x = (x | x << 16) & 0x1f0000ff0000ff;
+	x = (x | x << 8) & 0x100f00f00f00f00f;
+	x = (x | x << 4) & 0x10c30c30c30c30c3;
+	x = (x | x << 2) & 0x1249249249249249;
+
+	return x;
+}
+
+inline ulong MortonCode(float3 p) {
+
+	if (p.x > 1 || p.x < -0.0f)
+		printf("FAIL X! [%f]\n", p.x);
+
+	if (p.y > 1 || p.y < -0.0f)
+		printf("FAIL Y! [%f]\n", p.y);
+
+	if (p.z > 1 || p.z < -0.0f)
+		printf("FAIL Z! [%f]\n", p.z);
+
+	// points must be in the range [0,1]
+	//assert(p[0] <= 1 && p[0] >= 0); // x-component out of range [0,1]
+	//assert(p[1] <= 1 && p[1] >= 0); // y-component out of range [0,1]
+	//assert(p[2] <= 1 && p[2] >= 0); // z-component out of range [0,1]
+
+	// project the normalized values onto the range of 21 bits
+	float3 tmp = p * (float)(0x1fffff);
+
+	ulong x = SplitBy3((ulong)(tmp.x));
+	ulong y = SplitBy3((ulong)(tmp.y));
+	ulong z = SplitBy3((ulong)(tmp.z));
+
+	// interleave the bits from the 3 dimensions
+	return x | y << 1 | z << 2;
+
+}
+
+inline int longest_common_prefix(__global morton_key const* restrict morton_keys, int num_primitives, int i0, int i1) {
+	// select left and right 
+	int left = min(i0, i1);
+	int right = max(i0, i1);
+
+	// check the left and right is within the range of the primitives
+	if (left < 0 || right >= num_primitives) {
+		return -1;
+	}
+
+	// Load codes from buffer
+	ulong left_code = morton_keys[left].code;
+	ulong right_code = morton_keys[right].code;
+
+	// in case the codes are the same, find common prefix for the indices instead.
+	return left_code != right_code ? clz(left_code ^ right_code) : (64 + clz(left ^ right));
+}
+
+inline int2 find_span(__global morton_key const* restrict keys, int num_primitives, int index) {
+	// direction for the range
+	int d = sign((float)(longest_common_prefix(keys, num_primitives, index, index + 1) - longest_common_prefix(keys, num_primitives, index, index - 1)));
+
+	int delta_min = longest_common_prefix(keys, num_primitives, index, index - d);
+
+	// Max rough estimate for far end
+	int lmax = 2;
+	while (longest_common_prefix(keys, num_primitives, index, index + lmax * d) > delta_min)
+		lmax *= 2;
+
+	// Search back for the exact bound in the span
+	int l = 0;
+	int t = lmax;
+	do {
+		t /= 2;
+		if (longest_common_prefix(keys, num_primitives, index, index + (l + t) * d) > delta_min) {
+			l = l + t;
+		}
+	} while (t > 1);
+
+	return (int2)(min(index, index + l * d), max(index, index + l * d));
+}
+
+inline int find_split(__global morton_key const* restrict keys, int num_primitives, int2 span) {
+	int left = span.x;
+	int right = span.y;
+
+	int num_common = longest_common_prefix(keys, num_primitives, left, right);
+
+	do {
+		// propose new split in the middle of the range [left,right]
+		int split = (right + left) / 2;
+
+		if (longest_common_prefix(keys, num_primitives, left, split) > num_common) {
+			left = split;
+		}
+		else {
+			right = split;
+		}
+
+	} while (right > left + 1);
+
+	return left;
+}
+
+#endif // !MORTON_CL
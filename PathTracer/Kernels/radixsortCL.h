@@ -0,0 +1,218 @@
+#ifndef RADIXSORT_CL
+#define RADIXSORT_CL
+
+#include "mortonCL.h"
+
+// Stable LSD radix sort of morton keys, RADIX_BITS per pass. Every kernel runs in work groups of RADIX_RANGE work items.
+// A work group counts and scatters a block of RADIX_BLOCK_SIZE keys, with the digits counted in local memory.
+// The histograms are stored digit major, histograms[digit * num_blocks + block], so their exclusive scan is the scatter offset of every block and digit.
+// The scan is reduce-then-scan: every work group sums a tile of RADIX_SCAN_TILE counts, the tile sums are scanned by one work group, and the tiles are scanned with their offset.
+// The scatter is kept stable by sorting each RADIX_RANGE keys of the block in local memory by their digit, with one split per bit, before they are written
+#define RADIX_BITS 8
+#define RADIX_RANGE (1 << RADIX_BITS)
+#define RADIX_MASK (RADIX_RANGE - 1)
+#define RADIX_BLOCK_SIZE 1024
+#define RADIX_SCAN_ITEMS 4
+#define RADIX_SCAN_TILE (RADIX_RANGE * RADIX_SCAN_ITEMS)
+
+inline uint radix_num_blocks(uint num_keys) {
+	return (num_keys + RADIX_BLOCK_SIZE - 1) / RADIX_BLOCK_SIZE;
+}
+
+inline uint radix_num_tiles(uint num_keys) {
+	return (radix_num_blocks(num_keys) * RADIX_RANGE + RADIX_SCAN_TILE - 1) / RADIX_SCAN_TILE;
+}
+
+inline uint radix_digit(ulong code, uint shift) {
+	return (uint)(code >> shift) & RADIX_MASK;
+}
+
+// Exclusive prefix sum of 'value' over the work group of RADIX_RANGE work items, using 'scratch' of RADIX_RANGE entries. The sum of all values is stored in 'total'
+inline uint radix_local_scan(__local uint* scratch, const uint value, uint* total) {
+	const uint lid = get_local_id(0);
+	scratch[lid] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint offset = 1; offset < RADIX_RANGE; offset <<= 1) {
+		const uint add = lid >= offset ? scratch[lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scratch[lid] += add;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	const uint inclusive = scratch[lid];
+	*total = scratch[RADIX_RANGE - 1];
+	// The scratch may be reused right after
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return inclusive - value;
+}
+
+// Counts the digits in each block
+__attribute__((reqd_work_group_size(RADIX_RANGE, 1, 1)))
+__kernel void radix_count(
+	IN_VAL(uint, num_keys),
+	IN_VAL(uint, shift),
+	IN_BUF(morton_key, keys),
+	OUT_BUF(uint, histograms)
+) {
+	__local uint counts[RADIX_RANGE];
+
+	const uint lid = get_local_id(0);
+	const uint block = get_group_id(0);
+	const uint num_blocks = radix_num_blocks(num_keys);
+
+	counts[lid] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	const uint end = min((block + 1) * RADIX_BLOCK_SIZE, num_keys);
+	for (uint i = block * RADIX_BLOCK_SIZE + lid; i < end; i += RADIX_RANGE)
+		atomic_inc(&counts[radix_digit(keys[i].code, shift)]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// One digit for each work item
+	histograms[lid * num_blocks + block] = counts[lid];
+}
+
+// Sums each tile of the histograms
+__attribute__((reqd_work_group_size(RADIX_RANGE, 1, 1)))
+__kernel void radix_reduce(
+	IN_VAL(uint, num_keys),
+	IN_BUF(uint, histograms),
+	OUT_BUF(uint, tile_sums)
+) {
+	__local uint scratch[RADIX_RANGE];
+
+	const uint lid = get_local_id(0);
+	const uint tile = get_group_id(0);
+	const uint num_counts = radix_num_blocks(num_keys) * RADIX_RANGE;
+
+	uint sum = 0;
+	for (uint i = tile * RADIX_SCAN_TILE + lid; i < min((tile + 1) * RADIX_SCAN_TILE, num_counts); i += RADIX_RANGE)
+		sum += histograms[i];
+
+	uint total;
+	radix_local_scan(scratch, sum, &total);
+	if (lid == 0)
+		tile_sums[tile] = total;
+}
+
+// Exclusive scan of the tile sums in place. Must be launched as a single work group, which scans RADIX_RANGE sums at a time
+__attribute__((reqd_work_group_size(RADIX_RANGE, 1, 1)))
+__kernel void radix_scan(
+	IN_VAL(uint, num_keys),
+	__global uint* restrict tile_sums
+) {
+	__local uint scratch[RADIX_RANGE];
+
+	const uint lid = get_local_id(0);
+	const uint num_tiles = radix_num_tiles(num_keys);
+
+	uint carry = 0;
+	for (uint first = 0; first < num_tiles; first += RADIX_RANGE) {
+		const uint i = first + lid;
+		const uint sum = i < num_tiles ? tile_sums[i] : 0;
+
+		uint total;
+		const uint offset = radix_local_scan(scratch, sum, &total);
+		if (i < num_tiles)
+			tile_sums[i] = carry + offset;
+		carry += total;
+	}
+}
+
+// Exclusive scan of each tile of the histograms, offset by the scanned tile sums
+__attribute__((reqd_work_group_size(RADIX_RANGE, 1, 1)))
+__kernel void radix_downsweep(
+	IN_VAL(uint, num_keys),
+	__global uint* restrict histograms,
+	IN_BUF(uint, tile_sums)
+) {
+	__local uint scratch[RADIX_RANGE];
+
+	const uint lid = get_local_id(0);
+	const uint tile = get_group_id(0);
+	const uint num_counts = radix_num_blocks(num_keys) * RADIX_RANGE;
+
+	// Each work item scans RADIX_SCAN_ITEMS consecutive counts, after the counts of the lower work items
+	const uint first = tile * RADIX_SCAN_TILE + lid * RADIX_SCAN_ITEMS;
+	uint counts[RADIX_SCAN_ITEMS];
+	uint sum = 0;
+	for (uint k = 0; k < RADIX_SCAN_ITEMS; k++) {
+		counts[k] = first + k < num_counts ? histograms[first + k] : 0;
+		sum += counts[k];
+	}
+
+	uint total;
+	uint offset = tile_sums[tile] + radix_local_scan(scratch, sum, &total);
+	for (uint k = 0; k < RADIX_SCAN_ITEMS; k++) {
+		if (first + k < num_counts)
+			histograms[first + k] = offset;
+		offset += counts[k];
+	}
+}
+
+// Moves the keys of each block to their sorted position for this pass
+__attribute__((reqd_work_group_size(RADIX_RANGE, 1, 1)))
+__kernel void radix_scatter(
+	IN_VAL(uint, num_keys),
+	IN_VAL(uint, shift),
+	IN_BUF(morton_key, keys),
+	IN_BUF(uint, histograms),
+	OUT_BUF(morton_key, keys_sorted)
+) {
+	__local uint scratch[RADIX_RANGE];
+	__local morton_key tile_keys[RADIX_RANGE];
+	// Scatter offset of each digit, moved past the keys of each tile
+	__local uint offsets[RADIX_RANGE];
+	__local uint tile_start[RADIX_RANGE];
+
+	const uint lid = get_local_id(0);
+	const uint block = get_group_id(0);
+	const uint num_blocks = radix_num_blocks(num_keys);
+
+	offsets[lid] = histograms[lid * num_blocks + block];
+
+	const uint end = min((block + 1) * RADIX_BLOCK_SIZE, num_keys);
+	for (uint first = block * RADIX_BLOCK_SIZE; first < end; first += RADIX_RANGE) {
+		const uint count = min((uint)RADIX_RANGE, end - first);
+
+		// Keys past the end have the highest digit, so the stable sort leaves them after the valid keys
+		morton_key key;
+		key.code = ~0UL;
+		key.index = 0;
+		if (lid < count)
+			key = keys[first + lid];
+
+		// Stable sort of the tile by the digit, one bit at a time
+		for (uint bit = 0; bit < RADIX_BITS; bit++) {
+			const uint b = (radix_digit(key.code, shift) >> bit) & 1;
+			uint num_zeros;
+			const uint rank = radix_local_scan(scratch, 1 - b, &num_zeros);
+			const uint position = b ? num_zeros + lid - rank : rank;
+
+			tile_keys[position] = key;
+			barrier(CLK_LOCAL_MEM_FENCE);
+			key = tile_keys[lid];
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+
+		// The sorted keys of a digit are contiguous. The first of them marks where the digit starts
+		const uint digit = radix_digit(key.code, shift);
+		const bool first_of_digit = lid == 0 || radix_digit(tile_keys[lid - 1].code, shift) != digit;
+		const bool last_of_digit = lid == count - 1 || (lid + 1 < count && radix_digit(tile_keys[lid + 1].code, shift) != digit);
+		if (lid < count && first_of_digit)
+			tile_start[digit] = lid;
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		if (lid < count)
+			keys_sorted[offsets[digit] + lid - tile_start[digit]] = key;
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		// The last key of each digit moves the offset past the keys of the digit in this tile
+		if (lid < count && last_of_digit)
+			offsets[digit] += lid - tile_start[digit] + 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+#endif // !RADIXSORT_CL
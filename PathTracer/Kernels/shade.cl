@@ -1,5 +1,12 @@
 #include "commonCL.h"
 
+// Shadow rays traced for each shading point
+#ifdef LIGHT_CUT_SIZE
+#define NUM_LIGHT_SAMPLES LIGHT_CUT_SIZE
+#else
+#define NUM_LIGHT_SAMPLES 1
+#endif // LIGHT_CUT_SIZE
+
 inline float3 ColorFromNormal(float3 normal) {
 	float3 col = normalize(normal).xyz * 0.5f + 0.5f;
 	return col.xyz;
@@ -58,30 +65,17 @@ inline int lower_bound(__global float const* values, int n, float value)
 }
 
 
-int select_light(__global const float* cdf, int num_lights, float r, float* pdf_out) {
-	// TODO do binary search in the cdf of the lights
+// Picks a light proportional to its power in constant time, using the alias table
+int select_light(__global const AliasEntry* table, uint num_lights, uint* rng, float* pdf_out) {
+	const uint index = random_uint(rng, num_lights);
+	const AliasEntry entry = table[index];
 
-	const int index = max(1, lower_bound(cdf, num_lights, r)) - 1;
-
-	if (index < 0 || index >= num_lights) {
-		*pdf_out = 1.0f;
-		return 0;
+	if (rand(rng) < entry.probability) {
+		*pdf_out = entry.pdf;
+		return index;
 	}
-	/*
-	uint index = num_lights - 1;
-	for (uint i = 1; i < num_lights; i++) {
-		if (cdf[i] > r) {
-			index = i - 1;
-			break;
-		}
-	}
-	*/
-	const float pdf = cdf[index + num_lights];
-
-	//*pdf = 1.0f; // pdf is canceling out with power / area calculation, so all lights uses their material emission
-	// only works for area lights. need to calculate per light pdf if both point and area lights are used
-	*pdf_out = pdf;
-	return index;
+	*pdf_out = entry.pdf_alias;
+	return entry.alias;
 }
 
 float sqr(float x) {
@@ -188,9 +182,9 @@ inline float center_sqr_dist(float3 pmin, float3 pmax, float3 p){
 
 inline float2 calc_attenuation(float3 pmax_left, float3 pmax_right, float3 pmin_left, float3 pmin_right, float3 position){
 #ifdef MIN_DIST
-	float2 dist = (float2)(bbox_min_sqr_distance(pmax_left, pmin_left, position), bbox_min_sqr_distance(pmax_right, pmin_right, position));
+	float2 dist = (float2)(bbox_min_sqr_distance(pmin_left, pmax_left, position), bbox_min_sqr_distance(pmin_right, pmax_right, position));
 #else
-	float2 dist = (float2)(center_sqr_dist(pmax_left, pmin_left, position), center_sqr_dist(pmax_right, pmin_right, position));
+	float2 dist = (float2)(center_sqr_dist(pmin_left, pmax_left, position), center_sqr_dist(pmin_right, pmax_right, position));
 #endif
 	
 
@@ -252,15 +246,167 @@ inline float importance(LightTreeNode node, float3 position, float3 normal, floa
 	return max3(I.x, I.y, I.z);
 }
 
-inline int pick_light(__global const LightTreeNode* nodes, float3 position, float3 normal, float3 diffuse, double r, float* pdf_out) {
+// Pick a light within the leaf using the precomputed cdf. Leaves are small, so a linear scan is sufficient
+inline int pick_leaf_light(LightTreeNode node, __global const float* leaf_cdf, double xi, double* pdf) {
+	const int first = INDEX(node);
+	const int last = first + COUNT(node) - 1;
+	int index = first;
+	float cdf_prev = 0.0f;
+	while (index < last && xi >= leaf_cdf[index]) {
+		cdf_prev = leaf_cdf[index];
+		index++;
+	}
+	*pdf *= leaf_cdf[index] - cdf_prev;
+	return index;
+}
+
+#ifdef COMPACT_LIGHTTREE
+inline float3 decode_octahedral(ushort2 value) {
+	const float2 p = convert_float2(value) * (2.0f / 65535.0f) - 1.0f;
+	float3 n = (float3)(p.x, p.y, 1.0f - fabs(p.x) - fabs(p.y));
+	const float t = max(-n.z, 0.0f);
+	n.x += n.x >= 0.0f ? -t : t;
+	n.y += n.y >= 0.0f ? -t : t;
+	return normalize(n);
+}
+
+// Decodes the compact node at 'index' relative to its decoded parent
+inline LightTreeNode decode_node(CompactLightTreeNode compact, int index, LightTreeNode parent) {
+	const float3 step = (parent.pmax.xyz - parent.pmin.xyz) * (1.0f / 255.0f);
+	const float2 theta = vload_half2(0, (const half*)&compact.theta);
+	const float4 fraction = vload_half4(0, (const half*)&compact.energy);
+
+	LightTreeNode node;
+	node.pmin = (float4)(parent.pmin.xyz + convert_float3(compact.qmin.xyz) * step, 0.0f);
+	node.pmax = (float4)(parent.pmin.xyz + convert_float3(compact.qmax.xyz) * step, 0.0f);
+	node.axis = (float4)(decode_octahedral(compact.axis), theta.x);
+	node.energy = (float4)(fraction.xyz * (1.0f / COMPACT_ENERGY_SCALE) * parent.energy.xyz, theta.y);
+	if (compact.qmin.w == 0) {
+		node.left = index + 1;
+		node.right = compact.child;
+		node.type = 1;
+	}
+	else {
+		node.left = compact.child;
+		node.right = compact.qmin.w;
+		node.type = 0;
+	}
+	return node;
+}
+
+// The root is relative to the bounds and energy in the header
+inline LightTreeNode decode_root(__global const CompactLightTreeNode* nodes) {
+	const CompactLightTreeHeader header = ((__global const CompactLightTreeHeader*)nodes)[0];
+	LightTreeNode parent;
+	parent.pmin = header.pmin;
+	parent.pmax = header.pmax;
+	parent.energy = (float4)(header.pmin.w);
+	return decode_node(nodes[1], 1, parent);
+}
+
+typedef CompactLightTreeNode LightTreeNodeData;
+#define LOAD_ROOT(nodes) decode_root(nodes)
+#define LOAD_CHILD(nodes, index, parent) decode_node(nodes[index], index, parent)
+#else
+typedef LightTreeNode LightTreeNodeData;
+#define LOAD_ROOT(nodes) nodes[0]
+#define LOAD_CHILD(nodes, index, parent) nodes[index]
+#endif // COMPACT_LIGHTTREE
+
+#ifdef WIDE_LIGHTTREE
+// calc_attenuation for all children of a wide node
+inline void calc_attenuation_wide(__global const LightTreeNode* children, int count, float3 position, float* attenuation) {
+#ifdef AVOID_SINGULARITY
+	bool singular = false;
+#endif
+	for (int i = 0; i < count; i++) {
+		const float3 pmin = children[i].pmin.xyz;
+		const float3 pmax = children[i].pmax.xyz;
+#ifdef MIN_DIST
+		float dist = bbox_min_sqr_distance(pmin, pmax, position);
+#else
+		float dist = center_sqr_dist(pmin, pmax, position);
+#endif
+#ifdef ZERO_TEST
+		const float alpha = 0.5f;
+		if (dist == 0.0f)
+			dist += sqr_length(pmax - pmin) * alpha;
+#elif defined AVOID_SINGULARITY
+		const float alpha = 1.0f;
+		singular |= dist <= sqr_length(pmax - pmin) * alpha;
+#endif
+		attenuation[i] = 1.0f / dist;
+	}
+#ifdef AVOID_SINGULARITY
+	if (singular) {
+		for (int i = 0; i < count; i++) {
+			attenuation[i] = 1.0f;
+		}
+	}
+#endif
+}
+
+// Descends the wide tree, choosing between all children of a node at once
+inline int pick_light(__global const LightTreeNode* nodes, __global const float* leaf_cdf, float3 position, float3 normal, float3 diffuse, double r, float* pdf_out) {
 	LightTreeNode node = nodes[0];
 	double pdf = 1.0f;
 	double xi = r;
 
+	float I[LIGHT_TREE_MAX_WIDTH];
+
+	while (!LEAF(node)) {
+		// children are stored contiguously
+		__global const LightTreeNode* children = nodes + FIRST_CHILD(node);
+		const int count = CHILD_COUNT(node);
+
+		calc_attenuation_wide(children, count, position, I);
+
+		float sum = 0.0f;
+		int last = 0;
+		for (int i = 0; i < count; i++) {
+			I[i] *= importance(children[i], position, normal, diffuse);
+			sum += I[i];
+			if (I[i] > 0.0f)
+				last = i;
+		}
+
+		// return null light
+		if (sum == 0.0f) {
+			*pdf_out = 1.0f;
+			return -1;
+		}
+
+		// Find the child where xi falls in the cdf. Children without importance are never chosen
+		int c = 0;
+		double cdf = 0.0;
+		for (; c < last; c++) {
+			const double p = I[c] / sum;
+			if (xi < cdf + p)
+				break;
+			cdf += p;
+		}
+
+		const double p = I[c] / sum;
+		xi = min((xi - cdf) / p, 0.99999999);
+		pdf *= p;
+		node = children[c];
+	}
+
+	const int index = pick_leaf_light(node, leaf_cdf, xi, &pdf);
+
+	*pdf_out = pdf;
+	return index;
+}
+#else
+// Descends the subtree of 'node', which must be decoded already. The pdf is relative to the subtree
+inline int pick_light_from(__global const LightTreeNodeData* nodes, __global const float* leaf_cdf, LightTreeNode node, float3 position, float3 normal, float3 diffuse, double r, float* pdf_out) {
+	double pdf = 1.0f;
+	double xi = r;
+
 	while (!LEAF(node)) {
 		// node is internal
-		LightTreeNode node_l = nodes[node.left];
-		LightTreeNode node_r = nodes[node.right];
+		LightTreeNode node_l = LOAD_CHILD(nodes, node.left, node);
+		LightTreeNode node_r = LOAD_CHILD(nodes, node.right, node);
 
 		// Store the attenuation of the left node in x and right in y
 		float2 attenuation = calc_attenuation(node_l.pmax.xyz,node_r.pmax.xyz,node_l.pmin.xyz,node_r.pmin.xyz,position);
@@ -291,11 +437,210 @@ inline int pick_light(__global const LightTreeNode* nodes, float3 position, floa
 		}
 	}
 
-	barrier(CLK_LOCAL_MEM_FENCE);
+	const int index = pick_leaf_light(node, leaf_cdf, xi, &pdf);
 
 	*pdf_out = pdf;
-	return INDEX(node);
+	return index;
+}
+
+inline int pick_light(__global const LightTreeNodeData* nodes, __global const float* leaf_cdf, float3 position, float3 normal, float3 diffuse, double r, float* pdf_out) {
+	return pick_light_from(nodes, leaf_cdf, LOAD_ROOT(nodes), position, normal, diffuse, r, pdf_out);
+}
+
+// Estimated contribution of all lights in the node, used to choose which node of a cut to refine
+inline float cluster_weight(LightTreeNode node, float3 position, float3 normal, float3 diffuse) {
+	return importance(node, position, normal, diffuse) * calc_attenuation(node.pmax.xyz, node.pmax.xyz, node.pmin.xyz, node.pmin.xyz, position).x;
+}
+
+#ifdef LIGHT_CUT_SIZE
+
+// Selects a cut of up to LIGHT_CUT_SIZE nodes, by repeatedly replacing the internal node with the highest weight by its children.
+// The nodes of the cut covers disjoint sets of lights, so the sum of one sample from each node is an estimate of all lights.
+// Nodes without importance are dropped, as pick_light would never choose a light in them either. Returns the size of the cut
+inline int select_light_cut(__global const LightTreeNodeData* nodes, float3 position, float3 normal, float3 diffuse, LightTreeNode* cut) {
+	float weight[LIGHT_CUT_SIZE];
+	int size = 0;
+
+	const LightTreeNode root = LOAD_ROOT(nodes);
+	const float weight_root = cluster_weight(root, position, normal, diffuse);
+	if (weight_root > 0.0f) {
+		cut[0] = root;
+		weight[0] = weight_root;
+		size = 1;
+	}
+
+	while (size < LIGHT_CUT_SIZE) {
+		int best = -1;
+		float best_weight = 0.0f;
+		for (int i = 0; i < size; i++) {
+			if (!LEAF(cut[i]) && weight[i] > best_weight) {
+				best = i;
+				best_weight = weight[i];
+			}
+		}
+		// all nodes of the cut are leaves
+		if (best == -1)
+			break;
+
+		const LightTreeNode node = cut[best];
+		const LightTreeNode children[2] = { LOAD_CHILD(nodes, node.left, node), LOAD_CHILD(nodes, node.right, node) };
+
+		// remove the node, then add its children
+		cut[best] = cut[--size];
+		weight[best] = weight[size];
+		for (int c = 0; c < 2; c++) {
+			const float w = cluster_weight(children[c], position, normal, diffuse);
+			if (w > 0.0f) {
+				cut[size] = children[c];
+				weight[size] = w;
+				size++;
+			}
+		}
+	}
+	return size;
+}
+#endif // LIGHT_CUT_SIZE
+
+#ifdef LIGHT_CACHE_CELLS
+// The state of a slot is one of these plus 4 times its generation, which grows each time the slot is built, so readers can tell if the cell was replaced while they copied it
+#define LIGHT_CACHE_EMPTY 0
+#define LIGHT_CACHE_BUILDING 1
+#define LIGHT_CACHE_READY 2
+#define LIGHT_CACHE_STATUS(state) ((state) & 3)
+#define LIGHT_CACHE_GENERATION 4
+// Part of the cell distribution spread evenly over the cut, so every light keeps a non zero probability anywhere in the cell
+#define LIGHT_CACHE_UNIFORM 0.1f
+
+// Dominant axis and sign of the normal, 0-5
+inline uint normal_direction(float3 normal) {
+	const float3 a = fabs(normal);
+	const uint axis = a.x >= a.y && a.x >= a.z ? 0 : (a.y >= a.z ? 1 : 2);
+	const float sign = axis == 0 ? normal.x : (axis == 1 ? normal.y : normal.z);
+	return axis * 2 + (sign < 0.0f ? 1 : 0);
+}
+
+inline float3 direction_normal(uint direction) {
+	float3 normal = (float3)(0.0f);
+	const float sign = direction & 1 ? -1.0f : 1.0f;
+	if (direction >> 1 == 0)
+		normal.x = sign;
+	else if (direction >> 1 == 1)
+		normal.y = sign;
+	else
+		normal.z = sign;
+	return normal;
+}
+
+// Builds the cut of a cell from its center, refining like select_light_cut. Nodes without importance are kept, so the cut covers all lights
+inline void build_light_cache_cell(__global const LightTreeNode* nodes, float3 center, float3 normal, uint key, LightCacheCell* cell) {
+	const float3 diffuse = (float3)(1.0f);
+
+	int index[LIGHT_CACHE_CUT_SIZE];
+	float weight[LIGHT_CACHE_CUT_SIZE];
+	index[0] = 0;
+	weight[0] = cluster_weight(nodes[0], center, normal, diffuse);
+	int size = 1;
+
+	while (size < LIGHT_CACHE_CUT_SIZE) {
+		int best = -1;
+		float best_weight = -1.0f;
+		for (int i = 0; i < size; i++) {
+			if (!LEAF(nodes[index[i]]) && weight[i] > best_weight) {
+				best = i;
+				best_weight = weight[i];
+			}
+		}
+		// all nodes of the cut are leaves
+		if (best == -1)
+			break;
+
+		const LightTreeNode node = nodes[index[best]];
+		index[best] = node.left;
+		weight[best] = cluster_weight(nodes[node.left], center, normal, diffuse);
+		index[size] = node.right;
+		weight[size] = cluster_weight(nodes[node.right], center, normal, diffuse);
+		size++;
+	}
+
+	float sum = 0.0f;
+	for (int i = 0; i < size; i++) {
+		sum += weight[i];
+	}
+	// fall back to an even distribution when the weights are useless, e.g. infinite at the center of a light
+	const bool weighted = sum > 0.0f && isfinite(sum);
+	const float uniform = weighted ? LIGHT_CACHE_UNIFORM : 1.0f;
+	const float scale = weighted ? (1.0f - LIGHT_CACHE_UNIFORM) / sum : 0.0f;
+
+	float cdf = 0.0f;
+	for (int i = 0; i < size; i++) {
+		cdf += weight[i] * scale + uniform / size;
+		cell->nodes[i] = index[i];
+		cell->cdf[i] = cdf;
+	}
+	cell->cdf[size - 1] = 1.0f;
+	cell->size = size;
+	cell->key = key;
+}
+
+// Copies the cell of the shading point from the cache. An empty slot, or a slot holding another cell, is built for this cell, as the cut is cheap to compute.
+// Returns false if the slot is being built or replaced, in which case the whole tree is descended instead
+inline bool find_light_cache_cell(__global const LightTreeNode* nodes, float3 position, float3 normal, float cell_size, __global volatile LightCacheCell* cache, __global volatile uint* states, LightCacheCell* cell) {
+	const int3 coord = convert_int3_rtn(position / cell_size);
+	const uint direction = normal_direction(normal);
+
+	uint hash = hash1((uint)coord.x);
+	hash = hash1(hash ^ (uint)coord.y);
+	hash = hash1(hash ^ (uint)coord.z);
+	hash = hash1(hash ^ direction);
+	const uint slot = hash % LIGHT_CACHE_CELLS;
+	// the slot only uses the low bits, so the key stored in the cell is hashed again
+	const uint key = hash2(hash);
+
+	const uint state = states[slot];
+	if (LIGHT_CACHE_STATUS(state) == LIGHT_CACHE_BUILDING)
+		return false;
+
+	read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+	if (LIGHT_CACHE_STATUS(state) == LIGHT_CACHE_READY) {
+		*cell = cache[slot];
+		read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+		// the copy is only whole if the slot was not replaced meanwhile
+		if (cell->key == key)
+			return states[slot] == state;
+	}
+
+	// claim the slot, unless another work item did first
+	const uint generation = state - LIGHT_CACHE_STATUS(state);
+	if (atomic_cmpxchg(states + slot, state, generation + LIGHT_CACHE_BUILDING) != state)
+		return false;
+
+	const float3 center = (convert_float3(coord) + 0.5f) * cell_size;
+	build_light_cache_cell(nodes, center, direction_normal(direction), key, cell);
+	cache[slot] = *cell;
+	write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+	atomic_xchg(states + slot, generation + LIGHT_CACHE_GENERATION + LIGHT_CACHE_READY);
+	return true;
+}
+
+// Chooses a node from the cut of the cell, then descends from it like pick_light
+inline int pick_light_cached(__global const LightTreeNode* nodes, __global const float* leaf_cdf, const LightCacheCell* cell, float3 position, float3 normal, float3 diffuse, double r, float* pdf_out) {
+	const int last = cell->size - 1;
+	int c = 0;
+	float cdf_prev = 0.0f;
+	while (c < last && r >= cell->cdf[c]) {
+		cdf_prev = cell->cdf[c];
+		c++;
+	}
+	const float p = cell->cdf[c] - cdf_prev;
+	const double xi = min((r - cdf_prev) / p, 0.99999999);
+
+	float pdf;
+	const int index = pick_light_from(nodes, leaf_cdf, nodes[cell->nodes[c]], position, normal, diffuse, xi, &pdf);
+	*pdf_out = pdf * p;
+	return index;
 }
+#endif // LIGHT_CACHE_CELLS
+#endif // WIDE_LIGHTTREE
 
 inline float3 sample_light(Light light, float3 position, float3 normal, float2 r, float* pdf, float3* out_dir, float* out_dist) {
 	// Handle direct light
@@ -335,6 +680,26 @@ inline float3 sample_light(Light light, float3 position, float3 normal, float2 r
 	return L_i;
 }
 
+// Samples a point on light 'i' and writes the shadow ray and the contribution it carries if unoccluded. A light of -1 writes an empty sample
+inline void write_light_sample(__global const Light* lights, int i, float pdf, float3 position, float3 normal, float3 throughput, uint* rng, __global Ray* shadow_ray, __global float3* light_contribution) {
+	if (i != -1) {
+		const Light light = lights[i];
+		// lift shading point to avoid hitting the geometry again
+		const float3 lift = normal * 10e-6f;
+
+		float3 dir;
+		float dist;
+		const float3 L_i = sample_light(light, position, normal, random_float2(rng), &pdf, &dir, &dist);
+
+		*shadow_ray = CreateRay(position + lift, dir, 0.0f, dist - 10e-5f);
+		*light_contribution = throughput * L_i * inverse(pdf);
+	}
+	else {
+		*shadow_ray = CreateRay((float3)(0.0f), (float3)(0.0f), 0.0f, 0.0f);
+		*light_contribution = (float3)(0.0f, 0.0f, 0.0f);
+	}
+}
+
 __kernel void ProcessBounce(
 	IN_VAL(uint, num_samples),
 	IN_VAL(uint, num_lights),
@@ -346,9 +711,15 @@ __kernel void ProcessBounce(
 	IN_BUF(Light, lights),
 	IN_BUF(Material, materials),
 #ifdef USE_LIGHTTREE
-	IN_BUF(LightTreeNode, light_tree_nodes),
+	IN_BUF(LightTreeNodeData, light_tree_nodes),
+	IN_BUF(float, leaf_cdf),
+#ifdef LIGHT_CACHE_CELLS
+	IN_VAL(float, light_cache_cell_size),
+	__global volatile LightCacheCell* light_cache,
+	__global volatile uint* light_cache_states,
+#endif // LIGHT_CACHE_CELLS
 #else
-	IN_BUF(float, light_power_cdf),
+	IN_BUF(AliasEntry, light_alias_table),
 #endif
 	OUT_BUF(float3, results),
 	OUT_BUF(float3, throughputs),
@@ -410,34 +781,34 @@ __kernel void ProcessBounce(
 				const float3 lift = normal * 10e-6f;
 
 #ifndef USE_NAIVE
+#ifdef LIGHT_CUT_SIZE
+				// One light sample from each node of the cut. Sample c of the shading point is stored at c * num_samples + id
+				LightTreeNode cut[LIGHT_CUT_SIZE];
+				const int cut_size = select_light_cut(light_tree_nodes, position, normal, throughput, cut);
+				for (int c = 0; c < LIGHT_CUT_SIZE; c++) {
+					float pdf = 1.0f;
+					const int i = c < cut_size ? pick_light_from(light_tree_nodes, leaf_cdf, cut[c], position, normal, throughput, random_double(&rng), &pdf) : -1;
+					write_light_sample(lights, i, pdf, position, normal, throughput, &rng, shadow_rays + c * num_samples + id, light_contribution + c * num_samples + id);
+				}
+#else
 #ifdef USE_LIGHTTREE
 				// choose light
 				//uint i = random_uint(&rng, num_lights);
 				//float pdf = inverse(num_lights);
 				double r = random_double(&rng);
 				float pdf;
-				int i = pick_light(light_tree_nodes, position, normal, throughput, r, &pdf);
+#ifdef LIGHT_CACHE_CELLS
+				LightCacheCell cell;
+				int i = find_light_cache_cell(light_tree_nodes, position, normal, light_cache_cell_size, light_cache, light_cache_states, &cell) ? pick_light_cached(light_tree_nodes, leaf_cdf, &cell, position, normal, throughput, r, &pdf) : pick_light(light_tree_nodes, leaf_cdf, position, normal, throughput, r, &pdf);
+#else
+				int i = pick_light(light_tree_nodes, leaf_cdf, position, normal, throughput, r, &pdf);
+#endif // LIGHT_CACHE_CELLS
 #else
-				float r = rand(&rng);
 				float pdf;
-				int i = select_light(light_power_cdf, num_lights, r, &pdf);
+				int i = select_light(light_alias_table, num_lights, &rng, &pdf);
 #endif
-				// Check if light was found
-				if (i != -1) {
-					const Light light = lights[i];
-
-					float3 dir;
-					float dist;
-					const float3 L_i = sample_light(light, position, normal, random_float2(&rng), &pdf, &dir, &dist);
-
-					shadow_rays[id] = CreateRay(geometric.position.xyz + lift, dir, 0.0f, dist - 10e-5f);
-					const float3 L = throughput * L_i * inverse(pdf);
-					light_contribution[id] = L;
-				}
-				else {
-					shadow_rays[id] = CreateRay((float3)(0.0f), (float3)(0.0f), 0.0f, 0.0f);
-					light_contribution[id] = (float3)(0.0f,0.0f,0.0f);
-				}
+				write_light_sample(lights, i, pdf, position, normal, throughput, &rng, shadow_rays + id, light_contribution + id);
+#endif // LIGHT_CUT_SIZE
 #else
 				
 #endif // !USE_NAIVE
@@ -486,14 +857,17 @@ __kernel void shade_occlusion(
 	const int id = get_global_id(0);
 
 	if (id < num_samples) {
-
-		const int hit = hits[id];
 		const int state = states[id];
-		const float3 result = results[id];
-		const float3 contribution = contributions[id];
 
-		if (hit == -1 && state == STATE_ACTIVE) {
-			results[id] = result + contribution;
+		if (state == STATE_ACTIVE) {
+			float3 result = results[id];
+			// Accumulate the unoccluded samples of the shading point, stored num_samples apart
+			for (int c = 0; c < NUM_LIGHT_SAMPLES; c++) {
+				const int sample = c * num_samples + id;
+				if (hits[sample] == -1)
+					result += contributions[sample];
+			}
+			results[id] = result;
 		}
 	}
 }
\ No newline at end of file
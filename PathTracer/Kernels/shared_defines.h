@@ -15,9 +15,16 @@ typedef uint4   cl_uint4;
 typedef uint3   cl_uint3;
 typedef uint2   cl_uint2;
 typedef uint    cl_uint;
+typedef float   cl_float;
 typedef int4    cl_int4;
 typedef int3    cl_int3;
 typedef int2    cl_int2;
+typedef ushort4 cl_ushort4;
+typedef ushort2 cl_ushort2;
+typedef uchar8  cl_uchar8;
+typedef uchar4  cl_uchar4;
+typedef uchar   cl_uchar;
+typedef char4   cl_char4;
 #endif
 
     typedef struct Ray
@@ -45,12 +52,20 @@ typedef int2    cl_int2;
         cl_uint4 index;
     } Face;
 
+    // Intersection data of a face, stored in the order of the faces referenced by the BVH leaves
+    typedef struct Triangle {
+        cl_float4 v0;
+        cl_float4 e1; // v1 - v0
+        cl_float4 e2; // v2 - v0
+    } Triangle;
+
     typedef struct Material {
         cl_float4 diffuse;
         cl_float4 specular;
         cl_float4 emission;
     } Material;
 
+    // BVH node. Internal nodes have the child indices in left and right. Leaves have left = -count and right = the first of 'count' contiguous faces
     typedef struct Node {
         int parent;
         int left;
@@ -63,6 +78,53 @@ typedef int2    cl_int2;
         cl_float4 max;
     } AABB;
 
+    // 64 byte node of the binary BVH used for traversal, with the bounds of both children so each step is a single fetch.
+    // A child with count > 0 is a leaf of the faces [index, index + count), and otherwise the internal node at index
+    typedef struct BVHNode {
+        cl_float left_min[3];
+        int left;
+        cl_float left_max[3];
+        int left_count;
+        cl_float right_min[3];
+        int right;
+        cl_float right_max[3];
+        int right_count;
+    } BVHNode;
+
+    // Instance of a mesh in the two level BVH. The rows of the affine transform from world space to the space of the mesh, and the root of the mesh BVH
+    typedef struct Instance {
+        cl_float4 world_to_object[3];
+        int root;
+        int padding[3];
+    } Instance;
+
+#define BVH_MAX_WIDTH 8
+// Entries of the short stack of the binary traversal. Deeper trees are traced with the stackless traversal
+#define BVH_STACK_SIZE 24
+// Entries of the stack of the wide traversal, which pushes up to BVH_MAX_WIDTH - 1 nodes per level. Wide BVHs needing more are traced as binary BVHs
+#define WIDE_STACK_SIZE 64
+// Number of leaves of the treelets rebuilt by the treelet restructuring
+#define TREELET_SIZE 7
+// Meta value of the internal children of a wide BVH node. Leaf children have their face count, and empty slots 0
+#define WIDE_BVH_INTERNAL 255
+
+    // 80 byte node of the wide BVH, made by collapsing the binary BVH. The children are packed from the first slot.
+    // The child bounds are quantized to 8 bits on a grid starting at 'origin', with cells of 2^exponent along each axis.
+    // Internal children are stored contiguously from child_base, and the faces of the leaf children contiguously from face_base, both in slot order
+    typedef struct WideBVHNode {
+        cl_float origin[3];
+        cl_char4 exponent; // .w is unused
+        int child_base;
+        int face_base;
+        cl_uchar meta[BVH_MAX_WIDTH];
+        cl_uchar8 qmin_x;
+        cl_uchar8 qmin_y;
+        cl_uchar8 qmin_z;
+        cl_uchar8 qmax_x;
+        cl_uchar8 qmax_y;
+        cl_uchar8 qmax_z;
+    } WideBVHNode;
+
     typedef struct GeometricInfo {
         cl_float4 position;
         cl_float4 normal;
@@ -90,6 +152,15 @@ typedef int2    cl_int2;
         cl_float4 intensity;
     };
 
+    // Entry of the alias table used by the energy method. Slot i picks light i with 'probability' and light 'alias' otherwise.
+    // The pdfs of both outcomes are stored with it, so a pick is a single 16 byte load. The pdfs of triangle lights are per unit area
+    typedef struct AliasEntry {
+        float probability;
+        int alias;
+        float pdf;
+        float pdf_alias;
+    } AliasEntry;
+
 #define LEAF(node) node.type == 0
 #define INTERNAL(node) node.type == 1
 #define THETA_O(node) node.axis.w
@@ -98,6 +169,14 @@ typedef int2    cl_int2;
 #define ENERGY(node) node.energy.xyz
 #define INDEX(node) node.left
 #define COUNT(node) node.right
+// Internal nodes of the wide light tree stores their children contiguously
+#define FIRST_CHILD(node) node.left
+#define CHILD_COUNT(node) node.right
+#define LIGHT_TREE_MAX_WIDTH 8
+// Energy fractions of compact nodes are scaled by this, so small fractions keep the full half precision
+#define COMPACT_ENERGY_SCALE 32768.0f
+// The light count of compact leaves is stored in 8 bits
+#define COMPACT_MAX_LEAF_SIZE 255
 
 
     typedef struct LightTreeNode {
@@ -111,6 +190,36 @@ typedef int2    cl_int2;
         int padding;
     } LightTreeNode;
 
+    // 32 byte light tree node used with COMPACT_LIGHTTREE. Node i of the LightTree is stored at i+1, after the header.
+    // The bounds and energy are relative to the decoded parent, so the nodes must be decoded from the root down
+    typedef struct CompactLightTreeNode {
+        cl_uchar4 qmin; // pmin quantized to 8 bits within the parent bounds, .w is the light count of leaves and 0 for internal nodes
+        cl_uchar4 qmax; // pmax quantized to 8 bits within the parent bounds
+        cl_ushort2 axis; // octahedral encoded cone axis
+        cl_ushort2 theta; // half precision theta_o and theta_e
+        cl_ushort4 energy; // half precision fraction of the parent energy, multiplied by COMPACT_ENERGY_SCALE
+        int child; // right child of internal nodes, the left child is the next node. First light of leaves
+        int padding;
+    } CompactLightTreeNode;
+
+    // First record of the compact node buffer
+    typedef struct CompactLightTreeHeader {
+        cl_float4 pmin; // .w is the energy the root is relative to
+        cl_float4 pmax;
+    } CompactLightTreeHeader;
+
+// Nodes in the cut of a light cache cell
+#define LIGHT_CACHE_CUT_SIZE 16
+
+    // Cell of the light cache used with LIGHT_CACHE_CELLS. Holds a cut of the binary light tree, covering all lights, and the cdf for choosing a node of it
+    typedef struct LightCacheCell {
+        cl_uint key; // tag of the grid cell and normal direction the cut was built for
+        int size;
+        int nodes[LIGHT_CACHE_CUT_SIZE];
+        float cdf[LIGHT_CACHE_CUT_SIZE];
+        cl_int2 padding;
+    } LightCacheCell;
+
 #ifdef APP_LSIS
 
     inline Vertex make_vertex(glm::vec3 position, glm::vec3 normal, glm::vec2 uv) {
@@ -126,6 +235,14 @@ typedef int2    cl_int2;
         return face;
     }
 
+    inline Triangle make_triangle(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2) {
+        Triangle triangle = {};
+        triangle.v0 = { v0.x, v0.y, v0.z, 0.0f };
+        triangle.e1 = { v1.x - v0.x, v1.y - v0.y, v1.z - v0.z, 0.0f };
+        triangle.e2 = { v2.x - v0.x, v2.y - v0.y, v2.z - v0.z, 0.0f };
+        return triangle;
+    }
+
     inline Light make_light(glm::vec3 position, glm::vec3 direction, glm::vec3 intensity) {
         Light light = {};
         light.position = { position.x, position.y, position.z, 0.0f };
@@ -7,51 +7,103 @@ namespace LSIS {
 		return glm::vec3(in.x, in.y, in.z);
 	}
 
-	TypedBuffer<cl_float> LSIS::build_power_sampling_buffer(const SHARED::Light* lights, const size_t num_lights)
+	std::vector<SHARED::AliasEntry> build_power_alias_table(const SHARED::Light* lights, const size_t num_lights)
 	{
 		if (num_lights == 0) {
-			return TypedBuffer<cl_float>();
+			return std::vector<SHARED::AliasEntry>();
 		}
 
-		cl::CommandQueue queue = Compute::GetCommandQueue();
-
-		float* areas = new float[num_lights];
-		float* cdf = new float[2 * num_lights];
+		std::vector<double> weights = std::vector<double>(num_lights);
+		std::vector<float> areas = std::vector<float>(num_lights);
 
-		float sum_area = 0.0f;
-		for (uint32_t i = 0; i < num_lights; i++) {
-			SHARED::Light light = lights[i];
-			cl_float4 color = light.intensity;
+		double sum_power = 0.0;
+		for (size_t i = 0; i < num_lights; i++) {
+			const SHARED::Light& light = lights[i];
 
 			const glm::vec3 tangent = convert(light.tangent);
 			const glm::vec3 bitangent = convert(light.bitangent);
+			const glm::vec3 intensity = convert(light.intensity);
+
+			areas[i] = glm::length(glm::cross(tangent, bitangent)) * 0.5f;
+			weights[i] = static_cast<double>(intensity.x + intensity.y + intensity.z) * areas[i];
+			sum_power += weights[i];
+		}
+
+		printf("Total Power: %f\n", sum_power);
 
-			const float area = glm::length(glm::cross(tangent, bitangent)) * 0.5f;
-			areas[i] = area;
-			sum_area += area;
+		// Without any power, pick uniformly
+		if (!(sum_power > 0.0)) {
+			std::fill(weights.begin(), weights.end(), 1.0);
+			sum_power = static_cast<double>(num_lights);
 		}
 
-		printf("Total Area: %f\n", sum_area);
+		std::vector<SHARED::AliasEntry> table = std::vector<SHARED::AliasEntry>(num_lights);
+
+		// Scale the weights so the average is 1, and split them into the slots under and over the average
+		std::vector<double> scaled = std::vector<double>(num_lights);
+		std::vector<uint32_t> small, large;
+		small.reserve(num_lights);
+		large.reserve(num_lights);
+		for (size_t i = 0; i < num_lights; i++) {
+			const double pdf = weights[i] / sum_power;
+			// triangle lights are sampled uniformly over their area
+			const bool triangle = lights[i].position.w == 1.0f && areas[i] > 0.0f;
+			table[i].pdf = static_cast<float>(triangle ? pdf / areas[i] : pdf);
+
+			scaled[i] = pdf * static_cast<double>(num_lights);
+			if (scaled[i] < 1.0) {
+				small.push_back(static_cast<uint32_t>(i));
+			}
+			else {
+				large.push_back(static_cast<uint32_t>(i));
+			}
+		}
+
+		// Fill each small slot up to 1 with the remainder from a large slot
+		while (!small.empty() && !large.empty()) {
+			const uint32_t s = small.back();
+			const uint32_t l = large.back();
+			small.pop_back();
 
-		const float inv_sum = 1.0f / sum_area;
+			table[s].probability = static_cast<float>(scaled[s]);
+			table[s].alias = l;
 
-		float accum = 0.0f;
-		//cdf[0] = 0.0f;
-		for (uint32_t i = 0; i < num_lights; i++) {
-			const float pdf = areas[i] * inv_sum;
-			cdf[i] = accum;
-			cdf[i + num_lights] = 1.0f * inv_sum; // write pdf
-			accum += pdf;
-			//cdf[i] = (powers[i]*inv_sum) + cdf[i - 1];
+			scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+			if (scaled[l] < 1.0) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+
+		// The remaining slots are full, apart from rounding errors
+		for (uint32_t i : large) {
+			table[i].probability = 1.0f;
+			table[i].alias = i;
+		}
+		for (uint32_t i : small) {
+			table[i].probability = 1.0f;
+			table[i].alias = i;
 		}
 
-		TypedBuffer<cl_float> sampling_buffer = TypedBuffer<cl_float>(Compute::GetContext(), CL_MEM_READ_ONLY, num_lights * 2);
-		CHECK(queue.enqueueWriteBuffer(sampling_buffer.GetBuffer(), CL_TRUE, 0, sizeof(cl_float) * (num_lights * 2), (void*)cdf));
+		for (size_t i = 0; i < num_lights; i++) {
+			table[i].pdf_alias = table[table[i].alias].pdf;
+		}
+
+		return table;
+	}
+
+	TypedBuffer<SHARED::AliasEntry> LSIS::build_power_sampling_buffer(const SHARED::Light* lights, const size_t num_lights)
+	{
+		if (num_lights == 0) {
+			return TypedBuffer<SHARED::AliasEntry>();
+		}
+
+		cl::CommandQueue queue = Compute::GetCommandQueue();
 
+		const std::vector<SHARED::AliasEntry> table = build_power_alias_table(lights, num_lights);
 
-		// Cleanup
-		delete[] areas;
-		delete[] cdf;
+		TypedBuffer<SHARED::AliasEntry> sampling_buffer = TypedBuffer<SHARED::AliasEntry>(Compute::GetContext(), CL_MEM_READ_ONLY, num_lights);
+		CHECK(queue.enqueueWriteBuffer(sampling_buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::AliasEntry) * num_lights, table.data()));
 
 		return sampling_buffer;
 	}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 #include "Light/Light.h"
 #include "Compute/Buffer.h"
@@ -21,6 +22,12 @@ namespace LSIS {
 	private:
 	};
 
-	TypedBuffer<cl_float> build_power_sampling_buffer(const SHARED::Light* lights, const size_t num_lights);
+	// Alias table for picking lights proportional to their power, intensity * area. Built with Vose's method in O(n)
+	std::vector<SHARED::AliasEntry> build_power_alias_table(const SHARED::Light* lights, const size_t num_lights);
+	// The alias table uploaded to the device
+	TypedBuffer<SHARED::AliasEntry> build_power_sampling_buffer(const SHARED::Light* lights, const size_t num_lights);
+
+	// Cost of a cluster of lights for agglomerative clustering, lower is more similar
+	float similarity(float intensity, float diagonal, float half_angle, float scaling);
 
 }
\ No newline at end of file
@@ -3,13 +3,50 @@
 
 #include "Core/Timer.h"
 
+#include <cstring>
+
 #include "gtc/constants.hpp"
 #include "gtx/rotate_vector.hpp"
 
 namespace LSIS {
 
-	LightTree::LightTree(const SHARED::Light* lights, const size_t num_lights, size_t K)
-		: m_K(K)
+	// Subtrees with more lights than this are built as separate tasks
+	static constexpr int s_task_threshold = 1 << 10;
+	// Nodes with more lights than this are binned on all threads
+	static constexpr int s_parallel_binning_threshold = 1 << 16;
+	// Number of lights binned per chunk. Fixed so the result is the same for any number of threads
+	static constexpr int s_binning_chunk_size = 1 << 13;
+	// Nodes with at most this many lights are split by an exact sweep over the sorted lights instead of binning
+	static constexpr int s_sweep_threshold = 16;
+	// Fewest bins used for a binned node. Above it the bin count grows with the number of lights, up to K
+	static constexpr int s_min_bins = 16;
+
+	// Unused w components don't count as changes
+	static inline bool equal_xyz(const cl_float4& a, const cl_float4& b)
+	{
+		return a.x == b.x && a.y == b.y && a.z == b.z;
+	}
+
+	static inline bool equal_xyzw(const cl_float4& a, const cl_float4& b)
+	{
+		return equal_xyz(a, b) && a.w == b.w;
+	}
+
+	// Compares the fields read by the kernels, ignoring the padding
+	static inline bool same_light(const SHARED::Light& a, const SHARED::Light& b)
+	{
+		return equal_xyzw(a.position, b.position) && equal_xyzw(a.direction, b.direction) && equal_xyz(a.intensity, b.intensity)
+			&& equal_xyz(a.tangent, b.tangent) && equal_xyz(a.bitangent, b.bitangent);
+	}
+
+	static inline bool same_node(const SHARED::LightTreeNode& a, const SHARED::LightTreeNode& b)
+	{
+		return equal_xyz(a.pmin, b.pmin) && equal_xyz(a.pmax, b.pmax) && equal_xyzw(a.axis, b.axis) && equal_xyzw(a.energy, b.energy)
+			&& a.left == b.left && a.right == b.right && a.type == b.type;
+	}
+
+	LightTree::LightTree(const SHARED::Light* lights, const size_t num_lights, size_t K, size_t max_leaf_size)
+		: m_K(K), m_max_leaf_size(glm::max<size_t>(max_leaf_size, 1))
 	{
 		//PROFILE_SCOPE("LightTree Construction");
 		if (num_lights == 0) {
@@ -17,28 +54,65 @@ namespace LSIS {
 			return;
 		}
 
-		// Allocate node buffer
+		// Allocate node buffer. Multi light leaves leaves some of the nodes unused until the tree is compacted
 		m_num_nodes = num_lights * 2L - 1L;
 		m_nodes = new SHARED::LightTreeNode[m_num_nodes];
+		m_leaf_cdf.resize(num_lights);
+
+		// Allocate build data from the scratch arena of this thread. It is reused by later builds, and freed when the scope ends
+		Arena& arena = Arena::GetScratch();
+		Arena::Scope arena_scope(arena);
+		build_data data = allocate_build_data(arena, num_lights);
+
+		// Initialize build data
+		initialize_build_data(data, lights, num_lights);
+
+		// Allocate bins and splits for each thread in the pool
+		ThreadPool& pool = ThreadPool::Get();
+		scratch_list scratch = allocate_scratch(arena);
+
+		// Build the tree from the root. Returns when all subtrees has been built
+		ThreadPool::TaskGroup group;
+		build_subtree(data, scratch, group, { 0, 0, (int)num_lights });
+		pool.Wait(group);
+
+		// Store the lights in the order referenced by the leaves
+		m_lights.resize(num_lights);
+		m_light_ids.resize(num_lights);
+		for (size_t i = 0; i < num_lights; i++) {
+			m_lights[i] = lights[data.ids[i]];
+			m_light_ids[i] = data.ids[i];
+		}
 
-		// Allocate build data
-		build_data data = allocate_build_data(num_lights);
-		int next_index = 0;
+		if (m_max_leaf_size > 1) {
+			compact_nodes();
+		}
 
-		// Initialize build data and calculate total bound for all lights
-		bound lights_bound = initialize_build_data(data, lights, num_lights);
+		// Keep the measures of the built tree, to tell when refitting has degraded it
+		m_node_measure.resize(m_num_nodes);
+		pool.ParallelFor(0, m_num_nodes, [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				m_node_measure[i] = node_measure(m_nodes[i]);
+			}
+		});
+	}
+	void LightTree::build_subtree(build_data& data, scratch_list& scratch, ThreadPool::TaskGroup& group, queue_data root)
+	{
+		const int num_lights = static_cast<int>(m_leaf_cdf.size());
 
-		// Initialize queue and push the root node
-		auto queue = std::queue<queue_data>();
-		queue.push({ next_index++, 0, (int)num_lights});
+		// A task runs on a single thread, so the scratch data can be fetched once.
+		// Tasks executed by this thread while it waits inside bin_lights_parallel also use it, but nothing is kept in it across that wait
+		build_scratch& local = scratch[ThreadPool::GetThreadIndex()];
+		bin_data* bins = local.bins;
+		split_data* splits = local.splits;
 
-		bin_data bins[3] = { bin_data(m_K),bin_data(m_K),bin_data(m_K) };
-		split_data splits[3] = { split_data(m_K),split_data(m_K),split_data(m_K) };
+		// Use a local stack to avoid stack overflow with many lights
+		std::vector<queue_data> stack;
+		stack.push_back(root);
 
-		// Do recursive function using queue to avoid stack overflow with many lights
-		while (!queue.empty()) {
-			// Fetch next iteration data from the queue and pop the element
-			const auto [index, left, right] = queue.front(); queue.pop();
+		while (!stack.empty()) {
+			// Fetch next iteration data from the stack and pop the element
+			const auto [index, left, right] = stack.back(); stack.pop_back();
 			//printf("index: %d, left: %d, right: %d\n", index, left, right);
 			CORE_ASSERT(index >= 0 && index < m_num_nodes, "index out of bounds!");
 			CORE_ASSERT(left >= 0 && left < num_lights, "left is out of bounds!");
@@ -49,32 +123,30 @@ namespace LSIS {
 			if (range == 1) { // Is 
 				uint id = data.ids[left];
 
-				const float3 pmin = data.pmin[id];
-				const float3 pmax = data.pmax[id];
-				const float3 axis = data.axis[id];
-				const float3 energy = data.energy[id];
-				const float theta_o = data.theta_o[id];
-				const float theta_e = data.theta_e[id];
+				const float3 pmin = convert(data.pmin[id]);
+				const float3 pmax = convert(data.pmax[id]);
+				const float3 energy = convert(data.energy[id]);
+				const bcone cone = make_bcone(data.axis[id], data.theta_o[id], data.theta_e[id]);
 
-				m_nodes[index] = SHARED::make_light_tree_leaf(pmin, pmax, axis, energy, theta_o, theta_e, id, 1);
+				make_leaf(data, index, left, right, pmin, pmax, cone, energy);
 			}
-			else if (range == 2) {
+			else if (range == 2 && m_max_leaf_size < 2) {
 
-				const int index_left = next_index++;
-				const int index_right = next_index++;
+				const int index_left = index + 1;
+				const int index_right = index + 2;
 				const int middle = left + 1;
 
 				uint id_l = data.ids[left];
 				uint id_r = data.ids[left + 1];
 
-				bbox box_left = make_bbox(data.pmin[id_l], data.pmax[id_l]);
-				bbox box_right = make_bbox(data.pmin[id_r], data.pmax[id_r]);
+				bbox box_left = make_bbox(convert(data.pmin[id_l]), convert(data.pmax[id_l]));
+				bbox box_right = make_bbox(convert(data.pmin[id_r]), convert(data.pmax[id_r]));
 
 				bcone cone_left = make_bcone(data.axis[id_l], data.theta_o[id_l], data.theta_e[id_l]);
 				bcone cone_right = make_bcone(data.axis[id_r], data.theta_o[id_r], data.theta_e[id_r]);
 
-				float3 energy_left = data.energy[id_l];
-				float3 energy_right = data.energy[id_r];
+				float3 energy_left = convert(data.energy[id_l]);
+				float3 energy_right = convert(data.energy[id_r]);
 
 				bbox box = union_bbox(box_left, box_right);
 				bcone cone = union_bcone(cone_left, cone_right);
@@ -84,52 +156,40 @@ namespace LSIS {
 				m_nodes[index] = SHARED::make_light_tree_node(box.pmin, box.pmax, cone.axis, energy, cone.theta_o, cone.theta_e, index_left, index_right);
 
 				// and create the two child nodes. No need for queing
-				m_nodes[index_left] = SHARED::make_light_tree_leaf(box_left.pmin, box_left.pmax, cone_left.axis, energy_left, cone_left.theta_o, cone_left.theta_e, id_l, 1);
-				m_nodes[index_right] = SHARED::make_light_tree_leaf(box_right.pmin, box_right.pmax, cone_right.axis, energy_right, cone_right.theta_o, cone_right.theta_e, id_r, 1);
+				make_leaf(data, index_left, left, middle, box_left.pmin, box_left.pmax, cone_left, energy_left);
+				make_leaf(data, index_right, middle, right, box_right.pmin, box_right.pmax, cone_right, energy_right);
 			}
 			else { // Is Internal
 
-				// set the counts to zero to indicate the bins are empty
-				init_bins(bins[0]);
-				init_bins(bins[1]);
-				init_bins(bins[2]);
-
-				bin total = {};
-				bin_init(total);
-
-				bbox cb = make_bbox();
+				__m128 cb_min = _mm_set1_ps(std::numeric_limits<float>::infinity());
+				__m128 cb_max = _mm_set1_ps(-std::numeric_limits<float>::infinity());
 				for (int i = left; i < right; i++) {
-					float3 c_i = data.centers[data.ids[i]];
-					cb = union_bbox(cb, make_bbox(c_i));
+					const __m128 c_i = data.centers[data.ids[i]];
+					cb_min = _mm_min_ps(cb_min, c_i);
+					cb_max = _mm_max_ps(cb_max, c_i);
 				}
+				const bbox cb = make_bbox(convert(cb_min), convert(cb_max));
 
 				const float3 diagonal = cb.pmax - cb.pmin;
 				//const uint k = max_axis(diagonal);
+
+				// Small nodes get one bin per light, in sorted order along each axis. Larger nodes use fewer bins than K until there are enough lights to fill them
+				const bool sweep = range <= s_sweep_threshold;
+				const int num_bins = sweep ? range : static_cast<int>(glm::min<size_t>(m_K, glm::max(s_min_bins, range / 2)));
 				const float3 k0 = cb.pmin;
-				const float3 k1 = (static_cast<float>(K) * (1.0f - 1e-6f)) / (diagonal);
+				const float3 k1 = (static_cast<float>(num_bins) * (1.0f - 1e-6f)) / (diagonal);
 
 				// Calculate bins
-				for (int i = left; i < right; i++) {
-					const uint id = data.ids[i];
-					const float3 c_i = data.centers[id];
-					const glm::ivec3 bin_id = static_cast<glm::ivec3>(k1 * (c_i - k0));
-
-					const bbox cb_i = make_bbox(c_i);
-					const bbox box_i = make_bbox(data.pmin[id], data.pmax[id]);
-					const bcone cone_i = make_bcone(data.axis[id], data.theta_o[id], data.theta_e[id]);
-					const float3 e_i = data.energy[id];
-
-					bin_update(total, cb_i, box_i, cone_i, e_i);
-
-					for (int k = 0; k < 3; k++) {
-						if (diagonal[k] <= 0.0f)
-							continue;
-						CORE_ASSERT(bin_id[k] >= 0 && bin_id[k] < K, "Bin ID out of bounds!");
-						bin_update(bins[k].data[bin_id[k]], cb_i, box_i, cone_i, e_i);
-
-					}
-
-
+				bin total = {};
+				if (sweep) {
+					sweep_lights(data, local, total, left, right, diagonal);
+				}
+				else if (range >= s_parallel_binning_threshold) {
+					bin_lights_parallel(data, local, total, left, right, num_bins, k0, k1, diagonal);
+				}
+				else {
+					bin* const bin_ptrs[3] = { bins[0].data, bins[1].data, bins[2].data };
+					bin_lights(data, bin_ptrs, total, left, right, num_bins, k0, k1, diagonal);
 				}
 
 				const float3 K_r = glm::max(glm::max(diagonal.x, diagonal.y), diagonal.z) / diagonal;
@@ -143,7 +203,7 @@ namespace LSIS {
 					if (diagonal[k] <= 0.0f)
 						continue;
 
-					calculate_splits(splits[k], bins[k]);
+					calculate_splits(splits[k], bins[k], num_bins);
 
 					float cost;
 					const int index = find_best_split(splits[k], K_r[k], &cost);
@@ -158,49 +218,446 @@ namespace LSIS {
 				int middle;
 				if (best_k == -1) {
 					best_k = max_axis(diagonal);
-					best_split = K / 2;
+					best_split = static_cast<int>(m_K / 2);
 					//printf("Failed to find split!\n");
 					//printf("Range: %d\n", range);
 					middle = left + range / 2;
 				}
+				else if (sweep) {
+					// The lights are split after the best bin in the sorted order
+					std::copy(local.order[best_k], local.order[best_k] + range, data.ids + left);
+					middle = left + best_split + 1;
+				}
 				else {
 					middle = reorder_id(data, left, right, best_split, best_k, k0[best_k], k1[best_k]);
 				}
 
-				const float3 pmin =	total.box.pmin;
-				const float3 pmax = total.box.pmax;
+				const float3 pmin = convert(total.box_min);
+				const float3 pmax = convert(total.box_max);
 				const float3 axis = total.cone.axis;
 				const float theta_o = total.cone.theta_o;
 				const float theta_e = total.cone.theta_e;
 
-				constexpr int max_light_per_node = 1;
-
-				if (range <= max_light_per_node && best_cost >= total.energy.x + total.energy.y + total.energy.z) {
+				// The cost of a leaf is the energy of all its lights, as they are picked without spatial information
+				if (range <= m_max_leaf_size && best_cost >= component(total.energy, 0) + component(total.energy, 1) + component(total.energy, 2)) {
 					//printf("Range: %d, Don't devide!\n", range);
-					m_nodes[index] = SHARED::make_light_tree_leaf(pmin, pmax, axis, total.energy, theta_o, theta_e, data.ids[left], range);
+					make_leaf(data, index, left, right, pmin, pmax, total.cone, convert(total.energy));
 				}
 				else {
 					//printf("Range: %d, Divide!\n", range);
 
 					//const int middle = left + (range / 2);
-					const int index_left = next_index++;
-					const int index_right = next_index++;
+					// Depth first layout. The left subtree is stored right after this node, followed by the right subtree
+					const int index_left = index + 1;
+					const int index_right = index + 2 * (middle - left);
 
-					m_nodes[index] = SHARED::make_light_tree_node(pmin, pmax, axis, total.energy, theta_o, theta_e, index_left, index_right);
+					m_nodes[index] = SHARED::make_light_tree_node(pmin, pmax, axis, convert(total.energy), theta_o, theta_e, index_left, index_right);
 
 					//printf("index: %d, left: %d, middle: %d, right: %d\n", index, left, middle, right);
 
 					CORE_ASSERT(left != middle && middle != right, "only non zero ranges are allowed!");
 
-					queue.push({ index_left, left, middle });
-					queue.push({ index_right, middle, right });
+					const queue_data item_left = { index_left, left, middle };
+					const queue_data item_right = { index_right, middle, right };
+
+					// Large subtrees are handed to the pool, so idle threads can steal them
+					if (right - middle >= s_task_threshold) {
+						ThreadPool::Get().Submit(group, [this, data, &scratch, &group, item_right]() mutable { build_subtree(data, scratch, group, item_right); });
+					}
+					else {
+						stack.push_back(item_right);
+					}
+					stack.push_back(item_left);
 				}
 
 			}
 		}
+	}
+	inline void LightTree::bin_lights(const build_data& data, bin* const bins[3], bin& total, int left, int right, int num_bins, const float3& k0, const float3& k1, const float3& diagonal)
+	{
+		// set the counts to zero to indicate the bins are empty
+		for (int k = 0; k < 3; k++) {
+			for (int i = 0; i < num_bins; i++) {
+				bin_init(bins[k][i]);
+			}
+		}
+		bin_init(total);
+
+		const __m128 k0_v = convert_simd(k0);
+		const __m128 k1_v = convert_simd(k1);
+		const bool active[3] = { diagonal.x > 0.0f, diagonal.y > 0.0f, diagonal.z > 0.0f };
+
+		for (int i = left; i < right; i++) {
+			const uint id = data.ids[i];
+			const __m128 pmin_i = data.pmin[id];
+			const __m128 pmax_i = data.pmax[id];
+			const __m128 e_i = data.energy[id];
+
+			// Bin ids for all three axis at once
+			alignas(16) int bin_id[4];
+			_mm_store_si128(reinterpret_cast<__m128i*>(bin_id), _mm_cvttps_epi32(_mm_mul_ps(k1_v, _mm_sub_ps(data.centers[id], k0_v))));
 
-		// Delete build data
-		delete_build_data(data);
+			const bcone cone_i = make_bcone(data.axis[id], data.theta_o[id], data.theta_e[id]);
+
+			bin_update(total, pmin_i, pmax_i, cone_i, e_i);
+
+			for (int k = 0; k < 3; k++) {
+				if (!active[k])
+					continue;
+				CORE_ASSERT(bin_id[k] >= 0 && bin_id[k] < num_bins, "Bin ID out of bounds!");
+				bin_update(bins[k][bin_id[k]], pmin_i, pmax_i, cone_i, e_i);
+			}
+		}
+	}
+	inline void LightTree::bin_lights_parallel(const build_data& data, build_scratch& scratch, bin& total, int left, int right, int num_bins, const float3& k0, const float3& k1, const float3& diagonal)
+	{
+		ThreadPool& pool = ThreadPool::Get();
+		const size_t num_chunks = (right - left + s_binning_chunk_size - 1) / s_binning_chunk_size;
+
+		// Each chunk gets its own set of bins, which avoids synchronization while binning.
+		// Tasks run by this thread while it waits allocate after them, and rewind before returning
+		Arena& arena = Arena::GetScratch();
+		Arena::Scope arena_scope(arena);
+		bin* chunk_bins = arena.Allocate<bin>(num_chunks * 3 * num_bins);
+		bin* chunk_totals = arena.Allocate<bin>(num_chunks);
+
+		pool.ParallelFor(left, right, num_chunks, [&](size_t begin, size_t end, size_t chunk) {
+			bin* const bins[3] = { &chunk_bins[(chunk * 3 + 0) * num_bins], &chunk_bins[(chunk * 3 + 1) * num_bins], &chunk_bins[(chunk * 3 + 2) * num_bins] };
+			bin_lights(data, bins, chunk_totals[chunk], static_cast<int>(begin), static_cast<int>(end), num_bins, k0, k1, diagonal);
+		});
+
+		// Merge the chunks in order, so the result doesn't depend on the scheduling
+		for (int k = 0; k < 3; k++) {
+			init_bins(scratch.bins[k], num_bins);
+		}
+		bin_init(total);
+
+		for (size_t c = 0; c < num_chunks; c++) {
+			for (int k = 0; k < 3; k++) {
+				for (int i = 0; i < num_bins; i++) {
+					bin_union(scratch.bins[k].data[i], chunk_bins[(c * 3 + k) * num_bins + i]);
+				}
+			}
+			bin_union(total, chunk_totals[c]);
+		}
+	}
+	inline void LightTree::sweep_lights(const build_data& data, build_scratch& scratch, bin& total, int left, int right, const float3& diagonal)
+	{
+		const int range = right - left;
+		CORE_ASSERT(range <= s_sweep_threshold, "Too many lights for the sweep!");
+
+		bin_init(total);
+		for (int i = left; i < right; i++) {
+			const uint id = data.ids[i];
+			bin_update(total, data.pmin[id], data.pmax[id], make_bcone(data.axis[id], data.theta_o[id], data.theta_e[id]), data.energy[id]);
+		}
+
+		for (int k = 0; k < 3; k++) {
+			if (diagonal[k] <= 0.0f)
+				continue;
+
+			// Sort by the center, with ties broken by the id so the order is deterministic
+			uint* order = scratch.order[k];
+			std::copy(data.ids + left, data.ids + right, order);
+			std::sort(order, order + range, [&](uint a, uint b) {
+				const float c_a = component(data.centers[a], k);
+				const float c_b = component(data.centers[b], k);
+				return c_a < c_b || (c_a == c_b && a < b);
+			});
+
+			for (int i = 0; i < range; i++) {
+				const uint id = order[i];
+				bin& b = scratch.bins[k].data[i];
+				bin_init(b);
+				bin_update(b, data.pmin[id], data.pmax[id], make_bcone(data.axis[id], data.theta_o[id], data.theta_e[id]), data.energy[id]);
+			}
+		}
+	}
+	inline void LightTree::make_leaf(const build_data& data, const int index, const int left, const int right, const float3& pmin, const float3& pmax, const bcone& cone, const float3& energy)
+	{
+		m_nodes[index] = SHARED::make_light_tree_leaf(pmin, pmax, cone.axis, energy, cone.theta_o, cone.theta_e, left, right - left);
+
+		// Pick lights within the leaf proportional to their energy
+		float sum = 0.0f;
+		for (int i = left; i < right; i++) {
+			const __m128 e_i = data.energy[data.ids[i]];
+			sum += component(e_i, 0) + component(e_i, 1) + component(e_i, 2);
+			m_leaf_cdf[i] = sum;
+		}
+		for (int i = left; i < right; i++) {
+			m_leaf_cdf[i] = sum > 0.0f ? m_leaf_cdf[i] / sum : static_cast<float>(i - left + 1) / static_cast<float>(right - left);
+		}
+		// Guard against rounding, so the last light is always picked when the others aren't
+		m_leaf_cdf[right - 1] = 1.0f;
+	}
+	void LightTree::compact_nodes()
+	{
+		// Find the new index of all reachable nodes. Visiting the left child first keeps it right after its parent
+		std::vector<int> remap(m_num_nodes, -1);
+		std::vector<int> stack = { 0 };
+		int next_index = 0;
+		while (!stack.empty()) {
+			const int index = stack.back(); stack.pop_back();
+			remap[index] = next_index++;
+
+			const SHARED::LightTreeNode& node = m_nodes[index];
+			if (node.type == 1) {
+				stack.push_back(node.right);
+				stack.push_back(node.left);
+			}
+		}
+
+		// Move the nodes to their new position. The new index is never larger than the old, so it can be done in place
+		for (size_t i = 0; i < m_num_nodes; i++) {
+			if (remap[i] == -1)
+				continue;
+			SHARED::LightTreeNode node = m_nodes[i];
+			if (node.type == 1) {
+				node.left = remap[node.left];
+				node.right = remap[node.right];
+			}
+			m_nodes[remap[i]] = node;
+		}
+		m_num_nodes = next_index;
+	}
+	void LightTree::Refit(const SHARED::Light* lights, const size_t num_lights, float rebuild_threshold)
+	{
+		CORE_ASSERT(num_lights == m_lights.size(), "the number of lights can't change when refitting!");
+		if (m_num_nodes == 0)
+			return;
+
+		m_node_dirty.assign(m_num_nodes, 0);
+		m_light_dirty.assign(num_lights, 0);
+
+		// Gather the lights in the order of the tree
+		ThreadPool& pool = ThreadPool::Get();
+		pool.ParallelFor(0, num_lights, [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				const SHARED::Light& light = lights[m_light_ids[i]];
+				if (!same_light(light, m_lights[i])) {
+					m_lights[i] = light;
+					m_light_dirty[i] = 1;
+				}
+			}
+		});
+
+		// The build data is indexed by the position in m_lights
+		Arena& arena = Arena::GetScratch();
+		Arena::Scope arena_scope(arena);
+		build_data data = allocate_build_data(arena, num_lights);
+		initialize_build_data(data, m_lights.data(), num_lights);
+
+		// Split the tree in small subtrees, which are refitted as independent tasks, and the nodes above them
+		std::vector<int> top_nodes;
+		std::vector<int> subtrees;
+		std::vector<int> stack = { 0 };
+		while (!stack.empty()) {
+			const int index = stack.back(); stack.pop_back();
+			const LightTreeNode& node = m_nodes[index];
+			if (node.type == 1 && subtree_end(index) - index > 2 * s_task_threshold) {
+				top_nodes.push_back(index);
+				stack.push_back(node.right);
+				stack.push_back(node.left);
+			}
+			else {
+				subtrees.push_back(index);
+			}
+		}
+
+		// A subtree is stored depth first after its root, so visiting the nodes in reverse refits the children before their parent
+		pool.ParallelFor(0, subtrees.size(), subtrees.size(), [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				const int root = subtrees[i];
+				for (int index = subtree_end(root) - 1; index >= root; index--) {
+					refit_node(data, index);
+				}
+			}
+		});
+
+		// The top nodes were visited in preorder, so the same holds for them in reverse
+		for (auto it = top_nodes.rbegin(); it != top_nodes.rend(); ++it) {
+			refit_node(data, *it);
+		}
+
+		if (rebuild_threshold > 0.0f) {
+			// Rebuild the highest nodes that have degraded past the threshold. Each subtree may use the nodes up to the start of the next subtree
+			scratch_list scratch = nullptr;
+			std::vector<int> ancestors;
+			bool rebuilt = false;
+			std::vector<std::pair<int, int>> rebuild_stack = { { 0, static_cast<int>(m_num_nodes) } };
+			while (!rebuild_stack.empty()) {
+				const auto [index, end] = rebuild_stack.back(); rebuild_stack.pop_back();
+				const LightTreeNode node = m_nodes[index];
+				if (node.type != 1)
+					continue;
+
+				if (m_node_measure[index] > 0.0f && node_measure(node) > rebuild_threshold * m_node_measure[index]) {
+					if (scratch == nullptr) {
+						scratch = allocate_scratch(arena);
+					}
+					if (rebuild_subtree(data, scratch, index, end)) {
+						rebuilt = true;
+						continue;
+					}
+				}
+
+				ancestors.push_back(index);
+				rebuild_stack.push_back({ node.right, end });
+				rebuild_stack.push_back({ node.left, node.right });
+			}
+
+			// The union of a rebuilt subtree can differ slightly from the refitted, so the nodes above are refitted again
+			if (rebuilt) {
+				for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
+					refit_node(data, *it);
+				}
+			}
+		}
+	}
+	inline void LightTree::refit_node(const build_data& data, const int index)
+	{
+		const LightTreeNode old_node = m_nodes[index];
+		if (old_node.type == 1) {
+			const LightTreeNode& left = m_nodes[old_node.left];
+			const LightTreeNode& right = m_nodes[old_node.right];
+
+			const bbox box = union_bbox(make_bbox(convert(left.pmin), convert(left.pmax)), make_bbox(convert(right.pmin), convert(right.pmax)));
+			const bcone cone = union_bcone(make_bcone(convert(left.axis), THETA_O(left), THETA_E(left)), make_bcone(convert(right.axis), THETA_O(right), THETA_E(right)));
+			const float3 energy = convert(left.energy) + convert(right.energy);
+
+			m_nodes[index] = SHARED::make_light_tree_node(box.pmin, box.pmax, cone.axis, energy, cone.theta_o, cone.theta_e, old_node.left, old_node.right);
+			if (!same_node(old_node, m_nodes[index])) {
+				m_node_dirty[index] = 1;
+			}
+		}
+		else {
+			// Empty leaves are unused nodes left by a rebuild
+			if (COUNT(old_node) == 0)
+				return;
+
+			const int first = INDEX(old_node);
+			const int last = first + COUNT(old_node);
+
+			bbox box = make_bbox(convert(data.pmin[first]), convert(data.pmax[first]));
+			bcone cone = make_bcone(data.axis[first], data.theta_o[first], data.theta_e[first]);
+			float3 energy = convert(data.energy[first]);
+			for (int i = first + 1; i < last; i++) {
+				box = union_bbox(box, make_bbox(convert(data.pmin[i]), convert(data.pmax[i])));
+				cone = union_bcone(cone, make_bcone(data.axis[i], data.theta_o[i], data.theta_e[i]));
+				energy += convert(data.energy[i]);
+			}
+
+			// Also updates the cdf of the leaf
+			make_leaf(data, index, first, last, box.pmin, box.pmax, cone, energy);
+			if (!same_node(old_node, m_nodes[index])) {
+				m_node_dirty[index] = 1;
+				std::fill(m_light_dirty.begin() + first, m_light_dirty.begin() + last, uint8_t(1));
+			}
+		}
+	}
+	bool LightTree::rebuild_subtree(build_data& data, scratch_list& scratch, const int index, const int end)
+	{
+		int first, last;
+		subtree_lights(index, first, last);
+		const int range = last - first;
+
+		// Build into temporary nodes, since the new subtree can need a different number of nodes with multi light leaves
+		SHARED::LightTreeNode* tree_nodes = m_nodes;
+		size_t tree_num_nodes = m_num_nodes;
+		m_nodes = new SHARED::LightTreeNode[range * 2 - 1];
+		m_num_nodes = range * 2 - 1;
+
+		const std::vector<float> old_cdf(m_leaf_cdf.begin() + first, m_leaf_cdf.begin() + last);
+
+		ThreadPool::TaskGroup group;
+		build_subtree(data, scratch, group, { 0, first, last });
+		ThreadPool::Get().Wait(group);
+
+		if (m_max_leaf_size > 1) {
+			compact_nodes();
+
+			// Multi light leaves can make the new subtree larger than the old. Merge sibling leaves bottom up until it fits, each merge frees two nodes
+			int excess = static_cast<int>(m_num_nodes) - (end - index);
+			for (int i = static_cast<int>(m_num_nodes) - 1; i >= 0 && excess > 0; i--) {
+				const LightTreeNode node = m_nodes[i];
+				if (node.type != 1 || m_nodes[node.left].type != 0 || m_nodes[node.right].type != 0)
+					continue;
+				const int leaf_first = INDEX(m_nodes[node.left]);
+				const int leaf_last = INDEX(m_nodes[node.right]) + COUNT(m_nodes[node.right]);
+				if (leaf_last - leaf_first > 255)
+					continue;
+				make_leaf(data, i, leaf_first, leaf_last, convert(node.pmin), convert(node.pmax), make_bcone(convert(node.axis), THETA_O(node), THETA_E(node)), convert(node.energy));
+				excess -= 2;
+			}
+			if (excess < static_cast<int>(m_num_nodes) - (end - index)) {
+				compact_nodes();
+			}
+		}
+
+		std::swap(tree_nodes, m_nodes);
+		std::swap(tree_num_nodes, m_num_nodes);
+		SHARED::LightTreeNode* new_nodes = tree_nodes;
+		const int num_new_nodes = static_cast<int>(tree_num_nodes);
+
+		if (num_new_nodes > end - index) {
+			// Restore the old subtree
+			std::copy(old_cdf.begin(), old_cdf.end(), m_leaf_cdf.begin() + first);
+			for (int i = first; i < last; i++) {
+				data.ids[i] = i;
+			}
+			delete[] new_nodes;
+			return false;
+		}
+
+		// Move the subtree in place. Left over nodes become empty leaves
+		for (int i = 0; i < num_new_nodes; i++) {
+			LightTreeNode node = new_nodes[i];
+			if (node.type == 1) {
+				node.left += index;
+				node.right += index;
+			}
+			m_nodes[index + i] = node;
+			m_node_measure[index + i] = node_measure(node);
+		}
+		for (int i = index + num_new_nodes; i < end; i++) {
+			m_nodes[i] = SHARED::make_light_tree_leaf(float3(0.0f), float3(0.0f), float3(0.0f, 0.0f, 1.0f), float3(0.0f), 0.0f, 0.0f, 0, 0);
+			m_node_measure[i] = 0.0f;
+		}
+		delete[] new_nodes;
+
+		// Reorder the lights as referenced by the new leaves
+		std::vector<SHARED::Light> lights(m_lights.begin() + first, m_lights.begin() + last);
+		std::vector<uint> light_ids(m_light_ids.begin() + first, m_light_ids.begin() + last);
+		for (int i = first; i < last; i++) {
+			m_lights[i] = lights[data.ids[i] - first];
+			m_light_ids[i] = light_ids[data.ids[i] - first];
+		}
+
+		std::fill(m_node_dirty.begin() + index, m_node_dirty.begin() + end, uint8_t(1));
+		std::fill(m_light_dirty.begin() + first, m_light_dirty.begin() + last, uint8_t(1));
+		return true;
+	}
+	inline int LightTree::subtree_end(int index) const
+	{
+		// The last node of a subtree is its rightmost leaf
+		while (m_nodes[index].type == 1) {
+			index = m_nodes[index].right;
+		}
+		return index + 1;
+	}
+	inline void LightTree::subtree_lights(int index, int& first, int& last) const
+	{
+		int leftmost = index;
+		while (m_nodes[leftmost].type == 1) {
+			leftmost = m_nodes[leftmost].left;
+		}
+		const int rightmost = subtree_end(index) - 1;
+		first = INDEX(m_nodes[leftmost]);
+		last = INDEX(m_nodes[rightmost]) + COUNT(m_nodes[rightmost]);
+	}
+	inline float LightTree::node_measure(const SHARED::LightTreeNode& node)
+	{
+		return bbox_measure(make_bbox(convert(node.pmin), convert(node.pmax))) * bcone_measure(make_bcone(convert(node.axis), THETA_O(node), THETA_E(node)));
 	}
 	LightTree::~LightTree()
 	{
@@ -222,111 +679,300 @@ namespace LSIS {
 
 		return buffer;
 	}
-	inline LightTree::build_data LightTree::allocate_build_data(size_t size)
+	TypedBuffer<SHARED::CompactLightTreeNode> LightTree::GetCompactNodeBuffer()
 	{
-		build_data data = {};
-		data.pmin = new float3[size];
-		data.pmax = new float3[size];
-		data.centers = new float3[size];
-		data.axis = new float3[size];
-		data.theta_o = new float[size];
-		data.theta_e = new float[size];
-		data.energy = new float3[size];
-		data.ids = new uint[size];
-		return data;
+		if (m_num_nodes == 0)
+			return TypedBuffer<SHARED::CompactLightTreeNode>();
+
+		const std::vector<SHARED::CompactLightTreeNode> nodes = encode_compact_nodes();
+
+		const auto queue = Compute::GetCommandQueue();
+
+		TypedBuffer<SHARED::CompactLightTreeNode> buffer = TypedBuffer<SHARED::CompactLightTreeNode>(Compute::GetContext(), CL_MEM_READ_ONLY, nodes.size());
+		CHECK(queue.enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::CompactLightTreeNode) * nodes.size(), (void*)nodes.data()));
+
+		return buffer;
 	}
-	inline void LightTree::delete_build_data(build_data data)
+	std::vector<SHARED::CompactLightTreeNode> LightTree::encode_compact_nodes()
 	{
-		delete[] data.pmin;
-		delete[] data.pmax;
-		delete[] data.centers;
-		delete[] data.axis;
-		delete[] data.theta_o;
-		delete[] data.theta_e;
-		delete[] data.energy;
-		delete[] data.ids;
+		static_assert(sizeof(SHARED::CompactLightTreeNode) == 32, "compact nodes must be 32 bytes");
+		static_assert(sizeof(SHARED::CompactLightTreeHeader) == sizeof(SHARED::CompactLightTreeNode), "the header must fit in a node");
+
+		std::vector<SHARED::CompactLightTreeNode> compact(m_num_nodes + 1);
+
+		// The header stores the exact root bounds, and the energy the root is relative to
+		const LightTreeNode& root = m_nodes[0];
+		const float3 root_energy = convert(root.energy);
+		float energy_scale = glm::max(root_energy.x, glm::max(root_energy.y, root_energy.z));
+		if (energy_scale <= 0.0f)
+			energy_scale = 1.0f;
+
+		SHARED::CompactLightTreeHeader header = {};
+		header.pmin = { root.pmin.x, root.pmin.y, root.pmin.z, energy_scale };
+		header.pmax = { root.pmax.x, root.pmax.y, root.pmax.z, 0.0f };
+		std::memcpy(compact.data(), &header, sizeof(header));
+
+		// Nodes are encoded relative to the parent as the kernel decodes it, so the quantization errors does not accumulate
+		typedef struct decoded_parent {
+			int index;
+			float3 pmin;
+			float3 pmax;
+			float3 energy;
+		} decoded_parent;
+
+		std::vector<decoded_parent> stack = { { 0, convert(root.pmin), convert(root.pmax), float3(energy_scale) } };
+		while (!stack.empty()) {
+			const decoded_parent parent = stack.back(); stack.pop_back();
+			const LightTreeNode& node = m_nodes[parent.index];
+			SHARED::CompactLightTreeNode& out = compact[parent.index + 1];
+
+			// Round the bounds outwards, so the decoded box contains the node
+			const float3 pmin = convert(node.pmin);
+			const float3 pmax = convert(node.pmax);
+			const float3 step = (parent.pmax - parent.pmin) * (1.0f / 255.0f);
+			uint qmin[3] = { 0, 0, 0 };
+			uint qmax[3] = { 0, 0, 0 };
+			float3 decoded_min, decoded_max;
+			for (int k = 0; k < 3; k++) {
+				if (step[k] > 0.0f) {
+					qmin[k] = glm::clamp<int>(int(glm::floor((pmin[k] - parent.pmin[k]) / step[k])), 0, 255);
+					qmax[k] = glm::clamp<int>(int(glm::ceil((pmax[k] - parent.pmin[k]) / step[k])), 0, 255);
+					while (qmin[k] > 0 && parent.pmin[k] + float(qmin[k]) * step[k] > pmin[k])
+						qmin[k]--;
+					while (qmax[k] < 255 && parent.pmin[k] + float(qmax[k]) * step[k] < pmax[k])
+						qmax[k]++;
+				}
+				decoded_min[k] = parent.pmin[k] + float(qmin[k]) * step[k];
+				decoded_max[k] = parent.pmin[k] + float(qmax[k]) * step[k];
+			}
+
+			// Widen the cone by the error of the encoded axis, and round the angles up
+			const float3 axis = convert(node.axis);
+			out.axis = encode_octahedral(axis);
+			const float axis_error = glm::acos(glm::clamp(glm::dot(axis, decode_octahedral(out.axis)), -1.0f, 1.0f));
+			const float theta_o = glm::min(node.axis.w + axis_error, glm::pi<float>());
+			out.theta = { float_to_half(theta_o, true), float_to_half(node.energy.w, true) };
+
+			// The energy is stored as a fraction of the parents, scaled so small fractions stay out of the subnormal range.
+			// Lights with energy must never get zero importance, so non-zero fractions are at least the smallest half
+			const float3 energy = convert(node.energy);
+			uint16_t fraction[3];
+			float3 decoded_energy;
+			for (int k = 0; k < 3; k++) {
+				const float f = parent.energy[k] > 0.0f ? energy[k] / parent.energy[k] : 0.0f;
+				fraction[k] = float_to_half(f * COMPACT_ENERGY_SCALE, false);
+				if (f > 0.0f && fraction[k] == 0)
+					fraction[k] = 1;
+				decoded_energy[k] = half_to_float(fraction[k]) * (1.0f / COMPACT_ENERGY_SCALE) * parent.energy[k];
+			}
+			out.energy = { fraction[0], fraction[1], fraction[2], 0 };
+
+			if (node.type == 1) {
+				CORE_ASSERT(node.left == parent.index + 1, "the left child must follow its parent!");
+				out.qmin = { cl_uchar(qmin[0]), cl_uchar(qmin[1]), cl_uchar(qmin[2]), 0 };
+				out.child = node.right + 1;
+
+				stack.push_back({ node.right, decoded_min, decoded_max, decoded_energy });
+				stack.push_back({ node.left, decoded_min, decoded_max, decoded_energy });
+			}
+			else {
+				CORE_ASSERT(COUNT(node) > 0 && COUNT(node) <= COMPACT_MAX_LEAF_SIZE, "the light count of a compact leaf must fit in 8 bits!");
+				out.qmin = { cl_uchar(qmin[0]), cl_uchar(qmin[1]), cl_uchar(qmin[2]), cl_uchar(COUNT(node)) };
+				out.child = INDEX(node);
+			}
+			out.qmax = { cl_uchar(qmax[0]), cl_uchar(qmax[1]), cl_uchar(qmax[2]), 0 };
+			out.padding = 0;
+		}
+
+		return compact;
 	}
-	inline LightTree::bound LightTree::initialize_build_data(build_data& data, const SHARED::Light* lights, const size_t num_lights)
+	// Writes the runs of changed elements to the buffer. Runs separated by a few unchanged elements are merged into one write
+	template<typename T>
+	static void write_changes(const cl::CommandQueue& queue, TypedBuffer<T>& buffer, const T* data, const std::vector<uint8_t>& changed)
 	{
-		// Allocate global bound struct
-		bound cb = calc_light_bounds(lights, 0, data);
+		constexpr size_t max_gap = 16;
+		const size_t count = changed.size();
+		size_t i = 0;
+		while (i < count) {
+			if (!changed[i]) {
+				i++;
+				continue;
+			}
+			const size_t begin = i;
+			size_t end = i + 1;
+			for (size_t j = end; j < count && j - end < max_gap; j++) {
+				if (changed[j])
+					end = j + 1;
+			}
+			CHECK(queue.enqueueWriteBuffer(buffer.GetBuffer(), CL_FALSE, sizeof(T) * begin, sizeof(T) * (end - begin), (void*)(data + begin)));
+			i = end;
+		}
+	}
+	void LightTree::UploadNodeChanges(TypedBuffer<SHARED::LightTreeNode>& nodes)
+	{
+		const auto queue = Compute::GetCommandQueue();
 
-		// Handle rest of the lights
-		for (int i = 1; i < num_lights; i++) {
-			bound cb_i = calc_light_bounds(lights, i, data);
+		write_changes(queue, nodes, m_nodes, m_node_dirty);
+		CHECK(queue.finish());
+	}
+	void LightTree::UploadLightChanges(TypedBuffer<SHARED::Light>& lights, TypedBuffer<cl_float>& leaf_cdf)
+	{
+		const auto queue = Compute::GetCommandQueue();
 
-			// Update global bounds
-			cb.spatial = union_bbox(cb.spatial, cb_i.spatial);
-			cb.oriental = union_bcone(cb.oriental, cb_i.oriental);
-		}
+		write_changes(queue, lights, m_lights.data(), m_light_dirty);
+		write_changes(queue, leaf_cdf, m_leaf_cdf.data(), m_light_dirty);
+		CHECK(queue.finish());
+	}
+	TypedBuffer<SHARED::Light> LightTree::GetLightBuffer()
+	{
+		if (m_lights.empty())
+			return TypedBuffer<SHARED::Light>();
+
+		const auto queue = Compute::GetCommandQueue();
+
+		TypedBuffer<SHARED::Light> buffer = TypedBuffer<SHARED::Light>(Compute::GetContext(), CL_MEM_READ_ONLY, m_lights.size());
+		CHECK(queue.enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Light) * m_lights.size(), (void*)m_lights.data()));
+
+		return buffer;
+	}
+	TypedBuffer<cl_float> LightTree::GetLeafCDFBuffer()
+	{
+		if (m_leaf_cdf.empty())
+			return TypedBuffer<cl_float>();
 
-		// Return global bound
-		return cb;
+		const auto queue = Compute::GetCommandQueue();
+
+		TypedBuffer<cl_float> buffer = TypedBuffer<cl_float>(Compute::GetContext(), CL_MEM_READ_ONLY, m_leaf_cdf.size());
+		CHECK(queue.enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(cl_float) * m_leaf_cdf.size(), (void*)m_leaf_cdf.data()));
+
+		return buffer;
+	}
+	inline LightTree::build_data LightTree::allocate_build_data(Arena& arena, size_t size)
+	{
+		build_data data = {};
+		data.pmin = arena.Allocate<__m128>(size);
+		data.pmax = arena.Allocate<__m128>(size);
+		data.centers = arena.Allocate<__m128>(size);
+		data.axis = arena.Allocate<float3>(size);
+		data.theta_o = arena.Allocate<float>(size);
+		data.theta_e = arena.Allocate<float>(size);
+		data.energy = arena.Allocate<__m128>(size);
+		data.ids = arena.Allocate<uint>(size);
+		return data;
+	}
+	inline LightTree::scratch_list LightTree::allocate_scratch(Arena& arena)
+	{
+		const size_t num_threads = ThreadPool::Get().GetNumThreads();
+		scratch_list scratch = arena.Allocate<build_scratch>(num_threads);
+		for (size_t i = 0; i < num_threads; i++) {
+			// The sweep uses a bin for each light, which can be more than K
+			new (&scratch[i]) build_scratch(arena, glm::max<size_t>(m_K, s_sweep_threshold));
+		}
+		return scratch;
 	}
-	inline void LightTree::calculate_splits(split_data& data_out, const bin_data& bins)
+	inline void LightTree::initialize_build_data(build_data& data, const SHARED::Light* lights, const size_t num_lights)
 	{
-		const int last = m_K - 1;
+		// Every light only writes to its own index, so the lights can be processed in any order
+		ThreadPool::Get().ParallelFor(0, num_lights, [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				calc_light_bounds(lights, static_cast<uint>(i), data);
+			}
+		});
+	}
+	inline void LightTree::calculate_splits(split_data& data_out, const bin_data& bins, int num_bins)
+	{
+		// Splits separated only by empty bins divide the lights identically, so only the first of them is evaluated
+		int num_used = 0;
+		for (int i = 0; i < num_bins; i++) {
+			if (!bin_is_empty(bins.data[i])) {
+				data_out.bin_index[num_used++] = i;
+			}
+		}
+		const int last = num_used - 1;
+		data_out.num_splits = glm::max(last, 0);
 
 		// allocate bin for accumulaton
-		bin accumulation = {};
+		bin accumulation;
 
 		// Accumulate from left to right
 		bin_init(accumulation);
 		for (int i = 0; i < last; i++) {
-			// Fetch left bin in the split i
-			const bin& other = bins.data[i];
 			// Accumulate with previous bins
-			bin_union(accumulation, other);
-			// accumulated bin to the left bin in the split
-			data_out.data[i].bin_l = accumulation;
+			bin_union(accumulation, bins.data[data_out.bin_index[i]]);
+			// accumulated bin to the left side of split i
+			store_split(data_out.area_l, data_out.energy_l, data_out.theta_o_l, data_out.theta_e_l, data_out.count_l, i, accumulation);
 		}
 
 		// Accumulate from right to left
 		bin_init(accumulation);
 		for (int i = last; i > 0; i--) {
-			// Fetch the right bin in the split i
-			const bin& other = bins.data[i];
 			// Accumulate with previous bins
-			bin_union(accumulation, other);
-			// Save accumulation to the right bin in split i
-			data_out.data[i - 1].bin_r = accumulation;
+			bin_union(accumulation, bins.data[data_out.bin_index[i]]);
+			// Save accumulation to the right side of split i
+			store_split(data_out.area_r, data_out.energy_r, data_out.theta_o_r, data_out.theta_e_r, data_out.count_r, i - 1, accumulation);
+		}
+
+		// Mark the padding up to the next multiple of 4 as empty splits
+		bin_init(accumulation);
+		for (int i = data_out.num_splits; i < ((data_out.num_splits + 3) & ~3); i++) {
+			store_split(data_out.area_l, data_out.energy_l, data_out.theta_o_l, data_out.theta_e_l, data_out.count_l, i, accumulation);
+			store_split(data_out.area_r, data_out.energy_r, data_out.theta_o_r, data_out.theta_e_r, data_out.count_r, i, accumulation);
+		}
+	}
+	inline void LightTree::store_split(float* area, float* energy, float* theta_o, float* theta_e, float* count, const int i, const bin& b)
+	{
+		if (bin_is_empty(b)) {
+			area[i] = 0.0f;
+			energy[i] = 0.0f;
+			theta_o[i] = 0.0f;
+			theta_e[i] = 0.0f;
+			count[i] = 0.0f;
+			return;
 		}
+		area[i] = bbox_measure(b.box_min, b.box_max);
+		energy[i] = component(b.energy, 0) + component(b.energy, 1) + component(b.energy, 2);
+		theta_o[i] = b.cone.theta_o;
+		theta_e[i] = b.cone.theta_e;
+		count[i] = static_cast<float>(b.count);
 	}
 	inline int LightTree::find_best_split(const split_data& splits, const float K_r, float* cost_out)
 	{
-		const float M_a = bbox_measure(splits.data[0].bin_r.box);
-		const float M_o = bcone_measure(splits.data[0].bin_r.cone);
+		const float M_a = splits.area_r[0];
+		const float M_o = bcone_measure(make_bcone(float3(0.0f), splits.theta_o_r[0], splits.theta_e_r[0]));
 
 		//printf("M_a: %f, M_o: %f\n", M_a, M_o);
 
-		// Find the best split
+		const __m128 K_r_v = _mm_set1_ps(K_r);
+		const __m128 M_v = _mm_set1_ps(M_a * M_o);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+
+		// Find the best split, evaluating four splits at a time
 		float cost_best = std::numeric_limits<float>::infinity();
 		int index_best = -1;
-		for (int i = 0; i < m_K - 1; i++) {
-			const bin& left = splits.data[i].bin_l;
-			const bin& right = splits.data[i].bin_r;
-
-			const float M_al = bbox_measure(left.box);
-			const float M_ol = bcone_measure(left.cone);
-			const float E_l = left.energy.x + left.energy.y + left.energy.z;
-			const uint N_l = left.count;
-
-			const float M_ar = bbox_measure(right.box);
-			const float M_or = bcone_measure(right.cone);
-			const float E_r = right.energy.x + right.energy.y + right.energy.z;
-			const uint N_r = right.count;
-
-			const float cost = K_r * (((E_l * M_al * M_ol) + (E_r * M_ar * M_or)) / (M_a * M_o));
-
-			//printf("I: %d, N_l: %d, N_r: %d, cost: %f\n", i, N_l, N_r, cost);
-
-			if (N_l == 0 || N_r == 0) {
-				continue;
-			}
-
-			if (cost < cost_best) {
-				cost_best = cost;
-				index_best = i;
+		for (int i = 0; i < splits.num_splits; i += 4) {
+			const __m128 M_al = _mm_loadu_ps(splits.area_l + i);
+			const __m128 M_ol = bcone_measure(_mm_loadu_ps(splits.theta_o_l + i), _mm_loadu_ps(splits.theta_e_l + i));
+			const __m128 E_l = _mm_loadu_ps(splits.energy_l + i);
+
+			const __m128 M_ar = _mm_loadu_ps(splits.area_r + i);
+			const __m128 M_or = bcone_measure(_mm_loadu_ps(splits.theta_o_r + i), _mm_loadu_ps(splits.theta_e_r + i));
+			const __m128 E_r = _mm_loadu_ps(splits.energy_r + i);
+
+			const __m128 sum = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(E_l, M_al), M_ol), _mm_mul_ps(_mm_mul_ps(E_r, M_ar), M_or));
+			__m128 cost = _mm_mul_ps(K_r_v, _mm_div_ps(sum, M_v));
+
+			// Splits with an empty side are not valid
+			const __m128 valid = _mm_and_ps(_mm_cmpgt_ps(_mm_loadu_ps(splits.count_l + i), zero), _mm_cmpgt_ps(_mm_loadu_ps(splits.count_r + i), zero));
+			cost = _mm_blendv_ps(inf, cost, valid);
+
+			alignas(16) float costs[4];
+			_mm_store_ps(costs, cost);
+			for (int j = 0; j < 4; j++) {
+				if (costs[j] < cost_best) {
+					cost_best = costs[j];
+					index_best = i + j;
+				}
 			}
 		}
 
@@ -334,7 +980,7 @@ namespace LSIS {
 		//printf("Best split: %d, cost: %f\n", index_best, cost_best);
 
 		*cost_out = cost_best;
-		return index_best;
+		return index_best == -1 ? -1 : splits.bin_index[index_best];
 	}
 	inline int LightTree::reorder_id(build_data& data, uint start, uint end, const uint32_t split_id, int k, float k0, float k1)
 	{
@@ -352,11 +998,13 @@ namespace LSIS {
 			__debugbreak();
 		}
 
-		// calculate bin ids
+		// calculate bin ids. The scope frees them on every return
+		Arena& arena = Arena::GetScratch();
+		Arena::Scope arena_scope(arena);
 		const int range = end - start;
-		uint* bin_ids = new uint[end - start];
+		uint* bin_ids = arena.Allocate<uint>(range);
 		for (int i = 0; i < range; i++) {
-			const float c_ik = data.centers[data.ids[start + i]][k];
+			const float c_ik = component(data.centers[data.ids[start + i]], k);
 			uint bin_id = static_cast<uint>(k1 * (c_ik - k0));
 			CORE_ASSERT(bin_id >= 0 && bin_id < m_K, "Bin id out of bounds!");
 			bin_ids[i] = bin_id;
@@ -407,11 +1055,16 @@ namespace LSIS {
 		return box;
 	}
 	inline LightTree::bcone LightTree::make_bcone(const glm::vec3 axis, float theta_o, float theta_e)
+	{
+		return make_bcone(axis, theta_o, theta_e, theta_o == 0.0f ? 1.0f : glm::cos(theta_o));
+	}
+	inline LightTree::bcone LightTree::make_bcone(const glm::vec3 axis, float theta_o, float theta_e, float cos_theta_o)
 	{
 		bcone b = {};
 		b.axis = axis;
 		b.theta_o = theta_o;
 		b.theta_e = theta_e;
+		b.cos_theta_o = cos_theta_o;
 		return b;
 	}
 	inline void LightTree::swap(bcone& a, bcone& b)
@@ -419,6 +1072,7 @@ namespace LSIS {
 		std::swap(a.axis, b.axis);
 		std::swap(a.theta_o, b.theta_o);
 		std::swap(a.theta_e, b.theta_e);
+		std::swap(a.cos_theta_o, b.cos_theta_o);
 	}
 	inline LightTree::bbox LightTree::union_bbox(bbox a, bbox b)
 	{
@@ -432,21 +1086,29 @@ namespace LSIS {
 		if (b.theta_o > a.theta_o) {
 			swap(a, b);
 		}
-		const float d = a.axis == b.axis ? 1.0f : glm::max(-1.0f, glm::min(1.0f, glm::dot(a.axis, b.axis)));
-		const float theta_d = glm::acos(d);
+		const float theta_e = glm::max(a.theta_e, b.theta_e);
 #ifdef DEBUG
-		if (isnan(theta_d)) {
+		if (isnan(theta_e)) {
 			__debugbreak();
 		}
 #endif // DEBUG
-		const float theta_e = glm::max(a.theta_e, b.theta_e);
+		// a already covers all directions
+		if (glm::pi<float>() <= a.theta_o) {
+			return make_bcone(a.axis, a.theta_o, theta_e, a.cos_theta_o);
+		}
+		const float d = a.axis == b.axis ? 1.0f : glm::max(-1.0f, glm::min(1.0f, glm::dot(a.axis, b.axis)));
+		// Cheap containment test without acos. Only accepts directions with a margin, so it agrees with the exact test below
+		if (d >= 1.0f || (b.theta_o == 0.0f && d >= a.cos_theta_o + 1e-5f)) {
+			return make_bcone(a.axis, a.theta_o, theta_e, a.cos_theta_o);
+		}
+		const float theta_d = glm::acos(d);
 #ifdef DEBUG
-		if (isnan(theta_e)) {
+		if (isnan(theta_d)) {
 			__debugbreak();
 		}
 #endif // DEBUG
 		if (glm::min(theta_d + b.theta_o, glm::pi<float>()) <= a.theta_o) {
-			return make_bcone(a.axis, a.theta_o, theta_e);
+			return make_bcone(a.axis, a.theta_o, theta_e, a.cos_theta_o);
 		}
 		else {
 			const float theta_o = (a.theta_o + theta_d + b.theta_o) / 2.0f;
@@ -456,16 +1118,17 @@ namespace LSIS {
 			}
 #endif // DEBUG
 			if (glm::pi<float>() <= theta_o) {
-				return make_bcone(a.axis, glm::pi<float>(), theta_e);
+				return make_bcone(a.axis, glm::pi<float>(), theta_e, -1.0f);
 			}
 
+			// Rotate a.axis towards b.axis by theta_r in the plane spanned by the two axis
 			const float theta_r = theta_o - a.theta_o;
-#ifdef DEBUG
-			if (isnan(theta_r)) {
-				__debugbreak();
+			const float3 ortho = b.axis - a.axis * d;
+			const float ortho_length = glm::length(ortho);
+			if (ortho_length <= 0.0f) { // opposite axis, any rotation plane works. Be conservative
+				return make_bcone(a.axis, glm::pi<float>(), theta_e, -1.0f);
 			}
-#endif // DEBUG
-			float3 axis = glm::normalize(glm::rotate(a.axis, theta_r, glm::cross(a.axis, b.axis)));
+			float3 axis = glm::normalize(a.axis * glm::cos(theta_r) + ortho * (glm::sin(theta_r) / ortho_length));
 #ifdef DEBUG
 			if (isnan(axis.x) || isnan(axis.y) || isnan(axis.z)) {
 				__debugbreak();
@@ -480,6 +1143,12 @@ namespace LSIS {
 		float3 d = b.pmax - b.pmin;
 		return 2.0f * (d.x * d.y + d.x * d.z + d.y * d.z);
 	}
+	inline float LightTree::bbox_measure(const __m128 pmin, const __m128 pmax)
+	{
+		alignas(16) float d[4];
+		_mm_store_ps(d, _mm_sub_ps(pmax, pmin));
+		return 2.0f * (d[0] * d[1] + d[0] * d[2] + d[1] * d[2]);
+	}
 	inline float LightTree::bcone_measure(bcone b)
 	{
 		constexpr float PI = glm::pi<float>();
@@ -500,14 +1169,69 @@ namespace LSIS {
 #endif // DEBUG
 		return res;
 	}
-	inline void LightTree::init_bins(bin_data& bin)
+	inline __m128 LightTree::bcone_measure(const __m128 theta_o, const __m128 theta_e)
+	{
+		const __m128 PI = _mm_set1_ps(glm::pi<float>());
+		const __m128 two = _mm_set1_ps(2.0f);
+
+		const __m128 t_o = theta_o;
+		const __m128 t_w = _mm_min_ps(_mm_add_ps(t_o, theta_e), PI);
+
+		__m128 sin_o, cos_o, sin_w, cos_w;
+		sincos(t_o, &sin_o, &cos_o);
+		sincos(_mm_sub_ps(t_o, _mm_mul_ps(two, t_w)), &sin_w, &cos_w);
+
+		// Same equation as the scalar version
+		const __m128 a = _mm_mul_ps(_mm_set1_ps(2.0f * glm::two_pi<float>()), _mm_sub_ps(_mm_set1_ps(1.0f), cos_o));
+		__m128 b = _mm_mul_ps(_mm_mul_ps(two, t_w), sin_o);
+		b = _mm_sub_ps(b, cos_w);
+		b = _mm_sub_ps(b, _mm_mul_ps(_mm_mul_ps(two, t_o), sin_o));
+		b = _mm_add_ps(b, cos_o);
+		return _mm_add_ps(a, _mm_mul_ps(_mm_set1_ps(glm::half_pi<float>()), b));
+	}
+	/// sin and cos of four angles. Reduces to [-pi/4, pi/4] and uses the cephes polynomials
+	inline void LightTree::sincos(const __m128 x, __m128* s, __m128* c)
+	{
+		// Quadrant and reduction using pi/2 split in three parts for precision
+		const __m128 q_f = _mm_round_ps(_mm_mul_ps(x, _mm_set1_ps(2.0f / glm::pi<float>())), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		const __m128i q = _mm_cvtps_epi32(q_f);
+		__m128 r = _mm_sub_ps(x, _mm_mul_ps(q_f, _mm_set1_ps(1.5703125f)));
+		r = _mm_sub_ps(r, _mm_mul_ps(q_f, _mm_set1_ps(4.837512969970703125e-4f)));
+		r = _mm_sub_ps(r, _mm_mul_ps(q_f, _mm_set1_ps(7.54978995489188216e-8f)));
+
+		const __m128 r2 = _mm_mul_ps(r, r);
+
+		__m128 ps = _mm_set1_ps(-1.9515295891e-4f);
+		ps = _mm_add_ps(_mm_mul_ps(ps, r2), _mm_set1_ps(8.3321608736e-3f));
+		ps = _mm_add_ps(_mm_mul_ps(ps, r2), _mm_set1_ps(-1.6666654611e-1f));
+		ps = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(ps, r2), r), r);
+
+		__m128 pc = _mm_set1_ps(2.443315711809948e-5f);
+		pc = _mm_add_ps(_mm_mul_ps(pc, r2), _mm_set1_ps(-1.388731625493765e-3f));
+		pc = _mm_add_ps(_mm_mul_ps(pc, r2), _mm_set1_ps(4.166664568298827e-2f));
+		pc = _mm_mul_ps(_mm_mul_ps(pc, r2), r2);
+		pc = _mm_add_ps(_mm_sub_ps(pc, _mm_mul_ps(_mm_set1_ps(0.5f), r2)), _mm_set1_ps(1.0f));
+
+		// Odd quadrants swap sin and cos. sin is negated in quadrant 2 and 3, cos in quadrant 1 and 2
+		const __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+		const __m128 sign_s = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q, _mm_set1_epi32(2)), 30));
+		const __m128 sign_c = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(q, _mm_set1_epi32(1)), _mm_set1_epi32(2)), 30));
+
+		*s = _mm_xor_ps(_mm_blendv_ps(ps, pc, swap), sign_s);
+		*c = _mm_xor_ps(_mm_blendv_ps(pc, ps, swap), sign_c);
+	}
+	inline void LightTree::init_bins(bin_data& bin, int num_bins)
 	{
-		for (int i = 0; i < m_K; i++) {
+		for (int i = 0; i < num_bins; i++) {
 			bin_init(bin.data[i]);
 		}
 	}
 	inline void LightTree::bin_init(bin& data)
 	{
+		// Empty bounds and zero energy, so lights can be added without special cases
+		data.box_min = _mm_set1_ps(std::numeric_limits<float>::infinity());
+		data.box_max = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+		data.energy = _mm_setzero_ps();
 		data.count = 0;
 	}
 	inline void LightTree::bin_union(bin& dst, const bin& other)
@@ -522,27 +1246,19 @@ namespace LSIS {
 			dst = other;
 		}
 		else { // perform actual union
-			dst.cb = union_bbox(dst.cb, other.cb);
-			dst.box = union_bbox(dst.box, other.box);
+			dst.box_min = _mm_min_ps(dst.box_min, other.box_min);
+			dst.box_max = _mm_max_ps(dst.box_max, other.box_max);
 			dst.cone = union_bcone(dst.cone, other.cone);
 			dst.count += other.count;
-			dst.energy += other.energy;
+			dst.energy = _mm_add_ps(dst.energy, other.energy);
 		}
 	}
-	inline void LightTree::bin_update(bin& data, const bbox& cb, const bbox& box, const bcone& cone, const glm::vec3& energy)
+	inline void LightTree::bin_update(bin& data, const __m128 pmin, const __m128 pmax, const bcone& cone, const __m128 energy)
 	{
-		if (bin_is_empty(data)) {
-			data.cb = cb;
-			data.box = box;
-			data.cone = cone;
-			data.energy = energy;
-		}
-		else {
-			data.cb = union_bbox(data.cb, cb);
-			data.box = union_bbox(data.box, box);
-			data.cone = union_bcone(data.cone, cone);
-			data.energy += energy;
-		}
+		data.cone = bin_is_empty(data) ? cone : union_bcone(data.cone, cone);
+		data.box_min = _mm_min_ps(data.box_min, pmin);
+		data.box_max = _mm_max_ps(data.box_max, pmax);
+		data.energy = _mm_add_ps(data.energy, energy);
 		data.count++;
 	}
 	inline bool LightTree::bin_is_empty(const bin& data)
@@ -574,13 +1290,13 @@ namespace LSIS {
 		const float3 energy = convert(light.intensity) * area;
 
 		// Save local bounds data
-		data.pmin[index] = convert(pmin);
-		data.pmax[index] = convert(pmax);
-		data.centers[index] = convert(center);
+		data.pmin[index] = convert_simd(pmin);
+		data.pmax[index] = convert_simd(pmax);
+		data.centers[index] = convert_simd(center);
 		data.axis[index] = axis;
 		data.theta_o[index] = theta_o;
 		data.theta_e[index] = theta_e;
-		data.energy[index] = energy;
+		data.energy[index] = convert_simd(energy);
 		data.ids[index] = index;
 
 		bound res = {};
@@ -588,6 +1304,58 @@ namespace LSIS {
 		res.oriental = make_bcone(axis, theta_o, theta_e);
 		return res;
 	}
+	inline uint16_t LightTree::float_to_half(float value, bool round_up)
+	{
+		// Only non-negative values are stored. Values above the half range are clamped to the largest half
+		if (!(value > 0.0f))
+			return 0;
+
+		int exponent;
+		std::frexp(value, &exponent);
+		// Subnormals share the smallest exponent
+		exponent = glm::max(exponent - 1, -14);
+		if (exponent > 15)
+			return 0x7bff;
+
+		// The mantissa including the implicit bit. Rounding up to 2048 carries into the exponent
+		const float steps = std::ldexp(value, 10 - exponent);
+		const uint32_t mantissa = uint32_t(round_up ? std::ceil(steps) : std::nearbyint(steps));
+		return uint16_t(glm::min<uint32_t>((uint32_t(exponent + 14) << 10) + mantissa, 0x7bff));
+	}
+	inline float LightTree::half_to_float(uint16_t value)
+	{
+		const int exponent = (value >> 10) & 0x1f;
+		const uint32_t mantissa = value & 0x3ff;
+		if (exponent == 0)
+			return std::ldexp(float(mantissa), -24);
+		return std::ldexp(float(mantissa | 0x400), exponent - 25);
+	}
+	inline cl_ushort2 LightTree::encode_octahedral(float3 axis)
+	{
+		const float sum = glm::abs(axis.x) + glm::abs(axis.y) + glm::abs(axis.z);
+		float x = sum > 0.0f ? axis.x / sum : 0.0f;
+		float y = sum > 0.0f ? axis.y / sum : 0.0f;
+		// Fold the lower hemisphere over the diagonals
+		if (axis.z < 0.0f) {
+			const float fx = (1.0f - glm::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+			const float fy = (1.0f - glm::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+			x = fx;
+			y = fy;
+		}
+		const auto quantize = [](float v) { return cl_ushort(glm::clamp(std::nearbyint((v * 0.5f + 0.5f) * 65535.0f), 0.0f, 65535.0f)); };
+		return { quantize(x), quantize(y) };
+	}
+	inline LightTree::float3 LightTree::decode_octahedral(cl_ushort2 value)
+	{
+		// Same as decode_octahedral in shade.cl
+		const float x = float(value.x) * (2.0f / 65535.0f) - 1.0f;
+		const float y = float(value.y) * (2.0f / 65535.0f) - 1.0f;
+		float3 n = float3(x, y, 1.0f - glm::abs(x) - glm::abs(y));
+		const float t = glm::max(-n.z, 0.0f);
+		n.x += n.x >= 0.0f ? -t : t;
+		n.y += n.y >= 0.0f ? -t : t;
+		return glm::normalize(n);
+	}
 	/// Returns the index of the axis with the maximum value
 	inline LightTree::uint LightTree::max_axis(float3 a)
 	{
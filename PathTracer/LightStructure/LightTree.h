@@ -2,8 +2,11 @@
 
 #include <vector>
 #include <cinttypes>
+#include <immintrin.h>
 
 #include "LightStructure.h"
+#include "Memory/Arena.h"
+#include "Threading/ThreadPool.h"
 
 namespace LSIS {
 
@@ -22,6 +25,7 @@ namespace LSIS {
 			float3 axis;
 			float theta_o;
 			float theta_e;
+			float cos_theta_o; // cached for the containment test in union_bcone
 		} bcone;
 
 		typedef struct bound {
@@ -29,14 +33,15 @@ namespace LSIS {
 			bcone oriental;
 		} bound;
 
+		// pmin, pmax, centers and energy are stored as padded SSE vectors, so they can be loaded directly while binning
 		typedef struct build_data {
-			float3* pmin;
-			float3* pmax;
-			float3* centers;
+			__m128* pmin;
+			__m128* pmax;
+			__m128* centers;
 			float3* axis;
 			float* theta_o;
 			float* theta_e;
-			float3* energy;
+			__m128* energy;
 			uint* ids;
 		} build_data;
 
@@ -46,45 +51,133 @@ namespace LSIS {
 			int right;
 		} queue_data;
 
-		typedef struct bin {
-			bbox cb;
-			bbox box;
+		typedef struct alignas(16) bin {
+			__m128 box_min;
+			__m128 box_max;
+			__m128 energy;
 			bcone cone;
-			glm::vec3 energy;
 			uint count;
-		};
+		} bin;
 
 		typedef struct bin_data {
 			bin* data;
-			bin_data(const size_t k) { data = new bin[k]; }
-			~bin_data() { delete[] data; }
+			bin_data(Arena& arena, const size_t k) { data = arena.Allocate<bin>(k); }
 		} bin_data;
 
-		typedef struct split {
-			bin bin_l;
-			bin bin_r;
-		} split;
-
-
+		// Structure of arrays holding the measures of the left (_l) and right (_r) side of the splits.
+		// Only splits between non-empty bins are stored, bin_index holds the bin to the left of each split.
+		// The arrays are padded to a multiple of 4, so the split costs can be evaluated 4 at a time
 		typedef struct split_data {
-			split* data;
-			inline split_data(const size_t k) { data = new split[k - 1]; }
-			inline ~split_data() { delete[] data; }
+			size_t size;
+			int num_splits;
+			int* bin_index;
+			float* area_l;
+			float* energy_l;
+			float* theta_o_l;
+			float* theta_e_l;
+			float* count_l;
+			float* area_r;
+			float* energy_r;
+			float* theta_o_r;
+			float* theta_e_r;
+			float* count_r;
+			float* storage;
+			inline split_data(Arena& arena, const size_t k) : size((k + 2) & ~size_t(3)) {
+				num_splits = 0;
+				bin_index = arena.Allocate<int>(k);
+				storage = arena.Allocate<float>(size * 10);
+				float** channels[10] = { &area_l, &energy_l, &theta_o_l, &theta_e_l, &count_l, &area_r, &energy_r, &theta_o_r, &theta_e_r, &count_r };
+				for (size_t i = 0; i < 10; i++) {
+					*channels[i] = storage + i * size;
+				}
+			}
 		} split_data;
 
+		// Bins and splits used when processing a node, and the sorted lights of the sweep. Each thread in the pool owns one
+		typedef struct build_scratch {
+			bin_data bins[3];
+			split_data splits[3];
+			uint* order[3];
+			inline build_scratch(Arena& arena, const size_t k) : bins{ bin_data(arena, k), bin_data(arena, k), bin_data(arena, k) }, splits{ split_data(arena, k), split_data(arena, k), split_data(arena, k) } {
+				for (int i = 0; i < 3; i++) {
+					order[i] = arena.Allocate<uint>(k);
+				}
+			}
+		} build_scratch;
+
+		// One build_scratch per thread in the pool, indexed by the thread index
+		using scratch_list = build_scratch*;
+
 	public:
-		LightTree(const SHARED::Light* lights, const size_t num_lights, size_t k = 128);
+		/// Builds the tree in parallel on the global ThreadPool. 
+		/// Nodes are stored depth first, so the left child of a node is always the next node, and a subtree over n lights occupies 2n-1 consecutive nodes.
+		/// The node indices therefore never depend on the order the subtrees are processed in.
+		/// Leaves hold up to max_leaf_size lights, the SAOH cost decides when to stop splitting.
+		LightTree(const SHARED::Light* lights, const size_t num_lights, size_t k = 128, size_t max_leaf_size = 1);
 		~LightTree();
 
+		/// Fits the tree to the lights after they have moved or changed intensity, keeping the topology. The lights must be in the same order as given to the constructor.
+		/// The bounds, cones and energies are recomputed bottom up in parallel. Subtrees whose SAOH measure has grown more than 'rebuild_threshold' times since they were built are rebuilt, 0 disables the rebuilds
+		void Refit(const SHARED::Light* lights, const size_t num_lights, float rebuild_threshold = 0.0f);
+		/// Writes the nodes changed by the last Refit to a buffer created by GetNodeBuffer
+		void UploadNodeChanges(TypedBuffer<SHARED::LightTreeNode>& nodes);
+		/// Writes the lights and leaf cdf changed by the last Refit to the buffers created by GetLightBuffer and GetLeafCDFBuffer
+		void UploadLightChanges(TypedBuffer<SHARED::Light>& lights, TypedBuffer<cl_float>& leaf_cdf);
+
 		TypedBuffer<SHARED::LightTreeNode> GetNodeBuffer();
-		size_t GetNumNodes() { return m_num_nodes; }
+		/// The nodes in the 32 byte CompactLightTreeNode format, preceded by a CompactLightTreeHeader. Decoded by the kernels compiled with COMPACT_LIGHTTREE
+		TypedBuffer<SHARED::CompactLightTreeNode> GetCompactNodeBuffer();
+		/// The lights reordered so each leaf references a contiguous range. Use this instead of the input lights
+		TypedBuffer<SHARED::Light> GetLightBuffer();
+		/// For each light in the reordered buffer, the cumulative probability of picking it within its leaf
+		TypedBuffer<cl_float> GetLeafCDFBuffer();
+		size_t GetNumNodes() const { return m_num_nodes; }
+		const SHARED::LightTreeNode* GetNodes() const { return m_nodes; }
+		/// Host copies of the reordered lights and leaf cdf, for evaluating the tree without a device
+		const std::vector<SHARED::Light>& GetLights() const { return m_lights; }
+		const std::vector<float>& GetLeafCDF() const { return m_leaf_cdf; }
 
 	private:
-		inline build_data allocate_build_data(size_t size);
-		inline void delete_build_data(build_data data);
-		inline bound initialize_build_data(build_data& data, const SHARED::Light* lights, const size_t num_lights);
-
-		inline void calculate_splits(split_data& data_out, const bin_data& bins);
+		// The build data and scratch are allocated from the arena, and freed when it is rewound
+		inline build_data allocate_build_data(Arena& arena, size_t size);
+		inline scratch_list allocate_scratch(Arena& arena);
+		inline void initialize_build_data(build_data& data, const SHARED::Light* lights, const size_t num_lights);
+
+		// Builds the subtree described by 'root'. Large child subtrees are submitted as new tasks to the group
+		void build_subtree(build_data& data, scratch_list& scratch, ThreadPool::TaskGroup& group, queue_data root);
+
+		// Bins the lights in the range [left,right) into the first 'num_bins' bins of the three axis bin sets, and accumulates the total bound of the range
+		inline void bin_lights(const build_data& data, bin* const bins[3], bin& total, int left, int right, int num_bins, const float3& k0, const float3& k1, const float3& diagonal);
+		// Same as bin_lights, but splits the range into chunks binned on all threads, which are merged in chunk order afterwards
+		inline void bin_lights_parallel(const build_data& data, build_scratch& scratch, bin& total, int left, int right, int num_bins, const float3& k0, const float3& k1, const float3& diagonal);
+		// Sorts the lights in [left,right) along each axis into scratch.order, and stores one light per bin in that order, so every split between two lights is evaluated
+		inline void sweep_lights(const build_data& data, build_scratch& scratch, bin& total, int left, int right, const float3& diagonal);
+
+		// Creates the leaf for the lights in [left,right) and its cdf
+		inline void make_leaf(const build_data& data, const int index, const int left, const int right, const float3& pmin, const float3& pmax, const bcone& cone, const float3& energy);
+		// Removes the unused nodes left by multi light leaves, keeping the depth first order
+		void compact_nodes();
+		// Recomputes the node from its children, or the lights of a leaf
+		inline void refit_node(const build_data& data, const int index);
+		// Rebuilds the subtree at 'index', which may use the nodes up to 'end'. Returns false and keeps the old subtree if the new one doesn't fit
+		bool rebuild_subtree(build_data& data, scratch_list& scratch, const int index, const int end);
+		// Index after the last node of the subtree
+		inline int subtree_end(int index) const;
+		// The range of lights [first,last) referenced by the subtree
+		inline void subtree_lights(int index, int& first, int& last) const;
+		// SAOH measure of the node without energy, used to detect when the refitted tree has degraded
+		inline float node_measure(const SHARED::LightTreeNode& node);
+
+		// Encodes the header and all nodes in the compact format
+		std::vector<SHARED::CompactLightTreeNode> encode_compact_nodes();
+
+		inline uint16_t float_to_half(float value, bool round_up);
+		inline float half_to_float(uint16_t value);
+		inline cl_ushort2 encode_octahedral(float3 axis);
+		inline float3 decode_octahedral(cl_ushort2 value);
+
+		inline void calculate_splits(split_data& data_out, const bin_data& bins, int num_bins);
+		inline void store_split(float* area, float* energy, float* theta_o, float* theta_e, float* count, const int i, const bin& b);
 		inline int find_best_split(const split_data& splits, const float K_r, float* cost_out);
 
 		inline int reorder_id(build_data& data, uint start, uint end, const uint32_t split_id, int k, float k0, float k1);
@@ -94,6 +187,7 @@ namespace LSIS {
 		inline bbox make_bbox(const glm::vec3 p);
 		inline bbox make_bbox(const glm::vec3 pmin, const glm::vec3 pmax);
 		inline bcone make_bcone(const glm::vec3 axis, float theta_o, float theta_e);
+		inline bcone make_bcone(const glm::vec3 axis, float theta_o, float theta_e, float cos_theta_o);
 
 		inline void swap(bcone& a, bcone& b);
 
@@ -101,13 +195,17 @@ namespace LSIS {
 		inline bcone union_bcone(bcone a, bcone b);
 
 		inline float bbox_measure(bbox b);
+		inline float bbox_measure(const __m128 pmin, const __m128 pmax);
 		inline float bcone_measure(bcone b);
+		// bcone_measure of four cones at a time
+		inline __m128 bcone_measure(const __m128 theta_o, const __m128 theta_e);
+		inline void sincos(const __m128 x, __m128* s, __m128* c);
 
-		inline void init_bins(bin_data& bin);
+		inline void init_bins(bin_data& bin, int num_bins);
 
 		inline void bin_init(bin& data);
 		inline void bin_union(bin& dst, const bin& other); // store the union of the two bins in dst, to avoid creating new data
-		inline void bin_update(bin& data, const bbox& cb, const bbox& box, const bcone& cone, const glm::vec3& energy);
+		inline void bin_update(bin& data, const __m128 pmin, const __m128 pmax, const bcone& cone, const __m128 energy);
 		inline bool bin_is_empty(const bin& data);
 
 
@@ -117,11 +215,23 @@ namespace LSIS {
 		inline glm::vec3 convert(cl_float3 vec) { return glm::vec3(vec.x, vec.y, vec.z); }
 		//inline glm::vec3 convert(cl_float4 vec) { return glm::vec3(vec.x, vec.y, vec.z); }
 		inline float3 convert(glm::vec3 vec) { return { vec.x, vec.y, vec.z }; }
+		inline __m128 convert_simd(const float3 vec) { return _mm_setr_ps(vec.x, vec.y, vec.z, 0.0f); }
+		inline float3 convert(const __m128 vec) { alignas(16) float tmp[4]; _mm_store_ps(tmp, vec); return float3(tmp[0], tmp[1], tmp[2]); }
+		inline float component(const __m128& vec, int k) { return reinterpret_cast<const float*>(&vec)[k]; }
 
 	private:
 		const size_t m_K;
+		const size_t m_max_leaf_size;
 		SHARED::LightTreeNode* m_nodes = nullptr;
 		size_t m_num_nodes = 0;
+		std::vector<SHARED::Light> m_lights;
+		std::vector<uint> m_light_ids; // index in the constructor input of each light in m_lights
+		std::vector<float> m_leaf_cdf;
+		std::vector<float> m_node_measure; // node_measure when the node was built
+
+		// Elements changed by the last Refit
+		std::vector<uint8_t> m_node_dirty;
+		std::vector<uint8_t> m_light_dirty;
 	};
 
 }
\ No newline at end of file
@@ -0,0 +1,171 @@
+#include "pch.h"
+#include "LightTreeBuilder.h"
+
+#include "Core/Timer.h"
+
+namespace LSIS {
+
+	LightTreeBuilder::LightTreeBuilder()
+	{
+		Compile();
+	}
+
+	LightTreeBuilder::~LightTreeBuilder()
+	{
+	}
+
+	void LightTreeBuilder::Compile()
+	{
+		m_program = Compute::CreateProgram(Compute::GetContext(), Compute::GetDevice(), "Kernels/light_tree_builder.cl", { "-I Kernels/" });
+		m_kernel_prepare = Compute::CreateKernel(m_program, "prepare_lights");
+		m_kernel_bounds = Compute::CreateKernel(m_program, "calc_centroid_bounds");
+		m_kernel_morton_code = Compute::CreateKernel(m_program, "generate_light_codes");
+		m_kernel_radix_count = Compute::CreateKernel(m_program, "radix_count");
+		m_kernel_radix_reduce = Compute::CreateKernel(m_program, "radix_reduce");
+		m_kernel_radix_scan = Compute::CreateKernel(m_program, "radix_scan");
+		m_kernel_radix_downsweep = Compute::CreateKernel(m_program, "radix_downsweep");
+		m_kernel_radix_scatter = Compute::CreateKernel(m_program, "radix_scatter");
+		m_kernel_hierarchy = Compute::CreateKernel(m_program, "generate_light_hierarchy");
+		m_kernel_refit = Compute::CreateKernel(m_program, "refit_light_tree");
+	}
+
+	LightTreeBuilder::result LightTreeBuilder::Build(const TypedBuffer<SHARED::Light>& lights)
+	{
+		PROFILE_SCOPE("Light Tree Build GPU");
+
+		const cl_uint num_lights = static_cast<cl_uint>(lights.Count());
+		CORE_ASSERT(num_lights > 0, "Can't build a light tree without lights!");
+		const size_t num_nodes = static_cast<size_t>(num_lights) * 2 - 1;
+
+		auto& context = Compute::GetContext();
+		auto& queue = Compute::GetCommandQueue();
+
+		// Allocate temporary buffers
+		TypedBuffer<SHARED::LightTreeNode> leaves = TypedBuffer<SHARED::LightTreeNode>(context, CL_MEM_READ_WRITE, num_lights);
+		TypedBuffer<cl_float3> centers = TypedBuffer<cl_float3>(context, CL_MEM_READ_WRITE, num_lights);
+		TypedBuffer<cl_float3> bounds = TypedBuffer<cl_float3>(context, CL_MEM_READ_WRITE, 2);
+		TypedBuffer<morton_key> codes = TypedBuffer<morton_key>(context, CL_MEM_READ_WRITE, num_lights);
+		TypedBuffer<cl_int> parents = TypedBuffer<cl_int>(context, CL_MEM_READ_WRITE, num_nodes);
+
+		result out = {};
+		out.nodes = TypedBuffer<SHARED::LightTreeNode>(context, CL_MEM_READ_WRITE, num_nodes);
+		out.lights = TypedBuffer<SHARED::Light>(context, CL_MEM_READ_WRITE, num_lights);
+		out.leaf_cdf = TypedBuffer<cl_float>(context, CL_MEM_READ_ONLY, num_lights);
+
+		// Every leaf holds a single light
+		CHECK(queue.enqueueFillBuffer(out.leaf_cdf.GetBuffer(), 1.0f, 0, sizeof(cl_float) * num_lights));
+
+		PrepareLights(num_lights, lights, leaves, centers);
+		FindCentroidBounds(num_lights, centers, bounds);
+		GenerateMortonCodes(num_lights, centers, bounds, codes);
+		SortMortonCodes(num_lights, codes);
+		GenerateHierarchy(num_lights, codes, leaves, lights, out, parents);
+		Refit(num_lights, parents, out.nodes);
+
+		queue.finish();
+		return out;
+	}
+
+	void LightTreeBuilder::PrepareLights(cl_uint num_lights, const TypedBuffer<SHARED::Light>& lights, const TypedBuffer<SHARED::LightTreeNode>& leaves, const TypedBuffer<cl_float3>& centers)
+	{
+		m_kernel_prepare.setArg(0, sizeof(cl_uint), &num_lights);
+		m_kernel_prepare.setArg(1, lights.GetBuffer());
+		m_kernel_prepare.setArg(2, leaves.GetBuffer());
+		m_kernel_prepare.setArg(3, centers.GetBuffer());
+		CHECK(Compute::GetCommandQueue().enqueueNDRangeKernel(m_kernel_prepare, cl::NullRange, cl::NDRange(num_lights)));
+	}
+
+	void LightTreeBuilder::FindCentroidBounds(cl_uint num_lights, const TypedBuffer<cl_float3>& centers, const TypedBuffer<cl_float3>& bounds)
+	{
+		m_kernel_bounds.setArg(0, sizeof(cl_uint), &num_lights);
+		m_kernel_bounds.setArg(1, centers.GetBuffer());
+		m_kernel_bounds.setArg(2, bounds.GetBuffer());
+		CHECK(Compute::GetCommandQueue().enqueueNDRangeKernel(m_kernel_bounds, cl::NullRange, cl::NDRange(s_bounds_group_size), cl::NDRange(s_bounds_group_size)));
+	}
+
+	void LightTreeBuilder::GenerateMortonCodes(cl_uint num_lights, const TypedBuffer<cl_float3>& centers, const TypedBuffer<cl_float3>& bounds, const TypedBuffer<morton_key>& codes)
+	{
+		m_kernel_morton_code.setArg(0, sizeof(cl_uint), &num_lights);
+		m_kernel_morton_code.setArg(1, centers.GetBuffer());
+		m_kernel_morton_code.setArg(2, bounds.GetBuffer());
+		m_kernel_morton_code.setArg(3, codes.GetBuffer());
+		CHECK(Compute::GetCommandQueue().enqueueNDRangeKernel(m_kernel_morton_code, cl::NullRange, cl::NDRange(num_lights)));
+	}
+
+	void LightTreeBuilder::SortMortonCodes(cl_uint num_lights, TypedBuffer<morton_key>& codes)
+	{
+		auto& queue = Compute::GetCommandQueue();
+
+		const size_t num_blocks = (num_lights + s_radix_block_size - 1) / s_radix_block_size;
+		const size_t num_tiles = (s_radix_range * num_blocks + s_radix_scan_tile - 1) / s_radix_scan_tile;
+		TypedBuffer<cl_uint> histograms = TypedBuffer<cl_uint>(Compute::GetContext(), CL_MEM_READ_WRITE, s_radix_range * num_blocks);
+		TypedBuffer<cl_uint> tile_sums = TypedBuffer<cl_uint>(Compute::GetContext(), CL_MEM_READ_WRITE, num_tiles);
+
+		auto source = codes;
+		auto target = TypedBuffer<morton_key>(Compute::GetContext(), CL_MEM_READ_WRITE, num_lights);
+		for (cl_uint shift = 0; shift < 64; shift += s_radix_bits) {
+			m_kernel_radix_count.setArg(0, sizeof(cl_uint), &num_lights);
+			m_kernel_radix_count.setArg(1, sizeof(cl_uint), &shift);
+			m_kernel_radix_count.setArg(2, source.GetBuffer());
+			m_kernel_radix_count.setArg(3, histograms.GetBuffer());
+			CHECK(queue.enqueueNDRangeKernel(m_kernel_radix_count, cl::NullRange, cl::NDRange(num_blocks * s_radix_range), cl::NDRange(s_radix_range)));
+
+			// Exclusive scan of the histograms, reduced to one sum per tile, scanned and then spread over the tiles
+			m_kernel_radix_reduce.setArg(0, sizeof(cl_uint), &num_lights);
+			m_kernel_radix_reduce.setArg(1, histograms.GetBuffer());
+			m_kernel_radix_reduce.setArg(2, tile_sums.GetBuffer());
+			CHECK(queue.enqueueNDRangeKernel(m_kernel_radix_reduce, cl::NullRange, cl::NDRange(num_tiles * s_radix_range), cl::NDRange(s_radix_range)));
+
+			m_kernel_radix_scan.setArg(0, sizeof(cl_uint), &num_lights);
+			m_kernel_radix_scan.setArg(1, tile_sums.GetBuffer());
+			CHECK(queue.enqueueNDRangeKernel(m_kernel_radix_scan, cl::NullRange, cl::NDRange(s_radix_range), cl::NDRange(s_radix_range)));
+
+			m_kernel_radix_downsweep.setArg(0, sizeof(cl_uint), &num_lights);
+			m_kernel_radix_downsweep.setArg(1, histograms.GetBuffer());
+			m_kernel_radix_downsweep.setArg(2, tile_sums.GetBuffer());
+			CHECK(queue.enqueueNDRangeKernel(m_kernel_radix_downsweep, cl::NullRange, cl::NDRange(num_tiles * s_radix_range), cl::NDRange(s_radix_range)));
+
+			m_kernel_radix_scatter.setArg(0, sizeof(cl_uint), &num_lights);
+			m_kernel_radix_scatter.setArg(1, sizeof(cl_uint), &shift);
+			m_kernel_radix_scatter.setArg(2, source.GetBuffer());
+			m_kernel_radix_scatter.setArg(3, histograms.GetBuffer());
+			m_kernel_radix_scatter.setArg(4, target.GetBuffer());
+			CHECK(queue.enqueueNDRangeKernel(m_kernel_radix_scatter, cl::NullRange, cl::NDRange(num_blocks * s_radix_range), cl::NDRange(s_radix_range)));
+
+			std::swap(source, target);
+		}
+		codes = source;
+	}
+
+	void LightTreeBuilder::GenerateHierarchy(cl_uint num_lights, const TypedBuffer<morton_key>& codes, const TypedBuffer<SHARED::LightTreeNode>& leaves, const TypedBuffer<SHARED::Light>& lights, const result& out, const TypedBuffer<cl_int>& parents)
+	{
+		m_kernel_hierarchy.setArg(0, sizeof(cl_uint), &num_lights);
+		m_kernel_hierarchy.setArg(1, codes.GetBuffer());
+		m_kernel_hierarchy.setArg(2, leaves.GetBuffer());
+		m_kernel_hierarchy.setArg(3, lights.GetBuffer());
+		m_kernel_hierarchy.setArg(4, out.nodes.GetBuffer());
+		m_kernel_hierarchy.setArg(5, parents.GetBuffer());
+		m_kernel_hierarchy.setArg(6, out.lights.GetBuffer());
+		CHECK(Compute::GetCommandQueue().enqueueNDRangeKernel(m_kernel_hierarchy, cl::NullRange, cl::NDRange(num_lights)));
+	}
+
+	void LightTreeBuilder::Refit(cl_uint num_lights, const TypedBuffer<cl_int>& parents, const TypedBuffer<SHARED::LightTreeNode>& nodes)
+	{
+		// a single leaf is the root
+		if (num_lights < 2)
+			return;
+
+		auto& queue = Compute::GetCommandQueue();
+
+		// one arrival counter for each internal node
+		TypedBuffer<cl_uint> flags = TypedBuffer<cl_uint>(Compute::GetContext(), CL_MEM_READ_WRITE, num_lights - 1);
+		CHECK(queue.enqueueFillBuffer(flags.GetBuffer(), cl_uint(0), 0, sizeof(cl_uint) * (num_lights - 1)));
+
+		m_kernel_refit.setArg(0, sizeof(cl_uint), &num_lights);
+		m_kernel_refit.setArg(1, parents.GetBuffer());
+		m_kernel_refit.setArg(2, nodes.GetBuffer());
+		m_kernel_refit.setArg(3, flags.GetBuffer());
+		CHECK(queue.enqueueNDRangeKernel(m_kernel_refit, cl::NullRange, cl::NDRange(num_lights)));
+	}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Kernels/shared_defines.h"
+#include "Compute/Buffer.h"
+#include "Compute/Compute.h"
+
+#include "Kernel.h"
+
+namespace LSIS {
+
+	/// Builds a binary light tree on the device, as a LBVH over the morton codes of the light centers.
+	/// Internal nodes are stored in [0, n-1) with the root at 0, followed by the n leaves of a single light each. Children are referenced explicitly by left and right, so the nodes are traversed like the nodes of LightTree.
+	/// Lower quality than the SAOH built LightTree, but nothing passes through the host.
+	class LightTreeBuilder : Kernel {
+		typedef struct morton_key {
+			cl_ulong code;
+			cl_uint index;
+		} morton_key;
+	public:
+		typedef struct result {
+			TypedBuffer<SHARED::LightTreeNode> nodes;
+			TypedBuffer<SHARED::Light> lights; // in the order referenced by the leaves
+			TypedBuffer<cl_float> leaf_cdf;
+		} result;
+
+		LightTreeBuilder();
+		virtual ~LightTreeBuilder();
+
+		virtual void Compile() override;
+
+		result Build(const TypedBuffer<SHARED::Light>& lights);
+
+	private:
+		void PrepareLights(cl_uint num_lights, const TypedBuffer<SHARED::Light>& lights, const TypedBuffer<SHARED::LightTreeNode>& leaves, const TypedBuffer<cl_float3>& centers);
+		void FindCentroidBounds(cl_uint num_lights, const TypedBuffer<cl_float3>& centers, const TypedBuffer<cl_float3>& bounds);
+		void GenerateMortonCodes(cl_uint num_lights, const TypedBuffer<cl_float3>& centers, const TypedBuffer<cl_float3>& bounds, const TypedBuffer<morton_key>& codes);
+		void SortMortonCodes(cl_uint num_lights, TypedBuffer<morton_key>& codes);
+		void GenerateHierarchy(cl_uint num_lights, const TypedBuffer<morton_key>& codes, const TypedBuffer<SHARED::LightTreeNode>& leaves, const TypedBuffer<SHARED::Light>& lights, const result& out, const TypedBuffer<cl_int>& parents);
+		void Refit(cl_uint num_lights, const TypedBuffer<cl_int>& parents, const TypedBuffer<SHARED::LightTreeNode>& nodes);
+
+	private:
+		// Must match the defines in light_tree_builder.cl and radixsortCL.h
+		static constexpr size_t s_bounds_group_size = 256;
+		static constexpr size_t s_radix_bits = 8;
+		static constexpr size_t s_radix_range = 1 << s_radix_bits;
+		static constexpr size_t s_radix_block_size = 1024;
+		static constexpr size_t s_radix_scan_tile = 1024;
+
+		cl::Program m_program;
+		cl::Kernel m_kernel_prepare;
+		cl::Kernel m_kernel_bounds;
+		cl::Kernel m_kernel_morton_code;
+		cl::Kernel m_kernel_radix_count;
+		cl::Kernel m_kernel_radix_reduce;
+		cl::Kernel m_kernel_radix_scan;
+		cl::Kernel m_kernel_radix_downsweep;
+		cl::Kernel m_kernel_radix_scatter;
+		cl::Kernel m_kernel_hierarchy;
+		cl::Kernel m_kernel_refit;
+	};
+
+}
@@ -0,0 +1,260 @@
+#include "pch.h"
+#include "LightTreeClustering.h"
+
+#include "DataStructures/KdTree.h"
+#include "Threading/ThreadPool.h"
+
+#include "gtc/constants.hpp"
+
+namespace LSIS {
+
+	// Nearest clusters considered as merge candidates for each cluster
+	static constexpr unsigned int s_num_candidates = 8;
+
+	LightTreeClustering::LightTreeClustering(const SHARED::Light* lights, const size_t num_lights)
+	{
+		if (num_lights == 0)
+			return;
+
+		// A full binary tree over n leaves has 2n-1 nodes
+		std::vector<cluster> clusters = std::vector<cluster>(num_lights);
+		clusters.reserve(num_lights * 2 - 1);
+
+		ThreadPool::Get().ParallelFor(0, num_lights, [&](size_t begin, size_t end, size_t) {
+			for (size_t i = begin; i < end; i++) {
+				clusters[i] = make_cluster(lights[i], static_cast<uint>(i));
+			}
+		});
+
+		float3 pmin = clusters[0].pmin;
+		float3 pmax = clusters[0].pmax;
+		for (const cluster& c : clusters) {
+			pmin = glm::min(pmin, c.pmin);
+			pmax = glm::max(pmax, c.pmax);
+		}
+		// All lights are oriented, so the directional term is scaled by the scene diagonal
+		m_scaling = glm::length(pmax - pmin);
+
+		cluster_lights(clusters);
+		flatten(clusters, lights);
+	}
+
+	LightTreeClustering::~LightTreeClustering()
+	{
+	}
+
+	void LightTreeClustering::cluster_lights(std::vector<cluster>& clusters)
+	{
+		ThreadPool& pool = ThreadPool::Get();
+
+		std::vector<uint> active = std::vector<uint>(clusters.size());
+		for (uint i = 0; i < active.size(); i++) {
+			active[i] = i;
+		}
+
+		std::vector<uint> next_active;
+		std::vector<uint> order;
+		// Indexed by the cluster id, for all clusters that will be created
+		const size_t num_clusters = clusters.size() * 2 - 1;
+		std::vector<int> best = std::vector<int>(num_clusters, -1);
+		std::vector<float> best_cost = std::vector<float>(num_clusters);
+		std::vector<uint8_t> merged = std::vector<uint8_t>(num_clusters, 0);
+
+		while (active.size() > 1) {
+			KdTree<glm::vec3, uint, 3> kd_tree;
+			kd_tree.Reserve(active.size() + 1);
+			for (uint id : active) {
+				const cluster& c = clusters[id];
+				kd_tree.Insert((c.pmin + c.pmax) * 0.5f, id);
+			}
+			kd_tree.Build();
+			const size_t first_new = clusters.size();
+
+			// Find the best candidate of each cluster. Only reads the clusters, so all are searched at once
+			pool.ParallelFor(0, active.size(), [&](size_t begin, size_t end, size_t) {
+				std::vector<KDTreeRecord<glm::vec3, uint>> candidates;
+				for (size_t i = begin; i < end; i++) {
+					const uint id = active[i];
+					const cluster& c = clusters[id];
+
+					candidates.clear();
+					float radius = std::numeric_limits<float>::max();
+					kd_tree.NNearest((c.pmin + c.pmax) * 0.5f, id, radius, candidates, s_num_candidates);
+
+					best[id] = -1;
+					best_cost[id] = std::numeric_limits<float>::max();
+					for (const auto& candidate : candidates) {
+						const float cost = merge_cost(c, clusters[candidate.val]);
+						// Ties are broken by the id, so two clusters agree on the pair
+						if (best[id] == -1 || cost < best_cost[id] || (cost == best_cost[id] && candidate.val < static_cast<uint>(best[id]))) {
+							best[id] = candidate.val;
+							best_cost[id] = cost;
+						}
+					}
+				}
+			});
+
+			// Merge each cluster with its best candidate, cheapest first, unless one of them was merged already.
+			// Pairs that are each others best candidate are always merged, and the cheapest pair makes sure there is progress
+			order.assign(active.begin(), active.end());
+			std::sort(order.begin(), order.end(), [&](uint a, uint b) { return best_cost[a] < best_cost[b] || (best_cost[a] == best_cost[b] && a < b); });
+			for (uint id : order) {
+				const int other = best[id];
+				if (merged[id] || other == -1 || merged[other])
+					continue;
+				merged[id] = 1;
+				merged[other] = 1;
+				clusters.push_back(merge(clusters[id], clusters[other], id, other));
+			}
+
+			// The clusters left over and the new clusters are clustered in the next round
+			next_active.clear();
+			for (uint id : active) {
+				if (!merged[id])
+					next_active.push_back(id);
+			}
+			for (uint id = static_cast<uint>(first_new); id < clusters.size(); id++) {
+				next_active.push_back(id);
+			}
+			std::swap(active, next_active);
+		}
+	}
+
+	void LightTreeClustering::flatten(const std::vector<cluster>& clusters, const SHARED::Light* lights)
+	{
+		const size_t num_lights = clusters.back().count;
+		m_nodes.resize(clusters.size());
+		m_lights.resize(num_lights);
+
+		// Pairs of the cluster and its node index. The left child is always the next node, and the right child follows the left subtree
+		std::vector<std::pair<int, int>> stack = { { static_cast<int>(clusters.size()) - 1, 0 } };
+		int next_light = 0;
+		while (!stack.empty()) {
+			const auto [id, index] = stack.back(); stack.pop_back();
+			const cluster& c = clusters[id];
+
+			if (c.left == -1) {
+				m_nodes[index] = SHARED::make_light_tree_leaf(c.pmin, c.pmax, c.axis, c.energy, c.theta_o, c.theta_e, next_light, 1);
+				m_lights[next_light++] = lights[c.light];
+			}
+			else {
+				// The left subtree over n lights occupies 2n-1 nodes
+				const int left_index = index + 1;
+				const int right_index = left_index + static_cast<int>(clusters[c.left].count) * 2 - 1;
+
+				m_nodes[index] = SHARED::make_light_tree_node(c.pmin, c.pmax, c.axis, c.energy, c.theta_o, c.theta_e, left_index, right_index);
+				stack.push_back({ c.right, right_index });
+				stack.push_back({ c.left, left_index });
+			}
+		}
+	}
+
+	inline LightTreeClustering::cluster LightTreeClustering::make_cluster(const SHARED::Light& light, uint index)
+	{
+		const float3 t = convert(light.tangent);
+		const float3 b = convert(light.bitangent);
+		const float area = glm::length(glm::cross(t, b)) * 0.5f;
+
+		const float3 p0 = convert(light.position);
+		const float3 p1 = p0 + t;
+		const float3 p2 = p0 + b;
+
+		cluster c = {};
+		c.pmin = glm::min(glm::min(p0, p1), p2);
+		c.pmax = glm::max(glm::max(p0, p1), p2);
+		c.axis = glm::normalize(convert(light.direction));
+		c.theta_o = 0.0f;
+		c.theta_e = light.direction.w;
+		c.energy = convert(light.intensity) * area;
+		c.left = -1;
+		c.right = -1;
+		c.count = 1;
+		c.light = index;
+		return c;
+	}
+
+	inline LightTreeClustering::cluster LightTreeClustering::merge(const cluster& a_in, const cluster& b_in, int left, int right)
+	{
+		cluster c = {};
+		c.pmin = glm::min(a_in.pmin, b_in.pmin);
+		c.pmax = glm::max(a_in.pmax, b_in.pmax);
+		c.energy = a_in.energy + b_in.energy;
+		c.theta_e = glm::max(a_in.theta_e, b_in.theta_e);
+		c.left = left;
+		c.right = right;
+		c.count = a_in.count + b_in.count;
+
+		// Bounding cone of the two cones, the same as union_bcone of LightTree
+		const cluster& a = a_in.theta_o >= b_in.theta_o ? a_in : b_in;
+		const cluster& b = a_in.theta_o >= b_in.theta_o ? b_in : a_in;
+		const float pi = glm::pi<float>();
+		const float d = glm::clamp(glm::dot(a.axis, b.axis), -1.0f, 1.0f);
+		const float theta_d = glm::acos(d);
+
+		c.axis = a.axis;
+		c.theta_o = a.theta_o;
+		if (pi <= a.theta_o || glm::min(theta_d + b.theta_o, pi) <= a.theta_o)
+			return c;
+
+		const float theta_o = (a.theta_o + theta_d + b.theta_o) / 2.0f;
+		const float3 ortho = b.axis - a.axis * d;
+		const float ortho_length = glm::length(ortho);
+		if (pi <= theta_o || ortho_length <= 0.0f) {
+			c.theta_o = pi;
+			return c;
+		}
+
+		// Rotate a.axis towards b.axis by theta_r in the plane spanned by the two axis
+		const float theta_r = theta_o - a.theta_o;
+		c.axis = glm::normalize(a.axis * glm::cos(theta_r) + ortho * (glm::sin(theta_r) / ortho_length));
+		c.theta_o = theta_o;
+		return c;
+	}
+
+	inline float LightTreeClustering::merge_cost(const cluster& a, const cluster& b)
+	{
+		const cluster c = merge(a, b, -1, -1);
+		return similarity(c.energy.x + c.energy.y + c.energy.z, glm::length(c.pmax - c.pmin), c.theta_o, m_scaling);
+	}
+
+	TypedBuffer<SHARED::LightTreeNode> LightTreeClustering::GetNodeBuffer()
+	{
+		if (m_nodes.empty())
+			return TypedBuffer<SHARED::LightTreeNode>();
+
+		const auto queue = Compute::GetCommandQueue();
+
+		TypedBuffer<SHARED::LightTreeNode> buffer = TypedBuffer<SHARED::LightTreeNode>(Compute::GetContext(), CL_MEM_READ_ONLY, m_nodes.size());
+		CHECK(queue.enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::LightTreeNode) * m_nodes.size(), (void*)m_nodes.data()));
+
+		return buffer;
+	}
+
+	TypedBuffer<SHARED::Light> LightTreeClustering::GetLightBuffer()
+	{
+		if (m_lights.empty())
+			return TypedBuffer<SHARED::Light>();
+
+		const auto queue = Compute::GetCommandQueue();
+
+		TypedBuffer<SHARED::Light> buffer = TypedBuffer<SHARED::Light>(Compute::GetContext(), CL_MEM_READ_ONLY, m_lights.size());
+		CHECK(queue.enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Light) * m_lights.size(), (void*)m_lights.data()));
+
+		return buffer;
+	}
+
+	TypedBuffer<cl_float> LightTreeClustering::GetLeafCDFBuffer()
+	{
+		if (m_lights.empty())
+			return TypedBuffer<cl_float>();
+
+		const auto queue = Compute::GetCommandQueue();
+
+		const std::vector<cl_float> leaf_cdf = std::vector<cl_float>(m_lights.size(), 1.0f);
+		TypedBuffer<cl_float> buffer = TypedBuffer<cl_float>(Compute::GetContext(), CL_MEM_READ_ONLY, leaf_cdf.size());
+		CHECK(queue.enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(cl_float) * leaf_cdf.size(), (void*)leaf_cdf.data()));
+
+		return buffer;
+	}
+
+}
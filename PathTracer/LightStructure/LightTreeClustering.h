@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+
+#include "LightStructure.h"
+
+namespace LSIS {
+
+	/// Light tree built bottom up by agglomerative clustering, as an alternative to the top down SAOH build of LightTree.
+	/// Clusters are merged pairwise by the similarity metric, with the candidates found by nearest neighbour queries in a KdTree over the cluster centers.
+	/// The merges are done in rounds: every cluster finds its best candidate in parallel, then the clusters are merged with their candidates, cheapest first, if both are still unmerged.
+	/// The nodes are stored depth first with single light leaves, in the same format as the nodes of LightTree
+	class LightTreeClustering {
+	public:
+		LightTreeClustering(const SHARED::Light* lights, const size_t num_lights);
+		~LightTreeClustering();
+
+		TypedBuffer<SHARED::LightTreeNode> GetNodeBuffer();
+		/// The lights reordered so the leaves references them in depth first order. Use this instead of the input lights
+		TypedBuffer<SHARED::Light> GetLightBuffer();
+		/// Every leaf holds a single light, so all entries are 1
+		TypedBuffer<cl_float> GetLeafCDFBuffer();
+		size_t GetNumNodes() const { return m_nodes.size(); }
+		const SHARED::LightTreeNode* GetNodes() const { return m_nodes.data(); }
+
+	private:
+		using float3 = glm::vec3;
+		using uint = uint32_t;
+
+		typedef struct cluster {
+			float3 pmin;
+			float3 pmax;
+			float3 axis;
+			float theta_o;
+			float theta_e;
+			float3 energy;
+			int left; // child clusters, -1 for leaves
+			int right;
+			uint count; // number of lights
+			uint light; // light of leaves, index in the constructor input
+		} cluster;
+
+		inline cluster make_cluster(const SHARED::Light& light, uint index);
+		inline cluster merge(const cluster& a, const cluster& b, int left, int right);
+		// Similarity metric of the cluster merging a and b. Lower is better
+		inline float merge_cost(const cluster& a, const cluster& b);
+
+		// Clusters the active clusters in rounds until only the root is left
+		void cluster_lights(std::vector<cluster>& clusters);
+		// Stores the cluster tree depth first, and orders the lights as the leaves
+		void flatten(const std::vector<cluster>& clusters, const SHARED::Light* lights);
+
+		inline glm::vec3 convert(cl_float4 vec) { return glm::vec3(vec.x, vec.y, vec.z); }
+
+	private:
+		// The spatial and directional terms of the metric are scaled relative to each other by the scene size
+		float m_scaling = 0.0f;
+		std::vector<SHARED::LightTreeNode> m_nodes;
+		std::vector<SHARED::Light> m_lights;
+	};
+
+}
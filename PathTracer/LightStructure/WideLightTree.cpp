@@ -0,0 +1,82 @@
+#include "pch.h"
+#include "WideLightTree.h"
+
+namespace LSIS {
+
+	WideLightTree::WideLightTree(const LightTree& tree, size_t width)
+		: m_width(glm::clamp<size_t>(width, 2, LIGHT_TREE_MAX_WIDTH))
+	{
+		if (tree.GetNumNodes() == 0)
+			return;
+
+		const SHARED::LightTreeNode* nodes = tree.GetNodes();
+		m_nodes.reserve(tree.GetNumNodes());
+		m_nodes.push_back(nodes[0]);
+
+		// Pairs of the wide node index and the binary node it was copied from
+		auto queue = std::queue<std::pair<int, int>>();
+		if (INTERNAL(nodes[0]))
+			queue.push({ 0, 0 });
+
+		std::vector<int> children;
+		children.reserve(m_width);
+
+		while (!queue.empty()) {
+			const auto [index, source] = queue.front(); queue.pop();
+
+			children.clear();
+			children.push_back(nodes[source].left);
+			children.push_back(nodes[source].right);
+
+			// Replace the internal child with the most energy by its two children, until the node is full
+			while (children.size() < m_width) {
+				int best = -1;
+				float best_energy = -1.0f;
+				for (int i = 0; i < children.size(); i++) {
+					const SHARED::LightTreeNode& child = nodes[children[i]];
+					if (INTERNAL(child) && energy(child) > best_energy) {
+						best_energy = energy(child);
+						best = i;
+					}
+				}
+				if (best == -1)
+					break;
+
+				const SHARED::LightTreeNode& opened = nodes[children[best]];
+				children[best] = opened.left;
+				children.insert(children.begin() + best + 1, opened.right);
+			}
+
+			// Store the children contiguously after the nodes already created
+			const int first = static_cast<int>(m_nodes.size());
+			for (int i = 0; i < children.size(); i++) {
+				const SHARED::LightTreeNode& child = nodes[children[i]];
+				m_nodes.push_back(child);
+				if (INTERNAL(child))
+					queue.push({ first + i, children[i] });
+			}
+
+			m_nodes[index].left = first;
+			m_nodes[index].right = static_cast<int>(children.size());
+		}
+	}
+	WideLightTree::~WideLightTree()
+	{
+	}
+	TypedBuffer<SHARED::LightTreeNode> WideLightTree::GetNodeBuffer()
+	{
+		// Return empty buffer if no nodes are available
+		if (m_nodes.empty())
+			return TypedBuffer<SHARED::LightTreeNode>();
+
+		// Fetch command queue
+		const auto queue = Compute::GetCommandQueue();
+
+		// create buffer and copy node data to the GPU
+		TypedBuffer<SHARED::LightTreeNode> buffer = TypedBuffer<SHARED::LightTreeNode>(Compute::GetContext(), CL_MEM_READ_ONLY, m_nodes.size());
+		CHECK(queue.enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::LightTreeNode) * m_nodes.size(), (void*)m_nodes.data()));
+
+		return buffer;
+	}
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+
+#include "LightTree.h"
+
+namespace LSIS {
+
+	/// Light tree with up to LIGHT_TREE_MAX_WIDTH children per node, made by collapsing a binary LightTree.
+	/// Internal nodes stores the index of the first child in left and the number of children in right, with all children stored contiguously.
+	/// Leaves are identical to the leaves of the binary tree, so the light and leaf cdf buffers of the binary tree are used with it.
+	class WideLightTree {
+	public:
+		WideLightTree(const LightTree& tree, size_t width = 4);
+		~WideLightTree();
+
+		TypedBuffer<SHARED::LightTreeNode> GetNodeBuffer();
+		size_t GetNumNodes() const { return m_nodes.size(); }
+
+	private:
+		inline float energy(const SHARED::LightTreeNode& node) const { return node.energy.x + node.energy.y + node.energy.z; }
+
+	private:
+		const size_t m_width;
+		std::vector<SHARED::LightTreeNode> m_nodes;
+	};
+
+}
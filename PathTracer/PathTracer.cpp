@@ -9,13 +9,22 @@
 #include "Scene/Components.h"
 
 #include <list>
+#include <map>
 #include <tuple>
 
 #include "AccelerationStructure/LBVHStructure.h"
+#include "AccelerationStructure/BVHBuilder.h"
 #include "AccelerationStructure/SAHBVHStructure.h"
+#include "AccelerationStructure/WideBVH.h"
+#include "AccelerationStructure/MergedBVH.h"
 
 #include "LightStructure/LightStructure.h"
 #include "LightStructure/LightTree.h"
+#include "LightStructure/WideLightTree.h"
+#include "LightStructure/LightTreeBuilder.h"
+#include "LightStructure/LightTreeClustering.h"
+
+#include "SceneCache.h"
 
 #include "IO/Image.h"
 
@@ -122,6 +131,14 @@ namespace LSIS {
 				options.push_back("-D SOLID_ANGLE");
 			if (use_lighttree)
 				options.push_back("-D USE_LIGHTTREE");
+			if (use_lighttree && m_light_tree_width > 2)
+				options.push_back("-D WIDE_LIGHTTREE");
+			if (use_compact_nodes())
+				options.push_back("-D COMPACT_LIGHTTREE");
+			if (use_light_cut())
+				options.push_back("-D LIGHT_CUT_SIZE=" + std::to_string(m_light_cut_size));
+			if (use_light_cache())
+				options.push_back("-D LIGHT_CACHE_CELLS=" + std::to_string(m_light_cache_cells));
 			if (use_min_distance)
 				options.push_back("-D MIN_DIST");
 			if (use_conditional_attenuation)
@@ -155,12 +172,28 @@ namespace LSIS {
 		m_source_buffer = TypedBuffer<cl_uint>(context, CL_MEM_READ_WRITE, num_concurrent_samples);
 		m_active_count_buffer = TypedBuffer<cl_uint>(context, CL_MEM_READ_WRITE, 1);
 
-		m_light_contribution_buffer = TypedBuffer<cl_float3>(context, CL_MEM_READ_WRITE, num_concurrent_samples);
-
 		m_ray_buffer = TypedBuffer<SHARED::Ray>(context, CL_MEM_READ_WRITE, num_concurrent_samples);
 		m_intersection_buffer = TypedBuffer<SHARED::Intersection>(context, CL_MEM_READ_WRITE, num_concurrent_samples);
-		m_occlusion_ray_buffer = TypedBuffer<SHARED::Ray>(context, CL_MEM_READ_WRITE, num_concurrent_samples);
-		m_occlusion_buffer = TypedBuffer<cl_int>(context, CL_MEM_READ_WRITE, num_concurrent_samples);
+
+		PrepareShadowRays(context);
+	}
+
+	void PathTracer::PrepareShadowRays(const cl::Context& context)
+	{
+		size_t num_pixels = static_cast<size_t>(m_image_width) * static_cast<size_t>(m_image_height);
+		size_t num_shadow_rays = num_pixels * m_num_samples_per_pixel * num_light_samples();
+
+		// Already allocated for this number of rays
+		if (m_occlusion_ray_buffer.Count() == num_shadow_rays)
+			return;
+
+		m_light_contribution_buffer = TypedBuffer<cl_float3>(context, CL_MEM_READ_WRITE, num_shadow_rays);
+		m_occlusion_ray_buffer = TypedBuffer<SHARED::Ray>(context, CL_MEM_READ_WRITE, num_shadow_rays);
+		m_occlusion_buffer = TypedBuffer<cl_int>(context, CL_MEM_READ_WRITE, num_shadow_rays);
+
+		const cl_uint count = static_cast<cl_uint>(num_shadow_rays);
+		m_occlusion_count_buffer = TypedBuffer<cl_uint>(context, CL_MEM_READ_WRITE, 1);
+		CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(m_occlusion_count_buffer.GetBuffer(), CL_TRUE, 0, sizeof(cl_uint), &count));
 	}
 
 	void PathTracer::BuildStructure()
@@ -168,25 +201,149 @@ namespace LSIS {
 		//LoadMaterials();
 		LoadSceneData();
 
-		//BVHBuilder builder = BVHBuilder();
-		const auto start = std::chrono::high_resolution_clock::now();
+		if (use_instanced_bvh() && !m_meshes.empty()) {
+			const auto start = std::chrono::high_resolution_clock::now();
+
+			// The faces of each mesh are reordered for the leaves of its BVH
+			m_two_level_bvh = std::make_unique<TwoLevelBVH>(m_vertex_data, m_face_data, m_meshes, m_num_bins);
+			m_two_level_bvh->SetInstances(m_instance_meshes, m_instance_transforms);
+
+			const auto end = std::chrono::high_resolution_clock::now();
+			const std::chrono::duration<double, std::milli> duration = end - start;
+			m_profile_data.time_build_bvh = duration.count();
+
+			m_bvh_buffer = m_two_level_bvh->GetMeshNodeBuffer();
+			m_bvh_parent_buffer = m_two_level_bvh->GetMeshParentBuffer();
+			m_top_bvh_buffer = m_two_level_bvh->GetNodeBuffer();
+			m_instance_buffer = m_two_level_bvh->GetInstanceBuffer();
+			m_wide_bvh_buffer = TypedBuffer<SHARED::WideBVHNode>();
+
+			CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(m_face_buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Face) * m_num_faces, m_face_data));
+			build_triangles();
+		}
+		else if (m_scene_cache && m_scene_cache->IsLoaded()) {
+			const auto start = std::chrono::high_resolution_clock::now();
+
+			// The wide BVH is stored in place of the binary nodes. Only the binary BVH has parents, also when it replaced a wide BVH too deep for the stack
+			if (m_bvh_width > 2 && !m_scene_cache->Has(SceneCache::BVHParents)) {
+				m_wide_bvh_buffer = m_scene_cache->Upload<SHARED::WideBVHNode>(SceneCache::BVHNodes, CL_MEM_READ_ONLY);
+			}
+			else {
+				m_bvh_buffer = m_scene_cache->Upload<SHARED::BVHNode>(SceneCache::BVHNodes, CL_MEM_READ_ONLY);
+				m_bvh_parent_buffer = m_scene_cache->Upload<cl_int>(SceneCache::BVHParents, CL_MEM_READ_ONLY);
+				m_wide_bvh_buffer = TypedBuffer<SHARED::WideBVHNode>();
+			}
+			m_triangle_buffer = m_scene_cache->Upload<SHARED::Triangle>(SceneCache::Triangles, CL_MEM_READ_ONLY);
+
+			const auto end = std::chrono::high_resolution_clock::now();
+			const std::chrono::duration<double, std::milli> duration = end - start;
+			m_profile_data.time_build_bvh = duration.count();
+		}
+		else if (use_gpu_bvh_builder()) {
+			// Compile the builder kernels before the timer starts
+			BVHBuilder builder = BVHBuilder();
+			const auto start = std::chrono::high_resolution_clock::now();
+
+			TypedBuffer<cl_int> parents;
+			TypedBuffer<SHARED::BVHNode> nodes = builder.Build(m_vertex_buffer, m_face_buffer, parents, m_treelet_passes);
+
+			const auto end = std::chrono::high_resolution_clock::now();
+			const std::chrono::duration<double, std::milli> duration = end - start;
+			m_profile_data.time_build_bvh = duration.count();
+
+			// The leaves reference the faces in their input order, so the faces are kept
+			m_bvh_buffer = nodes;
+			m_bvh_parent_buffer = parents;
+			m_wide_bvh_buffer = TypedBuffer<SHARED::WideBVHNode>();
+			build_triangles();
+
+			if (m_scene_cache)
+				save_scene_cache();
+		}
+		else {
+			const auto start = std::chrono::high_resolution_clock::now();
 
 #ifdef USE_LBVH
-		LBVHStructure structure = LBVHStructure();
-		structure.Build(m_vertex_buffer, m_face_buffer);
+			LBVHStructure structure = LBVHStructure(4, m_treelet_passes);
+			structure.Build(m_vertex_data, m_face_data, m_num_faces);
 #else // Use Binned SAH BVH
-		SAHBVHStructure structure = SAHBVHStructure(m_vertex_data, m_face_data, m_num_faces);
+			SAHBVHStructure structure = SAHBVHStructure(m_vertex_data, m_face_data, m_num_faces, m_num_bins);
 #endif // USE_LBVH
 
-		const auto end = std::chrono::high_resolution_clock::now();
-		const std::chrono::duration<double, std::milli> duration = end - start;
-		m_profile_data.time_build_bvh = duration.count();
+			// The collapse or relayout is part of the build time
+			std::unique_ptr<WideBVH> wide_bvh;
+			std::unique_ptr<MergedBVH> merged_bvh;
+			if (m_bvh_width > 2) {
+				wide_bvh = std::make_unique<WideBVH>(structure.GetNodes(), structure.GetBounds(), structure.GetFaces().data(), m_bvh_width);
+				// The wide traversal has a fixed stack, so deeper trees are traced as binary BVHs
+				if (wide_bvh->GetStackSize() > WIDE_STACK_SIZE) {
+					printf("Wide BVH needs %zd stack entries, tracing the binary BVH instead\n", wide_bvh->GetStackSize());
+					wide_bvh.reset();
+				}
+			}
+			if (!wide_bvh)
+				merged_bvh = std::make_unique<MergedBVH>(structure.GetNodes(), structure.GetBounds());
+
+			const auto end = std::chrono::high_resolution_clock::now();
+			const std::chrono::duration<double, std::milli> duration = end - start;
+			m_profile_data.time_build_bvh = duration.count();
+
+			if (wide_bvh) {
+				m_wide_bvh_buffer = wide_bvh->GetNodeBuffer();
+				m_bvh_buffer = TypedBuffer<SHARED::BVHNode>();
+				m_bvh_parent_buffer = TypedBuffer<cl_int>();
+
+				// The wide nodes reference the faces in their own order
+				m_face_buffer = wide_bvh->GetFaceBuffer();
+				std::copy(wide_bvh->GetFaces().begin(), wide_bvh->GetFaces().end(), m_face_data);
+			}
+			else {
+				m_bvh_buffer = merged_bvh->GetNodeBuffer();
+				m_bvh_parent_buffer = merged_bvh->GetParentBuffer();
+				m_wide_bvh_buffer = TypedBuffer<SHARED::WideBVHNode>();
+
+				// The leaves reference the faces in the order of the structure
+				m_face_buffer = structure.GetFaceBuffer();
+				std::copy(structure.GetFaces().begin(), structure.GetFaces().end(), m_face_data);
+			}
+			build_triangles();
+
+			if (m_scene_cache)
+				save_scene_cache();
+		}
+		// Release the mapped file
+		m_scene_cache.reset();
 
-		m_bvh_buffer = structure.GetNodesBuffer();
-		m_bboxes_buffer = structure.GetBoundsBuffer();
+		// The width traced, as a wide BVH too deep for the stack is replaced by the binary BVH
+		m_profile_data.bvh_width = m_wide_bvh_buffer.Count() > 0 ? m_bvh_width : 2;
+		if (m_wide_bvh_buffer.Count() > 0) {
+			m_bvh.SetWideBVHBuffer(m_wide_bvh_buffer);
+		}
+		else {
+			// The short stack only holds BVH_STACK_SIZE nodes, so deeper trees must be traced without it
+			size_t depth = 0;
+			if (m_two_level_bvh) {
+				m_bvh.SetInstancedBVHBuffers(m_top_bvh_buffer, m_instance_buffer, m_bvh_buffer, m_bvh_parent_buffer);
+				depth = m_two_level_bvh->GetMeshDepth();
+			}
+			else {
+				m_bvh.SetBVHBuffer(m_bvh_buffer, m_bvh_parent_buffer);
 
-		m_bvh.SetBVHBuffer(m_bvh_buffer, m_bboxes_buffer);
-		m_bvh.SetGeometryBuffers(m_vertex_buffer, m_face_buffer);
+				std::vector<cl_int> parents(m_bvh_parent_buffer.Count());
+				CHECK(Compute::GetCommandQueue().enqueueReadBuffer(m_bvh_parent_buffer.GetBuffer(), CL_TRUE, 0, sizeof(cl_int) * parents.size(), parents.data()));
+				depth = MergedBVH::CalcDepth(parents.data(), parents.size());
+			}
+			const bool stackless = use_stackless_bvh || depth > BVH_STACK_SIZE;
+			if (stackless && !use_stackless_bvh)
+				printf("BVH depth %zd exceeds the traversal stack, tracing without a stack\n", depth);
+
+			m_bvh.UseStacklessTraversal(stackless);
+			m_profile_data.stackless_bvh = stackless;
+		}
+		m_profile_data.instancing = m_two_level_bvh != nullptr;
+		m_profile_data.gpu_bvh = use_gpu_bvh_builder();
+		m_profile_data.num_instances = m_two_level_bvh ? m_two_level_bvh->GetNumInstances() : 0;
+		m_bvh.SetGeometryBuffers(m_vertex_buffer, m_face_buffer, m_triangle_buffer);
 
 		ResetSamples();
 
@@ -248,19 +405,27 @@ namespace LSIS {
 		CHECK(m_kernel_shade.setArg(6, m_geometric_buffer.GetBuffer()));
 		CHECK(m_kernel_shade.setArg(7, m_lights.GetBuffer()));
 		CHECK(m_kernel_shade.setArg(8, m_material_buffer.GetBuffer()));
+		// The light structure arguments depends on the sampling method, so the remaining indices are counted
+		cl_uint arg = 9;
 		if (use_lighttree) {
-			CHECK(m_kernel_shade.setArg(9, m_lighttree_buffer.GetBuffer()));
+			CHECK(m_kernel_shade.setArg(arg++, use_compact_nodes() ? m_compact_lighttree_buffer.GetBuffer() : m_lighttree_buffer.GetBuffer()));
+			CHECK(m_kernel_shade.setArg(arg++, m_leaf_cdf_buffer.GetBuffer()));
+			if (use_light_cache()) {
+				CHECK(m_kernel_shade.setArg(arg++, sizeof(cl_float), &m_light_cache_cell_size));
+				CHECK(m_kernel_shade.setArg(arg++, m_light_cache_buffer.GetBuffer()));
+				CHECK(m_kernel_shade.setArg(arg++, m_light_cache_state_buffer.GetBuffer()));
+			}
 		}
 		else {
-			CHECK(m_kernel_shade.setArg(9, m_cdf_power_buffer.GetBuffer()));
-		}
-		CHECK(m_kernel_shade.setArg(10, m_result_buffer.GetBuffer()));
-		CHECK(m_kernel_shade.setArg(11, m_throughput_buffer.GetBuffer()));
-		CHECK(m_kernel_shade.setArg(12, m_state_buffer.GetBuffer()));
-		CHECK(m_kernel_shade.setArg(13, m_light_contribution_buffer.GetBuffer()));
-		CHECK(m_kernel_shade.setArg(14, m_ray_buffer.GetBuffer()));
-		CHECK(m_kernel_shade.setArg(15, m_occlusion_ray_buffer.GetBuffer()));
-		CHECK(m_kernel_shade.setArg(16, m_background_texture));
+			CHECK(m_kernel_shade.setArg(arg++, m_light_alias_table.GetBuffer()));
+		}
+		CHECK(m_kernel_shade.setArg(arg++, m_result_buffer.GetBuffer()));
+		CHECK(m_kernel_shade.setArg(arg++, m_throughput_buffer.GetBuffer()));
+		CHECK(m_kernel_shade.setArg(arg++, m_state_buffer.GetBuffer()));
+		CHECK(m_kernel_shade.setArg(arg++, m_light_contribution_buffer.GetBuffer()));
+		CHECK(m_kernel_shade.setArg(arg++, m_ray_buffer.GetBuffer()));
+		CHECK(m_kernel_shade.setArg(arg++, m_occlusion_ray_buffer.GetBuffer()));
+		CHECK(m_kernel_shade.setArg(arg++, m_background_texture));
 		//CHECK(m_kernel_shade.setArg(15, m_sampler));
 
 		cl::Event* e = m_event_queue.GetNextEvent();
@@ -297,6 +462,8 @@ namespace LSIS {
 	{
 		LoadHDRI();
 		CompileKernels();
+		// The number of shadow rays depends on the settings
+		PrepareShadowRays(Compute::GetContext());
 		m_viewer.CompileKernels();
 		m_bvh.Compile();
 		BuildStructure();
@@ -306,6 +473,73 @@ namespace LSIS {
 		Compute::GetCommandQueue().enqueueWriteBuffer(m_active_count_buffer.GetBuffer(), CL_TRUE, 0, sizeof(cl_uint), &m_num_concurrent_samples);
 	}
 
+	void PathTracer::RefitLights(const SHARED::Light* lights, size_t num_lights, float rebuild_threshold)
+	{
+		if (use_naive || !m_light_tree || num_lights != m_num_lights) {
+			Reset();
+			return;
+		}
+
+		const auto start = std::chrono::high_resolution_clock::now();
+
+		m_light_tree->Refit(lights, num_lights, rebuild_threshold);
+
+		// Only the binary nodes can be updated in place. The other formats depends on the parent nodes, so they are created again from the refitted tree
+		if (m_light_tree_width > 2) {
+			WideLightTree wide_tree = WideLightTree(*m_light_tree, m_light_tree_width);
+			m_lighttree_buffer = wide_tree.GetNodeBuffer();
+		}
+		else if (use_compact_nodes()) {
+			m_compact_lighttree_buffer = m_light_tree->GetCompactNodeBuffer();
+		}
+		else {
+			m_light_tree->UploadNodeChanges(m_lighttree_buffer);
+		}
+		m_light_tree->UploadLightChanges(m_lights, m_leaf_cdf_buffer);
+		clear_light_cache();
+
+		const auto end = std::chrono::high_resolution_clock::now();
+		const std::chrono::duration<double, std::milli> duration = end - start;
+		printf("Refitted light tree in %fms\n", duration.count());
+
+		ResetSamples();
+	}
+
+	void PathTracer::UpdateInstances()
+	{
+		if (!m_two_level_bvh) {
+			Reset();
+			return;
+		}
+
+		std::vector<glm::mat4> transforms = instance_transforms();
+		if (transforms.empty()) {
+			Reset();
+			return;
+		}
+
+		const auto start = std::chrono::high_resolution_clock::now();
+
+		// Only the top level depends on the transforms
+		m_instance_transforms = transforms;
+		m_two_level_bvh->SetInstances(m_instance_meshes, m_instance_transforms);
+		m_top_bvh_buffer = m_two_level_bvh->GetNodeBuffer();
+		m_instance_buffer = m_two_level_bvh->GetInstanceBuffer();
+		m_bvh.SetInstances(m_top_bvh_buffer, m_instance_buffer);
+
+		const auto end = std::chrono::high_resolution_clock::now();
+		const std::chrono::duration<double, std::milli> duration = end - start;
+		printf("Rebuilt top level BVH in %fms\n", duration.count());
+
+		const std::vector<SHARED::Light> lights = instance_lights();
+		if (lights.empty()) {
+			ResetSamples();
+		}
+		else {
+			RefitLights(lights.data(), lights.size());
+		}
+	}
+
 	void PathTracer::ResetSamples()
 	{
 		m_num_samples = 0;
@@ -342,7 +576,7 @@ namespace LSIS {
 			if (!use_naive) {
 				// if the shadow ray is not occluded, the lights contribution is added to the result
 				cl::Event* e = m_event_queue.GetNextEvent();
-				m_bvh.TraceOcclusion(m_occlusion_ray_buffer, m_occlusion_buffer, m_active_count_buffer);
+				m_bvh.TraceOcclusion(m_occlusion_ray_buffer, m_occlusion_buffer, m_occlusion_count_buffer);
 				CHECK(e->setCallback(CL_COMPLETE, accumulate, &m_profile_data.time_kernel_trace_occlusion));
 				ProcessOcclusion();
 			}
@@ -440,6 +674,83 @@ namespace LSIS {
 		m_profile_data.num_bins = num_bins;
 	}
 
+	void PathTracer::SetLightTreeWidth(size_t width)
+	{
+		m_light_tree_width = glm::clamp<size_t>(width, 2, LIGHT_TREE_MAX_WIDTH);
+		m_profile_data.light_tree_width = m_light_tree_width;
+	}
+
+	void PathTracer::SetMaxLeafSize(size_t max_leaf_size)
+	{
+		m_max_leaf_size = max_leaf_size;
+		m_profile_data.max_leaf_size = max_leaf_size;
+	}
+
+	void PathTracer::UseCompactLightTree(bool b)
+	{
+		use_compact_lighttree = b;
+		m_profile_data.compact_light_tree = b;
+	}
+
+	void PathTracer::UseGPULightTreeBuilder(bool b)
+	{
+		use_gpu_lighttree = b;
+		m_profile_data.gpu_light_tree = b;
+	}
+
+	void PathTracer::UseGPUBVHBuilder(bool b)
+	{
+		use_gpu_bvh = b;
+		m_profile_data.gpu_bvh = b;
+	}
+
+	void PathTracer::UseStacklessBVH(bool b)
+	{
+		use_stackless_bvh = b;
+		m_profile_data.stackless_bvh = b;
+	}
+
+	void PathTracer::UseInstancing(bool b)
+	{
+		use_instancing = b;
+		m_profile_data.instancing = b;
+	}
+
+	void PathTracer::UseAgglomerativeLightTree(bool b)
+	{
+		use_agglomerative_lighttree = b;
+		m_profile_data.agglomerative_light_tree = b;
+	}
+
+	void PathTracer::SetSceneCacheFolder(const std::string& folder)
+	{
+		m_scene_cache_folder = folder;
+	}
+
+	void PathTracer::SetLightCutSize(size_t n)
+	{
+		m_light_cut_size = std::max<size_t>(n, 1);
+		m_profile_data.light_cut_size = m_light_cut_size;
+	}
+
+	void PathTracer::SetLightCacheCells(size_t n)
+	{
+		m_light_cache_cells = n;
+		m_profile_data.light_cache_cells = n;
+	}
+
+	void PathTracer::SetBVHWidth(size_t width)
+	{
+		m_bvh_width = glm::clamp<size_t>(width, 2, BVH_MAX_WIDTH);
+		m_profile_data.bvh_width = m_bvh_width;
+	}
+
+	void PathTracer::SetTreeletPasses(size_t n)
+	{
+		m_treelet_passes = n;
+		m_profile_data.treelet_passes = n;
+	}
+
 	inline glm::vec3 convert(cl_float4 in) {
 		return glm::vec3(in.x, in.y, in.z);
 	}
@@ -455,10 +766,23 @@ namespace LSIS {
 		size_t num_indices = 0;
 		size_t num_materials = 0;
 
+		m_scene_cache.reset();
+
+		// With instancing only the first entity using a mesh adds its geometry, untransformed
+		const bool instanced = use_instanced_bvh();
+		std::map<const MeshData*, uint32_t> mesh_ids;
+		m_two_level_bvh.reset();
+		m_meshes.clear();
+		m_mesh_lights.clear();
+		m_mesh_bounds.clear();
+		m_instance_meshes.clear();
+		m_instance_transforms.clear();
+
 		if (entities.empty()) {
 			m_num_faces = 0;
 			m_num_vertices = 0;
 			m_num_lights = 0;
+			m_light_tree.reset();
 			ready = false;
 			return;
 		}
@@ -467,6 +791,22 @@ namespace LSIS {
 			Entity entity = { handle, p_scene };
 			auto mesh = entity.GetComponent<MeshComponent>().mesh->GetData();
 			auto transform = entity.GetComponent<TransformComponent>().Transform;
+			if (instanced) {
+				// The BVH of a mesh can't be empty
+				if (mesh->GetNumIndices() == 0)
+					continue;
+				auto it = mesh_ids.find(mesh.get());
+				if (it != mesh_ids.end()) {
+					m_instance_meshes.push_back(it->second);
+					m_instance_transforms.push_back(transform);
+					continue;
+				}
+				const uint32_t id = static_cast<uint32_t>(m_meshes.size());
+				mesh_ids[mesh.get()] = id;
+				m_instance_meshes.push_back(id);
+				m_instance_transforms.push_back(transform);
+				m_meshes.push_back({ num_indices, mesh->GetNumIndices() });
+			}
 			num_vertices += mesh->GetNumVertices();
 			num_indices += mesh->GetNumIndices();
 			num_materials += mesh->GetNumMaterials();
@@ -489,6 +829,13 @@ namespace LSIS {
 			Entity entity = { handle, p_scene };
 			auto mesh = entity.GetComponent<MeshComponent>().mesh->GetData();
 			auto transform = entity.GetComponent<TransformComponent>().Transform;
+			if (instanced) {
+				// The meshes are added in the order of their ids, by their first instance
+				const auto it = mesh_ids.find(mesh.get());
+				if (it == mesh_ids.end() || it->second != m_mesh_bounds.size())
+					continue;
+				transform = glm::mat4(1.0f);
+			}
 			auto indices = mesh->GetIndices();
 			auto vertices = mesh->GetVertices();
 			auto materials = mesh->GetMaterials();
@@ -520,6 +867,20 @@ namespace LSIS {
 				vertices_data[index_vertex++] = SHARED::make_vertex(position, normal, v.uv);
 			}
 
+			if (instanced) {
+				glm::vec3 pmin = glm::vec3(std::numeric_limits<float>::max());
+				glm::vec3 pmax = glm::vec3(-std::numeric_limits<float>::max());
+				for (size_t i = 0; i < num_vertices_object; i++) {
+					pmin = glm::min(pmin, vertices[i].position);
+					pmax = glm::max(pmax, vertices[i].position);
+				}
+				SHARED::AABB bbox = {};
+				bbox.min = { pmin.x, pmin.y, pmin.z, 0.0f };
+				bbox.max = { pmax.x, pmax.y, pmax.z, 0.0f };
+				m_mesh_bounds.push_back(bbox);
+				m_mesh_lights.emplace_back();
+			}
+
 			for (size_t i = 0; i < num_materials_object; i++) {
 				MaterialData data = materials[i];
 				materials_data[index_material++] = SHARED::make_material(data.diffuse, data.specular, data.emissive);
@@ -530,13 +891,28 @@ namespace LSIS {
 		auto context = Compute::GetContext();
 		auto queue = Compute::GetCommandQueue();
 
-		m_face_buffer = TypedBuffer<SHARED::Face>(context, CL_MEM_READ_ONLY, num_faces);
-		m_vertex_buffer = TypedBuffer<SHARED::Vertex>(context, CL_MEM_READ_ONLY, num_vertices);
-		m_material_buffer = TypedBuffer<SHARED::Material>(context, CL_MEM_READ_ONLY, num_materials);
+		// The cache holds a single BVH, so it isn't used with instancing
+		if (!m_scene_cache_folder.empty() && !instanced) {
+			m_scene_cache = std::make_unique<SceneCache>(m_scene_cache_folder, scene_cache_key(vertices_data, faces_data, materials_data));
+			m_scene_cache->Load();
+		}
+		const bool cached = m_scene_cache && m_scene_cache->IsLoaded();
+		m_profile_data.scene_cache_hit = cached;
+
+		if (cached) {
+			m_face_buffer = m_scene_cache->Upload<SHARED::Face>(SceneCache::Faces, CL_MEM_READ_ONLY);
+			m_vertex_buffer = m_scene_cache->Upload<SHARED::Vertex>(SceneCache::Vertices, CL_MEM_READ_ONLY);
+			m_material_buffer = m_scene_cache->Upload<SHARED::Material>(SceneCache::Materials, CL_MEM_READ_ONLY);
+		}
+		else {
+			m_face_buffer = TypedBuffer<SHARED::Face>(context, CL_MEM_READ_ONLY, num_faces);
+			m_vertex_buffer = TypedBuffer<SHARED::Vertex>(context, CL_MEM_READ_ONLY, num_vertices);
+			m_material_buffer = TypedBuffer<SHARED::Material>(context, CL_MEM_READ_ONLY, num_materials);
 
-		CHECK(queue.enqueueWriteBuffer(m_face_buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Face) * faces_data.size(), faces_data.data()));
-		CHECK(queue.enqueueWriteBuffer(m_vertex_buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Vertex) * vertices_data.size(), vertices_data.data()));
-		CHECK(queue.enqueueWriteBuffer(m_material_buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Material) * materials_data.size(), materials_data.data()));
+			CHECK(queue.enqueueWriteBuffer(m_face_buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Face) * faces_data.size(), faces_data.data()));
+			CHECK(queue.enqueueWriteBuffer(m_vertex_buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Vertex) * vertices_data.size(), vertices_data.data()));
+			CHECK(queue.enqueueWriteBuffer(m_material_buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Material) * materials_data.size(), materials_data.data()));
+		}
 
 		if (m_vertex_data != nullptr)
 			delete[] m_vertex_data;
@@ -567,6 +943,7 @@ namespace LSIS {
 		//}
 
 		for (auto i : mesh_light_indices) {
+			const size_t face_index = i;
 			SHARED::Face face = m_face_data[i];
 			glm::vec3 p0 = convert(m_vertex_data[face.index.x].position);
 			glm::vec3 p1 = convert(m_vertex_data[face.index.y].position);
@@ -590,10 +967,21 @@ namespace LSIS {
 			//printf("light: [%.2f,%.2f,%.2f]\n", i.x, i.y, i.z);
 
 			//lights_data.push_back(SHARED::make_light(p, n, i));
+			if (instanced) {
+				// The vertices are in the space of the mesh the face belongs to
+				const auto mesh = std::upper_bound(m_meshes.begin(), m_meshes.end(), face_index, [](size_t face, const TwoLevelBVH::Mesh& m) { return face < m.first_face; }) - 1;
+				m_mesh_lights[mesh - m_meshes.begin()].push_back(SHARED::make_mesh_light(p0, p1, p2, dir, i));
+				continue;
+			}
 			lights_data.push_back(SHARED::make_mesh_light(p0, p1, p2, dir, i));
 			num_lights++;
 		}
 
+		if (instanced) {
+			lights_data = instance_lights();
+			num_lights = lights_data.size();
+		}
+
 		// if no lights are present in the scene, push a empty, light to avoid crashing the kernel
 		if (lights_data.empty()) {
 			lights_data.push_back(SHARED::make_light({ 0,0,0 }, { 0,1,0 }, { 0,0,0 }));
@@ -606,14 +994,60 @@ namespace LSIS {
 
 		if (!use_naive)
 		{
+			// Compile the builder kernels before the timer starts
+			std::unique_ptr<LightTreeBuilder> builder = use_gpu_builder() && !cached ? std::make_unique<LightTreeBuilder>() : nullptr;
+
 			const auto start = std::chrono::high_resolution_clock::now();
 
-			if (use_lighttree) {
-				LightTree light_tree = LightTree(lights_data.data(), num_lights, m_num_bins);
-				m_lighttree_buffer = light_tree.GetNodeBuffer();
+			if (m_scene_cache && m_scene_cache->Has(SceneCache::LightTreeNodes)) {
+				// Only the buffers are cached, so RefitLights resets
+				m_light_tree.reset();
+				if (use_compact_nodes()) {
+					m_compact_lighttree_buffer = m_scene_cache->Upload<SHARED::CompactLightTreeNode>(SceneCache::LightTreeNodes, CL_MEM_READ_ONLY);
+				}
+				else {
+					m_lighttree_buffer = m_scene_cache->Upload<SHARED::LightTreeNode>(SceneCache::LightTreeNodes, CL_MEM_READ_ONLY);
+				}
+				m_leaf_cdf_buffer = m_scene_cache->Upload<cl_float>(SceneCache::LeafCDF, CL_MEM_READ_ONLY);
+				m_lights = m_scene_cache->Upload<SHARED::Light>(SceneCache::Lights, CL_MEM_READ_ONLY);
+			}
+			else if (builder) {
+				// The tree never leaves the device, so there is nothing to refit
+				m_light_tree.reset();
+				auto tree = builder->Build(m_lights);
+				m_lighttree_buffer = tree.nodes;
+				m_leaf_cdf_buffer = tree.leaf_cdf;
+				m_lights = tree.lights;
+			}
+			else if (use_agglomerative_builder()) {
+				m_light_tree.reset();
+				LightTreeClustering tree = LightTreeClustering(lights_data.data(), num_lights);
+				m_lighttree_buffer = tree.GetNodeBuffer();
+				m_leaf_cdf_buffer = tree.GetLeafCDFBuffer();
+				m_lights = tree.GetLightBuffer();
+			}
+			else if (use_lighttree) {
+				if (max_leaf_size() < m_max_leaf_size)
+					printf("Compact light tree leaves hold at most %d lights, the max leaf size is clamped to %d\n", COMPACT_MAX_LEAF_SIZE, COMPACT_MAX_LEAF_SIZE);
+				m_profile_data.max_leaf_size = max_leaf_size();
+				m_light_tree = std::make_unique<LightTree>(lights_data.data(), num_lights, m_num_bins, max_leaf_size());
+				if (m_light_tree_width > 2) {
+					WideLightTree wide_tree = WideLightTree(*m_light_tree, m_light_tree_width);
+					m_lighttree_buffer = wide_tree.GetNodeBuffer();
+				}
+				else if (use_compact_nodes()) {
+					m_compact_lighttree_buffer = m_light_tree->GetCompactNodeBuffer();
+				}
+				else {
+					m_lighttree_buffer = m_light_tree->GetNodeBuffer();
+				}
+				m_leaf_cdf_buffer = m_light_tree->GetLeafCDFBuffer();
+				// The leaves references the lights in the order of the tree
+				m_lights = m_light_tree->GetLightBuffer();
 			}
 			else {
-				m_cdf_power_buffer = build_power_sampling_buffer(lights_data.data(), num_lights);
+				m_light_tree.reset();
+				m_light_alias_table = build_power_sampling_buffer(lights_data.data(), num_lights);
 			}
 			const auto end = std::chrono::high_resolution_clock::now();
 			const std::chrono::duration<double, std::milli> duration = end - start;
@@ -622,10 +1056,160 @@ namespace LSIS {
 
 		m_num_lights = num_lights;
 
+		// The settings in effect, as each only applies to some of the light structures
+		m_profile_data.compact_light_tree = !use_naive && use_compact_nodes();
+		m_profile_data.gpu_light_tree = !use_naive && use_gpu_builder();
+		m_profile_data.light_cut_size = num_light_samples();
+		m_profile_data.light_cache_cells = use_light_cache() ? m_light_cache_cells : 0;
+		m_profile_data.agglomerative_light_tree = !use_naive && use_agglomerative_builder();
+
+		if (use_light_cache()) {
+			glm::vec3 pmin = glm::vec3(std::numeric_limits<float>::max());
+			glm::vec3 pmax = glm::vec3(-std::numeric_limits<float>::max());
+			if (instanced) {
+				// The corners of the mesh bounds placed by each instance
+				for (size_t i = 0; i < m_instance_meshes.size(); i++) {
+					const SHARED::AABB& bbox = m_mesh_bounds[m_instance_meshes[i]];
+					for (int corner = 0; corner < 8; corner++) {
+						const glm::vec4 p = m_instance_transforms[i] * glm::vec4(corner & 1 ? bbox.max.x : bbox.min.x, corner & 2 ? bbox.max.y : bbox.min.y, corner & 4 ? bbox.max.z : bbox.min.z, 1.0f);
+						pmin = glm::min(pmin, glm::vec3(p));
+						pmax = glm::max(pmax, glm::vec3(p));
+					}
+				}
+			}
+			else {
+				for (const auto& vertex : vertices_data) {
+					pmin = glm::min(pmin, convert(vertex.position));
+					pmax = glm::max(pmax, convert(vertex.position));
+				}
+			}
+			// Cells are a fraction of the scene diagonal, small enough for neighbouring points to pick the same cut
+			m_light_cache_cell_size = vertices_data.empty() ? 1.0f : std::max(glm::length(pmax - pmin) / 64.0f, 1e-4f);
+			clear_light_cache();
+		}
+
 		ready = true;
 		printf("PointLights: %zd, MeshLights: %zd\n", num_lights, num_emissive_faces);
 	}
 
+	uint64_t PathTracer::scene_cache_key(const std::vector<SHARED::Vertex>& vertices, const std::vector<SHARED::Face>& faces, const std::vector<SHARED::Material>& materials) const
+	{
+		// Every setting that changes the cached structures. The lights are derived from the geometry
+		const uint64_t settings[] = {
+#ifdef USE_LBVH
+			1,
+#else
+			0,
+#endif // USE_LBVH
+			use_naive,
+			use_lighttree,
+			m_num_bins,
+			max_leaf_size(),
+			m_light_tree_width,
+			use_compact_nodes(),
+			use_gpu_builder(),
+			use_agglomerative_builder(),
+			m_bvh_width,
+			m_treelet_passes,
+			use_gpu_bvh_builder(),
+		};
+
+		uint64_t key = SceneCache::Hash(settings, sizeof(settings));
+		key = SceneCache::Hash(vertices, key);
+		key = SceneCache::Hash(faces, key);
+		key = SceneCache::Hash(materials, key);
+		return key;
+	}
+
+	void PathTracer::save_scene_cache()
+	{
+		m_scene_cache->Store(SceneCache::Vertices, m_vertex_buffer);
+		m_scene_cache->Store(SceneCache::Faces, m_face_buffer);
+		m_scene_cache->Store(SceneCache::Materials, m_material_buffer);
+		if (m_wide_bvh_buffer.Count() > 0) {
+			m_scene_cache->Store(SceneCache::BVHNodes, m_wide_bvh_buffer);
+		}
+		else {
+			m_scene_cache->Store(SceneCache::BVHNodes, m_bvh_buffer);
+			m_scene_cache->Store(SceneCache::BVHParents, m_bvh_parent_buffer);
+		}
+		m_scene_cache->Store(SceneCache::Triangles, m_triangle_buffer);
+
+		if (!use_naive && use_lighttree) {
+			if (use_compact_nodes()) {
+				m_scene_cache->Store(SceneCache::LightTreeNodes, m_compact_lighttree_buffer);
+			}
+			else {
+				m_scene_cache->Store(SceneCache::LightTreeNodes, m_lighttree_buffer);
+			}
+			m_scene_cache->Store(SceneCache::Lights, m_lights);
+			m_scene_cache->Store(SceneCache::LeafCDF, m_leaf_cdf_buffer);
+		}
+
+		m_scene_cache->Save();
+	}
+
+	void PathTracer::build_triangles()
+	{
+		std::vector<SHARED::Triangle> triangles = std::vector<SHARED::Triangle>(m_num_faces);
+		for (size_t i = 0; i < m_num_faces; i++) {
+			const SHARED::Face& face = m_face_data[i];
+			triangles[i] = SHARED::make_triangle(convert(m_vertex_data[face.index.x].position), convert(m_vertex_data[face.index.y].position), convert(m_vertex_data[face.index.z].position));
+		}
+
+		m_triangle_buffer = TypedBuffer<SHARED::Triangle>(Compute::GetContext(), CL_MEM_READ_ONLY, m_num_faces);
+		CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(m_triangle_buffer.GetBuffer(), CL_TRUE, 0, sizeof(SHARED::Triangle) * m_num_faces, triangles.data()));
+	}
+
+	std::vector<SHARED::Light> PathTracer::instance_lights() const
+	{
+		std::vector<SHARED::Light> lights;
+		for (size_t i = 0; i < m_instance_meshes.size(); i++) {
+			const glm::mat4& transform = m_instance_transforms[i];
+			for (const SHARED::Light& light : m_mesh_lights[m_instance_meshes[i]]) {
+				const glm::vec3 p = convert(light.position);
+				const glm::vec3 p0 = glm::vec3(transform * glm::vec4(p, 1.0f));
+				const glm::vec3 p1 = glm::vec3(transform * glm::vec4(p + convert(light.tangent), 1.0f));
+				const glm::vec3 p2 = glm::vec3(transform * glm::vec4(p + convert(light.bitangent), 1.0f));
+				const glm::vec3 dir = glm::normalize(glm::cross(p1 - p0, p2 - p0));
+				lights.push_back(SHARED::make_mesh_light(p0, p1, p2, dir, convert(light.intensity)));
+			}
+		}
+		return lights;
+	}
+
+	std::vector<glm::mat4> PathTracer::instance_transforms() const
+	{
+		auto scene = Application::Get()->GetScene();
+		Scene* p_scene = scene.get();
+
+		// The same entities as LoadSceneData, skipping the empty meshes
+		std::vector<glm::mat4> transforms;
+		for (auto handle : scene->GetEntities<MeshComponent, TransformComponent>()) {
+			Entity entity = { handle, p_scene };
+			if (entity.GetComponent<MeshComponent>().mesh->GetData()->GetNumIndices() == 0)
+				continue;
+			transforms.push_back(entity.GetComponent<TransformComponent>().Transform);
+		}
+
+		if (transforms.size() != m_instance_meshes.size())
+			transforms.clear();
+		return transforms;
+	}
+
+	void PathTracer::clear_light_cache()
+	{
+		if (!use_light_cache())
+			return;
+
+		auto context = Compute::GetContext();
+		if (m_light_cache_buffer.Count() != m_light_cache_cells) {
+			m_light_cache_buffer = TypedBuffer<SHARED::LightCacheCell>(context, CL_MEM_READ_WRITE, m_light_cache_cells);
+			m_light_cache_state_buffer = TypedBuffer<cl_uint>(context, CL_MEM_READ_WRITE, m_light_cache_cells);
+		}
+		CHECK(Compute::GetCommandQueue().enqueueFillBuffer(m_light_cache_state_buffer.GetBuffer(), cl_uint(0), 0, sizeof(cl_uint) * m_light_cache_cells));
+	}
+
 	void PathTracer::LoadHDRI()
 	{
 		cl_int err;
@@ -10,10 +10,14 @@
 
 #include "PixelViewer.h"
 #include "BVH.h"
+#include "AccelerationStructure/TwoLevelBVH.h"
 #include "EventQueue.h"
 
 namespace LSIS {
 
+	class LightTree;
+	class SceneCache;
+
 	class PathTracer {
 	public:
 		using time = double;
@@ -51,6 +55,20 @@ namespace LSIS {
 			size_t height;
 			size_t samples;
 			size_t num_bins;
+			size_t max_leaf_size = 1;
+			size_t light_tree_width = 2;
+			bool compact_light_tree = false;
+			bool gpu_light_tree = false;
+			bool agglomerative_light_tree = false;
+			bool scene_cache_hit = false;
+			size_t light_cut_size = 1;
+			size_t light_cache_cells = 0;
+			size_t bvh_width = 2;
+			size_t treelet_passes = 0;
+			bool gpu_bvh = false;
+			bool stackless_bvh = false;
+			bool instancing = false;
+			size_t num_instances = 0;
 		};
 
 		enum Method {
@@ -73,6 +91,9 @@ namespace LSIS {
 		void SetImageSize(const uint32_t width, const uint32_t height);
 
 		void Reset();
+		/// Updates the light tree for moved or changed lights without rebuilding it. The lights must be in the order the scene lights were loaded in.
+		/// Subtrees degraded by more than 'rebuild_threshold' are rebuilt, see LightTree::Refit. Falls back to Reset when the lights can't be refitted
+		void RefitLights(const SHARED::Light* lights, size_t num_lights, float rebuild_threshold = 0.0f);
 		void ResetSamples();
 		void SetCameraProjection(glm::mat4 projection);
 
@@ -83,7 +104,38 @@ namespace LSIS {
 		void SetClusterAttenuation(ClusterAttenuation atten);
 		void UseFastThetaU(bool b);
 		void SetUseHDRI(bool b);
+		/// Most bins per node used by the light tree and the BVH builders
 		void SetNumBins(size_t num_bins);
+		void SetMaxLeafSize(size_t max_leaf_size);
+		void SetLightTreeWidth(size_t width);
+		/// Use the 32 byte compact light tree nodes. Only applies to the binary tree
+		void UseCompactLightTree(bool b);
+		/// Build the light tree on the device with LightTreeBuilder. Only applies to the binary tree of single light leaves, and the tree can't be refitted
+		void UseGPULightTreeBuilder(bool b);
+		/// Build the light tree bottom up with LightTreeClustering instead of the top down SAOH build. Only applies to the binary tree with full nodes, the leaves always hold a single light and the tree can't be refitted
+		void UseAgglomerativeLightTree(bool b);
+		/// Store the built structures in 'folder', keyed by the scene geometry and the build settings, and load them from there when nothing changed. An empty folder disables the cache
+		void SetSceneCacheFolder(const std::string& folder);
+		/// Sample one light from each node of a cut of up to 'n' light tree nodes per shading point, tracing n shadow rays. 1 samples a single light.
+		/// Only applies to the binary light tree
+		void SetLightCutSize(size_t n);
+		/// Cache a light tree cut for each grid cell and normal direction touched by the shading points, in a hash table of 'n' cells built lazily on the device. A cell replaces the cell in its slot when they collide.
+		/// Shading points choose a node of the cut of their cell and only descend the tree below it. 0 disables the cache. Only applies to the binary light tree with full nodes and single light samples
+		void SetLightCacheCells(size_t n);
+		/// Trace with a BVH of up to 'width' children per node, collapsed from the binary BVH with quantized child bounds. 2 traces the binary BVH
+		void SetBVHWidth(size_t width);
+		/// Optimize the BVH with 'n' passes of treelet restructuring. Only applies to the LBVH build (USE_LBVH) and the device builder
+		void SetTreeletPasses(size_t n);
+		/// Build the BVH on the device with BVHBuilder, for dynamic scenes. Only applies to the binary BVH
+		void UseGPUBVHBuilder(bool b);
+		/// Trace the binary BVH without a stack, going back up through the parents of the nodes. Always used when the BVH is deeper than BVH_STACK_SIZE
+		void UseStacklessBVH(bool b);
+		/// Trace a two level BVH, with a BVH for each unique mesh in its own space and a top level BVH over the entities using them, so repeated meshes are only stored once.
+		/// Only applies to the binary BVH, and the scene cache is not used
+		void UseInstancing(bool b);
+		/// Rebuilds the top level BVH after entities moved, and refits the light tree to their lights. The entities and their meshes must be the ones loaded.
+		/// Called by PathtracingLayer when the scene reports moved entities. Falls back to Reset without instancing
+		void UpdateInstances();
 
 		bool isDone() const { return m_num_samples == m_target_samples; }
 		size_t GetNumSamples() const { return m_num_samples; }
@@ -98,6 +150,8 @@ namespace LSIS {
 
 		void CompileKernels();
 		void PrepareCameraRays(const cl::Context& context);
+		// Allocates the shadow ray buffers for the number of light samples per shading point
+		void PrepareShadowRays(const cl::Context& context);
 
 		void BuildStructure();
 
@@ -109,8 +163,28 @@ namespace LSIS {
 		void ProcessResults();
 
 		void LoadSceneData();
+		uint64_t scene_cache_key(const std::vector<SHARED::Vertex>& vertices, const std::vector<SHARED::Face>& faces, const std::vector<SHARED::Material>& materials) const;
+		void save_scene_cache();
+		// Uploads the intersection data of the faces, in the order of m_face_data
+		void build_triangles();
+		// Empties the light cache, as the cached cuts refers to nodes of the current light tree
+		void clear_light_cache();
+		// Transforms the object space mesh lights into world space for every instance
+		std::vector<SHARED::Light> instance_lights() const;
+		// Object to world transforms of the loaded entities, in the order of m_instance_meshes. Empty if the entities no longer match
+		std::vector<glm::mat4> instance_transforms() const;
 		void LoadHDRI();
 
+		inline bool use_compact_nodes() const { return use_lighttree && use_compact_lighttree && m_light_tree_width == 2; }
+		inline size_t max_leaf_size() const { return use_compact_nodes() ? std::min<size_t>(m_max_leaf_size, COMPACT_MAX_LEAF_SIZE) : m_max_leaf_size; }
+		inline bool use_light_cut() const { return !use_naive && use_lighttree && m_light_tree_width == 2 && m_light_cut_size > 1; }
+		inline size_t num_light_samples() const { return use_light_cut() ? m_light_cut_size : 1; }
+		inline bool use_light_cache() const { return !use_naive && use_lighttree && m_light_tree_width == 2 && !use_compact_nodes() && !use_light_cut() && m_light_cache_cells > 0; }
+		inline bool use_gpu_builder() const { return use_lighttree && use_gpu_lighttree && !use_compact_lighttree && m_light_tree_width == 2 && m_max_leaf_size == 1; }
+		inline bool use_instanced_bvh() const { return use_instancing && m_bvh_width == 2; }
+		inline bool use_gpu_bvh_builder() const { return use_gpu_bvh && m_bvh_width == 2 && !use_instanced_bvh(); }
+		inline bool use_agglomerative_builder() const { return use_lighttree && use_agglomerative_lighttree && !use_compact_lighttree && m_light_tree_width == 2 && !use_gpu_builder(); }
+
 	private:
 		uint32_t m_image_width, m_image_height;
 		uint32_t m_num_pixels;
@@ -161,8 +235,35 @@ namespace LSIS {
 		bool use_orientation = false;
 		bool use_fast_theta_u = true;
 		bool use_zero_dist = false;
+		bool use_compact_lighttree = false;
+		bool use_gpu_lighttree = false;
+		bool use_gpu_bvh = false;
+		bool use_stackless_bvh = false;
+		bool use_instancing = false;
+		bool use_agglomerative_lighttree = false;
 
 		size_t m_num_bins = 128;
+		size_t m_max_leaf_size = 1;
+		size_t m_light_tree_width = 2;
+		size_t m_light_cut_size = 1;
+		size_t m_light_cache_cells = 0;
+		size_t m_bvh_width = 2;
+		size_t m_treelet_passes = 0;
+		// Grid cells of the light cache are cubes of this size, set from the scene bounds
+		float m_light_cache_cell_size = 1.0f;
+
+		// Unique meshes of the two level BVH, and the mesh and object to world transform of each instance.
+		// The lights of a mesh are kept in its own space, as the instances are placed with their transforms
+		std::unique_ptr<TwoLevelBVH> m_two_level_bvh;
+		std::vector<TwoLevelBVH::Mesh> m_meshes;
+		std::vector<std::vector<SHARED::Light>> m_mesh_lights;
+		std::vector<SHARED::AABB> m_mesh_bounds;
+		std::vector<uint32_t> m_instance_meshes;
+		std::vector<glm::mat4> m_instance_transforms;
+
+		std::string m_scene_cache_folder;
+		// Cache of the scene being loaded. Only kept while building the structures
+		std::unique_ptr<SceneCache> m_scene_cache;
 
 		EventQueue m_event_queue = EventQueue(100);
 
@@ -190,18 +291,32 @@ namespace LSIS {
 		TypedBuffer<SHARED::Ray> m_occlusion_ray_buffer;
 		TypedBuffer<SHARED::Intersection> m_intersection_buffer;
 		TypedBuffer<cl_int> m_occlusion_buffer;
+		// holds the number of shadow rays in the pass
+		TypedBuffer<cl_uint> m_occlusion_count_buffer;
 
 		// Geometry Buffers
 		TypedBuffer<SHARED::Vertex> m_vertex_buffer;
 		TypedBuffer<SHARED::Face> m_face_buffer;
 		TypedBuffer<SHARED::Material> m_material_buffer;
-		TypedBuffer<SHARED::Node> m_bvh_buffer;
-		TypedBuffer<SHARED::AABB> m_bboxes_buffer;
+		TypedBuffer<SHARED::BVHNode> m_bvh_buffer;
+		TypedBuffer<cl_int> m_bvh_parent_buffer;
+		// Top level of the two level BVH, with the bottom levels in the binary BVH buffers
+		TypedBuffer<SHARED::BVHNode> m_top_bvh_buffer;
+		TypedBuffer<SHARED::Instance> m_instance_buffer;
+		TypedBuffer<SHARED::WideBVHNode> m_wide_bvh_buffer;
+		TypedBuffer<SHARED::Triangle> m_triangle_buffer;
 
 		// Light Buffers
 		TypedBuffer<SHARED::Light> m_lights;
-		TypedBuffer<cl_float> m_cdf_power_buffer;
+		TypedBuffer<SHARED::AliasEntry> m_light_alias_table;
 		TypedBuffer<SHARED::LightTreeNode> m_lighttree_buffer;
+		// Kept after loading the scene, so it can be refitted
+		std::unique_ptr<LightTree> m_light_tree;
+		TypedBuffer<SHARED::CompactLightTreeNode> m_compact_lighttree_buffer;
+		TypedBuffer<cl_float> m_leaf_cdf_buffer;
+		TypedBuffer<SHARED::LightCacheCell> m_light_cache_buffer;
+		// holds if each cell of the light cache is empty, being built or ready, and how many times it was built
+		TypedBuffer<cl_uint> m_light_cache_state_buffer;
 
 
 	};
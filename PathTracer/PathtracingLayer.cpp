@@ -49,6 +49,11 @@ namespace LSIS {
 			m_pathtracer->SetCameraProjection( glm::transpose(glm::inverse(cam->GetViewProjectionMatrix())));
 			return true;
 		}
+		if (e.GetEventType() == EventType::TransformsUpdated) {
+			// Only the top level BVH and the lights are updated for instanced scenes
+			m_pathtracer->UpdateInstances();
+			return true;
+		}
 		return false;
 	}
 	void PathtracingLayer::OnAttach()
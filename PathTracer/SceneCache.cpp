@@ -0,0 +1,119 @@
+#include "pch.h"
+#include "SceneCache.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace LSIS {
+
+	uint64_t SceneCache::Hash(const void* data, size_t size, uint64_t hash)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		const size_t num_words = size / sizeof(uint64_t);
+		for (size_t i = 0; i < num_words; i++) {
+			uint64_t word;
+			memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+			hash = (hash ^ word) * s_hash_prime;
+		}
+		for (size_t i = num_words * sizeof(uint64_t); i < size; i++) {
+			hash = (hash ^ bytes[i]) * s_hash_prime;
+		}
+		// the size separates inputs that only differ in how they are split
+		return (hash ^ size) * s_hash_prime;
+	}
+
+	SceneCache::SceneCache(const std::string& folder, uint64_t key)
+		: m_filename((std::filesystem::path(folder) / (std::to_string(key) + ".lsc")).string()), m_key(key)
+	{
+	}
+
+	SceneCache::~SceneCache()
+	{
+	}
+
+	bool SceneCache::Load()
+	{
+		m_header = nullptr;
+		m_file = std::make_unique<MappedFile>(m_filename);
+		// A rejected file is unmapped, so Save can replace it
+		if (!m_file->IsOpen() || m_file->GetSize() < sizeof(header)) {
+			m_file.reset();
+			return false;
+		}
+
+		const header* head = static_cast<const header*>(m_file->GetData());
+		if (head->magic != s_magic || head->version != s_version || head->key != m_key) {
+			m_file.reset();
+			return false;
+		}
+
+		// Reject truncated files
+		for (uint32_t i = 0; i < NumSections; i++) {
+			if (head->offset[i] + head->size[i] > m_file->GetSize()) {
+				m_file.reset();
+				return false;
+			}
+		}
+
+		m_header = head;
+		return true;
+	}
+
+	bool SceneCache::Save()
+	{
+		auto& queue = Compute::GetCommandQueue();
+
+		header head = {};
+		head.magic = s_magic;
+		head.version = s_version;
+		head.key = m_key;
+
+		uint64_t offset = (sizeof(header) + s_alignment - 1) / s_alignment * s_alignment;
+		for (uint32_t i = 0; i < NumSections; i++) {
+			head.offset[i] = offset;
+			head.size[i] = m_store_size[i];
+			offset += (m_store_size[i] + s_alignment - 1) / s_alignment * s_alignment;
+		}
+
+		std::error_code error;
+		std::filesystem::create_directories(std::filesystem::path(m_filename).parent_path(), error);
+
+		// Written to a temporary file first, so a failed write never leaves a partial cache
+		const std::string temp_filename = m_filename + ".tmp";
+		std::ofstream file = std::ofstream(temp_filename, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			std::cout << "Failed to write the scene cache: " << m_filename << "\n";
+			return false;
+		}
+
+		std::vector<char> data = std::vector<char>(head.offset[0], 0);
+		memcpy(data.data(), &head, sizeof(header));
+		file.write(data.data(), data.size());
+
+		// Sections are written in order, padded to the alignment like the offsets
+		for (uint32_t i = 0; i < NumSections; i++) {
+			if (m_store_size[i] == 0)
+				continue;
+			data.assign((m_store_size[i] + s_alignment - 1) / s_alignment * s_alignment, 0);
+			CHECK(queue.enqueueReadBuffer(m_store[i], CL_TRUE, 0, m_store_size[i], data.data()));
+			file.write(data.data(), data.size());
+		}
+
+		file.close();
+		if (!file) {
+			std::filesystem::remove(temp_filename, error);
+			std::cout << "Failed to write the scene cache: " << m_filename << "\n";
+			return false;
+		}
+
+		std::filesystem::rename(temp_filename, m_filename, error);
+		if (error) {
+			std::cout << "Failed to replace the scene cache: " << m_filename << " (error " << error.value() << ": " << error.message() << ")\n";
+			std::filesystem::remove(temp_filename, error);
+			return false;
+		}
+		return true;
+	}
+
+}
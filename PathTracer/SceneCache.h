@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <memory>
+
+#include "Core.h"
+#include "Compute/Compute.h"
+#include "Compute/Buffer.h"
+#include "IO/MappedFile.h"
+
+#include "Kernels/shared_defines.h"
+
+namespace LSIS {
+
+	/// Versioned binary cache of the flattened scene and the structures built from it, so repeated runs of the same scene and build settings skip the builds.
+	/// Each key has its own file in the cache folder. The file is memory mapped on load and the sections are uploaded directly from the mapping.
+	class SceneCache {
+	public:
+		enum Section : uint32_t {
+			Vertices,
+			Faces,
+			Materials,
+			BVHNodes,
+			BVHParents,
+			Triangles,
+			Lights,
+			LightTreeNodes,
+			LeafCDF,
+			NumSections
+		};
+
+		/// FNV-1a over 64 bit words. Inputs are combined into one key by passing the previous hash
+		static uint64_t Hash(const void* data, size_t size, uint64_t hash = s_hash_offset);
+		template<typename T>
+		static uint64_t Hash(const std::vector<T>& data, uint64_t hash = s_hash_offset) { return Hash(data.data(), sizeof(T) * data.size(), hash); }
+
+		SceneCache(const std::string& folder, uint64_t key);
+		~SceneCache();
+
+		/// Maps the cache file of the key. Returns false if there is no valid cache for it
+		bool Load();
+		bool IsLoaded() const { return m_header != nullptr; }
+		/// True if the loaded cache holds the section
+		bool Has(Section section) const { return IsLoaded() && m_header->size[section] > 0; }
+
+		/// Creates a buffer with the content of a section of the loaded cache
+		template<typename T>
+		TypedBuffer<T> Upload(Section section, cl_mem_flags mem_flags) const {
+			CORE_ASSERT(Has(section), "The section is not in the cache!");
+			CORE_ASSERT(m_header->size[section] % sizeof(T) == 0, "The section does not hold elements of this type!");
+			const size_t count = m_header->size[section] / sizeof(T);
+			TypedBuffer<T> buffer = TypedBuffer<T>(Compute::GetContext(), mem_flags, count);
+			CHECK(Compute::GetCommandQueue().enqueueWriteBuffer(buffer.GetBuffer(), CL_TRUE, 0, m_header->size[section], section_data(section)));
+			return buffer;
+		}
+
+		/// Adds a device buffer to the sections written by Save
+		template<typename T>
+		void Store(Section section, const TypedBuffer<T>& buffer) {
+			m_store[section] = buffer.GetBuffer();
+			m_store_size[section] = buffer.Size();
+		}
+
+		/// Reads the stored buffers back from the device and writes the cache file
+		bool Save();
+
+	private:
+		typedef struct header {
+			uint32_t magic;
+			uint32_t version;
+			uint64_t key;
+			uint64_t offset[NumSections]; // in bytes from the start of the file
+			uint64_t size[NumSections]; // in bytes
+		} header;
+
+		const void* section_data(Section section) const { return static_cast<const char*>(m_file->GetData()) + m_header->offset[section]; }
+
+	private:
+		static constexpr uint64_t s_hash_offset = 14695981039346656037ull;
+		static constexpr uint64_t s_hash_prime = 1099511628211ull;
+		static constexpr uint32_t s_magic = 0x5349534c; // "LSIS"
+		// Increase when the file layout or any of the stored structs change
+		static constexpr uint32_t s_version = 4;
+		static constexpr size_t s_alignment = 64;
+
+		const std::string m_filename;
+		const uint64_t m_key;
+
+		std::unique_ptr<MappedFile> m_file;
+		const header* m_header = nullptr;
+
+		std::array<cl::Buffer, NumSections> m_store;
+		std::array<size_t, NumSections> m_store_size = {};
+	};
+
+}
@@ -24,6 +24,7 @@
 #include <ctime>
 
 #include "IO/Image.h"
+#include "Threading/ThreadPool.h"
 
 
 #ifdef LSIS_PLATFORM_WIN
@@ -54,6 +55,20 @@ void save_profile(LSIS::PathTracer::profile_data profile, std::string filepath)
 		file << "num_lights, " << profile.num_lights << std::endl;
 		file << "num_num_primitives, " << profile.num_primitives << std::endl;
 		file << "num_bins, " << profile.num_bins << std::endl;
+		file << "max_leaf_size, " << profile.max_leaf_size << std::endl;
+		file << "light_tree_width, " << profile.light_tree_width << std::endl;
+		file << "compact_light_tree, " << profile.compact_light_tree << std::endl;
+		file << "gpu_light_tree, " << profile.gpu_light_tree << std::endl;
+		file << "agglomerative_light_tree, " << profile.agglomerative_light_tree << std::endl;
+		file << "scene_cache_hit, " << profile.scene_cache_hit << std::endl;
+		file << "light_cut_size, " << profile.light_cut_size << std::endl;
+		file << "light_cache_cells, " << profile.light_cache_cells << std::endl;
+		file << "bvh_width, " << profile.bvh_width << std::endl;
+		file << "treelet_passes, " << profile.treelet_passes << std::endl;
+		file << "gpu_bvh, " << profile.gpu_bvh << std::endl;
+		file << "stackless_bvh, " << profile.stackless_bvh << std::endl;
+		file << "instancing, " << profile.instancing << std::endl;
+		file << "num_instances, " << profile.num_instances << std::endl;
 		file << "time_build_lightstructure, " << profile.time_build_lightstructure << std::endl;
 		file << "time_build_bvh, " << profile.time_build_bvh << std::endl;
 		file << "time_render, " << profile.time_render << std::endl;
@@ -127,11 +142,24 @@ int main(int argc, char** argv) {
 	auto pt_attenuation = LSIS::PathTracer::ClusterAttenuation::ZeroTest;
 	bool use_fast_theta_u = false;
 	bool use_hdri = false;
+	bool use_compact_lighttree = false;
+	bool use_gpu_lighttree = false;
+	bool use_gpu_bvh = false;
+	bool use_stackless_bvh = false;
+	bool use_instancing = false;
+	bool use_agglomerative_lighttree = false;
+	size_t light_cut_size = 1;
+	size_t light_cache_cells = 0;
+	size_t bvh_width = 2;
+	size_t treelet_passes = 0;
 
 	std::string output_folder = "../Test/";
 	std::string output_name = "Test";
+	std::string cache_folder = "";
 
 	size_t num_bins = 128;
+	size_t max_leaf_size = 1;
+	size_t light_tree_width = 2;
 	size_t sample_target = 5;
 	auto scene = app->GetScene();
 	float fov = 60.0f;
@@ -198,6 +226,10 @@ int main(int argc, char** argv) {
 			const std::string& out_folder = arg_list[++i];
 			output_folder = out_folder;
 		}
+		else if (arg == "-cache") {
+			const std::string& folder = arg_list[++i];
+			cache_folder = folder;
+		}
 		else if (arg == "-fast_theta_u") {
 			use_fast_theta_u = true;
 			printf("Using fast_theta_u\n");
@@ -230,6 +262,80 @@ int main(int argc, char** argv) {
 
 			num_bins = n;
 		}
+		else if (arg == "-leaf") {
+			const std::string& number = arg_list[++i];
+			int n = std::max(1, std::stoi(number));
+			printf("Set Max lights per leaf: %s, %d\n", number.c_str(), n);
+
+			max_leaf_size = n;
+		}
+		else if (arg == "-width") {
+			const std::string& number = arg_list[++i];
+			int n = std::max(2, std::min(LIGHT_TREE_MAX_WIDTH, std::stoi(number)));
+			printf("Set Light tree width: %s, %d\n", number.c_str(), n);
+
+			light_tree_width = n;
+		}
+		else if (arg == "-compact") {
+			use_compact_lighttree = true;
+			printf("Using compact light tree nodes\n");
+		}
+		else if (arg == "-cut") {
+			const std::string& number = arg_list[++i];
+			int n = std::max(1, std::min(32, std::stoi(number)));
+			printf("Set Light cut size: %s, %d\n", number.c_str(), n);
+
+			light_cut_size = n;
+		}
+		else if (arg == "-light_cache") {
+			const std::string& number = arg_list[++i];
+			int n = std::max(0, std::stoi(number));
+			printf("Set Light cache cells: %s, %d\n", number.c_str(), n);
+
+			light_cache_cells = n;
+		}
+		else if (arg == "-bvh_width") {
+			const std::string& number = arg_list[++i];
+			int n = std::max(2, std::min(BVH_MAX_WIDTH, std::stoi(number)));
+			printf("Set BVH width: %s, %d\n", number.c_str(), n);
+
+			bvh_width = n;
+		}
+		else if (arg == "-treelets") {
+			const std::string& number = arg_list[++i];
+			int n = std::max(0, std::stoi(number));
+			printf("Set treelet restructuring passes: %s, %d\n", number.c_str(), n);
+
+			treelet_passes = n;
+		}
+		else if (arg == "-gpu_bvh") {
+			use_gpu_bvh = true;
+			printf("Building the BVH on the device\n");
+		}
+		else if (arg == "-stackless") {
+			use_stackless_bvh = true;
+			printf("Tracing the BVH without a stack\n");
+		}
+		else if (arg == "-instancing") {
+			use_instancing = true;
+			printf("Tracing a two level BVH of the instanced meshes\n");
+		}
+		else if (arg == "-gpu_lighttree") {
+			use_gpu_lighttree = true;
+			printf("Building the light tree on the device\n");
+		}
+		else if (arg == "-agglomerative") {
+			use_agglomerative_lighttree = true;
+			printf("Building the light tree by agglomerative clustering\n");
+		}
+		else if (arg == "-threads") {
+			const std::string& number = arg_list[++i];
+			int n = std::max(0, std::stoi(number));
+			printf("Set Number of build threads: %s, %d\n", number.c_str(), n);
+
+			// 0 uses all hardware threads
+			LSIS::ThreadPool::Init(n);
+		}
 		else {
 			printf("Unknown argument: %s\n", arg);
 		}
@@ -262,6 +368,19 @@ int main(int argc, char** argv) {
 		pt->UseFastThetaU(use_fast_theta_u);
 		pt->SetUseHDRI(use_hdri);
 		pt->SetNumBins(num_bins);
+		pt->SetMaxLeafSize(max_leaf_size);
+		pt->SetLightTreeWidth(light_tree_width);
+		pt->UseCompactLightTree(use_compact_lighttree);
+		pt->UseGPULightTreeBuilder(use_gpu_lighttree);
+		pt->UseAgglomerativeLightTree(use_agglomerative_lighttree);
+		pt->SetSceneCacheFolder(cache_folder);
+		pt->SetLightCutSize(light_cut_size);
+		pt->SetLightCacheCells(light_cache_cells);
+		pt->SetBVHWidth(bvh_width);
+		pt->SetTreeletPasses(treelet_passes);
+		pt->UseGPUBVHBuilder(use_gpu_bvh);
+		pt->UseStacklessBVH(use_stackless_bvh);
+		pt->UseInstancing(use_instancing);
 
 		printf("Waiting for scene to load\n");
 		std::cout << std::flush;
@@ -353,6 +472,20 @@ int main(int argc, char** argv) {
 		printf("- Num Num Lights    : %zd\n", profile.num_lights);
 		printf("- Num Primitives    : %zd\n", profile.num_primitives);
 		printf("- Num Bins          : %zd\n", profile.num_bins);
+		printf("- Max Leaf Size     : %zd\n", profile.max_leaf_size);
+		printf("- Light Tree Width  : %zd\n", profile.light_tree_width);
+		printf("- Compact Nodes     : %s\n", profile.compact_light_tree ? "true" : "false");
+		printf("- GPU Light Tree    : %s\n", profile.gpu_light_tree ? "true" : "false");
+		printf("- Agglomerative     : %s\n", profile.agglomerative_light_tree ? "true" : "false");
+		printf("- Scene Cache Hit   : %s\n", profile.scene_cache_hit ? "true" : "false");
+		printf("- Light Cut Size    : %zd\n", profile.light_cut_size);
+		printf("- Light Cache Cells : %zd\n", profile.light_cache_cells);
+		printf("- BVH Width         : %zd\n", profile.bvh_width);
+		printf("- Treelet Passes    : %zd\n", profile.treelet_passes);
+		printf("- GPU BVH           : %s\n", profile.gpu_bvh ? "true" : "false");
+		printf("- Stackless BVH     : %s\n", profile.stackless_bvh ? "true" : "false");
+		printf("- Instancing        : %s\n", profile.instancing ? "true" : "false");
+		printf("- Instances         : %zd\n", profile.num_instances);
 	}
 
 	app->Destroy();
@@ -43,10 +43,13 @@ def arg_cam_rot(x:float, y:float, z:float):
 def arg_output(filepath:str):
     return ["-out", filepath]
 
+def arg_cache(folder:str):
+    return ["-cache", folder]
+
 
 models = ["../Assets/Models/Helix.obj", "../Assets/Models/CornellBox.obj"]
 
-args_scene = arg_scene(models)
+args_scene = arg_scene(models) + arg_cache("../Test/Cache/")
 
 run(args_scene + arg_num_samples(10))
 run(args_scene + arg_num_samples(100))
\ No newline at end of file
@@ -143,3 +143,46 @@ project "PathTracer"
 		"%{IncludeDir.spdlog}",
 		"%{prj.name}",
 	}
+
+project "LightBench"
+	kind "ConsoleApp"
+	location "LightBench"
+	language "C++"
+	cppdialect "C++17"
+	staticruntime "on"
+
+	targetdir ("bin/" .. outputdir)
+	objdir ("bin-int/" .. outputdir .. "/%{prj.name}")
+
+	pchheader "pch.h"
+    pchsource "LightBench/pch.cpp"
+
+	-- The light structures are built from the PathTracer sources, without a window or OpenCL context
+	files {
+		"%{prj.name}/**.h",
+		"%{prj.name}/**.cpp",
+		"PathTracer/LightStructure/LightTree.h",
+		"PathTracer/LightStructure/LightTree.cpp",
+		"PathTracer/LightStructure/LightStructure.h",
+		"PathTracer/LightStructure/LightStructure.cpp",
+	}
+
+	libdirs {
+		"Core"
+	}
+
+	links {
+		"Core"
+	}
+
+	includedirs {
+		"Core",
+		"$(OPENCL_PATH)/include",
+		"%{IncludeDir.glm}",
+		"%{IncludeDir.glad}",
+		"%{IncludeDir.entt}",
+		"%{IncludeDir.spdlog}",
+		"%{prj.name}",
+		"PathTracer",
+		"PathTracer/LightStructure",
+	}